@@ -5,8 +5,11 @@
 
 
 #include "Controller.h"
+#include "RpcDispatcher.h"
+#include "RpcEventLoop.h"
 #include "RpcException.h"
 #include "RpcMessage.h"
+#include "RpcMessageReader.h"
 
 
 
@@ -55,6 +58,14 @@ void NullSynchronizer::stateChanged(const void* change, size_t size)
 
 ClientController::ClientController(RpcClient* ipc)
 :  fRpc(ipc)
+,  fExecutor(nullptr)
+,  fDefaultExecutor(new RpcThreadExecutor("RpcCompletions"))
+,  fWriteBehindMs(0)
+,  fWriteBehindTimer(*this)
+,  fCallTimeoutMs(ClientController::kDefaultCallTimeoutMs)
+,  fTimeoutStartMs(Time::getMillisecondCounterHiRes())
+,  fTimeoutTicks(0)
+,  fTimeoutTimer(*this)
 ,  fSync(fTree1)
 {
    #if 0
@@ -67,6 +78,8 @@ ClientController::ClientController(RpcClient* ipc)
 
 
    fRpc->SetController(this);
+   this->SetExecutor(nullptr);
+   fTimeoutTimer.startTimer(ClientController::kTimeoutTickMs);
 
 
    //fTree1.setProperty("test", 1, nullptr);
@@ -74,41 +87,374 @@ ClientController::ClientController(RpcClient* ipc)
 
 ClientController::~ClientController()
 {
-   fRpc->disconnect();
+   // send whatever's buffered while we're still connected.
+   this->SetWriteBehind(0);
+   fTimeoutTimer.stopTimer();
+   this->Disconnect();
+   // in case we never connected; our default executor runs any callbacks
+   // that these post before it's destroyed.
+   this->FailPendingCalls(Controller::kConnectionError);
 }
 
 bool ClientController::ConnectToServer(const String& hostName, int portNumber, int msTimeout)
 {
-   return fRpc->connectToSocket(hostName, portNumber, msTimeout);
+   this->Disconnect();
+   fRpc->SetOptions(RpcMessage::kLegacyFormat);
+   bool retval = false;
+   if (RpcEventLoop::IsAvailable())
+   {
+      // InterprocessConnection's thread makes two reads and an allocation 
+      // for every frame; the event loop reads whatever has arrived at once.
+      fEventLoop = new RpcEventLoop(1);
+      retval = fEventLoop->Connect(fRpc, hostName, portNumber, msTimeout);
+      if (!retval)
+      {
+         fEventLoop = nullptr;
+      }
+   }
+   else
+   {
+      retval = fRpc->connectToSocket(hostName, portNumber, msTimeout);
+   }
+   if (retval)
+   {
+      this->NegotiateOptions();
+   }
+   return retval;
+}
+
+
+bool ClientController::ConnectToLocalServer(const String& name, int msTimeout)
+{
+   this->Disconnect();
+   fRpc->SetOptions(RpcMessage::kLegacyFormat);
+   if (RpcEventLoop::IsAvailable())
+   {
+      fEventLoop = new RpcEventLoop(1);
+      if (fEventLoop->ConnectLocal(fRpc, name, msTimeout))
+      {
+         this->NegotiateOptions();
+         return true;
+      }
+      fEventLoop = nullptr;
+   }
+   // the server couldn't listen on a local socket, so it opened a pipe.
+   if (!fRpc->connectToPipe(name, msTimeout))
+   {
+      return false;
+   }
+   this->NegotiateOptions();
+   return true;
+}
+
+
+void ClientController::Disconnect()
+{
+   if (nullptr != fEventLoop)
+   {
+      // loses the connection, if it hasn't been lost already.
+      fEventLoop->Stop();
+      fEventLoop = nullptr;
+   }
+   fRpc->disconnect();
+}
+
+
+void ClientController::SetSharedDictionary(const MemoryBlock& dictionary)
+{
+   fRpc->SetSharedDictionary(dictionary);
 }
 
-void ClientController::HandleReceivedMessage(const MemoryBlock& message)
+
+void ClientController::SetExecutor(RpcExecutor* executor)
 {
-   RpcMessage ipc(message);
+   fExecutor = (nullptr != executor) ? executor : fDefaultExecutor.get();
+}
 
-   uint32 code;
-   uint32 sequence;
 
-   ipc.GetMetadata(code, sequence);
-   DBG("RECEIVED message back, code = " + String(code) + ", sequence = " + String(sequence));
+void ClientController::SetCallTimeout(int timeoutMs)
+{
+   fCallTimeoutMs = jmax(1, timeoutMs);
+}
 
-   if (sequence != 0)
+
+int64 ClientController::GetTimeoutTicks() const
+{
+   const int64 tick = ClientController::kTimeoutTickMs;
+   // the next tick may be almost due already, so we add one to make sure 
+   // that calls never time out early.
+   return (this->GetCallTimeout() + tick - 1) / tick + 1;
+}
+
+
+void ClientController::ExpireCalls()
+{
+   const double elapsedMs = Time::getMillisecondCounterHiRes() - fTimeoutStartMs;
+   const int64 due = static_cast<int64>(elapsedMs / 
+      static_cast<double>(ClientController::kTimeoutTickMs));
+   if (due <= fTimeoutTicks)
+   {
+      return;
+   }
+
+   Array<uint32> expired;
+   fPending.AdvanceTimers(due - fTimeoutTicks, expired);
+   fTimeoutTicks = due;
+   for (int i = 0; i < expired.size(); ++i)
+   {
+      const uint32 sequence = expired.getUnchecked(i);
+      // it may have had its response since its timer went off.
+      if (fPending.Abandon(sequence, this->MakeException(sequence, Controller::kTimeout)))
+      {
+         DBG("Call sequence #" + String(sequence) + " timed out");
+         this->SendCancel(sequence);
+      }
+   }
+}
+
+
+void ClientController::FailPendingCalls(uint32 code)
+{
+   Array<uint32> sequences = fPending.GetSequences();
+   for (int i = 0; i < sequences.size(); ++i)
+   {
+      const uint32 sequence = sequences.getUnchecked(i);
+      fPending.Complete(sequence, this->MakeException(sequence, code));
+   }
+}
+
+
+void ClientController::SetWriteBehind(int intervalMs)
+{
+   if (intervalMs > 0)
+   {
+      fWriteBehindMs = intervalMs;
+      fWriteBehindTimer.startTimer(intervalMs);
+   }
+   else
+   {
+      fWriteBehindTimer.stopTimer();
+      fWriteBehindMs = 0;
+      this->FlushTreeProperties();
+   }
+}
+
+
+void ClientController::BufferTreeProperty(uint32 messageCode, 
+   const String& path, const RpcMessage& msg)
+{
+   const String key(String(messageCode) + ":" + path);
+   const ScopedLock lock(fBufferLock);
+   if (fBufferedIndex.contains(key))
+   {
+      // keep its place, so that properties are still sent in the order 
+      // they were first changed.
+      *fBuffered.getUnchecked(fBufferedIndex[key]) = msg;
+   }
+   else
+   {
+      fBufferedIndex.set(key, fBuffered.size());
+      fBuffered.add(new RpcMessage(msg));
+   }
+}
+
+
+void ClientController::FlushTreeProperties()
+{
+   const ScopedLock flushLock(fFlushLock);
+   OwnedArray<RpcMessage> buffered;
+   {
+      const ScopedLock lock(fBufferLock);
+      buffered.swapWith(fBuffered);
+      fBufferedIndex.clear();
+   }
+   if (0 == buffered.size())
+   {
+      return;
+   }
+
+   const uint32 options = this->GetOptions();
+   const uint32 oneWayBatch = RpcMessage::kOneWayCalls | RpcMessage::kBatchedCalls;
+   if (buffered.size() > 1 && oneWayBatch == (options & oneWayBatch))
+   {
+      // the batch is one-way, so the calls in it are too.
+      RpcMessage batch(Controller::kBatch, 0, options);
+      batch.AppendUInt(static_cast<uint32>(buffered.size()));
+      for (int i = 0; i < buffered.size(); ++i)
+      {
+         batch.AppendMessage(*buffered.getUnchecked(i));
+      }
+      if (!this->SendOneWay(batch))
+      {
+         DBG("ERROR sending " + String(buffered.size()) + " tree properties");
+      }
+      return;
+   }
+
+   for (int i = 0; i < buffered.size(); ++i)
+   {
+      if (!this->SendOneWay(*buffered.getUnchecked(i)))
+      {
+         DBG("ERROR setting tree property");
+      }
+   }
+}
+
+
+bool ClientController::SendOneWay(const RpcMessage& call)
+{
+   if (!fRpc->IsConnected())
+   {
+      return false;
+   }
+
+   const uint32 options = this->GetOptions();
+   if (0 != (options & RpcMessage::kOneWayCalls))
+   {
+      return fRpc->SendRpcMessage(call);
+   }
+
+   // an older server answers every call, and would send the answer to a 
+   // call with sequence 0 as if it were a change notification.
+   DiscardedCall* discarded = new DiscardedCall();
+   // (it can't be stranded in the table if the answer never comes.)
+   const uint32 sequence = fPending.Insert(discarded, this->GetTimeoutTicks());
+   if (0 == sequence)
+   {
+      delete discarded;
+      return false;
+   }
+   // once it's sent, the answer may arrive (and delete `discarded`) at any
+   // moment.
+   if (!fRpc->SendRpcMessage(ClientController::Resequence(call, sequence, options)))
+   {
+      fPending.Complete(sequence, this->MakeException(sequence, 
+         Controller::kConnectionError));
+      return false;
+   }
+   return true;
+}
+
+
+RpcMessage ClientController::Resequence(const RpcMessage& call, 
+   uint32 sequence, uint32 options)
+{
+   const RpcBuffer& encoded = call.GetBuffer();
+   RpcMessageReader params(encoded.GetData(), encoded.GetSize(), 
+      call.GetOptions());
+   RpcMessage msg(params.GetCode(), sequence, options);
+   msg.AppendData(static_cast<const char*>(encoded.GetData()) + params.GetOffset(),
+      params.GetBytesRemaining());
+   return msg;
+}
+
+
+MemoryBlock ClientController::MakeException(uint32 sequence, uint32 code) const
+{
+   RpcMessage exception(code, sequence, this->GetOptions());
+   // a void var terminates the (empty) list of extra data.
+   exception.AppendVar(var());
+   return exception.GetMemoryBlock();
+}
+
+
+void ClientController::ThrowIfException(RpcMessageReader& response, uint32 messageCode)
+{
+   uint32 responseCode = response.GetCode();
+
+   // If the message code of the response is different from the code 
+   // we sent but the sequence numbers match, the server is sending
+   // us an exception that we need to re-constitute back into an RpcException 
+   // object and then throw it. 
+   if (responseCode != messageCode)
    {
+      RpcException e(responseCode);
 
-      PendingCall* pc = fPending.FindCallBySequence(sequence);
-      if (pc)
+      // look for 1 or more var values in the message, and append any
+      // non-void vars to the exception object. A void var acts as a 
+      // terminator, and there should always be at least the terminator 
+      // included in an exception message.
+      while (true)
       {
-         // copy in the reply data and wake that thread up.
-         pc->SetMemoryBlock(message);
-         pc->Signal();
+         var v = response.GetVar();
+         if (v.isVoid())
+         {
+            // a void var inside the message is the terminator -- 
+            // exit the loop.
+            break;
+         }
+         e.AppendExtraData(v);
+      }
+      throw e;
+   }
+}
 
+
+void ClientController::NegotiateOptions()
+{
+   // The negotiation itself always uses the legacy format.
+   PendingCall pc;
+   const ScopedPendingCall spc(fPending, &pc);
+   RpcMessage msg(Controller::kNegotiate, pc.GetSequence());
+   MemoryBlock response;
+
+   msg.AppendData<uint32>(RpcMessage::kSupportedOptions);
+   msg.AppendData<uint32>(fRpc->GetDictionaryId());
+   try
+   {
+      if (this->CallFunction(msg, pc, response))
+      {
+         DBG("Negotiated wire options " + String::toHexString((int) this->GetOptions()));
       }
-      else 
+   }
+   catch (const RpcException& e)
+   {
+      // An older server will tell us that it doesn't know the kNegotiate 
+      // method; we just keep talking to it in the legacy format.
+      DBG("Server can't negotiate, exception code = " + String(e.GetCode()));
+   }
+}
+
+
+void ClientController::HandleReceivedMessage(const void* data, size_t size)
+{
+   // Decode in place -- the only copy we make is for a pending call that
+   // a thread is waiting on, since it has to outlive this callback.
+   RpcMessageReader ipc(data, size, this->GetOptions());
+
+   uint32 code = ipc.GetCode();
+   uint32 sequence = ipc.GetSequence();
+   if (!ipc.IsValid())
+   {
+      DBG("ERROR: Received a message too short to hold a header.");
+      return;
+   }
+   DBG("RECEIVED message back, code = " + String(code) + ", sequence = " + String(sequence));
+
+   if (Controller::kNegotiate == code)
+   {
+      // Switch formats here on the IPC thread, not in the thread that's 
+      // waiting on the call -- anything the server sends after this reply
+      // may already use the new options.
+      uint32 accepted = ipc.GetData<uint32>();
+      fRpc->SetOptions(accepted & RpcMessage::kSupportedOptions);
+   }
+
+   if (sequence != 0)
+   {
+
+      // copy in the reply data and wake that thread up.
+      if (!fPending.Complete(sequence, data, size))
       {
-         DBG("ERROR: Unexpected reply to call sequence #" + String(sequence));
-         RpcException e(Controller::kMessageSequenceError);
-         e.AppendExtraData(var(static_cast<int>(sequence)));
-         throw e;
+         if (fPending.IsAbandoned(sequence))
+         {
+            DBG("Dropping late reply to call sequence #" + String(sequence));
+            return;
+         }
+         // throwing here would take the I/O thread down with it, and leave
+         // every other call on this connection waiting.
+         DBG("ERROR: Dropping unexpected reply to call sequence #" + String(sequence));
+         return;
       }
    }
    else
@@ -122,7 +468,7 @@ void ClientController::HandleReceivedMessage(const MemoryBlock& message)
             DBG("BEFORE: ");
             //fTree1.setProperty("foo", Random().nextInt(), nullptr);
             DBG(fTree1.toXmlString());
-            String delta = String("> ") + ipc.GetValueTree(fTree1);
+            ipc.GetValueTree(fTree1);
             //DBG(tree.toXmlString());
             //String delta = String("> ") + ipc.GetValueTree(tree);
             // fLogger->logMessage(delta);
@@ -145,6 +491,26 @@ void ClientController::HandleReceivedMessage(const MemoryBlock& message)
       {
          ipc.GetValueTree(fTree2);
       }
+      else if (Controller::kValueTreeUpdates == code)
+      {
+         while (ipc.IsValid() && ipc.GetBytesRemaining() > 0)
+         {
+            const uint32 treeCode = ipc.GetUInt();
+            if (Controller::kValueTree1Update == treeCode)
+            {
+               ipc.GetValueTree(fTree1);
+            }
+            else if (Controller::kValueTree2Update == treeCode)
+            {
+               ipc.GetValueTree(fTree2);
+            }
+            else
+            {
+               DBG("ERROR: Update for unknown tree code " + String(treeCode));
+               break;
+            }
+         }
+      }
       else
       {
          DBG("Change notification, code " + String(code));
@@ -155,136 +521,69 @@ void ClientController::HandleReceivedMessage(const MemoryBlock& message)
 
 void ClientController::VoidFn()
 {
-   RpcMessage msg(Controller::kVoidFn);
-   RpcMessage response;
-
-   if (this->CallFunction(msg, response))
-   {
-      // nothing to do. 
-   }
-   else 
-   {
-      DBG("ERROR calling VoidFn();");
-   }
+   this->Call<VoidFnMethod>();
 }
 
+
 int ClientController::IntFn(int val)
 {
-   RpcMessage msg(Controller::kIntFn);
-   RpcMessage response;
-
-   int retval = 0;
-   msg.AppendData(val);
-   if (this->CallFunction(msg, response))
-   {
-      retval = response.GetData<int>();
-   }
-   else
-   {
-      DBG("ERROR calling IntFn();");
-   }
-
-   return retval;
+   return this->Call<IntFnMethod>(val);
 }
 
 
 void ClientController::UnknownFn()
 {
-   RpcMessage msg(Controller::kUnknownFn);
-   RpcMessage response;
-
-   if (this->CallFunction(msg, response))
-   {
-      // nothing to do.
-   }
-   else
-   {
-      DBG("ERROR calling UnknownFn();");
-   }
+   this->Call<UnknownFnMethod>();
 }
 
+
 String ClientController::StringFn(const String& inString)
 {
-   RpcMessage msg(Controller::kStringFn);
-   RpcMessage response;
-
-   String retval;
-   msg.AppendString(inString);
-   if (this->CallFunction(msg, response))
-   {
-      retval = response.GetString();
-      DBG("StringFn returns " + retval);
-   }
-   else
-   {
-      DBG("ERROR calling StringFn();");
-   }
+   String retval = this->Call<StringFnMethod>(inString);
+   DBG("StringFn returns " + retval);
    return retval;
 }  
 
-bool ClientController::CallFunction(RpcMessage& call, 
-                                    RpcMessage& response)
+bool ClientController::CallFunction(RpcMessage& call, PendingCall& pc,
+                                    MemoryBlock& response)
 {
    bool retval = false;
    uint32 messageCode;
    uint32 sequence;
 
    call.GetMetadata(messageCode, sequence);
+   this->FlushTreePropertiesIfBuffered();
 
    if (!fRpc->IsConnected())
    {
       throw RpcException(Controller::kConnectionError);
    }
 
-   // Remember which call we're waiting for. 
-   PendingCall pc(sequence);
-   // ...the ScopedPendingCall helper makes sure that we 
-   // are exception-safe. 
-   const ScopedPendingCall spc(fPending, &pc);
+   if (0 == sequence)
+   {
+      throw RpcException(Controller::kTooManyCallsError);
+   }
+   jassert(sequence == pc.GetSequence());
 
-   if (fRpc->sendMessage(call.GetMemoryBlock()))
+   if (fRpc->SendRpcMessage(call))
    {
       // wait for a response
-      if (pc.Wait(50000))
+      if (pc.Wait(this->GetCallTimeout()))
       {
          // if we get here, the pending call object has a memoryBlock 
-         // that we can use to populate our response.
-         response.FromMemoryBlock(pc.GetMemoryBlock());
-         // advance past the header bits...
-         uint32 responseCode;
-         response.GetMetadata(responseCode, sequence);
-
-         // If the message code of the response is different from the code 
-         // we sent but the sequence numbers match, the server is sending
-         // us an exception that we need to re-constitute back into an RpcException 
-         // object and then throw it. 
-         if (responseCode != messageCode)
-         {
-            RpcException e(responseCode);
-
-            // look for 1 or more var values in the message, and append any
-            // non-void vars to the exception object. A void var acts as a 
-            // terminator, and there should always be at least the terminator 
-            // included in an exception message.
-            while (true)
-            {
-               var v = response.GetVar();
-               if (v.isVoid())
-               {
-                  // a void var inside the message is the terminator -- 
-                  // exit the loop.
-                  break;
-               }
-               e.AppendExtraData(v);
-            }
-            throw e;
-         }
+         // that we can take over as our response.
+         pc.TakeMemoryBlock(response);
+         // the response is in the call's format, even if it's the reply to 
+         // kNegotiate that has just switched us over to another.
+         RpcMessageReader reader(response, call.GetOptions());
+         ClientController::ThrowIfException(reader, messageCode);
          retval = true;
 
       }
       else
       {  
          DBG("ERROR (timeout?) calling function code = " + String(messageCode));
+         this->SendCancel(sequence);
          throw RpcException(Controller::kTimeout);
       }
    }
@@ -293,12 +592,24 @@ bool ClientController::CallFunction(RpcMessage& call,
       DBG("ERROR sending call message.");
    }
 
-   // remove the pending call object from the list
-   //fPending.Remove(&pc);
-
    return retval;
 }
 
+void ClientController::SendCancel(uint32 sequence)
+{
+   const uint32 options = this->GetOptions();
+   if (0 == (options & RpcMessage::kCancelCalls))
+   {
+      return;
+   }
+   RpcMessage msg(Controller::kCancel, 0, options);
+   msg.AppendUInt(sequence);
+   if (!fRpc->IsConnected() || !fRpc->SendRpcMessage(msg))
+   {
+      DBG("ERROR sending cancel for call sequence #" + String(sequence));
+   }
+}
+
 bool ClientController::UpdateValueTree(int index, const void* data, size_t size)
 {
    ValueTree tree = this->GetTree(index);
@@ -359,23 +670,37 @@ String ServerController::StringFn(const String& inString)
 }  
 
 
+void ServerController::RegisterMethods(RpcDispatcher& dispatcher)
+{
+   // none of these touch the controller's state, so a slow one needn't 
+   // hold up the others.
+   const uint32 traits = RpcHandler::kIdempotent | RpcHandler::kConcurrent;
+   dispatcher.Register<VoidFnMethod>(this, &ServerController::VoidFn, traits);
+   dispatcher.Register<IntFnMethod>(this, &ServerController::IntFn, traits);
+   dispatcher.Register<StringFnMethod>(this, &ServerController::StringFn, traits);
+}
+
+
 void ServerController::timerCallback()
 {
    ++fTimerCount;
    if (0 == fTimerCount % 15)
    {
-      var lastVal = fTree1.getProperty("count");
-      int newVal = (int) lastVal + 1;
+      this->PostToTree(0, [this]()
+      {
+         var lastVal = fTree1.getProperty("count");
+         int newVal = (int) lastVal + 1;
 
-      ValueTree sub = fTree1.getChildWithName("sub");
-      Random r;
-      sub.setProperty("text", String("*** ") + String(r.nextInt()) + \
-                      " ***", nullptr);
+         ValueTree sub = fTree1.getChildWithName("sub");
+         Random r;
+         sub.setProperty("text", String("*** ") + String(r.nextInt()) + \
+                         " ***", nullptr);
 
-      fTree1.setProperty("count", newVal, nullptr);
-      fTree1.setProperty("even", (0 == newVal % 2), nullptr);
+         fTree1.setProperty("count", newVal, nullptr);
+         fTree1.setProperty("even", (0 == newVal % 2), nullptr);
 
-      DBG(fTree1.toXmlString());
+         DBG(fTree1.toXmlString());
+      });
    }
   
    // Notify listeners that we've changed. 
@@ -383,6 +708,46 @@ void ServerController::timerCallback()
 }
 
 
+void ServerController::SetTreeExecutor(RpcExecutor* executor)
+{
+   // waits for the jobs that are already on the strands.
+   fTreeStrands.clear();
+   if (nullptr != executor)
+   {
+      fTreeStrands.add(new RpcStrand(*executor));
+      fTreeStrands.add(new RpcStrand(*executor));
+   }
+}
+
+
+void ServerController::PostToTree(int index, const RpcExecutor::Job& job)
+{
+   RpcStrand* strand = fTreeStrands[index];
+   if (nullptr != strand)
+   {
+      strand->Post(job);
+   }
+   else
+   {
+      job();
+   }
+}
+
+
+void ServerController::RunOnTree(int index, const RpcExecutor::Job& job)
+{
+   RpcStrand* strand = fTreeStrands[index];
+   if (nullptr != strand)
+   {
+      strand->RunAndWait(job);
+   }
+   else
+   {
+      job();
+   }
+}
+
+
 /**
  *  UNIT TEST CODE FOLLOWS
  */
@@ -402,4 +767,248 @@ public:
    }
 };
 
-static SyncTest syncTest;
\ No newline at end of file
+static SyncTest syncTest;
+
+class AsyncCallTest : public UnitTest
+{
+public:
+   AsyncCallTest() : UnitTest("ClientController async call Tests") {}
+
+   void runTest() override
+   {
+      this->beginTest("Calls that can't be sent");
+      ClientController client(new RpcClient());
+      RpcFuture<int> future = client.CallAsync<Controller::IntFnMethod>(1);
+      this->expect(future.Wait(5000));
+      this->expect(Controller::kConnectionError == this->GetErrorCode(future));
+
+      this->beginTest("Callbacks run on the executor");
+      RpcThreadExecutor executor("test");
+      client.SetExecutor(&executor);
+      WaitableEvent called;
+      uint32 code = 0;
+      Thread::ThreadID callbackThread = nullptr;
+      client.CallAsync<Controller::StringFnMethod>(String("x")).Then(
+         [&](RpcFuture<String> result)
+      {
+         code = this->GetErrorCode(result);
+         callbackThread = Thread::getCurrentThreadId();
+         called.signal();
+      });
+      this->expect(called.wait(5000));
+      this->expect(Controller::kConnectionError == code);
+      this->expect(Thread::getCurrentThreadId() != callbackThread);
+      client.SetExecutor(nullptr);
+   }
+
+private:
+   template <typename R>
+   uint32 GetErrorCode(RpcFuture<R>& future)
+   {
+      try
+      {
+         future.Get();
+      }
+      catch (const RpcException& e)
+      {
+         return e.GetCode();
+      }
+      return 0;
+   }
+};
+
+static AsyncCallTest asyncCallTest;
+
+
+namespace
+{
+   /**
+    * Stands in for a server: it accepts the options that the client offers
+    * except `refused`, keeps every other message that it receives, and 
+    * answers the calls with empty responses -- all of them, if it hasn't 
+    * got the kOneWayCalls option. Unless `straySequence` is 0, each answer
+    * follows one to a call with that sequence number, which the client 
+    * never made.
+    */
+   class ScriptedConnection : public RpcConnection
+   {
+   public:
+      ScriptedConnection(uint32 refused, uint32 straySequence)
+      :  fRefused(refused)
+      ,  fStraySequence(straySequence)
+      {
+
+      }
+
+      void HandleMessage(const void* data, size_t size) override
+      {
+         RpcMessageReader call(data, size, this->GetOptions());
+         call.GetTimeout();
+         const uint32 code = call.GetCode();
+         const uint32 sequence = call.GetSequence();
+         RpcMessage response(code, sequence, this->GetOptions());
+         if (Controller::kNegotiate == code)
+         {
+            const uint32 accepted = call.GetData<uint32>() & 
+               RpcMessage::kSupportedOptions & ~fRefused;
+            response.AppendData<uint32>(accepted);
+            this->SendRpcMessage(response);
+            this->SetOptions(accepted);
+            return;
+         }
+         {
+            const ScopedLock lock(fLock);
+            fMessages.add(MemoryBlock(data, size));
+         }
+         if (0 != sequence || 0 == (this->GetOptions() & RpcMessage::kOneWayCalls))
+         {
+            if (0 != fStraySequence)
+            {
+               this->SendRpcMessage(RpcMessage(code, fStraySequence, 
+                  this->GetOptions()));
+            }
+            this->SendRpcMessage(response);
+         }
+      }
+
+      uint32 fRefused;
+      uint32 fStraySequence;
+      CriticalSection fLock;
+      Array<MemoryBlock> fMessages;
+   };
+
+
+   class ScriptedServer
+   {
+   public:
+      ScriptedServer(uint32 refused, uint32 straySequence=0)
+      :  fLoop(1)
+      {
+         fLoop.Listen(0, [this, refused, straySequence]() -> RpcConnection*
+         {
+            const ScopedLock lock(fLock);
+            return fConnections.add(new ScriptedConnection(refused, 
+               straySequence));
+         });
+      }
+
+      ~ScriptedServer()
+      {
+         fLoop.Stop();
+      }
+
+      /**
+       * @return a copy of the messages that our first client has sent.
+       */
+      Array<MemoryBlock> GetMessages()
+      {
+         const ScopedLock lock(fLock);
+         if (0 == fConnections.size())
+         {
+            return Array<MemoryBlock>();
+         }
+         ScriptedConnection* connection = fConnections.getUnchecked(0);
+         const ScopedLock messagesLock(connection->fLock);
+         return connection->fMessages;
+      }
+
+      RpcEventLoop fLoop;
+      CriticalSection fLock;
+      OwnedArray<ScriptedConnection> fConnections;
+   };
+}
+
+
+class OneWayCallTest : public UnitTest
+{
+public:
+   OneWayCallTest() : UnitTest("ClientController one-way call Tests") {}
+
+   void runTest() override
+   {
+      if (!RpcEventLoop::IsAvailable())
+      {
+         this->logMessage("RpcEventLoop isn't available here.");
+         return;
+      }
+      const uint32 kNoDictionary = RpcMessage::kDictionaryFrames;
+
+      this->beginTest("Write-behind");
+      {
+         ScriptedServer server(kNoDictionary);
+         ClientController client(new RpcClient());
+         this->expect(client.ConnectToServer("127.0.0.1", server.fLoop.GetPort(), 1000));
+         // nothing goes out until we flush.
+         client.SetWriteBehind(60 * 1000);
+         for (int i = 0; i < 100; ++i)
+         {
+            client.SetTreeProperty(Controller::kValueTree2SetProp, "sub/a", 
+               RpcMessage::kInt, i);
+            client.SetTreeProperty(Controller::kValueTree2SetProp, "sub/b", 
+               RpcMessage::kInt, 2 * i);
+         }
+         client.FlushTreeProperties();
+         client.VoidFn();
+         client.SetWriteBehind(0);
+
+         const Array<MemoryBlock> messages = server.GetMessages();
+         this->expect(2 == messages.size());
+         RpcMessageReader batch(messages.getReference(0), client.GetOptions());
+         this->expect(Controller::kBatch == batch.GetCode());
+         this->expect(0 == batch.GetSequence());
+         this->expect(2 == batch.GetUInt());
+         ValueTree tree("two");
+         for (int i = 0; i < 2; ++i)
+         {
+            RpcMessageReader property = batch.GetMessage();
+            this->expect(Controller::kValueTree2SetProp == property.GetCode());
+            this->expect(property.ApplyTreeProperty(tree));
+         }
+         const ValueTree sub = tree.getChildWithName("sub");
+         this->expect(99 == static_cast<int>(sub.getProperty("a")));
+         this->expect(198 == static_cast<int>(sub.getProperty("b")));
+      }
+
+      this->beginTest("Servers without one-way calls");
+      {
+         ScriptedServer server(kNoDictionary | RpcMessage::kOneWayCalls);
+         ClientController client(new RpcClient());
+         this->expect(client.ConnectToServer("127.0.0.1", server.fLoop.GetPort(), 1000));
+         this->expect(0 == (client.GetOptions() & RpcMessage::kOneWayCalls));
+         this->expect(client.CallOneWay<Controller::VoidFnMethod>());
+         // the answer to the one-way call arrives first, and is dropped.
+         client.VoidFn();
+         this->expect(0 == client.GetNumPendingCalls());
+
+         const Array<MemoryBlock> messages = server.GetMessages();
+         this->expect(2 == messages.size());
+         RpcMessageReader oneWay(messages.getReference(0), client.GetOptions());
+         this->expect(Controller::kVoidFn == oneWay.GetCode());
+         // it had to have a sequence number, for the answer to be matched to.
+         this->expect(0 != oneWay.GetSequence());
+      }
+
+      this->beginTest("Unexpected replies");
+      {
+         ScriptedServer server(kNoDictionary, 0x7fff0000);
+         ClientController client(new RpcClient());
+         this->expect(client.ConnectToServer("127.0.0.1", server.fLoop.GetPort(), 1000));
+         // the stray replies are dropped, and the connection carries on.
+         uint32 code = 0;
+         try
+         {
+            client.VoidFn();
+            client.VoidFn();
+         }
+         catch (const RpcException& e)
+         {
+            code = e.GetCode();
+         }
+         this->expect(0 == code);
+         this->expect(0 == client.GetNumPendingCalls());
+         this->expect(2 == server.GetMessages().size());
+      }
+   }
+};
+
+static OneWayCallTest oneWayCallTest;
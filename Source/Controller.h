@@ -8,9 +8,14 @@
 #include "../JuceLibraryCode/JuceHeader.h"
 
 #include "RpcClient.h"
+#include "RpcExecutor.h"
+#include "RpcFuture.h"
 #include "RpcMessage.h"
+#include "RpcMethod.h"
 #include "PendingCalls.h"
 
+class RpcEventLoop;
+
 /**
  * abstract base class defining the API that the controller supports.
  */
@@ -42,6 +47,9 @@ public:
       kTimerAlert = 10000,
       kValueTree1Update,
       kValueTree2Update,
+      kValueTreeUpdates,    /** changes to any of the trees (kDelimitedTrees 
+                                only): each one is that tree's update code 
+                                followed by the change */
 
       /**
        * A range of codes that represent exceptions across the RPC link.
@@ -52,10 +60,35 @@ public:
       kParameterError,      /** an error in one of the passed parameters */
       kConnectionError,     /** there's no connection */
       kMessageSequenceError,  /** Client received a response to a message that wasn't sent. */
+      kTooManyCallsError,   /** too many calls are already waiting for responses */
+      kInternalError,       /** the server failed to complete the call */
+
+      /**
+       * A range of codes used by the RPC layer itself rather than the 
+       * Controller API.
+       */
+      kProtocolBase = 30000,
+      kNegotiate,           /** agree on the RpcMessage::WireOptions to use, and
+                                check the ID of the shared dictionary */
+      kBatch,               /** several calls in one message, answered with 
+                                one response (kBatchedCalls only; see 
+                                RpcBatch) */
+      kCancel,              /** one-way: the client has given up on the call
+                                whose sequence number follows (kCancelCalls 
+                                only) */
 
 
    };
 
+   /**
+    * The signatures of the function calls above. These generate all of the 
+    * marshalling code on both sides of the connection; see RpcMethod.
+    */
+   typedef RpcMethod<kVoidFn, void()>              VoidFnMethod;
+   typedef RpcMethod<kIntFn, int(int)>             IntFnMethod;
+   typedef RpcMethod<kStringFn, String(String)>    StringFnMethod;
+   typedef RpcMethod<kUnknownFn, void()>           UnknownFnMethod;
+
    Controller();
 
    virtual ~Controller()
@@ -113,10 +146,29 @@ private:
 // forward declaration...
 class RpcMessage;
 
+class RpcDispatcher;
+
 class ClientController: public Controller
                       // , public ChangeBroadcaster
 {
+  friend class RpcBatch;
+
 public:
+  enum
+  {
+     /**
+      * How long a call waits for its response unless SetCallTimeout() says
+      * otherwise.
+      */
+     kDefaultCallTimeoutMs = 50000,
+
+     /**
+      * How often we check the timeouts of the calls that nobody's waiting 
+      * on; they may fail up to twice this much later than their timeouts.
+      */
+     kTimeoutTickMs = 10
+  };
+
   ClientController(RpcClient* ipc);
 
   ~ClientController();
@@ -133,13 +185,71 @@ public:
    */
   bool ConnectToServer(const String& hostName, int portNumber, int msTimeout);
 
+  /**
+   * Connect to a server on this host that's listening on a local socket,
+   * or on a NamedPipe where it can't (see RpcServer::StartLocal()), rather
+   * than a TCP port.
+   * @param  name       The name that the server listens on.
+   * @param  msTimeout  Number of milliseconds to wait for a successful 
+   *                    connection.
+   * @return            True if we connected.
+   */
+  bool ConnectToLocalServer(const String& name, int msTimeout);
+
+  /**
+   * Use a pre-trained dictionary for the RpcMessage::kDictionaryFrames 
+   * option; the server must have been given the same one. Call this before 
+   * connecting.
+   */
+  void SetSharedDictionary(const MemoryBlock& dictionary);
+
+  /**
+   * @return the RpcMessage::WireOptions that we agreed on with the server.
+   */
+  uint32 GetOptions() const { return fRpc->GetOptions(); }
+
+  /**
+   * Run the callbacks of our asynchronous calls (see CallAsync()) on 
+   * `executor`, which we don't own and which must outlive us. By default 
+   * they run on a thread of our own; pass an RpcMessageThreadExecutor to 
+   * run them where they can update the UI, or nullptr to go back to the 
+   * default.
+   */
+  void SetExecutor(RpcExecutor* executor);
+
+  /**
+   * Wait `timeoutMs` milliseconds for the response to each call before 
+   * giving up on it with Controller::kTimeout. If the server has the 
+   * RpcMessage::kCallDeadlines option, the calls tell it so, and it won't 
+   * start a call once that's passed. Asynchronous calls and batches time 
+   * out the same way, on a timer wheel in our pending call table, and 
+   * their futures fail with kTimeout. One-way calls never time out.
+   */
+  void SetCallTimeout(int timeoutMs);
+
+  int GetCallTimeout() const { return fCallTimeoutMs.get(); }
+
+  /**
+   * @return the number of calls that are waiting for their responses, 
+   *         including the one-way calls whose answers we'll throw away.
+   */
+  int GetNumPendingCalls() const { return fPending.Size(); }
+
+  /**
+   * Fail every call that's waiting for a response with an RpcException 
+   * with code `code`. We do this when the connection is lost, since the 
+   * responses will never arrive.
+   */
+  void FailPendingCalls(uint32 code);
+
   /**
    * Called when we receive a new message from the server. It's either going to be 
    * - a response to a function call we made 
    * - a change notification that won't be in the pending calls table.
-   * @param message Chunk of data from the server.
+   * @param data Chunk of data from the server, which is only valid until 
+   *             we return.
    */
-  void HandleReceivedMessage(const MemoryBlock& message);
+  void HandleReceivedMessage(const void* data, size_t size);
 
    /**
     * Need to be able to call fn returning void
@@ -165,14 +275,138 @@ public:
    String StringFn(const String& inString) override;    
 
 
+   /**
+    * Call a remote method described by an RpcMethod typedef (see 
+    * Controller::IntFnMethod, etc.)
+    * @return The method's return value, or a default-constructed value if 
+    *         the call failed without throwing an exception.
+    */
+   template <typename Method, typename... Args>
+   typename Method::ReturnType Call(const Args&... args)
+   {
+      // Remember which call we're waiting for. The ScopedPendingCall 
+      // helper gives it a sequence number and makes sure that we are 
+      // exception-safe.
+      PendingCall pc;
+      const ScopedPendingCall spc(fPending, &pc);
+      RpcMessage msg = Method::EncodeTimedCall(this->GetOptions(), pc.GetSequence(),
+         this->GetCallTimeout(), args...);
+      MemoryBlock response;
+
+      if (!this->CallFunction(msg, pc, response))
+      {
+         DBG("ERROR calling function code " + String((int) Method::kCode));
+         // fall through and decode the empty response, which gives us a 
+         // default return value.
+      }
+      RpcMessageReader reader(response, this->GetOptions());
+      return Method::DecodeResult(reader);
+   }
+
+
+   /**
+    * Call a remote method without waiting for the response. The calling 
+    * thread only encodes and sends the call, so one thread can have 
+    * thousands of calls in flight at once.
+    * @return A future that holds the result when it arrives; see RpcFuture 
+    *         for how to wait for it or have a callback run with it. If the 
+    *         call couldn't be sent or timed out (see SetCallTimeout()), the
+    *         future holds the RpcException.
+    */
+   template <typename Method, typename... Args>
+   RpcFuture<typename Method::ReturnType> CallAsync(const Args&... args)
+   {
+      this->FlushTreePropertiesIfBuffered();
+      AsyncCall<Method>* call = new AsyncCall<Method>(fExecutor, this->GetOptions());
+      RpcFuture<typename Method::ReturnType> future(call->GetState());
+      const uint32 sequence = fPending.Insert(call, this->GetTimeoutTicks());
+      if (0 == sequence)
+      {
+         const MemoryBlock failure(this->MakeException(0, Controller::kTooManyCallsError));
+         call->Completed(failure.getData(), failure.getSize());
+         return future;
+      }
+
+      // once it's sent, the response may arrive (and delete `call`) at any 
+      // moment.
+      RpcMessage msg = Method::EncodeTimedCall(this->GetOptions(), sequence, 
+         this->GetCallTimeout(), args...);
+      if (!fRpc->IsConnected() || !fRpc->SendRpcMessage(msg))
+      {
+         fPending.Complete(sequence, this->MakeException(sequence, 
+            Controller::kConnectionError));
+      }
+      return future;
+   }
+
+
+   /**
+    * Call a remote method without wanting its result. The server doesn't 
+    * send a response (see RpcMessage::kOneWayCalls), so there's nothing to 
+    * wait for and no sequence number to match it up with; an exception that
+    * the call throws on the server is lost. A server without that option 
+    * still answers, and we throw the answer away.
+    * @return false if the call couldn't be sent.
+    */
+   template <typename Method, typename... Args>
+   bool CallOneWay(const Args&... args)
+   {
+      this->FlushTreePropertiesIfBuffered();
+      return this->SendOneWay(Method::EncodeCall(this->GetOptions(), 0, args...));
+   }
+
+
+   /**
+    * Buffer the changes made with SetTreeProperty() instead of sending each
+    * one as it's made, and send them every `intervalMs` milliseconds (or 
+    * when FlushTreeProperties() is called) in a single message. If a 
+    * property is set more than once in that time, only its last value is 
+    * sent. Anything buffered is sent before any other call we make, so the
+    * server sees the changes in order with those calls.
+    * @param intervalMs How often to send the buffered changes, or 0 to 
+    *                   send them now and stop buffering.
+    */
+   void SetWriteBehind(int intervalMs);
+
+   /**
+    * Send any tree property changes that are buffered (see 
+    * SetWriteBehind()).
+    */
+   void FlushTreeProperties();
+
+   /**
+    * Change a property in one of the server's trees. If the server has the
+    * RpcMessage::kOneWayCalls option, this doesn't wait for it to reply; 
+    * with write-behind on, it only buffers the change.
+    */
    template <typename T>
    void SetTreeProperty(uint32 messageCode, const String& path, RpcMessage::DataType type, T val)
    {
-      RpcMessage msg(messageCode);
-      RpcMessage response;
+      const uint32 options = this->GetOptions();
+      const bool writeBehind = (0 != fWriteBehindMs.get());
+      if (writeBehind || 0 != (options & RpcMessage::kOneWayCalls))
+      {
+         RpcMessage msg(messageCode, 0, options);
+         msg.SetTreeProperty<T>(path, type, val);
+         if (writeBehind)
+         {
+            this->BufferTreeProperty(messageCode, path, msg);
+         }
+         else if (!this->SendOneWay(msg))
+         {
+            DBG("ERROR setting tree property");
+         }
+         return;
+      }
+
+      PendingCall pc;
+      const ScopedPendingCall spc(fPending, &pc);
+      RpcMessage msg(messageCode, pc.GetSequence(), this->GetOptions(), 
+         this->GetCallTimeout());
+      MemoryBlock response;
 
       msg.SetTreeProperty<T>(path, type, val);
-      if (this->CallFunction(msg, response))
+      if (this->CallFunction(msg, pc, response))
       {
          // nothing to do.
       }
@@ -183,23 +417,225 @@ public:
    }
 private:
 
+  /**
+   * Tell the server which optional wire format features we support, and 
+   * start using the ones that it supports as well. 
+   */
+  void NegotiateOptions();
+
+  /**
+   * Drop our connection to the server, if we have one.
+   */
+  void Disconnect();
+
   /**
    * Perform a function call across the socket connection. 
    * @param  call     Populated RpcMessage object containing message sequence, 
    *                  function code, and optional block of parameter data
-   * @param  response IcpMessage object that will be populated on 
-   *                  exit with the contents of the response from the server
+   * @param  pending  The call's entry in our pending call table, which 
+   *                  gave it its sequence number.
+   * @param  response Populated on exit with the raw response from the 
+   *                  server; decode it with an RpcMessageReader.
    * @return          True if the call completed successfully. False if the
    *                  server timed out or there was some other error.
    */
-  bool CallFunction(RpcMessage& call, RpcMessage& response);
+  bool CallFunction(RpcMessage& call, PendingCall& pending, MemoryBlock& response);
+
+  /**
+   * Tell the server that we've given up on the call with sequence number 
+   * `sequence`, if it has the RpcMessage::kCancelCalls option. Whether or 
+   * not it does, a response that arrives later is dropped (see 
+   * PendingCallTable::IsAbandoned()).
+   */
+  void SendCancel(uint32 sequence);
+
+  /**
+   * @return the call timeout in ticks of our timeout timer.
+   */
+  int64 GetTimeoutTicks() const;
+
+  /**
+   * Fail the calls whose timeouts have expired since we last looked, and 
+   * tell the server that we've given up on them. Called by 
+   * fTimeoutTimer.
+   */
+  void ExpireCalls();
+
+  /**
+   * Send a call that was encoded with sequence number 0 as a one-way call 
+   * (see CallOneWay()).
+   */
+  bool SendOneWay(const RpcMessage& call);
+
+  /**
+   * @return a copy of `call` with sequence number `sequence`.
+   */
+  static RpcMessage Resequence(const RpcMessage& call, uint32 sequence, 
+     uint32 options);
+
+  /**
+   * Add a tree property change to the write-behind buffer, replacing any 
+   * earlier change to the same property.
+   */
+  void BufferTreeProperty(uint32 messageCode, const String& path, 
+     const RpcMessage& msg);
+
+  void FlushTreePropertiesIfBuffered()
+  {
+     if (0 != fWriteBehindMs.get())
+     {
+        this->FlushTreeProperties();
+     }
+  }
+
+  /**
+   * If a response is an exception rather than the result of the call we 
+   * made with `messageCode`, re-constitute the RpcException and throw it.
+   */
+  static void ThrowIfException(RpcMessageReader& response, uint32 messageCode);
+
+  /**
+   * @return an exception response like the ones that the server sends.
+   */
+  MemoryBlock MakeException(uint32 sequence, uint32 code) const;
+
+  /**
+   * A call made with CallAsync(). It belongs to the pending call table 
+   * until its response arrives, and then it fills in its future and 
+   * deletes itself.
+   */
+  template <typename Method>
+  class AsyncCall : public PendingCall
+  {
+  public:
+     typedef typename Method::ReturnType ReturnType;
+
+     AsyncCall(RpcExecutor* executor, uint32 options)
+     :  PendingCall(true)
+     ,  fState(new typename RpcFuture<ReturnType>::State(executor))
+     ,  fOptions(options)
+     {
+
+     }
+
+     typename RpcFuture<ReturnType>::State* GetState() const { return fState; }
+
+     void Completed(const void* response, size_t size) override
+     {
+        // decoding the result is cheap enough to do here, and means that 
+        // anyone blocked in RpcFuture::Get() doesn't wait for the executor.
+        RpcMessageReader reader(response, size, fOptions);
+        try
+        {
+           ClientController::ThrowIfException(reader, Method::kCode);
+           fState->GetValue().template Decode<Method>(reader);
+           fState->Succeed();
+        }
+        catch (const RpcException& e)
+        {
+           fState->Fail(e);
+        }
+        delete this;
+     }
+
+  private:
+     typename RpcFuture<ReturnType>::State::Ptr fState;
+     uint32 fOptions;
+  };
+
+  /**
+   * A one-way call to a server that answers it anyway. The answer's 
+   * dropped when it arrives.
+   */
+  class DiscardedCall : public PendingCall
+  {
+  public:
+     DiscardedCall() : PendingCall(true) {}
+
+     void Completed(const void*, size_t) override
+     {
+        delete this;
+     }
+  };
+
+  /**
+   * Sends the write-behind buffer on a timer.
+   */
+  class WriteBehindTimer : public HighResolutionTimer
+  {
+  public:
+     WriteBehindTimer(ClientController& client) : fClient(client) {}
+
+     void hiResTimerCallback() override
+     {
+        fClient.FlushTreeProperties();
+     }
+
+  private:
+     ClientController& fClient;
+  };
+
+  /**
+   * Ticks every kTimeoutTickMs to expire calls that have timed out.
+   */
+  class TimeoutTimer : public HighResolutionTimer
+  {
+  public:
+     TimeoutTimer(ClientController& client) : fClient(client) {}
+
+     void hiResTimerCallback() override
+     {
+        fClient.ExpireCalls();
+     }
+
+  private:
+     ClientController& fClient;
+  };
 
   bool UpdateValueTree(int index, const void* data, size_t size);
 
 private:
 
   ScopedPointer<RpcClient> fRpc;
-  PendingCallList fPending;
+  PendingCallTable fPending;
+
+  /**
+   * Reads from the server in place of fRpc's connection thread, where 
+   * that's available; it has one I/O thread, for our one connection.
+   */
+  ScopedPointer<RpcEventLoop> fEventLoop;
+
+  /**
+   * Where our asynchronous calls' callbacks run.
+   */
+  RpcExecutor* fExecutor;
+  ScopedPointer<RpcThreadExecutor> fDefaultExecutor;
+
+  /**
+   * Tree property changes waiting to be sent, in the order that their 
+   * properties were first changed, with the index of each one's property 
+   * in fBufferedIndex.
+   */
+  CriticalSection fBufferLock;
+  OwnedArray<RpcMessage> fBuffered;
+  HashMap<String, int> fBufferedIndex;
+  /**
+   * Held while a flush is sent, so two flushes can't overtake each other.
+   */
+  CriticalSection fFlushLock;
+  Atomic<int> fWriteBehindMs;
+  WriteBehindTimer fWriteBehindTimer;
+
+  Atomic<int> fCallTimeoutMs;
+
+  /**
+   * When fTimeoutTimer started, and how many ticks it has moved the 
+   * pending call table's timers on since then, so that a late callback 
+   * catches up.
+   */
+  double fTimeoutStartMs;
+  int64 fTimeoutTicks;
+  TimeoutTimer fTimeoutTimer;
 
 
   ScopedPointer<FileLogger> fLogger;
@@ -235,13 +671,48 @@ public:
     */
    String StringFn(const String& inString) override;  
 
+   /**
+    * Register the handlers for our function calls with the server.
+    */
+   void RegisterMethods(RpcDispatcher& dispatcher);
+
    /**
     * Function called by our timer that will send change notifications back to the clients. 
     */
    void timerCallback() override;
 
+   /**
+    * Give each of our trees a strand on `executor`, which we don't own. 
+    * From then on, each tree (and everything that listens to it) is only 
+    * touched by jobs on its own strand (see PostToTree()), so changes to 
+    * one tree don't wait for the other, or for the message thread. The 
+    * RpcServer does this with its workers. Pass nullptr before `executor` 
+    * is destroyed to go back to using the trees on the message thread. Call
+    * this on the message thread.
+    */
+   void SetTreeExecutor(RpcExecutor* executor);
+
+   /**
+    * Run `job`, which reads or changes tree `index`, on that tree's strand. 
+    * If the trees don't have strands, the job runs straight away, and the 
+    * caller must be on the message thread.
+    */
+   void PostToTree(int index, const RpcExecutor::Job& job);
+
+   /**
+    * Like PostToTree(), but waits for the job to finish.
+    */
+   void RunOnTree(int index, const RpcExecutor::Job& job);
+
 
   int         fTimerCount;
+
+private:
+   /**
+    * One for each tree, in the same order, once SetTreeExecutor() has been 
+    * called.
+    */
+   OwnedArray<RpcStrand> fTreeStrands;
     
 };
 
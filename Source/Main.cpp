@@ -8,6 +8,7 @@
 #include "MainComponent.h"
 
 #include "Controller.h"
+#include "RpcBenchmarks.h"
 #include "RpcClient.h"
 #include "RpcException.h"
 #include "RpcServer.h"
@@ -38,6 +39,13 @@ public:
         UnitTestRunner testRunner;
 
         testRunner.runAllTests();
+
+        if (commandLine.contains("--benchmark"))
+        {
+            RunRpcBenchmarks();
+            this->quit();
+            return;
+        }
      
         ScopedPointer<Component> c(new ModeSelect());
         int retval = DialogWindow::showModalDialog("Select Mode", c, nullptr, Colours::grey, false);
@@ -58,6 +66,7 @@ public:
             mainWindow->SetText("client");
             RpcClient* ipc = new RpcClient();
             fClientController = new ClientController(ipc);
+            fClientController->SetExecutor(&fMessageThreadExecutor);
             mainWindow->SetController(fClientController);
             this->RunClient();
         }
@@ -66,22 +75,47 @@ public:
     }
 
 
+    /**
+     * @return where the server listens, for error messages.
+     */
+    static String GetServerAddress()
+    {
+#ifdef qUseNamedPipe
+        return "the local socket " + String(kPipeName);
+#else
+        return "port " + String(kPortNumber);
+#endif
+    }
+
+
     void RunServer()
     {
         DBG("Launching Server thread.");
 #ifdef qUseNamedPipe
-        fRpcServer->
+        if (!fRpcServer->StartLocal(kPipeName))
 #else        
-        fRpcServer->beginWaitingForSocket(kPortNumber);
+        if (!fRpcServer->Start(kPortNumber))
 #endif    
+        {
+            AlertWindow::showMessageBox(AlertWindow::WarningIcon,
+                "Server Error",
+                "Can't listen for clients on " + GetServerAddress() + ".",
+                "OK"
+                );
+            this->quit();
+        }
     }
 
 
     void RunClient()
     {
+#ifdef qUseNamedPipe
+        if (fClientController->ConnectToLocalServer(kPipeName, 1500))
+#else
         String hostname("127.0.0.1");
 
         if (fClientController->ConnectToServer(hostname, kPortNumber, 1500))
+#endif
         {
             fClientController->VoidFn();
             
@@ -118,7 +152,7 @@ public:
         {
             AlertWindow::showMessageBox(AlertWindow::WarningIcon,
                 "Connection Error",
-                "Can't connect to server.",
+                "Can't connect to server on " + GetServerAddress() + ".",
                 "OK"
                 );
             this->quit();
@@ -130,7 +164,7 @@ public:
         // Add your application's shutdown code here..
         if (nullptr != fRpcServer)
         {
-            fRpcServer->stop();
+            fRpcServer->Stop();
             fRpcServer = nullptr;
         }
         mainWindow = nullptr; // (deletes our window)
@@ -219,6 +253,9 @@ public:
 private:
     ScopedPointer<MainWindow> mainWindow;
 
+    // runs the client's async call callbacks where they can touch the UI.
+    RpcMessageThreadExecutor fMessageThreadExecutor;
+
     // if we're operating in client mode.
     ScopedPointer<ClientController> fClientController;
 
@@ -44,28 +44,65 @@ void MainContentComponent::changeListenerCallback(ChangeBroadcaster* src)
     if (client)
     {
         DBG("Calling StringFn");
-        try
+        // don't block the message thread on the round trip; the client 
+        // runs the callback on the message thread (see Main.cpp), by which 
+        // time we may have been deleted.
+        Component::SafePointer<MainContentComponent> safeThis(this);
+        client->CallAsync<Controller::StringFnMethod>(String("from server")).Then(
+            [safeThis](RpcFuture<String> result)
         {
-            String newText = fController->StringFn("from server");
-            this->SetText(newText);
-        }
-        catch (const RpcException& e)
-        {
-            switch (e.GetCode())
+            MainContentComponent* component = safeThis.getComponent();
+            if (nullptr == component)
             {
-                case Controller::kTimeout:
-                {
-                    this->SetText("TIMEOUT error");
-                }
-                break;
-                    
-                default:
+                return;
+            }
+            try
+            {
+                component->SetText(result.Get());
+            }
+            catch (const RpcException& e)
+            {
+                switch (e.GetCode())
                 {
-                    this->SetText("Exception code = " + String(e.GetCode()));
+                    case Controller::kTimeout:
+                    {
+                        component->SetText("TIMEOUT error");
+                    }
+                    break;
+                        
+                    default:
+                    {
+                        component->SetText("Exception code = " + String(e.GetCode()));
+                    }
+                    break;
                 }
-                break;
             }
+        });
+    }
+
+    ServerController* server = dynamic_cast<ServerController*>(fController);
+    if (server)
+    {
+        // the server's trees are only touched on their strands, so that's 
+        // where we take the snapshot, and we show it once it gets back to 
+        // the message thread.
+        Component::SafePointer<MainContentComponent> safeThis(this);
+        for (int i = 0; i < 2; ++i)
+        {
+            server->PostToTree(i, [safeThis, server, i]()
+            {
+                const String xml(server->GetTree(i).toXmlString());
+                MessageManager::callAsync([safeThis, xml, i]()
+                {
+                    MainContentComponent* component = safeThis.getComponent();
+                    if (nullptr != component)
+                    {
+                        component->SetTreeText(xml, i);
+                    }
+                });
+            });
         }
+        return;
     }
 
     for (int i = 0; i < 2; ++i)
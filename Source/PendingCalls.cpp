@@ -7,63 +7,201 @@
 #include "PendingCalls.h"
 
 
-PendingCallList::PendingCallList()
+PendingCallTable::Slot::Slot()
+:  fTimer(0)
+,  fCall(nullptr)
+,  fState(0)
 {
 
 }
 
-PendingCallList::~PendingCallList()
+
+PendingCallTable::PendingCallTable()
+:  fNextSlot(0)
+,  fSize(0)
 {
 
 }
 
-void PendingCallList::Append(PendingCall* call)
+PendingCallTable::~PendingCallTable()
 {
-   const ScopedLock lock(fMutex);
-   fPendingCalls.append(call);
+   jassert(0 == fSize.get());
 }
 
 
-PendingCall* PendingCallList::FindCallBySequence(uint32 sequence)
+uint32 PendingCallTable::NextGeneration(uint32 generation)
 {
-   const ScopedLock lock(fMutex);
-   PendingCall* retval = nullptr;
+   const uint32 mask = (1u << kGenerationBits) - 1;
+   generation = (generation + 1) & mask;
+   // generation 0 would let a sequence be 0, which is reserved for
+   // unsolicited messages from the server, and the last generation would let
+   // one be RpcMessage::kUseNextSequence.
+   if (0 == generation || mask == generation)
+   {
+      generation = 1;
+   }
+   return generation;
+}
 
-   // yep, we iterate linearly. The assumption here is that we'll almost 
-   // always only have a single active call at any given time. If that's NOT true, 
-   // we're unlikely to have more than a handful, so this shouldn't be too expensive. 
 
-   for (int i = 0; i < this->Size(); ++i)
+uint32 PendingCallTable::Insert(PendingCall* call, int64 timeoutTicks)
+{
+   jassert(0 == call->fSequence);
+   const uint32 start = static_cast<uint32>(++fNextSlot);
+   for (uint32 i = 0; i < kCapacity; ++i)
    {
-      PendingCall* pc = fPendingCalls[i].get();
-      if (sequence == pc->GetSequence())
+      const uint32 index = (start + i) & (kCapacity - 1);
+      Slot& slot = fSlots[index];
+      const uint32 state = slot.fState.get();
+      if (state & kInUse)
       {
-         retval = pc;
-         break;
+         continue;
+      }
+
+      const uint32 generation = NextGeneration(state >> kStateBits);
+      // nobody will look this call up until we've sent its sequence number,
+      // so it's safe to claim the slot before storing the call in it.
+      if (slot.fState.compareAndSetBool((generation << kStateBits) | kInUse, state))
+      {
+         slot.fCall = call;
+         call->fSequence = (generation << kSlotBits) | index;
+         ++fSize;
+         const uint32 sequence = call->fSequence;
+         if (timeoutTicks > 0)
+         {
+            slot.fTimer = fTimers.Schedule(sequence, timeoutTicks);
+         }
+         return sequence;
       }
    }
+   return 0;
+}
+
+
+bool PendingCallTable::Complete(uint32 sequence, const void* response, size_t size)
+{
+   return this->Finish(sequence, response, size, 0);
+}
+
 
-   return retval;
+bool PendingCallTable::Abandon(uint32 sequence, const MemoryBlock& failure)
+{
+   return this->Finish(sequence, failure.getData(), failure.getSize(), kAbandoned);
 }
 
 
+void PendingCallTable::AdvanceTimers(int64 ticks, Array<uint32>& expired)
+{
+   fTimers.Advance(ticks, expired);
+}
+
 
-void PendingCallList::Remove(PendingCall* pending, bool alsoDelete)
+bool PendingCallTable::Finish(uint32 sequence, const void* response, size_t size, 
+   uint32 tombstone)
 {
-   const ScopedLock lock(fMutex);
+   Slot& slot = fSlots[sequence & (kCapacity - 1)];
+   const uint32 waiting = ((sequence >> kSlotBits) << kStateBits) | kInUse;
+   if (0 == (sequence >> kSlotBits) ||
+      !slot.fState.compareAndSetBool(waiting | kCompleting, waiting))
+   {
+      return false;
+   }
+
+   // the call has what it was waiting for, so its timer can go.
+   const uint64 timer = slot.fTimer.exchange(0);
+   if (0 != timer)
+   {
+      fTimers.Cancel(timer);
+   }
 
-   fPendingCalls.remove(pending);
-   if (alsoDelete)
+   // the call can't be removed until we clear kCompleting.
+   PendingCall* call = slot.fCall.get();
+   if (!call->fRemoveOnCompletion)
    {
-      delete pending;
+      call->Completed(response, size);
+      slot.fState = waiting | kCompleted;
+      return true;
    }
 
+   // nobody else will remove this call, and it may delete itself once it
+   // has its response.
+   slot.fCall = nullptr;
+   call->fSequence = 0;
+   --fSize;
+   slot.fState = (waiting & ~static_cast<uint32>(kInUse)) | tombstone;
+   call->Completed(response, size);
+   return true;
 }
 
 
-int PendingCallList::Size() const
+void PendingCallTable::Remove(PendingCall* call)
 {
-  return fPendingCalls.size();
+   const uint32 sequence = call->fSequence;
+   if (0 == sequence)
+   {
+      return;
+   }
+
+   Slot& slot = fSlots[sequence & (kCapacity - 1)];
+   const uint32 generation = sequence >> kSlotBits;
+   while (true)
+   {
+      const uint32 state = slot.fState.get();
+      if (state & kCompleting)
+      {
+         // the IPC thread is handing us our response right now.
+         Thread::yield();
+         continue;
+      }
+      // we're still waiting (or our response has just arrived).
+      jassert(((generation << kStateBits) | kInUse) == 
+         (state & ~static_cast<uint32>(kCompleted)));
+      const uint32 tombstone = (state & kCompleted) ? 0 : kAbandoned;
+      if (slot.fState.compareAndSetBool((generation << kStateBits) | tombstone, state))
+      {
+         break;
+      }
+   }
+
+   const uint64 timer = slot.fTimer.exchange(0);
+   if (0 != timer)
+   {
+      fTimers.Cancel(timer);
+   }
+
+   slot.fCall = nullptr;
+   call->fSequence = 0;
+   --fSize;
+}
+
+
+bool PendingCallTable::IsAbandoned(uint32 sequence) const
+{
+   const Slot& slot = fSlots[sequence & (kCapacity - 1)];
+   const uint32 generation = sequence >> kSlotBits;
+   return (0 != generation) && 
+      (((generation << kStateBits) | kAbandoned) == slot.fState.get());
+}
+
+
+Array<uint32> PendingCallTable::GetSequences() const
+{
+   Array<uint32> sequences;
+   for (uint32 i = 0; i < kCapacity; ++i)
+   {
+      const uint32 state = fSlots[i].fState.get();
+      if (kInUse == (state & (kInUse | kCompleted)))
+      {
+         sequences.add(((state >> kStateBits) << kSlotBits) | i);
+      }
+   }
+   return sequences;
+}
+
+
+int PendingCallTable::Size() const
+{
+  return fSize.get();
 }
 
 
@@ -81,54 +219,289 @@ public:
    {
       this->beginTest("basic");
 
-      PendingCallList pcl;
+      PendingCallTable table;
+      MemoryBlock reply("reply", 5);
+
+      PendingCall pc1;
+      const uint32 seq1 = table.Insert(&pc1);
+      this->expect(0 != seq1);
+      this->expect(seq1 == pc1.GetSequence());
+      this->expect(1 == table.Size());
+
+      this->expect(!table.Complete(seq1 + 1, reply));
+      this->expect(table.Complete(seq1, reply));
+      this->expect(pc1.Wait(0));
+      this->expect(pc1.GetMemoryBlock() == reply);
+      // only one response per call.
+      this->expect(!table.Complete(seq1, reply));
+
+      table.Remove(&pc1);
+      this->expect(0 == pc1.GetSequence());
+      this->expect(0 == table.Size());
+      this->expect(!table.Complete(seq1, reply));
+      // it had its response, so it wasn't abandoned.
+      this->expect(!table.IsAbandoned(seq1));
 
-      PendingCall pc1(5);
+      this->beginTest("multiple calls");
 
-      pcl.Append(&pc1);
+      PendingCall pc2;
+      PendingCall pc3;
+      const uint32 seq2 = table.Insert(&pc2);
+      const uint32 seq3 = table.Insert(&pc3);
+      this->expect(seq2 != seq3);
+      this->expect(2 == table.Size());
+
+      this->expect(table.Complete(seq3, MemoryBlock("three", 5)));
+      this->expect(!pc2.Wait(0));
+      this->expect(pc3.Wait(0));
+      this->expect(table.Complete(seq2, MemoryBlock("two", 3)));
+      this->expect(pc2.GetMemoryBlock() == MemoryBlock("two", 3));
+      this->expect(pc3.GetMemoryBlock() == MemoryBlock("three", 5));
+      table.Remove(&pc2);
+      table.Remove(&pc3);
+
+      this->beginTest("Reused slots");
+      // a late response for a call that gave up mustn't go to the next
+      // call that uses the same slot.
+      Array<uint32> used;
+      for (int i = 0; i < PendingCallTable::kCapacity * 3; ++i)
+      {
+         PendingCall pc;
+         const uint32 seq = table.Insert(&pc);
+         this->expect(0 != seq && IsNew(used, seq));
+         table.Remove(&pc);
+         this->expect(!table.Complete(seq, reply));
+         this->expect(table.IsAbandoned(seq));
+      }
 
-      PendingCall* ppc = pcl.FindCallBySequence(5);
-      this->expect(nullptr != ppc);
-      this->expect(&pc1 == ppc);
-      this->expect(nullptr == pcl.FindCallBySequence(55));
+      this->beginTest("Tombstones");
+      {
+         PendingCall gaveUp;
+         const uint32 gaveUpSeq = table.Insert(&gaveUp);
+         this->expect(!table.IsAbandoned(gaveUpSeq));
+         table.Remove(&gaveUp);
+         this->expect(table.IsAbandoned(gaveUpSeq));
+         // other generations of the same slot aren't.
+         const uint32 slotMask = PendingCallTable::kCapacity - 1;
+         this->expect(!table.IsAbandoned(gaveUpSeq + PendingCallTable::kCapacity));
+         this->expect(!table.IsAbandoned(gaveUpSeq & slotMask));
+         // the tombstone goes once the slot is used again.
+         int inserted = 0;
+         OwnedArray<PendingCall> fillers;
+         while (table.IsAbandoned(gaveUpSeq) && inserted++ < PendingCallTable::kCapacity)
+         {
+            PendingCall* filler = fillers.add(new PendingCall());
+            table.Insert(filler);
+         }
+         this->expect(!table.IsAbandoned(gaveUpSeq));
+         for (int i = 0; i < fillers.size(); ++i)
+         {
+            table.Remove(fillers[i]);
+         }
+         this->expect(0 == table.Size());
+      }
 
-      pcl.Remove(&pc1);
-      this->expect(nullptr == pcl.FindCallBySequence(5));
+      this->beginTest("Full table");
+      OwnedArray<PendingCall> calls;
+      for (int i = 0; i < PendingCallTable::kCapacity; ++i)
+      {
+         this->expect(0 != table.Insert(calls.add(new PendingCall())));
+      }
+      PendingCall extra;
+      this->expect(0 == table.Insert(&extra));
+      {
+         ScopedPendingCall spc(table, &extra);
+         this->expect(0 == extra.GetSequence());
+      }
+      table.Remove(calls[7]);
+      {
+         ScopedPendingCall spc(table, &extra);
+         this->expect(0 != extra.GetSequence());
+      }
+      this->expect(0 == extra.GetSequence());
+      for (int i = 0; i < calls.size(); ++i)
+      {
+         table.Remove(calls[i]);
+      }
+      this->expect(0 == table.Size());
+
+      this->beginTest("Calls that remove themselves");
+      OneShotCall* oneShot = new OneShotCall();
+      const uint32 oneShotSeq = table.Insert(oneShot);
+      PendingCall waiting;
+      const uint32 waitingSeq = table.Insert(&waiting);
+      Array<uint32> sequences = table.GetSequences();
+      this->expect(2 == sequences.size());
+      this->expect(sequences.contains(oneShotSeq) && sequences.contains(waitingSeq));
+      this->expect(table.Complete(oneShotSeq, reply));
+      this->expect(1 == OneShotCall::sCompleted);
+      this->expect(1 == table.Size());
+      this->expect(!table.Complete(oneShotSeq, reply));
+      this->expect(table.Complete(waitingSeq, reply));
+      // completed calls aren't waiting any more.
+      this->expect(0 == table.GetSequences().size());
+      table.Remove(&waiting);
+
+      this->beginTest("Timeouts");
+      {
+         OneShotCall* answered = new OneShotCall();
+         OneShotCall* timedOut = new OneShotCall();
+         const int completedBefore = OneShotCall::sCompleted;
+         const uint32 answeredSeq = table.Insert(answered, 5);
+         const uint32 timedOutSeq = table.Insert(timedOut, 5);
+         // the response cancels the call's timer.
+         this->expect(table.Complete(answeredSeq, reply));
+         Array<uint32> expired;
+         table.AdvanceTimers(4, expired);
+         this->expect(0 == expired.size());
+         table.AdvanceTimers(1, expired);
+         this->expect(1 == expired.size() && timedOutSeq == expired[0]);
+         this->expect(table.Abandon(timedOutSeq, reply));
+         this->expect(completedBefore + 2 == OneShotCall::sCompleted);
+         this->expect(0 == table.Size());
+         // the response that comes after the timeout is recognized as late.
+         this->expect(!table.Complete(timedOutSeq, reply));
+         this->expect(table.IsAbandoned(timedOutSeq));
+         this->expect(!table.IsAbandoned(answeredSeq));
+      }
 
-      this->expect(0 == pcl.Size());
+      this->beginTest("Threads");
+      Responder responder(table);
+      OwnedArray<Caller> callers;
+      for (int i = 0; i < 8; ++i)
+      {
+         callers.add(new Caller(table, responder))->startThread();
+      }
+      responder.startThread();
+      for (int i = 0; i < callers.size(); ++i)
+      {
+         this->expect(callers[i]->waitForThreadToExit(10000));
+         this->expect(Caller::kCalls == callers[i]->fAnswered);
+      }
+      responder.stopThread(1000);
+      this->expect(0 == table.Size());
+   }
 
-      this->beginTest("multiple calls");
+private:
+   static bool IsNew(Array<uint32>& used, uint32 seq)
+   {
+      if (used.contains(seq))
+      {
+         return false;
+      }
+      used.add(seq);
+      return true;
+   }
 
-      PendingCall pc2(10);
-      PendingCall pc3(11);
+   /**
+    * Like an asynchronous call, which nobody waits for.
+    */
+   class OneShotCall : public PendingCall
+   {
+   public:
+      OneShotCall() : PendingCall(true) {}
 
-      pcl.Append(&pc2);
-      pcl.Append(&pc3);
+      void Completed(const void*, size_t) override
+      {
+         ++sCompleted;
+         delete this;
+      }
 
-      this->expect(2 == pcl.Size());
-      ppc = pcl.FindCallBySequence(11);
-      this->expect(&pc3 == ppc);
-      ppc = pcl.FindCallBySequence(10);
-      this->expect(&pc2 == ppc);
+      static int sCompleted;
+   };
 
+   /**
+    * Plays the part of the IPC thread, answering every call it's told about.
+    */
+   class Responder : public Thread
+   {
+   public:
+      Responder(PendingCallTable& table) : Thread("responder"), fTable(table) {}
 
-   }
+      void Post(uint32 sequence)
+      {
+         const ScopedLock lock(fMutex);
+         fSequences.add(sequence);
+      }
+
+      void run() override
+      {
+         while (!this->threadShouldExit())
+         {
+            Array<uint32> sequences;
+            {
+               const ScopedLock lock(fMutex);
+               sequences.swapWith(fSequences);
+            }
+            for (int i = 0; i < sequences.size(); ++i)
+            {
+               const uint32 seq = sequences.getUnchecked(i);
+               fTable.Complete(seq, MemoryBlock(&seq, sizeof(seq)));
+            }
+            Thread::yield();
+         }
+      }
 
+   private:
+      PendingCallTable& fTable;
+      CriticalSection fMutex;
+      Array<uint32> fSequences;
+   };
+
+   class Caller : public Thread
+   {
+   public:
+      enum { kCalls = 2000 };
+
+      Caller(PendingCallTable& table, Responder& responder)
+      :  Thread("caller")
+      ,  fTable(table)
+      ,  fResponder(responder)
+      ,  fAnswered(0)
+      {
+
+      }
+
+      void run() override
+      {
+         for (int i = 0; i < kCalls; ++i)
+         {
+            PendingCall pc;
+            const ScopedPendingCall spc(fTable, &pc);
+            const uint32 seq = pc.GetSequence();
+            fResponder.Post(seq);
+            if (pc.Wait(5000) && pc.GetMemoryBlock() == MemoryBlock(&seq, sizeof(seq)))
+            {
+               ++fAnswered;
+            }
+         }
+      }
+
+   private:
+      PendingCallTable& fTable;
+      Responder& fResponder;
+
+   public:
+      int fAnswered;
+   };
 };
 
 
-ScopedPendingCall::ScopedPendingCall(PendingCallList& list, PendingCall* call)
-:  fList(list)
+int PendingCallsTest::OneShotCall::sCompleted = 0;
+
+
+ScopedPendingCall::ScopedPendingCall(PendingCallTable& table, PendingCall* call)
+:  fTable(table)
 ,  fCall(call)
 {
-   fList.Append(call);
+   fTable.Insert(call);
 }
 
 
 ScopedPendingCall::~ScopedPendingCall()
 {
-   fList.Remove(fCall);
+   fTable.Remove(fCall);
 }
 
 
-static PendingCallsTest tests;
\ No newline at end of file
+static PendingCallsTest tests;
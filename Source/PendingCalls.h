@@ -11,15 +11,20 @@
 
 #include "../JuceLibraryCode/JuceHeader.h"
 
+#include "RpcTimerWheel.h"
+
 class PendingCall
 {
 public:
-   PendingCall(uint32 sequence)
-   : fSequence(sequence)
+   PendingCall()
+   : fSequence(0)
+   , fRemoveOnCompletion(false)
    {
 
    }
 
+   virtual ~PendingCall() {}
+
    /**
     * Tell our waitable event to block here, infinitely (default), or for a specified 
     * # of ms.
@@ -33,21 +38,55 @@ public:
 
    void Signal() const { fEvent.signal(); }
 
+   /**
+    * @return the sequence number that the PendingCallTable gave us, or 0 if
+    *         we aren't in a table.
+    */
    uint32 GetSequence() const { return fSequence; }
 
    void SetMemoryBlock(const MemoryBlock& mb) { fData = mb; }
 
    const MemoryBlock& GetMemoryBlock() const { return fData; }
 
-   bool operator==(const PendingCall& rhs) const { return (rhs.fSequence == fSequence);};
+   /**
+    * Move the returned data into `dest` without copying it.
+    */
+   void TakeMemoryBlock(MemoryBlock& dest) { dest.swapWith(fData); }
+
+protected:
+   /**
+    * @param removeOnCompletion For calls that nobody waits on: the table 
+    *                           removes the call before calling Completed(), 
+    *                           which may then delete it.
+    */
+   explicit PendingCall(bool removeOnCompletion)
+   : fSequence(0)
+   , fRemoveOnCompletion(removeOnCompletion)
+   {
+
+   }
+
+   /**
+    * Called by the table (on the IPC thread) with the call's response, 
+    * which is only valid until we return. By default, keeps a copy of the
+    * response and wakes up the thread that's waiting.
+    */
+   virtual void Completed(const void* response, size_t size)
+   {
+      fData.replaceWith(response, size);
+      this->Signal();
+   }
 
 private:
+   friend class PendingCallTable;
 
    /**
     * Sequence number of this function call.
     */
    uint32 fSequence;
 
+   bool fRemoveOnCompletion;
+
    /**
     * An event for the returned message to signal.
     */
@@ -58,71 +97,188 @@ private:
     */
    MemoryBlock fData;
 
+   JUCE_DECLARE_NON_COPYABLE(PendingCall)
+};
 
 
+/**
+ * @class PendingCallTable
+ *
+ * The calls on one connection that are waiting for responses. Each call is
+ * given a slot in a fixed-size table, and its sequence number is made up of
+ * the slot's index and a generation count that goes up every time the slot
+ * is reused:
+ *
+ *     sequence = (generation << kSlotBits) | slot
+ *
+ * so finding the call that a response belongs to is a single array index,
+ * and a late response to a call that has already given up can't be
+ * mistaken for a response to the next call in the same slot. Until the 
+ * slot is reused, it remembers that its last call gave up (see 
+ * IsAbandoned()), so a late response can be recognized and dropped.
+ *
+ * A call that nobody waits on can be given a timeout when it's inserted. 
+ * The timeouts are kept on an RpcTimerWheel, which the owner of the table
+ * moves on with AdvanceTimers(), and the calls whose timeouts expire are 
+ * handed their failures with Abandon().
+ *
+ * Insert() and Complete() never block, except to take the timer wheel's 
+ * lock for calls with timeouts. Remove() only waits if the IPC thread is 
+ * in the middle of handing that same call its response, so the call is 
+ * never destroyed while Complete() is still using it. Sequence numbers are
+ * local to the table, so connections don't share a counter.
+ */
+class PendingCallTable
+{
 public:
+   enum
+   {
+      kSlotBits = 12,
+
+      /**
+       * The most calls that can be waiting at once.
+       */
+      kCapacity = 1 << kSlotBits
+   };
+
+   PendingCallTable();
+
+   ~PendingCallTable();
+
    /**
-    * NOTE that the type and name of the linked list pointer are required
-    * to be this by JUCE
+    * Give a call a sequence number and add it to the table.
+    * @param  timeoutTicks If not 0, the number of AdvanceTimers() ticks 
+    *                      after which the call's sequence number is 
+    *                      returned as expired.
+    * @return the call's sequence number, or 0 if the table is full.
     */
-   LinkedListPointer<PendingCall> nextListItem;
+   uint32 Insert(PendingCall* call, int64 timeoutTicks=0);
 
+   /**
+    * Hand a response to the call that's waiting for it and wake it up.
+    * @param  sequence Sequence number from the response.
+    * @param  response The response message, which the call doesn't keep.
+    * @return          false if no call is waiting with that sequence number
+    *                  (or it has already had its response).
+    */
+   bool Complete(uint32 sequence, const void* response, size_t size);
 
+   bool Complete(uint32 sequence, const MemoryBlock& response)
+   {
+      return this->Complete(sequence, response.getData(), response.getSize());
+   }
 
-};
+   /**
+    * Like Complete(), for a call that's giving up -- `failure` is what it 
+    * gets instead of its response -- so its slot keeps a tombstone (see 
+    * IsAbandoned()).
+    */
+   bool Abandon(uint32 sequence, const MemoryBlock& failure);
 
+   /**
+    * Move the calls' timers on `ticks` ticks.
+    * @param expired Receives the sequence numbers of the calls whose 
+    *                timeouts have expired. It's up to the caller to 
+    *                Abandon() them; any that have been completed since 
+    *                won't be found.
+    */
+   void AdvanceTimers(int64 ticks, Array<uint32>& expired);
 
-class PendingCallList
-{
-public:
-   PendingCallList();
+   /**
+    * Remove a call from the table, but do not delete it. If the call 
+    * hadn't had its response, its slot keeps a tombstone for it until the 
+    * slot is reused.
+    */
+   void Remove(PendingCall* call);
 
-   ~PendingCallList();
+   /**
+    * @return true if `sequence` belongs to a call that was removed before 
+    *         its response arrived, and whose slot hasn't been reused since.
+    */
+   bool IsAbandoned(uint32 sequence) const;
 
    /**
-    * Append a new PendingCall object to the end of our list.
-    * @param call [description]
+    * @return the sequence numbers of the calls still waiting for responses,
+    *         e.g. to fail them all when the connection is lost. Calls may 
+    *         come and go while we're looking.
     */
-   void Append(PendingCall* call);
+   Array<uint32> GetSequences() const;
 
    /**
-    * Look for a pending call with the specified sequence id.
-    * @param  sequence id of the call we're looking for.
-    * @return          nullptr if there's no such id.
+    * @return the number of calls in the table.
     */
-   PendingCall* FindCallBySequence(uint32 sequence);
+   int Size() const;
 
+private:
+   enum
+   {
+      /**
+       * A slot's state is its generation shifted left by kStateBits, plus
+       * these flags.
+       */
+      kInUse      = 0x01,
+      kCompleting = 0x02,
+      kCompleted  = 0x04,
+      kAbandoned  = 0x08,
+      kStateBits  = 4,
+
+      kGenerationBits = 32 - kSlotBits
+   };
 
+   static uint32 NextGeneration(uint32 generation);
 
    /**
-    * Remove this object from the list, but do not delete it.
-    * @param pending pointer to the object.
+    * Hand a call its response and take it out of its slot if that's what it
+    * wants, leaving `tombstone` (0 or kAbandoned) in the slot's state.
     */
-   void Remove(PendingCall* pending, bool alsoDelete=false);
+   bool Finish(uint32 sequence, const void* response, size_t size, 
+      uint32 tombstone);
 
+   /**
+    * Each slot gets a cache line to itself, so threads working on calls in
+    * neighbouring slots don't slow each other down.
+    */
+   struct Slot
+   {
+      Slot();
 
-   int Size() const;
+      /**
+       * The call's RpcTimerWheel::Handle, or 0 if it has no timeout.
+       */
+      Atomic<uint64> fTimer;
+      Atomic<PendingCall*> fCall;
+      Atomic<uint32> fState;
+      char fPadding[64 - sizeof(Atomic<uint64>) - sizeof(Atomic<PendingCall*>) - 
+         sizeof(Atomic<uint32>)];
+   };
 
+   Slot fSlots[kCapacity];
 
-private:
+   RpcTimerWheel fTimers;
 
-   LinkedListPointer<PendingCall> fPendingCalls;
-   
    /**
-    * Function calls/returns will happen on separate threads. 
+    * Where the next Insert() starts looking for a free slot.
     */
-   CriticalSection fMutex;
+   Atomic<uint32> fNextSlot;
+
+   Atomic<int> fSize;
+
+   JUCE_DECLARE_NON_COPYABLE(PendingCallTable)
 };
 
 
 class ScopedPendingCall
 {
 public:
-  ScopedPendingCall(PendingCallList& list, PendingCall* call);
+  /**
+   * Insert a call into the table for as long as we exist. If the table is
+   * full, the call's sequence number stays 0.
+   */
+  ScopedPendingCall(PendingCallTable& table, PendingCall* call);
   ~ScopedPendingCall();
 
 private:
-  PendingCallList& fList;
+  PendingCallTable& fTable;
   PendingCall* fCall;
 
 };
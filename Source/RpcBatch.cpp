@@ -0,0 +1,655 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcBatch.h"
+#include "RpcServer.h"
+
+
+/**
+ * Counts down the calls in a batch, and fills in the batch's own future
+ * once they've all finished.
+ */
+class RpcBatch::Progress : public ReferenceCountedObject
+{
+public:
+   typedef ReferenceCountedObjectPtr<Progress> Ptr;
+
+   Progress(RpcExecutor* executor, int numCalls)
+   :  fDone(new RpcFuture<void>::State(executor))
+   ,  fRemaining(numCalls)
+   {
+      if (0 == numCalls)
+      {
+         fDone->Succeed();
+      }
+   }
+
+   RpcFuture<void> GetFuture() const { return RpcFuture<void>(fDone); }
+
+   void Finished(int numCalls)
+   {
+      if (0 == (fRemaining -= numCalls))
+      {
+         fDone->Succeed();
+      }
+   }
+
+private:
+   RpcFuture<void>::State::Ptr fDone;
+   Atomic<int> fRemaining;
+};
+
+
+/**
+ * The batch's entry in the client's pending call table. Like an
+ * asynchronous call, it deletes itself once its response has arrived.
+ */
+class RpcBatch::BatchCall : public PendingCall
+{
+public:
+   BatchCall(OwnedArray<Call>& calls, Progress* progress, uint32 options)
+   :  PendingCall(true)
+   ,  fProgress(progress)
+   ,  fOptions(options)
+   {
+      fCalls.swapWith(calls);
+   }
+
+   const OwnedArray<Call>& GetCalls() const { return fCalls; }
+
+   void Completed(const void* response, size_t size) override
+   {
+      RpcMessageReader reader(response, size, fOptions);
+      try
+      {
+         RpcBatch::ThrowIfException(reader, Controller::kBatch);
+         reader.GetUInt();
+         // the responses are in the same order as the calls.
+         for (int i = 0; i < fCalls.size(); ++i)
+         {
+            RpcMessageReader result = reader.GetMessage();
+            fCalls.getUnchecked(i)->Resolve(result);
+         }
+      }
+      catch (const RpcException& e)
+      {
+         // the batch as a whole failed.
+         for (int i = 0; i < fCalls.size(); ++i)
+         {
+            fCalls.getUnchecked(i)->Fail(e);
+         }
+      }
+      fProgress->Finished(fCalls.size());
+      delete this;
+   }
+
+private:
+   OwnedArray<Call> fCalls;
+   Progress::Ptr fProgress;
+   uint32 fOptions;
+};
+
+
+/**
+ * One call from a batch, sent on its own.
+ */
+class RpcBatch::SingleCall : public PendingCall
+{
+public:
+   SingleCall(Call* call, Progress* progress, uint32 options)
+   :  PendingCall(true)
+   ,  fCall(call)
+   ,  fProgress(progress)
+   ,  fOptions(options)
+   {
+
+   }
+
+   void Completed(const void* response, size_t size) override
+   {
+      RpcMessageReader reader(response, size, fOptions);
+      fCall->Resolve(reader);
+      fProgress->Finished(1);
+      delete this;
+   }
+
+private:
+   ScopedPointer<Call> fCall;
+   Progress::Ptr fProgress;
+   uint32 fOptions;
+};
+
+
+RpcBatch::Call::Call(const RpcMessage& msg)
+:  fMessage(msg)
+{
+   RpcMessageReader header(fMessage.GetBuffer().GetData(),
+      fMessage.GetBuffer().GetSize(), fMessage.GetOptions());
+   fCode = header.GetCode();
+}
+
+
+RpcBatch::RpcBatch(ClientController& client)
+:  fClient(client)
+{
+
+}
+
+
+RpcBatch::~RpcBatch()
+{
+   if (fCalls.size() > 0)
+   {
+      this->Send();
+   }
+}
+
+
+RpcFuture<void> RpcBatch::Send()
+{
+   Progress::Ptr progress = new Progress(fClient.fExecutor, fCalls.size());
+   RpcFuture<void> future = progress->GetFuture();
+   const uint32 options = fClient.GetOptions();
+   if (0 == fCalls.size())
+   {
+      return future;
+   }
+   fClient.FlushTreePropertiesIfBuffered();
+   if (0 == (options & RpcMessage::kBatchedCalls))
+   {
+      this->SendSingly(progress);
+      return future;
+   }
+
+   BatchCall* batch = new BatchCall(fCalls, progress, options);
+   const uint32 sequence = fClient.fPending.Insert(batch, fClient.GetTimeoutTicks());
+   if (0 == sequence)
+   {
+      const MemoryBlock failure(fClient.MakeException(0, Controller::kTooManyCallsError));
+      batch->Completed(failure.getData(), failure.getSize());
+      return future;
+   }
+
+   // once it's sent, the response may arrive (and delete `batch`) at any
+   // moment.
+   const OwnedArray<Call>& calls = batch->GetCalls();
+   RpcMessage msg(Controller::kBatch, sequence, options, fClient.GetCallTimeout());
+   msg.AppendUInt(static_cast<uint32>(calls.size()));
+   for (int i = 0; i < calls.size(); ++i)
+   {
+      msg.AppendMessage(calls.getUnchecked(i)->GetMessage());
+   }
+   if (!fClient.fRpc->IsConnected() || !fClient.fRpc->SendRpcMessage(msg))
+   {
+      fClient.fPending.Complete(sequence, fClient.MakeException(sequence,
+         Controller::kConnectionError));
+   }
+   return future;
+}
+
+
+void RpcBatch::SendSingly(Progress* progress)
+{
+   const uint32 options = fClient.GetOptions();
+   for (int i = 0; i < fCalls.size(); ++i)
+   {
+      Call* call = fCalls.getUnchecked(i);
+      SingleCall* single = new SingleCall(call, progress, options);
+      const uint32 sequence = fClient.fPending.Insert(single, 
+         fClient.GetTimeoutTicks());
+      if (0 == sequence)
+      {
+         const MemoryBlock failure(fClient.MakeException(0, 
+            Controller::kTooManyCallsError));
+         single->Completed(failure.getData(), failure.getSize());
+         continue;
+      }
+
+      // the call was encoded with its place in the batch as its sequence
+      // number; it needs one from the table instead.
+      RpcMessage msg(ClientController::Resequence(call->GetMessage(), sequence,
+         options));
+      if (!fClient.fRpc->IsConnected() || !fClient.fRpc->SendRpcMessage(msg))
+      {
+         fClient.fPending.Complete(sequence, fClient.MakeException(sequence,
+            Controller::kConnectionError));
+      }
+   }
+   // the SingleCalls own them now.
+   fCalls.clear(false);
+}
+
+
+void RpcBatch::ThrowIfException(RpcMessageReader& response, uint32 messageCode)
+{
+   if (!response.IsValid())
+   {
+      // the server didn't send a response for this call.
+      throw RpcException(Controller::kInternalError);
+   }
+   ClientController::ThrowIfException(response, messageCode);
+}
+
+
+class RpcBatchHandler::Batch : public ReferenceCountedObject
+{
+public:
+   typedef ReferenceCountedObjectPtr<Batch> Ptr;
+
+   Batch(RpcServerConnection* connection, RpcResponder* responder)
+   :  fLink((nullptr != connection) ? connection->GetLink() : nullptr)
+   ,  fResponder(responder)
+   ,  fRemaining(1)
+   {
+
+   }
+
+   RpcMessage& AddResult(const RpcMessageReader& call)
+   {
+      return *fResults.add(new RpcMessage(call.GetCode(), call.GetSequence(),
+         fResponder->GetResponse().GetOptions()));
+   }
+
+   RpcMessage& GetResult(int index) { return *fResults.getUnchecked(index); }
+
+   /**
+    * Run one of the calls on a worker, from our own copy of its message.
+    */
+   void RunConcurrent(RpcHandler* handler, const MemoryBlock& message, 
+      uint32 options, int index)
+   {
+      const RpcMessageReader call(message, options);
+      if (nullptr == fLink)
+      {
+         RpcBatchHandler::Run(nullptr, handler, call, this->GetResult(index));
+      }
+      else
+      {
+         const RpcServerConnection::Link::ScopedUse use(fLink);
+         // if the client has gone, there's nobody to send the results to.
+         if (nullptr != use.GetConnection())
+         {
+            RpcBatchHandler::Run(use.GetConnection(), handler, call, 
+               this->GetResult(index));
+         }
+      }
+      this->Finished();
+   }
+
+   /**
+    * One more call is running on the workers.
+    */
+   void Started() { ++fRemaining; }
+
+   /**
+    * A call on the workers (or the batch itself) is done; whichever is last
+    * sends the response.
+    */
+   void Finished()
+   {
+      if (0 != --fRemaining)
+      {
+         return;
+      }
+      RpcMessage& response = fResponder->GetResponse();
+      response.AppendUInt(static_cast<uint32>(fResults.size()));
+      for (int i = 0; i < fResults.size(); ++i)
+      {
+         response.AppendMessage(*fResults.getUnchecked(i));
+      }
+      fResponder->Send();
+   }
+
+private:
+   RpcServerConnection::Link::Ptr fLink;
+   RpcResponder::Ptr fResponder;
+   OwnedArray<RpcMessage> fResults;
+   Atomic<int> fRemaining;
+};
+
+
+RpcBatchHandler::RpcBatchHandler(const RpcDispatcher& dispatcher,
+   RpcExecutor* workers)
+:  RpcHandler(kNoResponse | kBlocking)
+,  fDispatcher(dispatcher)
+,  fWorkers(workers)
+{
+
+}
+
+
+void RpcBatchHandler::Handle(RpcServerConnection* connection,
+   RpcMessageReader& call, RpcMessage& response)
+{
+   const Array<RpcMessageReader> calls(RpcBatchHandler::ReadCalls(call));
+   this->Start(connection, calls, 
+      new RpcResponder(connection, call, response.GetOptions()));
+}
+
+
+void RpcBatchHandler::HandleBatched(RpcServerConnection* connection,
+   RpcMessageReader& call, RpcMessage& response)
+{
+   const Array<RpcMessageReader> calls(RpcBatchHandler::ReadCalls(call));
+   response.AppendUInt(static_cast<uint32>(calls.size()));
+   for (int i = 0; i < calls.size(); ++i)
+   {
+      const RpcMessageReader& c = calls.getReference(i);
+      RpcMessage result(c.GetCode(), c.GetSequence(), response.GetOptions());
+      RpcBatchHandler::Run(connection, fDispatcher.Find(c.GetCode()), c, result);
+      response.AppendMessage(result);
+   }
+}
+
+
+Array<RpcMessageReader> RpcBatchHandler::ReadCalls(RpcMessageReader& call)
+{
+   const uint32 count = call.GetUInt();
+   Array<RpcMessageReader> calls;
+   for (uint32 i = 0; i < count && call.IsValid(); ++i)
+   {
+      calls.add(call.GetMessage());
+   }
+   if (!call.IsValid())
+   {
+      throw RpcException(Controller::kParameterError);
+   }
+   return calls;
+}
+
+
+void RpcBatchHandler::Start(RpcServerConnection* connection,
+   const Array<RpcMessageReader>& calls, RpcResponder* responder)
+{
+   Batch::Ptr batch = new Batch(connection, responder);
+   for (int i = 0; i < calls.size(); ++i)
+   {
+      batch->AddResult(calls.getReference(i));
+   }
+
+   // we never wait for the workers here: this may be running on one of 
+   // them, and they could all be busy with batches waiting on each other.
+   for (int i = 0; i < calls.size(); ++i)
+   {
+      const RpcMessageReader& c = calls.getReference(i);
+      RpcHandler* handler = fDispatcher.Find(c.GetCode());
+      if (nullptr != fWorkers && nullptr != handler &&
+         handler->HasTrait(RpcHandler::kConcurrent))
+      {
+         // the call points into the batch message, which may be gone 
+         // before the call runs.
+         RpcMessageReader whole(c);
+         whole.Seek(0);
+         const size_t size = whole.GetBytesRemaining();
+         const MemoryBlock message(whole.Skip(size), size);
+         const uint32 options = c.GetOptions();
+         batch->Started();
+         fWorkers->Post([batch, handler, message, options, i]()
+         {
+            batch->RunConcurrent(handler, message, options, i);
+         });
+      }
+      else
+      {
+         RpcBatchHandler::Run(connection, handler, c, batch->GetResult(i));
+      }
+   }
+   batch->Finished();
+}
+
+
+void RpcBatchHandler::Run(RpcServerConnection* connection, RpcHandler* handler,
+   RpcMessageReader call, RpcMessage& result)
+{
+   try
+   {
+      if (nullptr == handler)
+      {
+         RpcException e(Controller::kUnknownMethodError);
+         e.AppendExtraData(var(static_cast<int>(call.GetCode())));
+         throw e;
+      }
+      handler->HandleBatched(connection, call, result);
+   }
+   catch (const RpcException& e)
+   {
+      result = RpcResponder::MakeException(e, call.GetSequence(),
+         result.GetOptions());
+   }
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+namespace
+{
+   /**
+    * Answers after a while, from any thread.
+    */
+   class SlowHandler : public RpcHandler
+   {
+   public:
+      SlowHandler() : RpcHandler(kConcurrent) {}
+
+      void Handle(RpcServerConnection*, RpcMessageReader& call,
+         RpcMessage& response) override
+      {
+         const int val = call.GetInt();
+         Thread::sleep(100);
+         response.AppendInt(val);
+      }
+   };
+}
+
+
+class RpcBatchTest : public UnitTest
+{
+public:
+   RpcBatchTest() : UnitTest("RpcBatch tests") {}
+
+   struct Doubler
+   {
+      int Double(int val)
+      {
+         if (val < 0)
+         {
+            throw RpcException(Controller::kParameterError);
+         }
+         return 2 * val;
+      }
+   };
+
+   void runTest() override
+   {
+      const uint32 options = RpcMessage::kSupportedOptions;
+
+      this->beginTest("Nested messages");
+      {
+         RpcMessage inner(Controller::kIntFn, 3, options);
+         inner.AppendInt(-7);
+         RpcMessage outer(Controller::kBatch, 9, options);
+         outer.AppendUInt(1);
+         outer.AppendMessage(inner);
+         MemoryBlock data(outer.GetMemoryBlock());
+         RpcMessageReader reader(data, options);
+         this->expect(1 == reader.GetUInt());
+         RpcMessageReader nested = reader.GetMessage();
+         this->expect(nested.IsValid());
+         this->expect(Controller::kIntFn == nested.GetCode());
+         this->expect(3 == nested.GetSequence());
+         this->expect(-7 == nested.GetInt());
+         this->expect(0 == reader.GetBytesRemaining());
+         // there's nothing left to read.
+         RpcMessageReader missing = reader.GetMessage();
+         this->expect(!missing.IsValid());
+         this->expect(!reader.IsValid());
+      }
+
+      Doubler doubler;
+      RpcThreadExecutor workers("batch test", 4);
+      RpcDispatcher dispatcher;
+      dispatcher.Register<Controller::IntFnMethod>(&doubler, &Doubler::Double);
+      dispatcher.Register(Controller::kStringFn, new SlowHandler());
+      RpcBatchHandler* handler = new RpcBatchHandler(dispatcher, &workers);
+      dispatcher.Register(Controller::kBatch, handler);
+
+      this->beginTest("Results and exceptions");
+      {
+         RpcMessage batch(Controller::kBatch, 1, options);
+         batch.AppendUInt(3);
+         RpcMessage call1(Controller::kIntFn, 1, options);
+         call1.AppendInt(21);
+         batch.AppendMessage(call1);
+         RpcMessage call2(Controller::kIntFn, 2, options);
+         call2.AppendInt(-1);
+         batch.AppendMessage(call2);
+         RpcMessage call3(Controller::kUnknownFn, 3, options);
+         batch.AppendMessage(call3);
+
+         MemoryBlock responseData(this->Handle(handler, batch));
+         RpcMessageReader reader(responseData, options);
+         this->expect(3 == reader.GetUInt());
+
+         RpcMessageReader result1 = reader.GetMessage();
+         this->expect(Controller::kIntFn == result1.GetCode());
+         this->expect(1 == result1.GetSequence());
+         this->expect(42 == result1.GetInt());
+
+         RpcMessageReader result2 = reader.GetMessage();
+         this->expect(Controller::kParameterError == result2.GetCode());
+         this->expect(2 == result2.GetSequence());
+         this->expect(result2.GetVar().isVoid());
+
+         RpcMessageReader result3 = reader.GetMessage();
+         this->expect(Controller::kUnknownMethodError == result3.GetCode());
+         this->expect(Controller::kUnknownFn == (int) result3.GetVar());
+         this->expect(result3.IsValid());
+      }
+
+      this->beginTest("Concurrent calls");
+      {
+         RpcMessage batch(Controller::kBatch, 2, options);
+         batch.AppendUInt(8);
+         for (int i = 0; i < 8; ++i)
+         {
+            RpcMessage call(Controller::kStringFn, i + 1, options);
+            call.AppendInt(i);
+            batch.AppendMessage(call);
+         }
+         const int64 start = Time::getMillisecondCounter();
+         MemoryBlock responseData(this->Handle(handler, batch));
+         // eight 100ms calls on four threads.
+         this->expect(Time::getMillisecondCounter() - start < 700);
+
+         RpcMessageReader reader(responseData, options);
+         this->expect(8 == reader.GetUInt());
+         bool inOrder = true;
+         for (int i = 0; i < 8; ++i)
+         {
+            RpcMessageReader result = reader.GetMessage();
+            inOrder = inOrder && (i == result.GetInt());
+         }
+         this->expect(inOrder);
+      }
+
+      this->beginTest("Bad batches");
+      {
+         RpcMessage batch(Controller::kBatch, 3, options);
+         batch.AppendUInt(2);
+         RpcMessage call(Controller::kIntFn, 1, options);
+         call.AppendInt(1);
+         batch.AppendMessage(call);
+         RpcMessage response(Controller::kBatch, 3, options);
+         uint32 code = 0;
+         try
+         {
+            MemoryBlock batchData(batch.GetMemoryBlock());
+            RpcMessageReader reader(batchData, options);
+            handler->Handle(nullptr, reader, response);
+         }
+         catch (const RpcException& e)
+         {
+            code = e.GetCode();
+         }
+         this->expect(Controller::kParameterError == code);
+      }
+
+      this->beginTest("More batches than workers");
+      {
+         // each batch starts on one of the two workers, and hands its 
+         // call to them as well.
+         RpcThreadExecutor fewWorkers("batch test", 2);
+         RpcBatchHandler fewHandler(dispatcher, &fewWorkers);
+         const int kNumBatches = 4;
+         OwnedArray<MemoryBlock> batches;
+         ReferenceCountedArray<RpcResponder> responders;
+         for (int i = 0; i < kNumBatches; ++i)
+         {
+            RpcMessage batch(Controller::kBatch, i + 1, options);
+            batch.AppendUInt(1);
+            RpcMessage call(Controller::kStringFn, 1, options);
+            call.AppendInt(i);
+            batch.AppendMessage(call);
+            const MemoryBlock* batchData = batches.add(
+               new MemoryBlock(batch.GetMemoryBlock()));
+            RpcMessageReader reader(*batchData, options);
+            RpcResponder* responder = new RpcResponder(nullptr, reader, options);
+            responders.add(responder);
+            fewWorkers.Post([&fewHandler, batchData, options, responder]()
+            {
+               RpcMessageReader reader(*batchData, options);
+               fewHandler.Start(nullptr, RpcBatchHandler::ReadCalls(reader),
+                  responder);
+            });
+         }
+         bool allDone = true;
+         for (int i = 0; i < kNumBatches; ++i)
+         {
+            allDone = allDone && this->WaitFor(responders[i]);
+         }
+         this->expect(allDone);
+         for (int i = 0; i < kNumBatches && allDone; ++i)
+         {
+            MemoryBlock responseData(responders[i]->GetResponse().GetMemoryBlock());
+            RpcMessageReader reader(responseData, options);
+            this->expect(1 == reader.GetUInt());
+            this->expect(i == reader.GetMessage().GetInt());
+         }
+      }
+   }
+
+private:
+   /**
+    * Run a batch as the server would, and wait for its response.
+    */
+   MemoryBlock Handle(RpcBatchHandler* handler, const RpcMessage& batch)
+   {
+      MemoryBlock batchData(batch.GetMemoryBlock());
+      RpcMessageReader reader(batchData, batch.GetOptions());
+      RpcResponder::Ptr responder = new RpcResponder(nullptr, reader, 
+         batch.GetOptions());
+      // none of these handlers use the connection.
+      handler->Start(nullptr, RpcBatchHandler::ReadCalls(reader), responder);
+      this->expect(this->WaitFor(responder));
+      return responder->GetResponse().GetMemoryBlock();
+   }
+
+   /**
+    * @return true if the responder had its response within a few seconds.
+    */
+   static bool WaitFor(const RpcResponder* responder)
+   {
+      for (int i = 0; i < 5000 && !responder->IsDone(); ++i)
+      {
+         Thread::sleep(1);
+      }
+      return responder->IsDone();
+   }
+};
+
+static RpcBatchTest batchTest;
@@ -0,0 +1,268 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCBATCH_H_INCLUDED
+#define RPCBATCH_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include "Controller.h"
+#include "RpcDispatcher.h"
+#include "RpcExecutor.h"
+#include "RpcFuture.h"
+
+class RpcResponder;
+
+
+/**
+ * @class RpcBatch
+ *
+ * Several calls that are sent to the server in one Controller::kBatch
+ * message and answered in one response, so that they share a single round
+ * trip:
+ *
+ *     RpcBatch batch(client);
+ *     RpcFuture<int> count = batch.Add<Controller::IntFnMethod>(21);
+ *     RpcFuture<String> name = batch.Add<Controller::StringFnMethod>(String("x"));
+ *     batch.SetTreeProperty(Controller::kValueTree1SetProp, "sub/x", RpcMessage::kInt, 42);
+ *     batch.Send().Wait();
+ *
+ * Each call gets its own future, which holds its result or the
+ * RpcException that it threw, just as if it had been made with
+ * ClientController::CallAsync(). The server runs the calls in order,
+ * except that calls to RpcHandler::kConcurrent handlers may run at the same
+ * time as the others.
+ *
+ * If the server doesn't have the RpcMessage::kBatchedCalls option, the
+ * calls are sent one at a time instead.
+ *
+ * A batch is built and sent by one thread; after Send() it's empty again
+ * and can be reused.
+ */
+class RpcBatch
+{
+public:
+   RpcBatch(ClientController& client);
+
+   /**
+    * Sends any calls that haven't been sent yet.
+    */
+   ~RpcBatch();
+
+   /**
+    * Add a call to a remote method described by an RpcMethod typedef.
+    */
+   template <typename Method, typename... Args>
+   RpcFuture<typename Method::ReturnType> Add(const Args&... args)
+   {
+      MethodCall<Method>* call = new MethodCall<Method>(fClient.fExecutor,
+         Method::EncodeCall(fClient.GetOptions(), this->NextSequence(), args...));
+      fCalls.add(call);
+      return RpcFuture<typename Method::ReturnType>(call->GetState());
+   }
+
+   /**
+    * Add a change to a property in one of the server's trees (see
+    * ClientController::SetTreeProperty()).
+    */
+   template <typename T>
+   RpcFuture<void> SetTreeProperty(uint32 messageCode, const String& path,
+      RpcMessage::DataType type, T val)
+   {
+      RpcMessage msg(messageCode, this->NextSequence(), fClient.GetOptions());
+      msg.SetTreeProperty<T>(path, type, val);
+      MethodCall<TreePropertyMethod>* call =
+         new MethodCall<TreePropertyMethod>(fClient.fExecutor, msg);
+      fCalls.add(call);
+      return RpcFuture<void>(call->GetState());
+   }
+
+   /**
+    * @return the number of calls waiting to be sent.
+    */
+   int GetSize() const { return fCalls.size(); }
+
+   /**
+    * Send all of the calls that have been added.
+    * @return a future that's ready once every call's future is.
+    */
+   RpcFuture<void> Send();
+
+private:
+   /**
+    * Calls in a batch have sequence numbers of their own, counting up from
+    * 1, which the server copies into their responses.
+    */
+   uint32 NextSequence() const { return static_cast<uint32>(fCalls.size() + 1); }
+
+   /**
+    * One call in the batch, which fills in its own future.
+    */
+   class Call
+   {
+   public:
+      Call(const RpcMessage& msg);
+
+      virtual ~Call() {}
+
+      const RpcMessage& GetMessage() const { return fMessage; }
+
+      uint32 GetCode() const { return fCode; }
+
+      /**
+       * Decode the call's response into its future.
+       */
+      virtual void Resolve(RpcMessageReader& response) = 0;
+
+      virtual void Fail(const RpcException& e) = 0;
+
+   private:
+      RpcMessage fMessage;
+      uint32 fCode;
+   };
+
+   template <typename Method>
+   class MethodCall : public Call
+   {
+   public:
+      typedef typename Method::ReturnType ReturnType;
+
+      MethodCall(RpcExecutor* executor, const RpcMessage& msg)
+      :  Call(msg)
+      ,  fState(new typename RpcFuture<ReturnType>::State(executor))
+      {
+
+      }
+
+      typename RpcFuture<ReturnType>::State* GetState() const { return fState; }
+
+      void Resolve(RpcMessageReader& response) override
+      {
+         try
+         {
+            RpcBatch::ThrowIfException(response, this->GetCode());
+            fState->GetValue().template Decode<Method>(response);
+            fState->Succeed();
+         }
+         catch (const RpcException& e)
+         {
+            fState->Fail(e);
+         }
+      }
+
+      void Fail(const RpcException& e) override
+      {
+         fState->Fail(e);
+      }
+
+   private:
+      typename RpcFuture<ReturnType>::State::Ptr fState;
+   };
+
+   /**
+    * How tree property changes are decoded: there's nothing in the
+    * response.
+    */
+   struct TreePropertyMethod
+   {
+      typedef void ReturnType;
+
+      static void DecodeResult(RpcMessageReader&) {}
+   };
+
+   class Progress;
+   class BatchCall;
+   class SingleCall;
+
+   /**
+    * Throws the RpcException in `response`, if that's what it is, or an
+    * exception if it couldn't be read.
+    */
+   static void ThrowIfException(RpcMessageReader& response, uint32 messageCode);
+
+   /**
+    * Send the calls one at a time, to a server that can't batch them.
+    */
+   void SendSingly(Progress* progress);
+
+private:
+   ClientController& fClient;
+
+   OwnedArray<Call> fCalls;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcBatch)
+};
+
+
+/**
+ * @class RpcBatchHandler
+ *
+ * The server side of RpcBatch: runs each call in a Controller::kBatch
+ * message with its handler from the dispatcher, and sends all of their
+ * responses (or exceptions) back in one message. Calls whose handlers have
+ * the RpcHandler::kConcurrent trait run on the server's workers, alongside
+ * the others; the rest run in order. The batch doesn't wait for its 
+ * concurrent calls: whichever call finishes last sends the response (see
+ * RpcResponder), so the handler has the RpcHandler::kNoResponse trait. It
+ * has the RpcHandler::kBlocking trait too, so that its calls never run on 
+ * an I/O thread.
+ */
+class RpcBatchHandler : public RpcHandler
+{
+public:
+   /**
+    * @param dispatcher Where to find the handlers for the calls.
+    * @param workers    Where to run kConcurrent calls, or nullptr to run
+    *                   everything on the batch's own thread.
+    */
+   RpcBatchHandler(const RpcDispatcher& dispatcher, RpcExecutor* workers);
+
+   void Handle(RpcServerConnection* connection, RpcMessageReader& call,
+      RpcMessage& response) override;
+
+   /**
+    * A batch inside a batch, or a one-way batch, needs its results before 
+    * we return, so all of its calls run here, in order.
+    */
+   void HandleBatched(RpcServerConnection* connection, RpcMessageReader& call,
+      RpcMessage& response) override;
+
+   /**
+    * Read the calls out of a batch.
+    * @return readers that point into the batch message.
+    * @throws RpcException if the batch is malformed.
+    */
+   static Array<RpcMessageReader> ReadCalls(RpcMessageReader& call);
+
+   /**
+    * Start running a batch's calls; `responder` sends all of their results 
+    * once the last one has finished, which may be before we return.
+    * @param connection The connection the batch arrived on.
+    * @param calls      The batch's calls, from ReadCalls().
+    * @param responder  Where the results go.
+    */
+   void Start(RpcServerConnection* connection, 
+      const Array<RpcMessageReader>& calls, RpcResponder* responder);
+
+private:
+   /**
+    * The results of a batch whose calls are still running.
+    */
+   class Batch;
+
+   /**
+    * Run one call, leaving its response (or exception) in `result`.
+    */
+   static void Run(RpcServerConnection* connection, RpcHandler* handler,
+      RpcMessageReader call, RpcMessage& result);
+
+private:
+   const RpcDispatcher& fDispatcher;
+   RpcExecutor* fWorkers;
+};
+
+
+#endif  // RPCBATCH_H_INCLUDED
@@ -0,0 +1,1981 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcBenchmarks.h"
+
+#include "PendingCalls.h"
+#include "Controller.h"
+#include "RpcBuffer.h"
+#include "RpcCompression.h"
+#include "RpcConnection.h"
+#include "RpcDictionary.h"
+#include "RpcEventLoop.h"
+#include "RpcMessage.h"
+#include "RpcOutbox.h"
+#include "RpcServer.h"
+#include "RpcTimerWheel.h"
+
+#include <functional>
+#include <map>
+#include <vector>
+
+#if JUCE_LINUX
+#include <arpa/inet.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+
+/**
+ * Where we can, the benchmarks count real heap allocations by standing in
+ * for the C library's allocator, which everything (including operator new
+ * and MemoryBlock) ends up in.
+ */
+#if JUCE_LINUX && defined(__GLIBC__)
+   #define RPC_COUNT_ALLOCATIONS 1
+#else
+   #define RPC_COUNT_ALLOCATIONS 0
+#endif
+
+
+namespace
+{
+   /**
+    * Convert a tick count from Time::getHighResolutionTicks() into 
+    * nanoseconds per iteration.
+    */
+   double NanosecondsPer(int64 ticks, int iterations)
+   {
+      return 1.0e9 * Time::highResolutionTicksToSeconds(ticks) / iterations;
+   }
+
+#if RPC_COUNT_ALLOCATIONS
+   // only the thread that's being measured counts.
+   thread_local bool tCountAllocations = false;
+   thread_local int tNumAllocations = 0;
+#endif
+
+   /**
+    * Counts the blocks that the heap hands out to this thread while it's in
+    * scope. A realloc() that keeps its block where it was isn't counted.
+    */
+   class AllocationCounter
+   {
+   public:
+#if RPC_COUNT_ALLOCATIONS
+      AllocationCounter() : fStart(tNumAllocations) { tCountAllocations = true; }
+
+      ~AllocationCounter() { tCountAllocations = false; }
+
+      int Get() const { return tNumAllocations - fStart; }
+
+      static bool IsAvailable() { return true; }
+
+   private:
+      int fStart;
+#else
+      AllocationCounter() {}
+
+      int Get() const { return 0; }
+
+      static bool IsAvailable() { return false; }
+#endif
+   };
+}
+
+
+#if RPC_COUNT_ALLOCATIONS
+extern "C"
+{
+   void* __libc_malloc(size_t size);
+   void* __libc_calloc(size_t count, size_t size);
+   void* __libc_realloc(void* block, size_t size);
+
+   void* malloc(size_t size) __THROW
+   {
+      tNumAllocations += tCountAllocations;
+      return __libc_malloc(size);
+   }
+
+   void* calloc(size_t count, size_t size) __THROW
+   {
+      tNumAllocations += tCountAllocations;
+      return __libc_calloc(count, size);
+   }
+
+   void* realloc(void* block, size_t size) __THROW
+   {
+      void* moved = __libc_realloc(block, size);
+      tNumAllocations += (tCountAllocations && moved != block);
+      return moved;
+   }
+}
+#endif
+
+
+/**
+ * Heap allocations needed to build our common message types, comparing 
+ * RpcMessage (backed by an RpcBuffer) against building the same frame by 
+ * appending to a MemoryBlock, which is what RpcMessage used to do. Both 
+ * are counted the same way, by AllocationCounter, so they include anything
+ * else that allocates while a message is built (e.g. String).
+ */
+class MessageAllocationBenchmark : public UnitTest
+{
+public:
+   MessageAllocationBenchmark() : UnitTest("Benchmark: message allocations") {}
+
+   struct MemoryBlockBuilder
+   {
+      void Append(const void* data, size_t numBytes)
+      {
+         fBlock.append(data, numBytes);
+      }
+
+      template <typename T>
+      void Append(T val)
+      {
+         this->Append(&val, sizeof(T));
+      }
+
+      void AppendString(const String& s)
+      {
+         this->Append(s.toRawUTF8(), s.getNumBytesAsUTF8() + 1);
+      }
+
+      MemoryBlock fBlock;
+   };
+
+   struct Measurement
+   {
+      int fAllocations;
+      int64 fTicks;
+   };
+
+   /**
+    * Call `build(i)` for each of `iterations` messages.
+    */
+   template <typename Fn>
+   static Measurement Measure(Fn build, int iterations)
+   {
+      const AllocationCounter allocations;
+      const int64 start = Time::getHighResolutionTicks();
+      for (int i = 0; i < iterations; ++i)
+      {
+         build(i);
+      }
+      Measurement result;
+      result.fTicks = Time::getHighResolutionTicks() - start;
+      result.fAllocations = allocations.Get();
+      return result;
+   }
+
+   /**
+    * Log both measurements, and check that RpcMessage allocates 
+    * `expectedPerCall` times for each message, fewer than MemoryBlock.
+    */
+   void Report(const String& name, const Measurement& old, 
+      const Measurement& current, int iterations, int expectedPerCall)
+   {
+      if (!AllocationCounter::IsAvailable())
+      {
+         this->logMessage(name + ": MemoryBlock " + 
+            String(NanosecondsPer(old.fTicks, iterations), 1) + " ns/call; RpcMessage " + 
+            String(NanosecondsPer(current.fTicks, iterations), 1) + 
+            " ns/call (heap allocations aren't counted on this platform)");
+         return;
+      }
+      const double perCall = iterations;
+      this->logMessage(name + ": MemoryBlock " + 
+         String(old.fAllocations / perCall, 2) + " allocs/call, " + 
+         String(NanosecondsPer(old.fTicks, iterations), 1) + " ns/call; RpcMessage " + 
+         String(current.fAllocations / perCall, 2) + " allocs/call, " + 
+         String(NanosecondsPer(current.fTicks, iterations), 1) + " ns/call");
+      this->expect(expectedPerCall * iterations == current.fAllocations);
+      this->expect(current.fAllocations < old.fAllocations);
+   }
+
+   void runTest() override
+   {
+      const String stringArg("from server");
+
+      this->beginTest("VoidFn");
+      {
+         const Measurement old = Measure([](int i)
+         {
+            MemoryBlockBuilder b;
+            b.Append<uint32>(Controller::kVoidFn);
+            b.Append<uint32>(i);
+         }, kIterations);
+         const Measurement current = Measure([](int i)
+         {
+            RpcMessage msg(Controller::kVoidFn, i);
+         }, kIterations);
+         this->Report("VoidFn", old, current, kIterations, 0);
+      }
+
+      this->beginTest("IntFn");
+      {
+         const Measurement old = Measure([](int i)
+         {
+            MemoryBlockBuilder b;
+            b.Append<uint32>(Controller::kIntFn);
+            b.Append<uint32>(i);
+            b.Append<int>(i);
+         }, kIterations);
+         const Measurement current = Measure([](int i)
+         {
+            RpcMessage msg(Controller::kIntFn, i);
+            msg.AppendData(i);
+         }, kIterations);
+         this->Report("IntFn", old, current, kIterations, 0);
+      }
+
+      this->beginTest("StringFn");
+      {
+         const Measurement old = Measure([&stringArg](int i)
+         {
+            MemoryBlockBuilder b;
+            b.Append<uint32>(Controller::kStringFn);
+            b.Append<uint32>(i);
+            b.AppendString(stringArg);
+         }, kIterations);
+         const Measurement current = Measure([&stringArg](int i)
+         {
+            RpcMessage msg(Controller::kStringFn, i);
+            msg.AppendString(stringArg);
+         }, kIterations);
+         this->Report("StringFn", old, current, kIterations, 0);
+      }
+
+      this->beginTest("SetTreeProperty");
+      {
+         const String path("sub1/sub2/doubleVal");
+         const Measurement old = Measure([&path](int i)
+         {
+            MemoryBlockBuilder b;
+            b.Append<uint32>(Controller::kValueTree2SetProp);
+            b.Append<uint32>(i);
+            b.AppendString(path);
+            b.Append<int>(RpcMessage::kDouble);
+            b.Append<double>(i);
+         }, kIterations);
+         const Measurement current = Measure([&path](int i)
+         {
+            RpcMessage msg(Controller::kValueTree2SetProp, i);
+            msg.SetTreeProperty(path, RpcMessage::kDouble, double(i));
+         }, kIterations);
+         this->Report("SetTreeProperty", old, current, kIterations, 0);
+      }
+
+      this->beginTest("Large message with Reserve()");
+      {
+         const int kNumValues = 1000;
+         const Measurement old = Measure([kNumValues](int i)
+         {
+            MemoryBlockBuilder b;
+            b.Append<uint32>(Controller::kIntFn);
+            b.Append<uint32>(i);
+            for (int j = 0; j < kNumValues; ++j)
+            {
+               b.Append<int>(j);
+            }
+         }, kIterations / 100);
+         const Measurement current = Measure([kNumValues](int i)
+         {
+            RpcMessage msg(Controller::kIntFn, i);
+            msg.Reserve(2 * sizeof(uint32) + kNumValues * sizeof(int));
+            for (int j = 0; j < kNumValues; ++j)
+            {
+               msg.AppendData(j);
+            }
+         }, kIterations / 100);
+         // the one allocation is the one that we reserved.
+         this->Report("4K message", old, current, kIterations / 100, 1);
+      }
+   }
+
+private:
+   enum { kIterations = 100000 };
+};
+
+
+/**
+ * Bytes on the wire for our common message types, comparing the legacy format
+ * against the compact one that we negotiate with current peers. Sequence 
+ * numbers are taken from the range a long-running client will be using.
+ */
+class WireSizeBenchmark : public UnitTest
+{
+public:
+   WireSizeBenchmark() : UnitTest("Benchmark: wire size") {}
+
+   enum MessageType
+   {
+      kVoidFn = 0,
+      kIntFn,
+      kStringFn,
+      kIntProperty,
+      kDoubleProperty,
+      kStringProperty,
+      kVars,
+      kNumMessageTypes
+   };
+
+   static size_t MessageSize(MessageType type, uint32 sequence, uint32 options)
+   {
+      const String path("sub1/sub2/val");
+      RpcMessage msg(Controller::kVoidFn, sequence, options);
+      switch (type)
+      {
+         case kVoidFn:
+         break;
+
+         case kIntFn:
+         {
+            msg = RpcMessage(Controller::kIntFn, sequence, options);
+            msg.AppendInt(static_cast<int>(sequence % 200) - 100);
+         }
+         break;
+
+         case kStringFn:
+         {
+            msg = RpcMessage(Controller::kStringFn, sequence, options);
+            msg.AppendString("a short string");
+         }
+         break;
+
+         case kIntProperty:
+         {
+            msg = RpcMessage(Controller::kValueTree1SetProp, sequence, options);
+            msg.SetTreeProperty(path, RpcMessage::kInt, 
+               static_cast<int>(sequence % 1000));
+         }
+         break;
+
+         case kDoubleProperty:
+         {
+            msg = RpcMessage(Controller::kValueTree1SetProp, sequence, options);
+            msg.SetTreeProperty(path, RpcMessage::kDouble, 0.5 * sequence);
+         }
+         break;
+
+         case kStringProperty:
+         {
+            msg = RpcMessage(Controller::kValueTree1SetProp, sequence, options);
+            msg.SetTreeProperty(path, RpcMessage::kString, String("on"));
+         }
+         break;
+
+         case kVars:
+         {
+            msg.AppendVar(var(static_cast<int>(sequence % 1000)));
+            msg.AppendVar(var(int64(sequence)));
+            msg.AppendVar(var(true));
+            msg.AppendVar(var());
+         }
+         break;
+
+         default:
+         break;
+      }
+      return msg.GetBuffer().GetSize();
+   }
+
+   void runTest() override
+   {
+      const char* names[kNumMessageTypes] = { "VoidFn", "IntFn", "StringFn", 
+         "int property", "double property", "string property", "4 vars" };
+
+      const uint32 compact = RpcMessage::kSupportedOptions;
+      size_t legacyTotal = 0;
+      size_t compactTotal = 0;
+      for (int type = 0; type < kNumMessageTypes; ++type)
+      {
+         this->beginTest(names[type]);
+         size_t legacyBytes = 0;
+         size_t compactBytes = 0;
+         for (uint32 seq = kFirstSequence; seq < kFirstSequence + kIterations; ++seq)
+         {
+            legacyBytes += MessageSize(static_cast<MessageType>(type), seq, 
+               RpcMessage::kLegacyFormat);
+            compactBytes += MessageSize(static_cast<MessageType>(type), seq, compact);
+         }
+         this->expect(compactBytes < legacyBytes);
+         this->Report(names[type], legacyBytes, compactBytes);
+         legacyTotal += legacyBytes;
+         compactTotal += compactBytes;
+      }
+
+      this->beginTest("All message types");
+      this->expect(compactTotal * 10 <= legacyTotal * 7);
+      this->Report("total", legacyTotal, compactTotal);
+   }
+
+private:
+   void Report(const String& name, size_t legacyBytes, size_t compactBytes)
+   {
+      const double iterations = kIterations;
+      double saved = 100.0 * (1.0 - double(compactBytes) / legacyBytes);
+      this->logMessage(name + ": " + String(legacyBytes / iterations, 1) + 
+         " -> " + String(compactBytes / iterations, 1) + 
+         " bytes/message (" + String(saved, 1) + "% smaller)");
+   }
+
+private:
+   enum 
+   { 
+      kFirstSequence = 1000,
+      kIterations = 10000 
+   };
+};
+
+
+/**
+ * Time to send large frames (like ValueTree full syncs) over a loopback 
+ * socket, comparing InterprocessConnection::sendMessage(), which copies 
+ * each frame into a new block along with its header, against 
+ * RpcConnection's vectored write. 
+ */
+class SendPathBenchmark : public UnitTest
+{
+public:
+   SendPathBenchmark() : UnitTest("Benchmark: send path") {}
+
+   /**
+    * Counts what it receives.
+    */
+   class Sink : public InterprocessConnection
+   {
+   public:
+      Sink() : InterprocessConnection(false, RpcConnection::kMagic), fReceived(0) {}
+
+      ~Sink() { this->disconnect(); }
+
+      void connectionMade() override {}
+
+      void connectionLost() override {}
+
+      void messageReceived(const MemoryBlock&) override
+      {
+         ++fReceived;
+         fSignal.signal();
+      }
+
+      /**
+       * Wait until `count` messages have arrived in total.
+       */
+      bool WaitFor(int count)
+      {
+         while (fReceived.get() < count)
+         {
+            if (!fSignal.wait(5000))
+            {
+               return false;
+            }
+         }
+         return true;
+      }
+
+      Atomic<int> fReceived;
+      WaitableEvent fSignal;
+   };
+
+   class SinkServer : public InterprocessConnectionServer
+   {
+   public:
+      InterprocessConnection* createConnectionObject() override
+      {
+         fSink = new Sink();
+         fConnected.signal();
+         return fSink;
+      }
+
+      ScopedPointer<Sink> fSink;
+      WaitableEvent fConnected;
+   };
+
+   class Source : public RpcConnection
+   {
+   public:
+      ~Source() { this->disconnect(); }
+
+      void HandleMessage(const void*, size_t) override {}
+   };
+
+   void runTest() override
+   {
+      SinkServer server;
+      server.beginWaitingForSocket(kPort);
+      ScopedPointer<Source> source(new Source());
+      source->connectToSocket("127.0.0.1", kPort, 1000);
+      this->expect(server.fConnected.wait(5000));
+
+      const int sizes[] = { 64, 64 * 1024, 4 * 1024 * 1024 };
+      int received = 0;
+      for (int s = 0; s < 3; ++s)
+      {
+         const int size = sizes[s];
+         const int iterations = jmax(20, (256 * 1024 * 1024 / 16) / size);
+         this->beginTest(String(size) + " byte frames");
+
+         RpcMessage msg(Controller::kValueTree1Update, 0);
+         msg.Reserve(size);
+         while (msg.GetBuffer().GetSize() < static_cast<size_t>(size))
+         {
+            msg.AppendData<uint8>(static_cast<uint8>(msg.GetBuffer().GetSize()));
+         }
+         // what sendMessage() needs; building it isn't part of the timing.
+         MemoryBlock block(msg.GetMemoryBlock());
+
+         int64 start = Time::getHighResolutionTicks();
+         for (int i = 0; i < iterations; ++i)
+         {
+            source->sendMessage(block);
+         }
+         received += iterations;
+         this->expect(server.fSink->WaitFor(received));
+         int64 copyTicks = Time::getHighResolutionTicks() - start;
+
+         int copies = RpcConnection::GetCopiedFrameCount();
+         start = Time::getHighResolutionTicks();
+         for (int i = 0; i < iterations; ++i)
+         {
+            source->SendRpcMessage(msg);
+         }
+         received += iterations;
+         this->expect(server.fSink->WaitFor(received));
+         int64 vectorTicks = Time::getHighResolutionTicks() - start;
+         this->expect(copies == RpcConnection::GetCopiedFrameCount());
+
+         this->logMessage(String(size) + " bytes: sendMessage " + 
+            String(NanosecondsPer(copyTicks, iterations) / 1000, 1) + " us/frame; " + 
+            "vectored " + String(NanosecondsPer(vectorTicks, iterations) / 1000, 1) + 
+            " us/frame");
+      }
+
+      source = nullptr;
+      server.stop();
+   }
+
+private:
+   enum { kPort = 0xec54 };
+};
+
+
+/**
+ * Size and CPU cost of compressing a ValueTree full sync, using a tree shaped
+ * like our production ones: thousands of nodes that all use the same few
+ * property names.
+ */
+class CompressionBenchmark : public UnitTest
+{
+public:
+   CompressionBenchmark() : UnitTest("Benchmark: compression") {}
+
+   void runTest() override
+   {
+      ValueTree root("session");
+      for (int t = 0; t < kNumTracks; ++t)
+      {
+         ValueTree track("track");
+         track.setProperty("name", "Track " + String(t), nullptr);
+         track.setProperty("colour", "ff" + String::toHexString(t * 7919 % 0xFFFFFF), nullptr);
+         for (int c = 0; c < kClipsPerTrack; ++c)
+         {
+            ValueTree clip("clip");
+            clip.setProperty("start", t * 1000 + c * 48, nullptr);
+            clip.setProperty("length", 48, nullptr);
+            clip.setProperty("gain", 0.5 + c * 0.01, nullptr);
+            clip.setProperty("muted", false, nullptr);
+            clip.setProperty("source", "audio/take_" + String(c % 10) + ".wav", nullptr);
+            track.addChild(clip, -1, nullptr);
+         }
+         root.addChild(track, -1, nullptr);
+      }
+
+      const uint32 options = RpcMessage::kSupportedOptions;
+      RpcMessage sync(Controller::kValueTree1Update, 0, options);
+      sync.AppendValueTree(root);
+      const size_t size = sync.GetBuffer().GetSize();
+
+      this->beginTest("Full sync");
+      RpcCompression::Stats before = RpcCompression::GetStats();
+      ScopedPointer<RpcMessage> compressed;
+      for (int i = 0; i < kIterations; ++i)
+      {
+         compressed = RpcCompression::Compress(sync);
+      }
+      this->expect(nullptr != compressed);
+      const RpcBuffer& packed = compressed->GetBuffer();
+      MemoryBlock expanded;
+      for (int i = 0; i < kIterations; ++i)
+      {
+         RpcCompression::Expand(packed.GetData(), packed.GetSize(), options, expanded);
+      }
+      this->expect(expanded == sync.GetMemoryBlock());
+      RpcCompression::Stats after = RpcCompression::GetStats();
+
+      const double compressSeconds = after.fCompressSeconds - before.fCompressSeconds;
+      const double expandSeconds = after.fExpandSeconds - before.fExpandSeconds;
+      const double iterations = kIterations;
+      const double megabytes = size * iterations / (1024 * 1024);
+      this->logMessage(String(size) + " -> " + String(packed.GetSize()) + " bytes (" + 
+         String(100.0 * packed.GetSize() / size, 1) + "%); compress " + 
+         String(1000 * compressSeconds / iterations, 2) + " ms (" + 
+         String(roundToInt(megabytes / compressSeconds)) + " MB/s), expand " + 
+         String(1000 * expandSeconds / iterations, 2) + " ms (" + 
+         String(roundToInt(megabytes / expandSeconds)) + " MB/s)");
+   }
+
+private:
+   enum
+   {
+      kNumTracks = 200,
+      kClipsPerTrack = 100,
+      kIterations = 10
+   };
+};
+
+
+/**
+ * Size of small ValueTree deltas sent as they are, each zlib-compressed on
+ * its own, and dictionary-encoded, with and without a pre-trained
+ * dictionary.
+ */
+class DictionaryBenchmark : public UnitTest
+{
+public:
+   DictionaryBenchmark() : UnitTest("Benchmark: dictionary encoding") {}
+
+   class Recorder : public ValueTreeSynchroniser
+   {
+   public:
+      Recorder(const ValueTree& tree) : ValueTreeSynchroniser(tree) {}
+
+      void stateChanged(const void* change, size_t size) override
+      {
+         fDeltas.add(MemoryBlock(change, size));
+      }
+
+      Array<MemoryBlock> fDeltas;
+   };
+
+   /**
+    * Record `count` property changes to a mixer-like tree.
+    */
+   static Array<MemoryBlock> MakeDeltas(int count, int seed)
+   {
+      ValueTree root("mixer");
+      for (int c = 0; c < 32; ++c)
+      {
+         ValueTree channel("channel");
+         channel.addChild(ValueTree("eq"), -1, nullptr);
+         channel.addChild(ValueTree("sends"), -1, nullptr);
+         root.addChild(channel, -1, nullptr);
+      }
+
+      const char* names[] = { "gain", "pan", "mute", "solo", "frequency", 
+         "bandwidth", "level", "label" };
+      Recorder recorder(root);
+      Random rng(seed);
+      while (recorder.fDeltas.size() < count)
+      {
+         ValueTree channel = root.getChild(rng.nextInt(32));
+         ValueTree node = rng.nextBool() ? channel : channel.getChild(rng.nextInt(2));
+         const int name = rng.nextInt(8);
+         switch (name)
+         {
+            case 2: case 3: node.setProperty(names[name], rng.nextBool(), nullptr); break;
+            case 7: node.setProperty(names[name], "Channel " + String(rng.nextInt(32)), nullptr); break;
+            default: node.setProperty(names[name], rng.nextInt(2000) - 1000, nullptr); break;
+         }
+      }
+      return recorder.fDeltas;
+   }
+
+   void runTest() override
+   {
+      const uint32 options = RpcMessage::kSupportedOptions;
+      const Array<MemoryBlock> deltas = MakeDeltas(kIterations, 1);
+      // RpcMessages can't be moved with realloc(), so not Array<RpcMessage>.
+      OwnedArray<RpcMessage> messages;
+      for (int i = 0; i < deltas.size(); ++i)
+      {
+         RpcMessage* msg = messages.add(new RpcMessage(Controller::kValueTree1Update, 0, 
+            options));
+         msg->AppendData(deltas[i].getData(), deltas[i].getSize());
+      }
+
+      MemoryBlock trained;
+      const Array<MemoryBlock> samples = MakeDeltas(1000, 2);
+      for (int i = 0; i < samples.size(); ++i)
+      {
+         trained.append(samples[i].getData(), samples[i].getSize());
+      }
+
+      this->beginTest("Small deltas");
+      size_t rawBytes = 0;
+      size_t zlibBytes = 0;
+      for (int i = 0; i < messages.size(); ++i)
+      {
+         const RpcMessage& msg = *messages.getUnchecked(i);
+         rawBytes += msg.GetBuffer().GetSize();
+         ScopedPointer<RpcMessage> compressed(RpcCompression::Compress(msg));
+         zlibBytes += (nullptr != compressed) ? compressed->GetBuffer().GetSize() : 
+            msg.GetBuffer().GetSize();
+      }
+      const double iterations = kIterations;
+      this->logMessage(String(rawBytes / iterations, 1) + " bytes/delta; zlib " + 
+         String(zlibBytes / iterations, 1));
+
+      MemoryBlock none;
+      this->Run("session dictionary", messages, none, rawBytes);
+      this->Run("pre-trained dictionary", messages, trained, rawBytes);
+   }
+
+private:
+   void Run(const String& name, const OwnedArray<RpcMessage>& messages, 
+      const MemoryBlock& dictionary, size_t rawBytes)
+   {
+      RpcDictionaryEncoder encoder(dictionary);
+      RpcDictionaryDecoder decoder(dictionary);
+      const uint32 options = RpcMessage::kSupportedOptions;
+      OwnedArray<RpcMessage> encoded;
+      size_t encodedBytes = 0;
+
+      int64 start = Time::getHighResolutionTicks();
+      for (int i = 0; i < messages.size(); ++i)
+      {
+         RpcMessage* out = encoded.add(new RpcMessage(0, 0, options));
+         encoder.Encode(*messages.getUnchecked(i), *out);
+         encodedBytes += out->GetBuffer().GetSize();
+      }
+      int64 encodeTicks = Time::getHighResolutionTicks() - start;
+
+      bool allMatch = true;
+      MemoryBlock decoded;
+      start = Time::getHighResolutionTicks();
+      for (int i = 0; i < encoded.size(); ++i)
+      {
+         const RpcBuffer& wire = encoded.getUnchecked(i)->GetBuffer();
+         allMatch = decoder.Decode(wire.GetData(), wire.GetSize(), options, decoded) && 
+            allMatch;
+      }
+      int64 decodeTicks = Time::getHighResolutionTicks() - start;
+      this->expect(allMatch);
+      this->expect(encodedBytes < rawBytes);
+
+      const double iterations = kIterations;
+      this->logMessage(name + ": " + String(encodedBytes / iterations, 1) + 
+         " bytes/delta (" + String(100.0 * (1.0 - double(encodedBytes) / rawBytes), 1) + 
+         "% smaller); encode " + String(NanosecondsPer(encodeTicks, kIterations), 0) + 
+         " ns, decode " + String(NanosecondsPer(decodeTicks, kIterations), 0) + " ns");
+   }
+
+private:
+   enum { kIterations = 100000 };
+};
+
+
+/**
+ * Client threads making calls at the same time, comparing the 
+ * PendingCallTable against the PendingCallList that it replaced: a linked 
+ * list behind a CriticalSection, searched by index (so each lookup was 
+ * O(n^2)), with sequence numbers from a process-wide counter. A few dozen 
+ * idle calls stay in flight throughout, as they do when some calls are slow.
+ */
+class PendingCallBenchmark : public UnitTest
+{
+public:
+   PendingCallBenchmark() : UnitTest("Benchmark: pending calls") {}
+
+   /**
+    * The old PendingCallList.
+    */
+   class LockedList
+   {
+   public:
+      struct Call
+      {
+         Call() : fSequence(++sSequence) {}
+
+         uint32 fSequence;
+         WaitableEvent fEvent;
+         MemoryBlock fData;
+         LinkedListPointer<Call> nextListItem;
+      };
+
+      void Append(Call* call)
+      {
+         const ScopedLock lock(fMutex);
+         fCalls.append(call);
+      }
+
+      bool Complete(uint32 sequence, const MemoryBlock& response)
+      {
+         Call* call = nullptr;
+         {
+            const ScopedLock lock(fMutex);
+            for (int i = 0; i < fCalls.size(); ++i)
+            {
+               if (sequence == fCalls[i].get()->fSequence)
+               {
+                  call = fCalls[i].get();
+                  break;
+               }
+            }
+         }
+         if (nullptr != call)
+         {
+            call->fData = response;
+            call->fEvent.signal();
+         }
+         return (nullptr != call);
+      }
+
+      void Remove(Call* call)
+      {
+         const ScopedLock lock(fMutex);
+         fCalls.remove(call);
+      }
+
+      static Atomic<uint32> sSequence;
+
+   private:
+      LinkedListPointer<Call> fCalls;
+      CriticalSection fMutex;
+   };
+
+   /**
+    * Makes `fCalls` calls, acting as its own IPC thread.
+    */
+   class Caller : public Thread
+   {
+   public:
+      Caller(LockedList* list, PendingCallTable* table, int calls)
+      :  Thread("caller")
+      ,  fList(list)
+      ,  fTable(table)
+      ,  fCalls(calls)
+      ,  fAnswered(0)
+      {
+
+      }
+
+      void run() override
+      {
+         fStart.wait();
+         const MemoryBlock response(16, true);
+         for (int i = 0; i < fCalls; ++i)
+         {
+            if (nullptr != fList)
+            {
+               LockedList::Call call;
+               fList->Append(&call);
+               if (fList->Complete(call.fSequence, response) && call.fEvent.wait(0))
+               {
+                  ++fAnswered;
+               }
+               fList->Remove(&call);
+            }
+            else
+            {
+               PendingCall call;
+               const ScopedPendingCall spc(*fTable, &call);
+               if (fTable->Complete(call.GetSequence(), response) && call.Wait(0))
+               {
+                  ++fAnswered;
+               }
+            }
+         }
+      }
+
+      WaitableEvent fStart;
+
+   private:
+      LockedList* fList;
+      PendingCallTable* fTable;
+      int fCalls;
+
+   public:
+      int fAnswered;
+   };
+
+   /**
+    * @return nanoseconds per call with `numThreads` threads making calls.
+    */
+   double Run(LockedList* list, PendingCallTable* table, int numThreads)
+   {
+      const int callsPerThread = kTotalCalls / numThreads;
+      OwnedArray<Caller> callers;
+      for (int i = 0; i < numThreads; ++i)
+      {
+         callers.add(new Caller(list, table, callsPerThread))->startThread();
+      }
+      // let them all get to the starting line.
+      Thread::sleep(20);
+
+      const int64 start = Time::getHighResolutionTicks();
+      for (int i = 0; i < numThreads; ++i)
+      {
+         callers.getUnchecked(i)->fStart.signal();
+      }
+      for (int i = 0; i < numThreads; ++i)
+      {
+         callers.getUnchecked(i)->waitForThreadToExit(-1);
+         this->expect(callsPerThread == callers.getUnchecked(i)->fAnswered);
+      }
+      const int64 ticks = Time::getHighResolutionTicks() - start;
+      return NanosecondsPer(ticks, callsPerThread * numThreads);
+   }
+
+   void runTest() override
+   {
+      LockedList list;
+      PendingCallTable table;
+      OwnedArray<LockedList::Call> idleCalls;
+      OwnedArray<PendingCall> idlePending;
+      for (int i = 0; i < kIdleCalls; ++i)
+      {
+         list.Append(idleCalls.add(new LockedList::Call()));
+         table.Insert(idlePending.add(new PendingCall()));
+      }
+
+      for (int numThreads = 1; numThreads <= 64; numThreads *= 2)
+      {
+         this->beginTest(String(numThreads) + " threads");
+         const double listNs = this->Run(&list, nullptr, numThreads);
+         const double tableNs = this->Run(nullptr, &table, numThreads);
+         this->logMessage(String(numThreads) + " threads: PendingCallList " + 
+            String(listNs, 1) + " ns/call; PendingCallTable " + 
+            String(tableNs, 1) + " ns/call");
+      }
+
+      for (int i = 0; i < kIdleCalls; ++i)
+      {
+         list.Remove(idleCalls.getUnchecked(i));
+         table.Remove(idlePending.getUnchecked(i));
+      }
+   }
+
+private:
+   enum 
+   { 
+      kTotalCalls = 64 * 1000,
+      kIdleCalls = 64
+   };
+};
+
+Atomic<uint32> PendingCallBenchmark::LockedList::sSequence;
+
+
+/**
+ * A million outstanding call timeouts, most of which are cancelled by 
+ * their responses, on an RpcTimerWheel and on an ordered map of deadlines 
+ * (the usual O(log n) alternative). A thread parked in 
+ * WaitableEvent::wait() per call, which is what synchronous calls do, 
+ * isn't an option at this scale at all.
+ */
+class TimerWheelBenchmark : public UnitTest
+{
+public:
+   TimerWheelBenchmark() : UnitTest("Benchmark: call timeouts") {}
+
+   typedef std::multimap<int64, uint32> DeadlineMap;
+
+   void Report(const String& name, int64 scheduleTicks, int64 cancelTicks, 
+      int64 advanceTicks)
+   {
+      this->logMessage(name + ": schedule " + 
+         String(NanosecondsPer(scheduleTicks, kTimers), 1) + " ns, cancel " + 
+         String(NanosecondsPer(cancelTicks, kTimers - kTimers / kExpireEvery), 1) + 
+         " ns, expire " + 
+         String(NanosecondsPer(advanceTicks, kTimers / kExpireEvery), 1) + 
+         " ns per timer; " + 
+         String(NanosecondsPer(advanceTicks, kMaxTicks), 1) + " ns per tick");
+   }
+
+   void runTest() override
+   {
+      Array<int64> timeouts;
+      Random random(1);
+      for (int i = 0; i < kTimers; ++i)
+      {
+         timeouts.add(1 + random.nextInt(kMaxTicks));
+      }
+
+      this->beginTest("Timer wheel");
+      {
+         RpcTimerWheel wheel;
+         std::vector<RpcTimerWheel::Handle> handles(kTimers);
+         int64 start = Time::getHighResolutionTicks();
+         for (int i = 0; i < kTimers; ++i)
+         {
+            handles[i] = wheel.Schedule(static_cast<uint32>(i), timeouts.getUnchecked(i));
+         }
+         const int64 scheduleTicks = Time::getHighResolutionTicks() - start;
+         this->expect(kTimers == wheel.GetSize());
+
+         start = Time::getHighResolutionTicks();
+         for (int i = 0; i < kTimers; ++i)
+         {
+            if (0 != i % kExpireEvery)
+            {
+               wheel.Cancel(handles[i]);
+            }
+         }
+         const int64 cancelTicks = Time::getHighResolutionTicks() - start;
+
+         Array<uint32> expired;
+         start = Time::getHighResolutionTicks();
+         for (int tick = 0; tick < kMaxTicks; ++tick)
+         {
+            wheel.Advance(1, expired);
+         }
+         const int64 advanceTicks = Time::getHighResolutionTicks() - start;
+         this->expect(kTimers / kExpireEvery == expired.size());
+         this->Report("RpcTimerWheel", scheduleTicks, cancelTicks, advanceTicks);
+      }
+
+      this->beginTest("Ordered map");
+      {
+         DeadlineMap deadlines;
+         std::vector<DeadlineMap::iterator> handles(kTimers);
+         int64 start = Time::getHighResolutionTicks();
+         for (int i = 0; i < kTimers; ++i)
+         {
+            handles[i] = deadlines.insert(std::make_pair(timeouts.getUnchecked(i), 
+               static_cast<uint32>(i)));
+         }
+         const int64 scheduleTicks = Time::getHighResolutionTicks() - start;
+
+         start = Time::getHighResolutionTicks();
+         for (int i = 0; i < kTimers; ++i)
+         {
+            if (0 != i % kExpireEvery)
+            {
+               deadlines.erase(handles[i]);
+            }
+         }
+         const int64 cancelTicks = Time::getHighResolutionTicks() - start;
+
+         Array<uint32> expired;
+         start = Time::getHighResolutionTicks();
+         for (int64 tick = 1; tick <= kMaxTicks; ++tick)
+         {
+            while (!deadlines.empty() && deadlines.begin()->first <= tick)
+            {
+               expired.add(deadlines.begin()->second);
+               deadlines.erase(deadlines.begin());
+            }
+         }
+         const int64 advanceTicks = Time::getHighResolutionTicks() - start;
+         this->expect(kTimers / kExpireEvery == expired.size());
+         this->Report("std::multimap", scheduleTicks, cancelTicks, advanceTicks);
+      }
+   }
+
+private:
+   enum
+   {
+      kTimers = 1000 * 1000,
+
+      /**
+       * Timeouts of up to 50 seconds in 10ms ticks.
+       */
+      kMaxTicks = 5000,
+
+      /**
+       * One call in this many times out; the rest get their responses.
+       */
+      kExpireEvery = 10
+   };
+};
+
+
+#if JUCE_LINUX
+
+/**
+ * Plain sockets connected to a local port from a child process, so that a 
+ * benchmark measures only the server's side of them, and the two ends' 
+ * sockets don't share one descriptor limit. Once they've connected, the 
+ * child runs a round each time that it's asked to, and says when it's 
+ * done. The child sticks to system calls (a round mustn't allocate), 
+ * because it's forked from a process with other threads.
+ */
+class ClientProcess
+{
+public:
+   typedef std::function<void(const std::vector<int>& sockets)> Round;
+
+   ClientProcess(int count) 
+   :  fChild(-1)
+   ,  fSockets(count)
+   {
+      fToChild[0] = fToChild[1] = -1;
+      fFromChild[0] = fFromChild[1] = -1;
+   }
+
+   ~ClientProcess()
+   {
+      this->Stop();
+   }
+
+   /**
+    * Fork the child, and wait for it to connect its sockets to `port`.
+    * @return false if they couldn't all connect.
+    */
+   bool Start(int port, const Round& round)
+   {
+      if (0 != ::pipe(fToChild) || 0 != ::pipe(fFromChild))
+      {
+         return false;
+      }
+      fChild = ::fork();
+      if (0 == fChild)
+      {
+         ::close(fToChild[1]);
+         ::close(fFromChild[0]);
+         this->RunChild(port, round);
+      }
+      ::close(fToChild[0]);
+      ::close(fFromChild[1]);
+      fToChild[0] = fFromChild[1] = -1;
+
+      char signal = 0;
+      return (1 == ::read(fFromChild[0], &signal, 1)) && ('c' == signal);
+   }
+
+   /**
+    * Ask for a round, without waiting for it.
+    */
+   void StartRound()
+   {
+      const char signal = 'r';
+      ignoreUnused(::write(fToChild[1], &signal, 1));
+   }
+
+   /**
+    * Wait for the next round that we've asked for to finish.
+    */
+   bool WaitForRound()
+   {
+      char signal = 0;
+      return (1 == ::read(fFromChild[0], &signal, 1)) && ('d' == signal);
+   }
+
+   /**
+    * Tell the child to close its sockets and go, and wait for it.
+    */
+   void Stop()
+   {
+      if (fChild > 0)
+      {
+         // closing the pipe tells the child to go.
+         ::close(fToChild[1]);
+         ::waitpid(fChild, nullptr, 0);
+         ::close(fFromChild[0]);
+         fChild = -1;
+      }
+   }
+
+private:
+   void RunChild(int port, const Round& round)
+   {
+      struct sockaddr_in address;
+      zerostruct(address);
+      address.sin_family = AF_INET;
+      address.sin_port = htons(static_cast<uint16>(port));
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      for (size_t i = 0; i < fSockets.size(); ++i)
+      {
+         fSockets[i] = ::socket(AF_INET, SOCK_STREAM, 0);
+         if (fSockets[i] < 0 || 0 != ::connect(fSockets[i], 
+            reinterpret_cast<struct sockaddr*>(&address), sizeof(address)))
+         {
+            ::_exit(1);
+         }
+         const int noDelay = 1;
+         ::setsockopt(fSockets[i], IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+      }
+
+      char signal = 'c';
+      ignoreUnused(::write(fFromChild[1], &signal, 1));
+      while (1 == ::read(fToChild[0], &signal, 1) && 'r' == signal)
+      {
+         round(fSockets);
+         signal = 'd';
+         ignoreUnused(::write(fFromChild[1], &signal, 1));
+      }
+      ::_exit(0);
+   }
+
+private:
+   pid_t fChild;
+   int fToChild[2];
+   int fFromChild[2];
+   std::vector<int> fSockets;
+};
+
+
+/**
+ * What it costs the server to have thousands of clients: its resident 
+ * memory and threads once they've all connected, and the context switches 
+ * that it makes while each client sends a small frame a round. The 
+ * clients are a ClientProcess.
+ *
+ * InterprocessConnection can't get anywhere near 10,000 connections (see 
+ * kThreadConnections), so the engines are compared at a size that they 
+ * can all manage, and then the event loop's backends are measured at 
+ * 10,000 on their own. The thread-per-connection server uses plain InterprocessConnections, 
+ * because RpcConnection's duplicate send descriptors would halve the number 
+ * it could manage.
+ */
+class ConnectionScaleBenchmark : public UnitTest
+{
+public:
+   ConnectionScaleBenchmark() : UnitTest("Benchmark: 10k connections") {}
+
+   struct Usage
+   {
+      Usage()
+      {
+         fResidentKb = 0;
+         fThreads = 0;
+         StringArray lines;
+         lines.addLines(File("/proc/self/status").loadFileAsString());
+         for (int i = 0; i < lines.size(); ++i)
+         {
+            if (lines[i].startsWith("VmRSS:"))
+            {
+               fResidentKb = lines[i].fromFirstOccurrenceOf(":", false, false).getLargeIntValue();
+            }
+            else if (lines[i].startsWith("Threads:"))
+            {
+               fThreads = lines[i].fromFirstOccurrenceOf(":", false, false).getIntValue();
+            }
+         }
+         struct rusage usage;
+         ::getrusage(RUSAGE_SELF, &usage);
+         fSwitches = usage.ru_nvcsw + usage.ru_nivcsw;
+      }
+
+      int64 fResidentKb;
+      int fThreads;
+      int64 fSwitches;
+   };
+
+   /**
+    * Our usage before a measurement, once the memory that the last one 
+    * freed has been handed back, so that it can't be reused unseen.
+    */
+   static Usage Idle()
+   {
+      ::malloc_trim(0);
+      return Usage();
+   }
+
+   /**
+    * Counts the frames that the server receives, by either engine.
+    */
+   static Atomic<int> sReceived;
+
+   class Counter : public InterprocessConnection
+   {
+   public:
+      Counter() : InterprocessConnection(false, RpcConnection::kMagic) {}
+
+      void connectionMade() override {}
+
+      void connectionLost() override {}
+
+      void messageReceived(const MemoryBlock&) override { ++sReceived; }
+   };
+
+   class CounterServer : public InterprocessConnectionServer
+   {
+   public:
+      InterprocessConnection* createConnectionObject() override
+      {
+         const ScopedLock lock(fLock);
+         return fConnections.add(new Counter());
+      }
+
+      int GetSize()
+      {
+         const ScopedLock lock(fLock);
+         return fConnections.size();
+      }
+
+      CriticalSection fLock;
+      OwnedArray<Counter> fConnections;
+   };
+
+   class RpcCounter : public RpcConnection
+   {
+   public:
+      void HandleMessage(const void*, size_t) override { ++sReceived; }
+   };
+
+   /**
+    * Wait up to a minute for `condition`.
+    */
+   template <typename Condition>
+   static bool WaitFor(Condition condition)
+   {
+      for (int i = 0; i < 6000; ++i)
+      {
+         if (condition())
+         {
+            return true;
+         }
+         Thread::sleep(10);
+      }
+      return false;
+   }
+
+   /**
+    * Connect the clients to a server that's listening on kPort, and 
+    * measure it.
+    * @param getConnections Returns the number of clients that the server 
+    *                       has accepted.
+    */
+   template <typename GetConnections>
+   void Measure(const String& name, const Usage& idle, int count, 
+      GetConnections getConnections)
+   {
+      const uint32 frame[6] = { ByteOrder::swapIfBigEndian(static_cast<uint32>(RpcConnection::kMagic)), 
+         ByteOrder::swapIfBigEndian(static_cast<uint32>(16)), 1, 2, 3, 4 };
+      ClientProcess clients(count);
+      this->expect(clients.Start(kPort, [&frame](const std::vector<int>& sockets)
+      {
+         for (size_t i = 0; i < sockets.size(); ++i)
+         {
+            ignoreUnused(::write(sockets[i], frame, sizeof(frame)));
+         }
+      }), "clients couldn't connect");
+      this->expect(WaitFor([&]() { return getConnections() >= count; }));
+      const Usage connected;
+
+      sReceived = 0;
+      const int64 start = Time::getHighResolutionTicks();
+      for (int round = 0; round < kRounds; ++round)
+      {
+         clients.StartRound();
+      }
+      this->expect(WaitFor([&]() { return sReceived.get() >= count * kRounds; }));
+      const double seconds = Time::highResolutionTicksToSeconds(
+         Time::getHighResolutionTicks() - start);
+      const Usage sent;
+      clients.Stop();
+
+      const int frames = count * kRounds;
+      const int64 switches = sent.fSwitches - connected.fSwitches;
+      this->logMessage(name + ": " + String(count) + " connections take " + 
+         String((connected.fResidentKb - idle.fResidentKb) / 1024.0, 1) + " MB (" + 
+         String(static_cast<double>(connected.fResidentKb - idle.fResidentKb) / count, 1) + 
+         " KB each) and " + String(connected.fThreads - idle.fThreads) + " threads; " + 
+         String(frames) + " frames in " + String(seconds * 1000.0, 0) + " ms with " + 
+         String(switches) + " context switches (" + 
+         String(static_cast<double>(switches) / frames, 2) + " per frame, " + 
+         String(switches / seconds, 0) + " per second)");
+   }
+
+   void MeasureEventLoop(int count, RpcEventLoop::Backend backend)
+   {
+      if (!RpcEventLoop::IsAvailable(backend))
+      {
+         return;
+      }
+      const Usage idle = Idle();
+      CriticalSection lock;
+      OwnedArray<RpcCounter> connections;
+      RpcEventLoop loop(jmin(static_cast<int>(RpcServer::kMaxIoThreads), 
+         SystemStats::getNumCpus()), backend);
+      this->expect(loop.Listen(kPort, [&]() -> RpcConnection*
+      {
+         const ScopedLock connectionsLock(lock);
+         return connections.add(new RpcCounter());
+      }));
+      const int numThreads = loop.GetNumThreads();
+      this->Measure("RpcEventLoop, " + String((RpcEventLoop::kIoUring == backend) ? 
+         "io_uring" : "epoll") + " (" + String(numThreads) + 
+         ((1 == numThreads) ? " I/O thread)" : " I/O threads)"), idle, count, 
+         [&loop]() { return loop.GetNumConnections(); });
+      loop.Stop();
+   }
+
+   void MeasureThreads(int count)
+   {
+      const Usage idle = Idle();
+      CounterServer server;
+      this->expect(server.beginWaitingForSocket(kPort));
+      this->Measure("InterprocessConnection threads", idle, count, 
+         [&server]() { return server.GetSize(); });
+      server.stop();
+   }
+
+   void runTest() override
+   {
+      this->beginTest(String(kThreadConnections) + " connections");
+      this->MeasureEventLoop(kThreadConnections, RpcEventLoop::kEpoll);
+      this->MeasureEventLoop(kThreadConnections, RpcEventLoop::kIoUring);
+      this->MeasureThreads(kThreadConnections);
+
+      // we need a descriptor per connection, and a few to spare.
+      struct rlimit limit;
+      ::getrlimit(RLIMIT_NOFILE, &limit);
+      limit.rlim_cur = limit.rlim_max;
+      ::setrlimit(RLIMIT_NOFILE, &limit);
+      const int count = static_cast<int>(jmin(static_cast<rlim_t>(kConnections), 
+         limit.rlim_cur - 256));
+
+      this->beginTest(String(count) + " connections");
+      this->MeasureEventLoop(count, RpcEventLoop::kEpoll);
+      this->MeasureEventLoop(count, RpcEventLoop::kIoUring);
+   }
+
+private:
+   enum
+   {
+      kPort = 0xec56,
+      kConnections = 10000,
+
+      /**
+       * StreamingSocket waits for its sockets with select(), which can't 
+       * cope with descriptors of FD_SETSIZE (1024) or more, so this is 
+       * about as many as InterprocessConnection can serve.
+       */
+      kThreadConnections = 900,
+
+      kRounds = 10
+   };
+};
+
+Atomic<int> ConnectionScaleBenchmark::sReceived;
+
+
+/**
+ * Round trips through a server that echoes every frame straight back: the 
+ * frames per second that it manages, and the CPU time that it spends on 
+ * each, with InterprocessConnection's thread per connection and with each 
+ * of RpcEventLoop's backends. A ClientProcess sends a frame on each of 
+ * its sockets and then reads the echoes, kRounds times over.
+ */
+class EchoBenchmark : public UnitTest
+{
+public:
+   EchoBenchmark() : UnitTest("Benchmark: echo round trips") {}
+
+   class Echo : public InterprocessConnection
+   {
+   public:
+      Echo() : InterprocessConnection(false, RpcConnection::kMagic) {}
+
+      void connectionMade() override {}
+
+      void connectionLost() override {}
+
+      void messageReceived(const MemoryBlock& message) override 
+      { 
+         this->sendMessage(message); 
+      }
+   };
+
+   class EchoServer : public InterprocessConnectionServer
+   {
+   public:
+      InterprocessConnection* createConnectionObject() override
+      {
+         const ScopedLock lock(fLock);
+         return fConnections.add(new Echo());
+      }
+
+      CriticalSection fLock;
+      OwnedArray<Echo> fConnections;
+   };
+
+   class RpcEcho : public RpcConnection
+   {
+   public:
+      void HandleMessage(const void* data, size_t size) override
+      {
+         this->SendFrame(data, size);
+      }
+   };
+
+   /**
+    * The CPU time that this process has used, in seconds.
+    */
+   static double CpuSeconds()
+   {
+      struct rusage usage;
+      ::getrusage(RUSAGE_SELF, &usage);
+      return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1.0e6;
+   }
+
+   /**
+    * Run the clients against whichever server is listening on kPort.
+    */
+   void Measure(const String& name, size_t size)
+   {
+      // everything that the child uses is allocated up front.
+      HeapBlock<char> frame(size + 8, true);
+      HeapBlock<char> echo(size + 8);
+      uint32* header = reinterpret_cast<uint32*>(frame.getData());
+      header[0] = ByteOrder::swapIfBigEndian(static_cast<uint32>(RpcConnection::kMagic));
+      header[1] = ByteOrder::swapIfBigEndian(static_cast<uint32>(size));
+      const size_t frameSize = size + 8;
+
+      ClientProcess clients(kClients);
+      this->expect(clients.Start(kPort, [&](const std::vector<int>& sockets)
+      {
+         for (int round = 0; round < kRounds; ++round)
+         {
+            for (size_t i = 0; i < sockets.size(); ++i)
+            {
+               ignoreUnused(::write(sockets[i], frame.getData(), frameSize));
+            }
+            for (size_t i = 0; i < sockets.size(); ++i)
+            {
+               size_t received = 0;
+               while (received < frameSize)
+               {
+                  const ssize_t bytes = ::read(sockets[i], echo + received, 
+                     frameSize - received);
+                  if (bytes <= 0)
+                  {
+                     ::_exit(1);
+                  }
+                  received += static_cast<size_t>(bytes);
+               }
+            }
+         }
+      }), "clients couldn't connect");
+
+      const double cpuStart = CpuSeconds();
+      const int64 start = Time::getHighResolutionTicks();
+      clients.StartRound();
+      this->expect(clients.WaitForRound());
+      const double seconds = Time::highResolutionTicksToSeconds(
+         Time::getHighResolutionTicks() - start);
+      const double cpu = CpuSeconds() - cpuStart;
+      clients.Stop();
+
+      const int frames = kClients * kRounds;
+      this->logMessage(name + ": " + String(frames / seconds, 0) + 
+         " round trips per second, " + String(1.0e6 * cpu / frames, 2) + 
+         " us of server CPU per frame");
+   }
+
+   void MeasureEventLoop(size_t size, RpcEventLoop::Backend backend)
+   {
+      if (!RpcEventLoop::IsAvailable(backend))
+      {
+         return;
+      }
+      CriticalSection lock;
+      OwnedArray<RpcEcho> connections;
+      RpcEventLoop loop(jmin(static_cast<int>(RpcServer::kMaxIoThreads), 
+         SystemStats::getNumCpus()), backend);
+      this->expect(loop.Listen(kPort, [&]() -> RpcConnection*
+      {
+         const ScopedLock connectionsLock(lock);
+         return connections.add(new RpcEcho());
+      }));
+      this->Measure((RpcEventLoop::kIoUring == backend) ? 
+         "RpcEventLoop, io_uring" : "RpcEventLoop, epoll", size);
+      loop.Stop();
+   }
+
+   void MeasureThreads(size_t size)
+   {
+      EchoServer server;
+      this->expect(server.beginWaitingForSocket(kPort));
+      this->Measure("InterprocessConnection threads", size);
+      server.stop();
+   }
+
+   void runTest() override
+   {
+      const size_t sizes[] = { 64, 16 * 1024 };
+      for (int i = 0; i < numElementsInArray(sizes); ++i)
+      {
+         this->beginTest(String(kClients) + " clients, " + String(sizes[i]) + 
+            " byte frames");
+         this->MeasureThreads(sizes[i]);
+         this->MeasureEventLoop(sizes[i], RpcEventLoop::kEpoll);
+         this->MeasureEventLoop(sizes[i], RpcEventLoop::kIoUring);
+      }
+   }
+
+private:
+   enum
+   {
+      kPort = 0xec57,
+      kClients = 100,
+      kRounds = 200
+   };
+};
+
+
+/**
+ * How long a thread that broadcasts to every client (as the message thread
+ * does with tree changes) is held up when one of the clients stops reading
+ * for a while, and how many frames go out in each write. The
+ * thread-per-connection server's RpcConnections write on the sending
+ * thread; the event loop's queue their frames for its I/O threads.
+ */
+class BroadcastBenchmark : public UnitTest
+{
+public:
+   BroadcastBenchmark() : UnitTest("Benchmark: broadcasting to a slow client") {}
+
+   class Sink : public RpcConnection
+   {
+   public:
+      void connectionMade() override
+      {
+         RpcConnection::connectionMade();
+         ++sMade;
+      }
+
+      void HandleMessage(const void*, size_t) override {}
+
+      static Atomic<int> sMade;
+   };
+
+   class SinkServer : public InterprocessConnectionServer
+   {
+   public:
+      InterprocessConnection* createConnectionObject() override
+      {
+         const ScopedLock lock(fLock);
+         return fConnections.add(new Sink());
+      }
+
+      CriticalSection fLock;
+      OwnedArray<Sink> fConnections;
+   };
+
+   /**
+    * A client that reads everything that's broadcast, after an optional
+    * nap.
+    */
+   class Reader : public Thread
+   {
+   public:
+      Reader(int delayMs)
+      :  Thread("Reader")
+      ,  fDelayMs(delayMs)
+      {
+
+      }
+
+      void run() override
+      {
+         Thread::sleep(fDelayMs);
+         HeapBlock<char> buffer(kFrameSize + 8);
+         const int total = kFrames * (kFrameSize + 8);
+         for (int received = 0; received < total; )
+         {
+            const int bytes = fSocket.read(buffer, jmin(total - received, 
+               static_cast<int>(kFrameSize + 8)), false);
+            if (bytes <= 0)
+            {
+               return;
+            }
+            received += bytes;
+         }
+      }
+
+      StreamingSocket fSocket;
+      const int fDelayMs;
+   };
+
+   /**
+    * Connect the readers to whichever server is listening on kPort, and
+    * broadcast to `connections` once they've all been made.
+    */
+   void Measure(const String& name, std::function<Array<Sink*>()> connections)
+   {
+      Sink::sMade = 0;
+      OwnedArray<Reader> readers;
+      for (int i = 0; i < kClients; ++i)
+      {
+         Reader* reader = readers.add(new Reader((0 == i) ? kSlowMs : 0));
+         this->expect(reader->fSocket.connect("127.0.0.1", kPort, 1000));
+      }
+      while (Sink::sMade.get() < kClients)
+      {
+         Thread::sleep(1);
+      }
+      const Array<Sink*> sinks = connections();
+      for (int i = 0; i < readers.size(); ++i)
+      {
+         readers[i]->startThread();
+      }
+
+      HeapBlock<char> frame(kFrameSize, true);
+      const int64 frames = RpcOutbox::GetFrameCount();
+      const int64 writes = RpcOutbox::GetWriteCount();
+      double longest = 0;
+      const double start = Time::getMillisecondCounterHiRes();
+      for (int i = 0; i < kFrames; ++i)
+      {
+         const double passStart = Time::getMillisecondCounterHiRes();
+         for (int j = 0; j < sinks.size(); ++j)
+         {
+            sinks[j]->SendFrame(frame, kFrameSize);
+         }
+         longest = jmax(longest, Time::getMillisecondCounterHiRes() - passStart);
+      }
+      const double elapsed = Time::getMillisecondCounterHiRes() - start;
+      for (int i = 0; i < readers.size(); ++i)
+      {
+         this->expect(readers[i]->waitForThreadToExit(10000));
+      }
+
+      String writeCounts;
+      if (RpcOutbox::GetWriteCount() > writes)
+      {
+         writeCounts = ", " + String(static_cast<double>(RpcOutbox::GetFrameCount() - frames) / 
+            (RpcOutbox::GetWriteCount() - writes), 1) + " frames per write";
+      }
+      this->logMessage(name + ": broadcasting took " + String(elapsed, 1) + 
+         " ms, the longest round " + String(longest, 1) + " ms" + writeCounts);
+   }
+
+   void MeasureThreads()
+   {
+      SinkServer server;
+      this->expect(server.beginWaitingForSocket(kPort));
+      this->Measure("RpcConnection threads", [&server]()
+      {
+         const ScopedLock lock(server.fLock);
+         Array<Sink*> sinks;
+         sinks.addArray(server.fConnections);
+         return sinks;
+      });
+      server.stop();
+   }
+
+   void MeasureEventLoop(RpcEventLoop::Backend backend, int writeLatencyUs = 0)
+   {
+      if (!RpcEventLoop::IsAvailable(backend))
+      {
+         return;
+      }
+      CriticalSection lock;
+      OwnedArray<Sink> connections;
+      RpcEventLoop loop(jmin(static_cast<int>(RpcServer::kMaxIoThreads), 
+         SystemStats::getNumCpus()), backend);
+      loop.SetWriteLatency(writeLatencyUs);
+      this->expect(loop.Listen(kPort, [&]() -> RpcConnection*
+      {
+         const ScopedLock connectionsLock(lock);
+         return connections.add(new Sink());
+      }));
+      String name((RpcEventLoop::kIoUring == backend) ? 
+         "RpcEventLoop, io_uring" : "RpcEventLoop, epoll");
+      if (writeLatencyUs > 0)
+      {
+         name << ", " << writeLatencyUs << " us write latency";
+      }
+      this->Measure(name, [&]()
+      {
+         const ScopedLock connectionsLock(lock);
+         Array<Sink*> sinks;
+         sinks.addArray(connections);
+         return sinks;
+      });
+      loop.Stop();
+   }
+
+   void runTest() override
+   {
+      this->beginTest(String(kClients) + " clients, one of which waits " + 
+         String(kSlowMs) + " ms before reading");
+      this->MeasureThreads();
+      this->MeasureEventLoop(RpcEventLoop::kEpoll);
+      this->MeasureEventLoop(RpcEventLoop::kIoUring);
+      this->MeasureEventLoop(RpcEventLoop::kEpoll, 1000);
+      this->MeasureEventLoop(RpcEventLoop::kIoUring, 1000);
+   }
+
+private:
+   enum
+   {
+      kPort = 0xec58,
+      kClients = 10,
+      kFrames = 1000,
+      kFrameSize = 1024,
+      kSlowMs = 500
+   };
+};
+
+Atomic<int> BroadcastBenchmark::Sink::sMade;
+
+
+/**
+ * How long a round trip takes between a client and a server on the same 
+ * host, over loopback TCP and over a local socket (see 
+ * RpcEventLoop::ListenLocal()), with an RpcEventLoop at each end, as 
+ * ClientController and RpcServer have. One frame is in flight at a time, 
+ * as with a synchronous call.
+ */
+class LocalTransportBenchmark : public UnitTest
+{
+public:
+   LocalTransportBenchmark() : UnitTest("Benchmark: local transport") {}
+
+   class Echo : public RpcConnection
+   {
+   public:
+      void HandleMessage(const void* data, size_t size) override
+      {
+         this->SendFrame(data, size);
+      }
+   };
+
+   class Client : public RpcConnection
+   {
+   public:
+      void HandleMessage(const void*, size_t) override
+      {
+         fEchoed.signal();
+      }
+
+      WaitableEvent fEchoed;
+   };
+
+   void Measure(RpcEventLoop::Backend backend, bool local, size_t size)
+   {
+      if (!RpcEventLoop::IsAvailable(backend))
+      {
+         return;
+      }
+      CriticalSection lock;
+      OwnedArray<Echo> connections;
+      RpcEventLoop server(1, backend);
+      const RpcEventLoop::Factory factory = [&]() -> RpcConnection*
+      {
+         const ScopedLock connectionsLock(lock);
+         return connections.add(new Echo());
+      };
+      Client client;
+      RpcEventLoop clientLoop(1, backend);
+      if (local)
+      {
+         this->expect(server.ListenLocal(kName, factory));
+         this->expect(clientLoop.ConnectLocal(&client, kName, 1000));
+      }
+      else
+      {
+         this->expect(server.Listen(kPort, factory));
+         this->expect(clientLoop.Connect(&client, "127.0.0.1", kPort, 1000));
+      }
+
+      HeapBlock<char> frame(size, true);
+      Array<double> times;
+      times.ensureStorageAllocated(kRoundTrips);
+      for (int i = 0; i < kWarmUp + kRoundTrips; ++i)
+      {
+         const int64 start = Time::getHighResolutionTicks();
+         if (!client.SendFrame(frame, size) || !client.fEchoed.wait(5000))
+         {
+            this->expect(false, "the echo didn't come back");
+            break;
+         }
+         if (i >= kWarmUp)
+         {
+            times.add(1.0e6 * Time::highResolutionTicksToSeconds(
+               Time::getHighResolutionTicks() - start));
+         }
+      }
+      clientLoop.Stop();
+      server.Stop();
+      if (0 == times.size())
+      {
+         return;
+      }
+
+      DefaultElementComparator<double> comparator;
+      times.sort(comparator);
+      double total = 0;
+      for (int i = 0; i < times.size(); ++i)
+      {
+         total += times.getUnchecked(i);
+      }
+      const String name = String(local ? "local socket" : "loopback TCP") + 
+         ((RpcEventLoop::kIoUring == backend) ? ", io_uring" : ", epoll");
+      this->logMessage(name + ": mean " + String(total / times.size(), 1) + 
+         " us, median " + String(times[times.size() / 2], 1) + " us, 99th " +
+         "percentile " + String(times[times.size() * 99 / 100], 1) + " us");
+   }
+
+   void runTest() override
+   {
+      const size_t sizes[] = { 64, 16 * 1024 };
+      for (int i = 0; i < numElementsInArray(sizes); ++i)
+      {
+         this->beginTest(String(sizes[i]) + " byte round trips");
+         this->Measure(RpcEventLoop::kEpoll, false, sizes[i]);
+         this->Measure(RpcEventLoop::kEpoll, true, sizes[i]);
+         this->Measure(RpcEventLoop::kIoUring, false, sizes[i]);
+         this->Measure(RpcEventLoop::kIoUring, true, sizes[i]);
+      }
+   }
+
+private:
+   enum
+   {
+      kPort = 0xec59,
+      kWarmUp = 200,
+      kRoundTrips = 5000
+   };
+
+   static const char* const kName;
+};
+
+const char* const LocalTransportBenchmark::kName = "RpcLocalTransportBenchmark";
+
+#endif
+
+
+void RunRpcBenchmarks()
+{
+   OwnedArray<UnitTest> benchmarks;
+   benchmarks.add(new MessageAllocationBenchmark());
+   benchmarks.add(new WireSizeBenchmark());
+   benchmarks.add(new SendPathBenchmark());
+   benchmarks.add(new CompressionBenchmark());
+   benchmarks.add(new DictionaryBenchmark());
+   benchmarks.add(new PendingCallBenchmark());
+   benchmarks.add(new TimerWheelBenchmark());
+#if JUCE_LINUX
+   benchmarks.add(new ConnectionScaleBenchmark());
+   benchmarks.add(new EchoBenchmark());
+   benchmarks.add(new BroadcastBenchmark());
+   benchmarks.add(new LocalTransportBenchmark());
+#endif
+
+   Array<UnitTest*> tests;
+   for (int i = 0; i < benchmarks.size(); ++i)
+   {
+      tests.add(benchmarks.getUnchecked(i));
+   }
+
+   UnitTestRunner runner;
+   runner.runTests(tests);
+}
@@ -0,0 +1,23 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCBENCHMARKS_H_INCLUDED
+#define RPCBENCHMARKS_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+
+/**
+ * Run the performance benchmarks, logging their results. 
+ *
+ * The benchmarks are written as UnitTest objects, but they're slow, so unlike 
+ * the unit tests they aren't created statically and don't run every time that 
+ * the app launches. Launch the app with the `--benchmark` switch to run them.
+ */
+void RunRpcBenchmarks();
+
+
+#endif  // RPCBENCHMARKS_H_INCLUDED
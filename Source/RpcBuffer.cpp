@@ -0,0 +1,181 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcBuffer.h"
+
+
+namespace
+{
+   Atomic<int> sHeapAllocations;
+}
+
+
+RpcBuffer::RpcBuffer()
+:  fData(fInline)
+,  fSize(0)
+,  fCapacity(kInlineSize)
+{
+
+}
+
+
+RpcBuffer::RpcBuffer(const RpcBuffer& other)
+:  fData(fInline)
+,  fSize(0)
+,  fCapacity(kInlineSize)
+{
+   this->ReplaceWith(other.GetData(), other.GetSize());
+}
+
+
+RpcBuffer& RpcBuffer::operator=(const RpcBuffer& other)
+{
+   if (this != &other)
+   {
+      this->ReplaceWith(other.GetData(), other.GetSize());
+   }
+   return *this;
+}
+
+
+RpcBuffer::~RpcBuffer()
+{
+
+}
+
+
+void RpcBuffer::Append(const void* data, size_t numBytes)
+{
+   if (numBytes > 0)
+   {
+      if (fSize + numBytes > fCapacity)
+      {
+         this->Grow(jmax(fSize + numBytes, 2 * fCapacity));
+      }
+      memcpy(fData + fSize, data, numBytes);
+      fSize += numBytes;
+   }
+}
+
+
+void RpcBuffer::ReplaceWith(const void* data, size_t numBytes)
+{
+   fSize = 0;
+   this->Reserve(numBytes);
+   this->Append(data, numBytes);
+}
+
+
+void RpcBuffer::Reserve(size_t capacity)
+{
+   if (capacity > fCapacity)
+   {
+      this->Grow(capacity);
+   }
+}
+
+
+void RpcBuffer::Grow(size_t capacity)
+{
+   ++sHeapAllocations;
+   if (this->IsInline())
+   {
+      fHeap.malloc(capacity);
+      memcpy(fHeap.getData(), fInline, fSize);
+   }
+   else
+   {
+      fHeap.realloc(capacity);
+   }
+   fData = fHeap.getData();
+   fCapacity = capacity;
+}
+
+
+int RpcBuffer::GetHeapAllocationCount()
+{
+   return sHeapAllocations.get();
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+
+class RpcBufferTest : public UnitTest
+{
+public:
+   RpcBufferTest() : UnitTest("RpcBuffer tests") {}
+
+   void runTest() override
+   {
+      this->beginTest("Inline storage");
+      RpcBuffer b1;
+      this->expect(b1.IsInline());
+      this->expect(0 == b1.GetSize());
+
+      int allocations = RpcBuffer::GetHeapAllocationCount();
+      for (int i = 0; i < RpcBuffer::kInlineSize / (int) sizeof(int); ++i)
+      {
+         b1.Append(&i, sizeof(i));
+      }
+      this->expect(b1.IsInline());
+      this->expect(RpcBuffer::kInlineSize == b1.GetSize());
+      this->expect(allocations == RpcBuffer::GetHeapAllocationCount());
+
+      this->beginTest("Geometric growth");
+      int val = RpcBuffer::kInlineSize / sizeof(int);
+      b1.Append(&val, sizeof(val));
+      this->expect(!b1.IsInline());
+      this->expect(2 * RpcBuffer::kInlineSize == b1.GetCapacity());
+      for (int i = 0; i < 1000; ++i)
+      {
+         val = i + 1 + RpcBuffer::kInlineSize / sizeof(int);
+         b1.Append(&val, sizeof(val));
+      }
+      // 64 -> 128 -> ... -> 4096 bytes
+      this->expect(6 == RpcBuffer::GetHeapAllocationCount() - allocations);
+
+      const int* p = static_cast<const int*>(b1.GetData());
+      bool contentsOk = true;
+      for (size_t i = 0; i < b1.GetSize() / sizeof(int); ++i)
+      {
+         contentsOk = contentsOk && (static_cast<int>(i) == p[i]);
+      }
+      this->expect(contentsOk);
+
+      this->beginTest("Copying");
+      RpcBuffer b2(b1);
+      this->expect(b2.GetSize() == b1.GetSize());
+      this->expect(0 == memcmp(b1.GetData(), b2.GetData(), b1.GetSize()));
+      this->expect(b2.GetData() != b1.GetData());
+
+      RpcBuffer b3;
+      b3.Append("abc", 3);
+      RpcBuffer b4(b3);
+      this->expect(b4.IsInline());
+      this->expect(0 == memcmp("abc", b4.GetData(), 3));
+      b4 = b1;
+      this->expect(!b4.IsInline());
+      this->expect(b4.GetSize() == b1.GetSize());
+
+      this->beginTest("Reserve and reuse");
+      RpcBuffer b5;
+      allocations = RpcBuffer::GetHeapAllocationCount();
+      b5.Reserve(10000);
+      for (int i = 0; i < 2500; ++i)
+      {
+         b5.Append(&i, sizeof(i));
+      }
+      this->expect(1 == RpcBuffer::GetHeapAllocationCount() - allocations);
+      b5.Clear();
+      this->expect(0 == b5.GetSize());
+      this->expect(10000 == b5.GetCapacity());
+   }
+};
+
+static RpcBufferTest tests;
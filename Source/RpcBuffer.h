@@ -0,0 +1,144 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCBUFFER_H_INCLUDED
+#define RPCBUFFER_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+
+/**
+ * @class RpcBuffer
+ *
+ * A growable block of bytes used to build outgoing RpcMessages.
+ *
+ * Unlike a MemoryBlock (which reallocates on every append), the buffer keeps
+ * a capacity that's separate from its size:
+ * - The first kInlineSize bytes live inside the object itself, so the small
+ *   messages that make up most of our traffic (VoidFn, IntFn, tree property
+ *   sets...) never touch the heap.
+ * - Past that, the capacity doubles each time it's exceeded, or can be set
+ *   up front with Reserve() when the caller knows how big the message will be.
+ */
+class RpcBuffer
+{
+public:
+   enum
+   {
+      kInlineSize = 64
+   };
+
+   RpcBuffer();
+
+   RpcBuffer(const RpcBuffer& other);
+
+   RpcBuffer& operator=(const RpcBuffer& other);
+
+   ~RpcBuffer();
+
+   const void* GetData() const { return fData; }
+
+   void* GetData() { return fData; }
+
+   size_t GetSize() const { return fSize; }
+
+   size_t GetCapacity() const { return fCapacity; }
+
+   /**
+    * @return true if the data is still held in our inline storage.
+    */
+   bool IsInline() const { return (fData == fInline); }
+
+   /**
+    * Add bytes to the end of the buffer, growing it if needed.
+    */
+   void Append(const void* data, size_t numBytes);
+
+   /**
+    * Replace the contents of the buffer with a copy of `data`.
+    */
+   void ReplaceWith(const void* data, size_t numBytes);
+
+   /**
+    * Make sure that the buffer can hold at least `capacity` bytes without
+    * needing to grow again.
+    */
+   void Reserve(size_t capacity);
+
+   /**
+    * Set the size to zero without giving back any memory, so the buffer can be
+    * reused.
+    */
+   void Clear() { fSize = 0; }
+
+   /**
+    * @return the number of times that any RpcBuffer has had to allocate (or
+    *         reallocate) heap memory since the program started. Used by the
+    *         benchmarks.
+    */
+   static int GetHeapAllocationCount();
+
+private:
+   /**
+    * Move the data into a heap block of `capacity` bytes.
+    */
+   void Grow(size_t capacity);
+
+private:
+   char*          fData;
+   size_t         fSize;
+   size_t         fCapacity;
+   HeapBlock<char> fHeap;
+   char           fInline[kInlineSize];
+};
+
+
+/**
+ * @class RpcBufferView
+ *
+ * A read-only view of bytes that belong to someone else (usually an
+ * RpcBuffer), so we can hand them out without copying. It follows the
+ * MemoryBlock accessor names so that code written against a MemoryBlock keeps
+ * working, and converts to a MemoryBlock when a caller needs its own copy.
+ *
+ * The view is only valid while the bytes it points at are unchanged.
+ */
+class RpcBufferView
+{
+public:
+   RpcBufferView(const void* data, size_t size)
+   :  fData(data)
+   ,  fSize(size)
+   {
+
+   }
+
+   const void* getData() const { return fData; }
+
+   size_t getSize() const { return fSize; }
+
+   operator MemoryBlock() const
+   {
+      return MemoryBlock(fData, fSize);
+   }
+
+   bool operator==(const MemoryBlock& other) const
+   {
+      return other.matches(fData, fSize);
+   }
+
+   bool operator!=(const MemoryBlock& other) const
+   {
+      return !other.matches(fData, fSize);
+   }
+
+private:
+   const void* fData;
+   size_t      fSize;
+};
+
+
+#endif  // RPCBUFFER_H_INCLUDED
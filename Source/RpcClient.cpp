@@ -12,8 +12,7 @@
 #include "Controller.h"
 
 RpcClient::RpcClient()
-:  InterprocessConnection(false, 0xf2b49e2c)
-,  fController(nullptr)
+:  fController(nullptr)
 ,  fIsConnected(false)
 {
 
@@ -33,19 +32,26 @@ void RpcClient::SetController(ClientController* controller)
 void RpcClient::connectionMade()
 {
    DBG("RpcClient::connectionMade()");
+   RpcConnection::connectionMade();
    fIsConnected = true;
 }
 
 void RpcClient::connectionLost()
 {
    DBG("RpcClient::connectionLost()");
-   fIsConnected = true;
+   RpcConnection::connectionLost();
+   fIsConnected = false;
+   if (nullptr != fController)
+   {
+      // their responses will never arrive.
+      fController->FailPendingCalls(Controller::kConnectionError);
+   }
 }
 
-void RpcClient::messageReceived(const MemoryBlock& message)
+void RpcClient::HandleMessage(const void* data, size_t size)
 {
    if (nullptr != fController)
    {
-      fController->HandleReceivedMessage(message);
+      fController->HandleReceivedMessage(data, size);
    }
 }
\ No newline at end of file
@@ -9,10 +9,12 @@
 
 #include "../JuceLibraryCode/JuceHeader.h"
 
+#include "RpcConnection.h"
+
 
 class ClientController;
 
-class RpcClient : public InterprocessConnection
+class RpcClient : public RpcConnection
 {
 public:
    RpcClient();
@@ -25,7 +27,7 @@ public:
 
    void connectionLost() override;
 
-   void messageReceived(const MemoryBlock& message) override;
+   void HandleMessage(const void* data, size_t size) override;
 
    bool IsConnected() const { return fIsConnected; };
 
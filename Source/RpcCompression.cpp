@@ -0,0 +1,286 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "Controller.h"
+#include "RpcCompression.h"
+#include "RpcMessageReader.h"
+
+
+namespace
+{
+   /**
+    * zlib's fastest setting. Our large messages are mostly tree data full of
+    * repeated property names, which compresses well even so.
+    */
+   const int kCompressionLevel = 1;
+
+   Atomic<int64> sCompressedMessages;
+   Atomic<int64> sRejectedMessages;
+   Atomic<int64> sBytesIn;
+   Atomic<int64> sBytesOut;
+   Atomic<int64> sExpandedMessages;
+   Atomic<int64> sCompressTicks;
+   Atomic<int64> sExpandTicks;
+
+
+   /**
+    * An OutputStream that appends to an RpcMessage, so that the compressor
+    * can write straight into the message that we're going to send.
+    */
+   class RpcMessageOutputStream : public OutputStream
+   {
+   public:
+      RpcMessageOutputStream(RpcMessage& msg) : fMessage(msg) {}
+
+      void flush() override {}
+
+      bool setPosition(int64) override { return false; }
+
+      int64 getPosition() override
+      {
+         return static_cast<int64>(fMessage.GetBuffer().GetSize());
+      }
+
+      bool write(const void* data, size_t numBytes) override
+      {
+         fMessage.AppendData(data, numBytes);
+         return true;
+      }
+
+   private:
+      RpcMessage& fMessage;
+   };
+}
+
+
+RpcCompression::Stats::Stats()
+:  fCompressedMessages(0)
+,  fRejectedMessages(0)
+,  fBytesIn(0)
+,  fBytesOut(0)
+,  fExpandedMessages(0)
+,  fCompressSeconds(0)
+,  fExpandSeconds(0)
+{
+
+}
+
+
+double RpcCompression::Stats::GetRatio() const
+{
+   if (0 == fBytesIn)
+   {
+      return 1.0;
+   }
+   return static_cast<double>(fBytesOut) / fBytesIn;
+}
+
+
+RpcMessage* RpcCompression::Compress(const RpcMessage& msg)
+{
+   jassert(0 != (msg.GetOptions() & RpcMessage::kCompressedFrames));
+   const RpcBuffer& data = msg.GetBuffer();
+   RpcMessageReader reader(data.GetData(), data.GetSize(), msg.GetOptions());
+   const size_t bodySize = reader.GetBytesRemaining();
+   if (!reader.IsValid() || bodySize > kMaxExpandedSize)
+   {
+      return nullptr;
+   }
+
+   const int64 start = Time::getHighResolutionTicks();
+   ScopedPointer<RpcMessage> compressed(new RpcMessage(
+      reader.GetCode() | RpcMessage::kCompressedFlag, reader.GetSequence(),
+      msg.GetOptions()));
+   compressed->AppendUInt(static_cast<uint32>(bodySize));
+   {
+      RpcMessageOutputStream out(*compressed);
+      // the compressor finishes the zlib stream when it's destroyed.
+      GZIPCompressorOutputStream zip(&out, kCompressionLevel);
+      zip.write(reader.Skip(bodySize), bodySize);
+   }
+   sCompressTicks += Time::getHighResolutionTicks() - start;
+
+   const size_t compressedSize = compressed->GetBuffer().GetSize();
+   if (compressedSize >= data.GetSize())
+   {
+      ++sRejectedMessages;
+      return nullptr;
+   }
+
+   ++sCompressedMessages;
+   sBytesIn += static_cast<int64>(data.GetSize());
+   sBytesOut += static_cast<int64>(compressedSize);
+   return compressed.release();
+}
+
+
+bool RpcCompression::IsCompressed(const void* data, size_t size, uint32 options)
+{
+   if (0 == (options & RpcMessage::kCompressedFrames))
+   {
+      return false;
+   }
+   RpcMessageReader reader(data, size, options);
+   return reader.IsValid() && 0 != (reader.GetCode() & RpcMessage::kCompressedFlag);
+}
+
+
+bool RpcCompression::Expand(const void* data, size_t size, uint32 options,
+   MemoryBlock& expanded)
+{
+   const int64 start = Time::getHighResolutionTicks();
+   RpcMessageReader reader(data, size, options);
+   const uint32 code = reader.GetCode() & ~static_cast<uint32>(RpcMessage::kCompressedFlag);
+   const uint32 bodySize = reader.GetUInt();
+   if (!reader.IsValid() || bodySize > kMaxExpandedSize)
+   {
+      return false;
+   }
+
+   // rebuild the original header, then expand the body after it.
+   RpcMessage header(code, reader.GetSequence(), options);
+   const RpcBuffer& headerData = header.GetBuffer();
+   expanded.setSize(headerData.GetSize() + bodySize, false);
+   memcpy(expanded.getData(), headerData.GetData(), headerData.GetSize());
+
+   const size_t compressedSize = reader.GetBytesRemaining();
+   MemoryInputStream source(reader.Skip(compressedSize), compressedSize, false);
+   GZIPDecompressorInputStream unzip(source);
+   char* body = static_cast<char*>(expanded.getData()) + headerData.GetSize();
+   size_t done = 0;
+   while (done < bodySize)
+   {
+      const int numRead = unzip.read(body + done,
+         static_cast<int>(jmin<size_t>(bodySize - done, 0x10000000)));
+      if (numRead <= 0)
+      {
+         break;
+      }
+      done += static_cast<size_t>(numRead);
+   }
+
+   // the body must be exactly the size that the sender said it was.
+   char extra;
+   const bool ok = (bodySize == done) && (0 == unzip.read(&extra, 1));
+   sExpandTicks += Time::getHighResolutionTicks() - start;
+   if (ok)
+   {
+      ++sExpandedMessages;
+   }
+   return ok;
+}
+
+
+RpcCompression::Stats RpcCompression::GetStats()
+{
+   Stats stats;
+   stats.fCompressedMessages = sCompressedMessages.get();
+   stats.fRejectedMessages = sRejectedMessages.get();
+   stats.fBytesIn = sBytesIn.get();
+   stats.fBytesOut = sBytesOut.get();
+   stats.fExpandedMessages = sExpandedMessages.get();
+   stats.fCompressSeconds = Time::highResolutionTicksToSeconds(sCompressTicks.get());
+   stats.fExpandSeconds = Time::highResolutionTicksToSeconds(sExpandTicks.get());
+   return stats;
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+class RpcCompressionTest : public UnitTest
+{
+public:
+   RpcCompressionTest() : UnitTest("RpcCompression tests") {}
+
+   void runTest() override
+   {
+      const uint32 optionList[] = { RpcMessage::kCompressedFrames,
+         RpcMessage::kSupportedOptions };
+      // (the code and the flag are different enumerations.)
+      const uint32 compressedCode = Controller::kValueTree1Update | 
+         static_cast<uint32>(RpcMessage::kCompressedFlag);
+      for (int i = 0; i < 2; ++i)
+      {
+         const uint32 options = optionList[i];
+         this->beginTest("Round trip, options = " + String(options));
+         RpcMessage tree(Controller::kValueTree1Update, 0, options);
+         for (int j = 0; j < 2000; ++j)
+         {
+            tree.SetTreeProperty("channels/channel" + String(j % 16) + "/gain",
+               RpcMessage::kDouble, j * 0.5);
+         }
+         const RpcBuffer& original = tree.GetBuffer();
+
+         RpcCompression::Stats before = RpcCompression::GetStats();
+         ScopedPointer<RpcMessage> compressed(RpcCompression::Compress(tree));
+         this->expect(nullptr != compressed);
+         const RpcBuffer& packed = compressed->GetBuffer();
+         this->expect(packed.GetSize() * 4 < original.GetSize());
+         this->expect(RpcCompression::IsCompressed(packed.GetData(),
+            packed.GetSize(), options));
+         this->expect(!RpcCompression::IsCompressed(original.GetData(),
+            original.GetSize(), options));
+
+         MemoryBlock expanded;
+         this->expect(RpcCompression::Expand(packed.GetData(), packed.GetSize(),
+            options, expanded));
+         this->expect(expanded == tree.GetMemoryBlock());
+
+         RpcCompression::Stats after = RpcCompression::GetStats();
+         this->expect(before.fCompressedMessages + 1 == after.fCompressedMessages);
+         this->expect(before.fExpandedMessages + 1 == after.fExpandedMessages);
+         this->expect(after.fBytesIn - before.fBytesIn ==
+            static_cast<int64>(original.GetSize()));
+         this->expect(after.GetRatio() < 1.0);
+
+         this->beginTest("Incompressible data, options = " + String(options));
+         Random rng(i);
+         RpcMessage noise(Controller::kValueTree1Update, 0, options);
+         for (int j = 0; j < 1024; ++j)
+         {
+            noise.AppendData<int>(rng.nextInt());
+         }
+         before = RpcCompression::GetStats();
+         this->expect(nullptr == RpcCompression::Compress(noise));
+         after = RpcCompression::GetStats();
+         this->expect(before.fRejectedMessages + 1 == after.fRejectedMessages);
+
+         this->beginTest("Bad compressed data, options = " + String(options));
+         // truncated.
+         this->expect(!RpcCompression::Expand(packed.GetData(),
+            packed.GetSize() - 10, options, expanded));
+
+         // a body size that doesn't match the data.
+         RpcMessage wrongSize(compressedCode, 0, options);
+         wrongSize.AppendUInt(static_cast<uint32>(original.GetSize()));
+         RpcMessageReader reader(packed.GetData(), packed.GetSize(), options);
+         reader.GetUInt();
+         const size_t zipSize = reader.GetBytesRemaining();
+         wrongSize.AppendData(reader.Skip(zipSize), zipSize);
+         const RpcBuffer& wrong = wrongSize.GetBuffer();
+         this->expect(!RpcCompression::Expand(wrong.GetData(), wrong.GetSize(),
+            options, expanded));
+
+         // not zlib data at all.
+         RpcMessage garbage(compressedCode, 0, options);
+         garbage.AppendUInt(100);
+         garbage.AppendString("this isn't compressed");
+         const RpcBuffer& junk = garbage.GetBuffer();
+         this->expect(!RpcCompression::Expand(junk.GetData(), junk.GetSize(),
+            options, expanded));
+      }
+
+      this->beginTest("Flag needs the option");
+      RpcMessage flagged(compressedCode, 0, RpcMessage::kCompactEncoding);
+      const RpcBuffer& flaggedData = flagged.GetBuffer();
+      this->expect(!RpcCompression::IsCompressed(flaggedData.GetData(),
+         flaggedData.GetSize(), RpcMessage::kCompactEncoding));
+   }
+};
+
+static RpcCompressionTest compressionTest;
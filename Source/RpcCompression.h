@@ -0,0 +1,113 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCCOMPRESSION_H_INCLUDED
+#define RPCCOMPRESSION_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include "RpcMessage.h"
+
+
+/**
+ * @class RpcCompression
+ *
+ * zlib compression of whole messages, for connections that have agreed on
+ * the RpcMessage::kCompressedFrames option.
+ *
+ * A compressed message has the usual header, with RpcMessage::kCompressedFlag
+ * set in its code, followed by the size of the original message body (as
+ * written by AppendUInt()) and then the zlib-compressed body. The receiver
+ * expands it back into exactly the message that was compressed, so nothing
+ * above RpcConnection ever sees a compressed message.
+ *
+ * All of the methods are thread-safe.
+ */
+class RpcCompression
+{
+public:
+   enum
+   {
+      /**
+       * Don't compress messages smaller than this by default; below this
+       * size the CPU time costs more than the bytes we'd save.
+       */
+      kDefaultThreshold = 4096,
+
+      /**
+       * We refuse to expand a message body larger than this, so that a bad
+       * frame can't make us allocate an unbounded amount of memory.
+       */
+      kMaxExpandedSize  = 256 * 1024 * 1024
+   };
+
+   /**
+    * Running totals across every connection, for tuning the threshold.
+    */
+   struct Stats
+   {
+      Stats();
+
+      /**
+       * Number of messages sent compressed.
+       */
+      int64 fCompressedMessages;
+
+      /**
+       * Messages that we compressed, but sent uncompressed because they
+       * didn't get any smaller.
+       */
+      int64 fRejectedMessages;
+
+      /**
+       * Size of the messages that were sent compressed, before and after.
+       */
+      int64 fBytesIn;
+      int64 fBytesOut;
+
+      int64 fExpandedMessages;
+
+      /**
+       * Time spent compressing (including rejected messages) and expanding.
+       */
+      double fCompressSeconds;
+      double fExpandSeconds;
+
+      /**
+       * @return compressed size / original size for the messages that were
+       *         sent compressed, or 1.0 if there haven't been any.
+       */
+      double GetRatio() const;
+   };
+
+   /**
+    * Compress a message.
+    * @return a new compressed copy of `msg` that the caller owns, or nullptr
+    *         if compressing it wouldn't make it any smaller.
+    */
+   static RpcMessage* Compress(const RpcMessage& msg);
+
+   /**
+    * @return true if a received message has the kCompressedFlag set.
+    */
+   static bool IsCompressed(const void* data, size_t size, uint32 options);
+
+   /**
+    * Expand a compressed message back into its original form.
+    * @param  data     The received message.
+    * @param  size     its size in bytes.
+    * @param  options  WireOptions in use on the connection.
+    * @param  expanded Set to the original message.
+    * @return          false if the data isn't a valid compressed message.
+    */
+   static bool Expand(const void* data, size_t size, uint32 options,
+      MemoryBlock& expanded);
+
+   static Stats GetStats();
+};
+
+
+#endif  // RPCCOMPRESSION_H_INCLUDED
@@ -0,0 +1,583 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcConnection.h"
+
+#if ! JUCE_WINDOWS
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+
+namespace
+{
+   Atomic<int> sCopiedFrames;
+
+#if ! JUCE_WINDOWS
+   /**
+    * Write all of the data in `iov`, coping with partial writes.
+    * MSG_NOSIGNAL keeps a closed connection from raising SIGPIPE.
+    */
+   bool WriteAll(int socket, struct iovec* iov, int count)
+   {
+      struct msghdr msg;
+      zerostruct(msg);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+
+      while (msg.msg_iovlen > 0)
+      {
+         ssize_t written = ::sendmsg(socket, &msg, MSG_NOSIGNAL);
+         if (written < 0)
+         {
+            if (EINTR == errno)
+            {
+               continue;
+            }
+            return false;
+         }
+
+         // skip past whatever was written.
+         while (msg.msg_iovlen > 0 && static_cast<size_t>(written) >= msg.msg_iov->iov_len)
+         {
+            written -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+         }
+         if (msg.msg_iovlen > 0)
+         {
+            msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + written;
+            msg.msg_iov->iov_len -= written;
+         }
+      }
+      return true;
+   }
+#endif
+}
+
+
+const RpcMessage* RpcPayload::GetCompressedMessage() const
+{
+   const ScopedLock lock(fCompressLock);
+   if (!fCompressTried)
+   {
+      fCompressed = RpcCompression::Compress(fMessage);
+      fCompressTried = true;
+   }
+   return fCompressed;
+}
+
+
+RpcConnection::RpcConnection()
+:  InterprocessConnection(false, kMagic)
+,  fOptions(RpcMessage::kLegacyFormat)
+,  fCompressionThreshold(RpcCompression::kDefaultThreshold)
+,  fSendSocket(-1)
+{
+
+}
+
+
+RpcConnection::~RpcConnection()
+{
+   this->CloseSendSocket();
+}
+
+
+void RpcConnection::connectionMade()
+{
+#if ! JUCE_WINDOWS
+   const ScopedLock lock(fSendLock);
+   StreamingSocket* socket = this->getSocket();
+   if (nullptr != socket && fSendSocket < 0)
+   {
+      fSendSocket = ::dup(socket->getRawSocketHandle());
+   }
+#endif
+}
+
+
+void RpcConnection::AttachSocket(int socket, const RpcOutbox::Ptr& outbox)
+{
+   {
+      // senders that found the outbox we had keep it alive, and it's been
+      // closed, so it turns their frames away.
+      const ScopedLock lock(fSendLock);
+      fSendSocket = socket;
+      fOutbox = outbox;
+   }
+   this->connectionMade();
+}
+
+
+RpcOutbox::Ptr RpcConnection::GetOutbox() const
+{
+   // AttachSocket() replaces it when we reconnect.
+   const ScopedLock lock(fSendLock);
+   return fOutbox;
+}
+
+
+void RpcConnection::connectionLost()
+{
+   this->CloseSendSocket();
+}
+
+
+void RpcConnection::Abort()
+{
+#if ! JUCE_WINDOWS
+   // shutting down our duplicate shuts down the socket itself, which ends
+   // the connection thread's read loop (or the event loop's reads).
+   const ScopedLock lock(fSendLock);
+   if (fSendSocket >= 0)
+   {
+      ::shutdown(fSendSocket, SHUT_RDWR);
+   }
+#endif
+}
+
+
+void RpcConnection::CloseSendSocket()
+{
+#if ! JUCE_WINDOWS
+   const ScopedLock lock(fSendLock);
+   if (nullptr != fOutbox)
+   {
+      fOutbox->Close();
+   }
+   if (fSendSocket >= 0)
+   {
+      ::close(fSendSocket);
+      fSendSocket = -1;
+   }
+#endif
+}
+
+
+void RpcConnection::SetOptions(uint32 options)
+{
+   const ScopedLock lock(fSendLock);
+   fOptions = options;
+   if (0 != (options & RpcMessage::kDictionaryFrames))
+   {
+      fEncoder = new RpcDictionaryEncoder(fSharedDictionary);
+      fDecoder = new RpcDictionaryDecoder(fSharedDictionary);
+   }
+   else
+   {
+      fEncoder = nullptr;
+      fDecoder = nullptr;
+   }
+}
+
+
+void RpcConnection::SetSharedDictionary(const MemoryBlock& dictionary)
+{
+   const ScopedLock lock(fSendLock);
+   fSharedDictionary = dictionary;
+}
+
+
+uint32 RpcConnection::GetDictionaryId() const
+{
+   const ScopedLock lock(fSendLock);
+   return RpcDictionaryWindow::GetDictionaryId(fSharedDictionary);
+}
+
+
+void RpcConnection::messageReceived(const MemoryBlock& message)
+{
+   this->FrameReceived(message.getData(), message.getSize());
+}
+
+
+void RpcConnection::FrameReceived(const void* data, size_t size)
+{
+   const uint32 options = this->GetOptions();
+   if (RpcCompression::IsCompressed(data, size, options))
+   {
+      MemoryBlock expanded;
+      if (!RpcCompression::Expand(data, size, options, expanded))
+      {
+         DBG("ERROR: Received a compressed message that won't expand.");
+         return;
+      }
+      this->HandleMessage(expanded.getData(), expanded.getSize());
+      return;
+   }
+
+   if (RpcDictionaryDecoder::IsEncoded(data, size, options))
+   {
+      MemoryBlock decoded;
+      if (nullptr == fDecoder || !fDecoder->Decode(data, size, options, decoded))
+      {
+         // our window no longer matches the sender's, so nothing else it
+         // sends can be trusted.
+         DBG("ERROR: Received a dictionary-encoded message that won't decode.");
+         this->Abort();
+         return;
+      }
+      this->HandleMessage(decoded.getData(), decoded.getSize());
+      return;
+   }
+   this->HandleMessage(data, size);
+}
+
+
+bool RpcConnection::ShouldCompress(const RpcMessage& msg) const
+{
+   return (0 != (msg.GetOptions() & RpcMessage::kCompressedFrames)) &&
+      (msg.GetBuffer().GetSize() >= static_cast<size_t>(this->GetCompressionThreshold()));
+}
+
+
+bool RpcConnection::SendRpcMessage(const RpcMessage& msg)
+{
+   if (this->ShouldCompress(msg))
+   {
+      ScopedPointer<RpcMessage> compressed(RpcCompression::Compress(msg));
+      if (nullptr != compressed)
+      {
+         const RpcBuffer& data = compressed->GetBuffer();
+         return this->SendFrame(data.GetData(), data.GetSize());
+      }
+   }
+   return this->SendEncoded(msg);
+}
+
+
+bool RpcConnection::SendEncoded(const RpcMessage& msg)
+{
+   const RpcBuffer& data = msg.GetBuffer();
+   if (RpcDictionaryEncoder::CanEncode(msg))
+   {
+      // encode and send under the same lock, so that the other end sees the
+      // messages in the order that they went into our window.
+      const ScopedLock lock(fSendLock);
+      RpcMessage encoded(0, 0, msg.GetOptions());
+      if (nullptr != fEncoder && fEncoder->Encode(msg, encoded))
+      {
+         const RpcBuffer& encodedData = encoded.GetBuffer();
+         return this->SendFrame(encodedData.GetData(), encodedData.GetSize());
+      }
+      return this->SendFrame(data.GetData(), data.GetSize());
+   }
+   return this->SendFrame(data.GetData(), data.GetSize());
+}
+
+
+bool RpcConnection::SendPayload(const RpcPayload& payload)
+{
+   const RpcMessage& msg = payload.GetMessage();
+   if (this->ShouldCompress(msg))
+   {
+      const RpcMessage* compressed = payload.GetCompressedMessage();
+      if (nullptr != compressed)
+      {
+         const RpcBuffer& data = compressed->GetBuffer();
+         return this->SendFrame(data.GetData(), data.GetSize());
+      }
+   }
+   // each connection has its own window, so small payloads are encoded
+   // separately for each of them.
+   return this->SendEncoded(msg);
+}
+
+
+bool RpcConnection::SendFrame(const void* data, size_t numBytes)
+{
+   const RpcOutbox::Ptr outbox(this->GetOutbox());
+   if (nullptr != outbox)
+   {
+      // our I/O thread writes it.
+      return outbox->Push(data, numBytes);
+   }
+
+   const ScopedLock lock(fSendLock);
+#if ! JUCE_WINDOWS
+   if (fSendSocket >= 0)
+   {
+      uint32 header[2] = { ByteOrder::swapIfBigEndian(static_cast<uint32>(kMagic)),
+                           ByteOrder::swapIfBigEndian(static_cast<uint32>(numBytes)) };
+      struct iovec iov[2];
+      iov[0].iov_base = header;
+      iov[0].iov_len = sizeof(header);
+      iov[1].iov_base = const_cast<void*>(data);
+      iov[1].iov_len = numBytes;
+      return WriteAll(fSendSocket, iov, (numBytes > 0) ? 2 : 1);
+   }
+#endif
+
+   ++sCopiedFrames;
+   return this->sendMessage(MemoryBlock(data, numBytes));
+}
+
+
+int RpcConnection::GetCopiedFrameCount()
+{
+   return sCopiedFrames.get();
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+namespace
+{
+   /**
+    * InterprocessConnectionServer doesn't tell us which port it's bound to,
+    * so ask the system for a free one by listening on port 0, and give it
+    * back for the server to listen on.
+    * @return the port, or -1 if we couldn't get one.
+    */
+   int FindFreePort()
+   {
+      StreamingSocket socket;
+      if (!socket.createListener(0, "127.0.0.1"))
+      {
+         return -1;
+      }
+      return socket.getBoundPort();
+   }
+
+
+   /**
+    * Keeps the messages that a test connection receives.
+    */
+   class MessageLog
+   {
+   public:
+      void Add(const MemoryBlock& message)
+      {
+         const ScopedLock lock(fLock);
+         fMessages.add(message);
+         fReceived.signal();
+      }
+
+      bool WaitForMessages(int count)
+      {
+         while (true)
+         {
+            {
+               const ScopedLock lock(fLock);
+               if (fMessages.size() >= count)
+               {
+                  return true;
+               }
+            }
+            if (!fReceived.wait(5000))
+            {
+               return false;
+            }
+         }
+      }
+
+      CriticalSection fLock;
+      Array<MemoryBlock> fMessages;
+      WaitableEvent fReceived;
+   };
+
+
+   /**
+    * A plain JUCE connection, to check that our frames are compatible with
+    * InterprocessConnection's.
+    */
+   class SinkConnection : public InterprocessConnection
+                        , public MessageLog
+   {
+   public:
+      SinkConnection() : InterprocessConnection(false, RpcConnection::kMagic) {}
+
+      ~SinkConnection() { this->disconnect(); }
+
+      void connectionMade() override {}
+
+      void connectionLost() override {}
+
+      void messageReceived(const MemoryBlock& message) override
+      {
+         this->Add(message);
+      }
+   };
+
+
+   class SinkServer : public InterprocessConnectionServer
+   {
+   public:
+      InterprocessConnection* createConnectionObject() override
+      {
+         fSink = new SinkConnection();
+         fConnected.signal();
+         return fSink;
+      }
+
+      ScopedPointer<SinkConnection> fSink;
+      WaitableEvent fConnected;
+   };
+
+
+   class SourceConnection : public RpcConnection
+                          , public MessageLog
+   {
+   public:
+      ~SourceConnection() { this->disconnect(); }
+
+      void HandleMessage(const void* data, size_t size) override
+      {
+         this->Add(MemoryBlock(data, size));
+      }
+   };
+
+
+   class CompressingServer : public InterprocessConnectionServer
+   {
+   public:
+      InterprocessConnection* createConnectionObject() override
+      {
+         fConnection = new SourceConnection();
+         fConnection->SetOptions(RpcMessage::kSupportedOptions);
+         fConnected.signal();
+         return fConnection;
+      }
+
+      ScopedPointer<SourceConnection> fConnection;
+      WaitableEvent fConnected;
+   };
+}
+
+
+class RpcConnectionTest : public UnitTest
+{
+public:
+   RpcConnectionTest() : UnitTest("RpcConnection tests") {}
+
+   void runTest() override
+   {
+      this->beginTest("Vectored sends");
+      SinkServer server;
+      int port = FindFreePort();
+      this->expect(server.beginWaitingForSocket(port));
+      ScopedPointer<SourceConnection> source(new SourceConnection());
+      this->expect(source->connectToSocket("127.0.0.1", port, 1000));
+      this->expect(server.fConnected.wait(5000));
+
+      int copies = RpcConnection::GetCopiedFrameCount();
+
+      RpcMessage small(10, 1);
+      small.AppendString("a small message");
+      this->expect(source->SendRpcMessage(small));
+
+      RpcMessage large(11, 2);
+      large.Reserve(1024 * 1024 + 16);
+      for (int i = 0; i < 256 * 1024; ++i)
+      {
+         large.AppendData<int>(i);
+      }
+      this->expect(source->SendRpcMessage(large));
+
+      RpcPayload::Ptr shared = new RpcPayload(12, 0, RpcMessage::kLegacyFormat);
+      shared->GetMessage().AppendString("shared");
+      this->expect(source->SendRpcMessage(shared->GetMessage()));
+      this->expect(source->SendRpcMessage(shared->GetMessage()));
+
+      this->expect(copies == RpcConnection::GetCopiedFrameCount());
+      this->expect(server.fSink->WaitForMessages(4));
+
+      this->beginTest("Frames match sendMessage()");
+      const ScopedLock lock(server.fSink->fLock);
+      const Array<MemoryBlock>& received = server.fSink->fMessages;
+      this->expect(4 == received.size());
+      this->expect(received[0] == small.GetMemoryBlock());
+      this->expect(received[1] == large.GetMemoryBlock());
+      this->expect(received[2] == shared->GetMessage().GetMemoryBlock());
+      this->expect(received[3] == received[2]);
+
+      source = nullptr;
+      server.stop();
+
+      this->beginTest("Compressed frames");
+      CompressingServer receiver;
+      port = FindFreePort();
+      this->expect(receiver.beginWaitingForSocket(port));
+      ScopedPointer<SourceConnection> sender(new SourceConnection());
+      sender->SetOptions(RpcMessage::kSupportedOptions);
+      this->expect(sender->connectToSocket("127.0.0.1", port, 1000));
+      this->expect(receiver.fConnected.wait(5000));
+
+      RpcMessage tree(13, 3, RpcMessage::kSupportedOptions);
+      for (int i = 0; i < 1000; ++i)
+      {
+         tree.SetTreeProperty("tracks/track" + String(i % 8) + "/name",
+            RpcMessage::kString, String("untitled"));
+      }
+      RpcMessage below(14, 4, RpcMessage::kSupportedOptions);
+      below.AppendString("too small to compress");
+      RpcPayload::Ptr payload = new RpcPayload(15, 0, RpcMessage::kSupportedOptions);
+      payload->GetMessage().AppendData(tree.GetBuffer().GetData(),
+         tree.GetBuffer().GetSize());
+
+      RpcCompression::Stats before = RpcCompression::GetStats();
+      this->expect(sender->SendRpcMessage(tree));
+      this->expect(sender->SendRpcMessage(below));
+      this->expect(sender->SendPayload(*payload));
+      this->expect(sender->SendPayload(*payload));
+      this->expect(receiver.fConnection->WaitForMessages(4));
+      RpcCompression::Stats after = RpcCompression::GetStats();
+      // the payload is only compressed once.
+      this->expect(before.fCompressedMessages + 2 == after.fCompressedMessages);
+
+      {
+         const ScopedLock compressedLock(receiver.fConnection->fLock);
+         const Array<MemoryBlock>& expanded = receiver.fConnection->fMessages;
+         this->expect(expanded[0] == tree.GetMemoryBlock());
+         this->expect(expanded[1] == below.GetMemoryBlock());
+         this->expect(expanded[2] == payload->GetMessage().GetMemoryBlock());
+         this->expect(expanded[3] == expanded[2]);
+      }
+
+      this->beginTest("Compression threshold");
+      sender->SetCompressionThreshold(std::numeric_limits<int>::max());
+      before = RpcCompression::GetStats();
+      this->expect(sender->SendRpcMessage(tree));
+      this->expect(receiver.fConnection->WaitForMessages(5));
+      after = RpcCompression::GetStats();
+      this->expect(before.fCompressedMessages == after.fCompressedMessages);
+
+      this->beginTest("Dictionary frames");
+      RpcDictionaryWindow::Stats dictionaryBefore = RpcDictionaryWindow::GetStats();
+      OwnedArray<RpcMessage> deltas;
+      for (int i = 0; i < 100; ++i)
+      {
+         RpcMessage* delta = deltas.add(new RpcMessage(16, 0, RpcMessage::kSupportedOptions));
+         delta->SetTreeProperty("tracks/track" + String(i % 8) + "/clips/clip" +
+            String(i % 5) + "/gain", RpcMessage::kDouble, i * 0.25);
+         this->expect(sender->SendRpcMessage(*delta));
+      }
+      this->expect(receiver.fConnection->WaitForMessages(105));
+      RpcDictionaryWindow::Stats dictionaryAfter = RpcDictionaryWindow::GetStats();
+      this->expect(dictionaryAfter.fEncodedMessages > dictionaryBefore.fEncodedMessages + 90);
+      this->expect(dictionaryAfter.fDecodedMessages > dictionaryBefore.fDecodedMessages + 90);
+      {
+         const ScopedLock dictionaryLock(receiver.fConnection->fLock);
+         bool allMatch = true;
+         for (int i = 0; i < deltas.size(); ++i)
+         {
+            allMatch = allMatch &&
+               (receiver.fConnection->fMessages[5 + i] == deltas[i]->GetMemoryBlock());
+         }
+         this->expect(allMatch);
+      }
+
+      sender = nullptr;
+      receiver.stop();
+   }
+};
+
+static RpcConnectionTest connectionTest;
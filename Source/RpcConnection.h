@@ -0,0 +1,255 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCCONNECTION_H_INCLUDED
+#define RPCCONNECTION_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include "RpcCompression.h"
+#include "RpcDictionary.h"
+#include "RpcMessage.h"
+#include "RpcOutbox.h"
+
+
+/**
+ * @class RpcPayload
+ *
+ * An encoded message that's built once and then sent, unchanged, to any
+ * number of connections (for example, a ValueTree update going to every
+ * client that's watching that tree). Payloads are reference-counted so
+ * that each sender can keep one alive for as long as it needs to.
+ */
+class RpcPayload : public ReferenceCountedObject
+{
+public:
+   typedef ReferenceCountedObjectPtr<RpcPayload> Ptr;
+
+   RpcPayload(uint32 code, uint32 sequence, uint32 options)
+   :  fMessage(code, sequence, options)
+   ,  fCompressTried(false)
+   {
+
+   }
+
+   /**
+    * Use this to build the payload; once it's been shared, it must not be
+    * changed.
+    */
+   RpcMessage& GetMessage() { return fMessage; }
+
+   const RpcMessage& GetMessage() const { return fMessage; }
+
+   uint32 GetOptions() const { return fMessage.GetOptions(); }
+
+   /**
+    * @return the compressed form of the message (see RpcCompression), or
+    *         nullptr if it doesn't compress. The message is compressed the
+    *         first time this is called, however many connections send it.
+    */
+   const RpcMessage* GetCompressedMessage() const;
+
+private:
+   RpcMessage fMessage;
+
+   CriticalSection fCompressLock;
+   mutable ScopedPointer<RpcMessage> fCompressed;
+   mutable bool fCompressTried;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcPayload)
+};
+
+
+/**
+ * @class RpcConnection
+ *
+ * Base class for both ends of an RPC connection, which adds a send path
+ * that doesn't copy the message, and keeps track of the wire options that
+ * the two ends have agreed on.
+ *
+ * InterprocessConnection::sendMessage() builds a new MemoryBlock holding the
+ * 8-byte frame header and a copy of the message, and then writes that. We
+ * write the header and the message data with a single vectored write
+ * instead, using our own duplicate of the socket's file descriptor (so it
+ * can't be closed out from under us by the connection thread). Named pipes,
+ * and platforms without vectored socket writes, fall back to sendMessage().
+ * A connection that an RpcEventLoop reads doesn't write on the sending
+ * thread at all: its frames are queued in an RpcOutbox, for the I/O thread
+ * to write together.
+ *
+ * With the kCompressedFrames option, messages at least as large as the
+ * compression threshold are compressed on the way out, and compressed
+ * messages are expanded on the way in before they're passed on to
+ * HandleMessage(). With the kDictionaryFrames option, smaller messages
+ * are encoded against the recent history of the connection in the same way
+ * (see RpcDictionaryWindow).
+ *
+ * All sends must go through SendRpcMessage(), SendPayload() or SendFrame(),
+ * which serialize them (or queue them in order). Subclasses that override connectionMade() or
+ * connectionLost() must call our versions.
+ */
+class RpcConnection : public InterprocessConnection
+{
+public:
+   enum
+   {
+      /**
+       * The first word of each frame's header.
+       */
+      kMagic = 0xf2b49e2c
+   };
+
+   RpcConnection();
+
+   ~RpcConnection();
+
+   /**
+    * Send a message to the other end of the connection.
+    * @return false if the message couldn't be sent.
+    */
+   bool SendRpcMessage(const RpcMessage& msg);
+
+   /**
+    * Send a shared payload, using its cached compressed form if it's large
+    * enough to compress.
+    */
+   bool SendPayload(const RpcPayload& payload);
+
+   /**
+    * Send a block of already-encoded message data as one frame.
+    */
+   bool SendFrame(const void* data, size_t numBytes);
+
+   void connectionMade() override;
+
+   void connectionLost() override;
+
+   /**
+    * Take ownership of a connected socket that an RpcEventLoop reads from,
+    * in place of our connection thread, and call connectionMade(). From
+    * then on, we queue what we send in `outbox` (see RpcOutbox), and close
+    * the socket in connectionLost().
+    */
+   void AttachSocket(int socket, const RpcOutbox::Ptr& outbox);
+
+   /**
+    * @return the outbox that AttachSocket() gave us, or nullptr.
+    */
+   RpcOutbox::Ptr GetOutbox() const;
+
+   /**
+    * Passes the message on to FrameReceived(). Subclasses override 
+    * HandleMessage() instead.
+    */
+   void messageReceived(const MemoryBlock& message) override;
+
+   /**
+    * Expands a received frame if it's compressed or encoded, and passes it
+    * on to HandleMessage(). The frame needn't be in a block of its own; an
+    * RpcEventLoop passes frames straight out of the buffers that it reads 
+    * into, and reuses those once we return.
+    */
+   void FrameReceived(const void* data, size_t size);
+
+   /**
+    * Called on the connection thread (or the RpcEventLoop thread that reads
+    * the connection) for each message that arrives, after it's been
+    * expanded if it was compressed or encoded. The message is only valid 
+    * until this returns, so anything that needs it after that must copy it.
+    */
+   virtual void HandleMessage(const void* data, size_t size) = 0;
+
+   /**
+    * @return the RpcMessage::WireOptions in use on this connection. Until
+    *         they've been negotiated, this is kLegacyFormat.
+    */
+   uint32 GetOptions() const { return fOptions.get(); }
+
+   /**
+    * Switch to a new set of options. Only call this on the connection thread
+    * (or before connecting), so that no message is decoded with the wrong
+    * options.
+    */
+   void SetOptions(uint32 options);
+
+   /**
+    * Use a pre-trained dictionary for kDictionaryFrames. Both ends must use
+    * the same one, or they won't agree on that option. Call this before
+    * connecting.
+    */
+   void SetSharedDictionary(const MemoryBlock& dictionary);
+
+   /**
+    * @return the RpcDictionaryWindow::GetDictionaryId() of our shared
+    *         dictionary, which we check during negotiation.
+    */
+   uint32 GetDictionaryId() const;
+
+   /**
+    * Don't compress messages smaller than `numBytes`. Defaults to
+    * RpcCompression::kDefaultThreshold.
+    */
+   void SetCompressionThreshold(int numBytes) { fCompressionThreshold = numBytes; }
+
+   int GetCompressionThreshold() const { return fCompressionThreshold.get(); }
+
+   /**
+    * @return the number of frames that have had to be copied before
+    *         sending, by any connection. Used by the benchmarks.
+    */
+   static int GetCopiedFrameCount();
+
+private:
+   void CloseSendSocket();
+
+   /**
+    * Drop the connection from the connection thread itself, which can't
+    * call disconnect().
+    */
+   void Abort();
+
+   /**
+    * @return true if `msg` should be compressed before it's sent.
+    */
+   bool ShouldCompress(const RpcMessage& msg) const;
+
+   /**
+    * Dictionary-encode `msg` if we can, and send it.
+    */
+   bool SendEncoded(const RpcMessage& msg);
+
+private:
+   CriticalSection fSendLock;
+
+   Atomic<uint32> fOptions;
+
+   Atomic<int> fCompressionThreshold;
+
+   MemoryBlock fSharedDictionary;
+
+   /**
+    * Only created once kDictionaryFrames has been agreed on. The encoder is
+    * protected by fSendLock; the decoder is only used on the connection
+    * thread.
+    */
+   ScopedPointer<RpcDictionaryEncoder> fEncoder;
+   ScopedPointer<RpcDictionaryDecoder> fDecoder;
+
+   /**
+    * Our duplicate of the socket's file descriptor (or the attached socket
+    * itself), or -1.
+    */
+   int fSendSocket;
+
+   /**
+    * Only for attached sockets. Once the connection's lost, it's closed, 
+    * and turns frames away.
+    */
+   RpcOutbox::Ptr fOutbox;
+};
+
+
+#endif  // RPCCONNECTION_H_INCLUDED
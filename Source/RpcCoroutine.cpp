@@ -0,0 +1,186 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcCoroutine.h"
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+#if RPC_COROUTINES
+
+class RpcCoroutineTest : public UnitTest
+{
+public:
+   RpcCoroutineTest() : UnitTest("RpcCoroutine tests") {}
+
+   /**
+    * A service with a slow method, which does its work on its own thread.
+    */
+   class Service
+   {
+   public:
+      Service() : fWorkers("coroutine test"), fResult(0) {}
+
+      RpcTask<int> Double(const int& val)
+      {
+         fStarted = Thread::getCurrentThreadId();
+         co_await RpcResumeOn(fWorkers);
+         fGate.wait(5000);
+         fFinished = Thread::getCurrentThreadId();
+         fResult = co_await this->Add(val, val);
+         fDone.signal();
+         co_return fResult;
+      }
+
+      RpcTask<int> Add(int a, int b)
+      {
+         if (a < 0)
+         {
+            throw RpcException(Controller::kParameterError);
+         }
+         co_return a + b;
+      }
+
+      RpcThreadExecutor fWorkers;
+      WaitableEvent fGate;
+      WaitableEvent fDone;
+      Thread::ThreadID fStarted;
+      Thread::ThreadID fFinished;
+      int fResult;
+   };
+
+   /**
+    * Somewhere to keep what a test coroutine saw.
+    */
+   struct Outcome
+   {
+      Outcome() : fValue(0), fCode(0), fThread(nullptr) {}
+
+      int fValue;
+      uint32 fCode;
+      Thread::ThreadID fThread;
+      WaitableEvent fDone;
+   };
+
+   static RpcDetachedTask AwaitTask(RpcTask<int> task, Outcome& outcome)
+   {
+      try
+      {
+         outcome.fValue = co_await task;
+      }
+      catch (const RpcException& e)
+      {
+         outcome.fCode = e.GetCode();
+      }
+      outcome.fDone.signal();
+   }
+
+   static RpcDetachedTask AwaitFuture(RpcFuture<int> future, Outcome& outcome)
+   {
+      try
+      {
+         outcome.fValue = co_await future;
+      }
+      catch (const RpcException& e)
+      {
+         outcome.fCode = e.GetCode();
+      }
+      outcome.fThread = Thread::getCurrentThreadId();
+      outcome.fDone.signal();
+   }
+
+   void runTest() override
+   {
+      Service service;
+
+      this->beginTest("Tasks");
+      {
+         Outcome sum;
+         AwaitTask(service.Add(20, 22), sum);
+         this->expect(sum.fDone.wait(0));
+         this->expect(42 == sum.fValue);
+
+         Outcome failed;
+         AwaitTask(service.Add(-1, 0), failed);
+         this->expect(failed.fDone.wait(0));
+         this->expect(Controller::kParameterError == failed.fCode);
+      }
+
+      this->beginTest("Awaiting futures");
+      {
+         RpcThreadExecutor executor("futures");
+         RpcFuture<int>::State::Ptr state = new RpcFuture<int>::State(&executor);
+         Outcome outcome;
+         AwaitFuture(RpcFuture<int>(state), outcome);
+         this->expect(!outcome.fDone.wait(20));
+
+         RpcMessage result(Controller::kIntFn, 1, RpcMessage::kSupportedOptions);
+         result.AppendInt(42);
+         MemoryBlock resultData(result.GetMemoryBlock());
+         RpcMessageReader reader(resultData, RpcMessage::kSupportedOptions);
+         state->GetValue().Decode<Controller::IntFnMethod>(reader);
+         state->Succeed();
+         this->expect(outcome.fDone.wait(5000));
+         this->expect(42 == outcome.fValue);
+         // the coroutine carried on on the executor's thread.
+         this->expect(Thread::getCurrentThreadId() != outcome.fThread);
+
+         RpcFuture<int>::State::Ptr failedState = new RpcFuture<int>::State(&executor);
+         failedState->Fail(RpcException(Controller::kConnectionError));
+         Outcome failed;
+         AwaitFuture(RpcFuture<int>(failedState), failed);
+         this->expect(failed.fDone.wait(5000));
+         this->expect(Controller::kConnectionError == failed.fCode);
+      }
+
+      this->beginTest("Handlers");
+      {
+         RpcDispatcher dispatcher;
+         this->expect(RpcRegisterCoroutine<Controller::IntFnMethod>(dispatcher,
+            &service, &Service::Double));
+         RpcHandler* handler = dispatcher.Find(Controller::kIntFn);
+         this->expect(handler->HasTrait(RpcHandler::kNoResponse));
+
+         RpcMessage call(Controller::kIntFn, 7, RpcMessage::kSupportedOptions);
+         call.AppendInt(21);
+         MemoryBlock callData(call.GetMemoryBlock());
+         RpcMessageReader reader(callData, RpcMessage::kSupportedOptions);
+         RpcMessage response(Controller::kIntFn, 7, RpcMessage::kSupportedOptions);
+         // there's no connection to send the response on, but the handler
+         // still runs.
+         handler->Handle(nullptr, reader, response);
+
+         // the handler returned while the coroutine was still waiting...
+         this->expect(!service.fDone.wait(20));
+         this->expect(Thread::getCurrentThreadId() == service.fStarted);
+         // ...and it finished on the service's own thread.
+         service.fGate.signal();
+         this->expect(service.fDone.wait(5000));
+         this->expect(42 == service.fResult);
+         this->expect(Thread::getCurrentThreadId() != service.fFinished);
+
+         RpcMessage badCall(Controller::kIntFn, 8, RpcMessage::kSupportedOptions);
+         MemoryBlock badCallData(badCall.GetMemoryBlock());
+         RpcMessageReader badReader(badCallData, RpcMessage::kSupportedOptions);
+         uint32 code = 0;
+         try
+         {
+            handler->Handle(nullptr, badReader, response);
+         }
+         catch (const RpcException& e)
+         {
+            code = e.GetCode();
+         }
+         this->expect(Controller::kParameterError == code);
+      }
+   }
+};
+
+static RpcCoroutineTest coroutineTest;
+
+#endif  // RPC_COROUTINES
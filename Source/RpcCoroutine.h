@@ -0,0 +1,406 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCCOROUTINE_H_INCLUDED
+#define RPCCOROUTINE_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+/**
+ * C++20 coroutine support for both ends of a connection. The rest of the
+ * project builds as C++11, so all of this is compiled out unless the
+ * compiler supports coroutines; set RPC_COROUTINES to 0 to leave it out
+ * anyway.
+ */
+#ifndef RPC_COROUTINES
+ #if defined(__cpp_impl_coroutine) && defined(__has_include)
+  #if __has_include(<coroutine>)
+   #define RPC_COROUTINES 1
+  #endif
+ #endif
+#endif
+
+#ifndef RPC_COROUTINES
+ #define RPC_COROUTINES 0
+#endif
+
+
+#if RPC_COROUTINES
+
+#include "Controller.h"
+#include "RpcDispatcher.h"
+#include "RpcExecutor.h"
+#include "RpcFuture.h"
+#include "RpcServer.h"
+
+#include <coroutine>
+#include <exception>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+
+/**
+ * Lets a coroutine wait for the result of an asynchronous call:
+ *
+ *     int doubled = co_await client.CallAsync<Controller::IntFnMethod>(21);
+ *
+ * The coroutine carries on on the client's RpcExecutor once the result has
+ * arrived. If the call failed, co_await throws its RpcException.
+ */
+template <typename R>
+class RpcFutureAwaiter
+{
+public:
+   explicit RpcFutureAwaiter(const RpcFuture<R>& future) : fFuture(future) {}
+
+   bool await_ready() const { return fFuture.IsReady(); }
+
+   void await_suspend(std::coroutine_handle<> awaiting)
+   {
+      fFuture.Then([awaiting](RpcFuture<R>) { awaiting.resume(); });
+   }
+
+   R await_resume() { return fFuture.Get(); }
+
+private:
+   RpcFuture<R> fFuture;
+};
+
+template <typename R>
+RpcFutureAwaiter<R> operator co_await(const RpcFuture<R>& future)
+{
+   return RpcFutureAwaiter<R>(future);
+}
+
+
+/**
+ * Moves a coroutine onto one of an executor's threads:
+ *
+ *     co_await RpcResumeOn(fWorkers);
+ *     ...slow work here doesn't hold up the connection thread.
+ */
+class RpcResumeOn
+{
+public:
+   explicit RpcResumeOn(RpcExecutor& executor) : fExecutor(executor) {}
+
+   bool await_ready() const { return false; }
+
+   void await_suspend(std::coroutine_handle<> awaiting)
+   {
+      fExecutor.Post([awaiting]() { awaiting.resume(); });
+   }
+
+   void await_resume() {}
+
+private:
+   RpcExecutor& fExecutor;
+};
+
+
+/**
+ * The parts of an RpcTask's promise that don't depend on its result type.
+ */
+class RpcTaskPromiseBase
+{
+public:
+   /**
+    * When the task finishes, carry on with whoever was awaiting it.
+    */
+   struct FinalAwaiter
+   {
+      bool await_ready() const noexcept { return false; }
+
+      template <typename Promise>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> task) noexcept
+      {
+         std::coroutine_handle<> next = task.promise().fContinuation;
+         return next ? next : std::noop_coroutine();
+      }
+
+      void await_resume() noexcept {}
+   };
+
+   /**
+    * Tasks don't start until they're awaited.
+    */
+   std::suspend_always initial_suspend() noexcept { return {}; }
+
+   FinalAwaiter final_suspend() noexcept { return {}; }
+
+   void unhandled_exception() { fException = std::current_exception(); }
+
+   void RethrowIfFailed()
+   {
+      if (fException)
+      {
+         std::rethrow_exception(fException);
+      }
+   }
+
+   std::coroutine_handle<> fContinuation;
+   std::exception_ptr fException;
+};
+
+template <typename R>
+class RpcTaskPromise : public RpcTaskPromiseBase
+{
+public:
+   RpcTaskPromise() : fValue() {}
+
+   void return_value(R value) { fValue = std::move(value); }
+
+   R GetResult()
+   {
+      this->RethrowIfFailed();
+      return std::move(fValue);
+   }
+
+private:
+   R fValue;
+};
+
+template <>
+class RpcTaskPromise<void> : public RpcTaskPromiseBase
+{
+public:
+   void return_void() {}
+
+   void GetResult() { this->RethrowIfFailed(); }
+};
+
+
+/**
+ * @class RpcTask
+ *
+ * The return type of a coroutine that produces an `R`, for use as a server
+ * handler (see RpcCoroutineHandler) or from inside another coroutine:
+ *
+ *     RpcTask<int> Service::Lookup(int key)
+ *     {
+ *        co_await RpcResumeOn(fWorkers);
+ *        co_return fTable.Find(key);
+ *     }
+ *
+ * A task doesn't run until it's awaited, and an RpcException thrown inside
+ * it comes out of the co_await.
+ */
+template <typename R>
+class RpcTask
+{
+public:
+   class promise_type : public RpcTaskPromise<R>
+   {
+   public:
+      RpcTask get_return_object()
+      {
+         return RpcTask(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+   };
+
+   RpcTask() {}
+
+   RpcTask(RpcTask&& other) noexcept : fTask(std::exchange(other.fTask, nullptr)) {}
+
+   RpcTask& operator=(RpcTask&& other) noexcept
+   {
+      if (this != &other)
+      {
+         this->Destroy();
+         fTask = std::exchange(other.fTask, nullptr);
+      }
+      return *this;
+   }
+
+   ~RpcTask() { this->Destroy(); }
+
+   bool await_ready() const noexcept { return false; }
+
+   std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+   {
+      fTask.promise().fContinuation = awaiting;
+      return fTask;
+   }
+
+   R await_resume() { return fTask.promise().GetResult(); }
+
+private:
+   explicit RpcTask(std::coroutine_handle<promise_type> task) : fTask(task) {}
+
+   void Destroy()
+   {
+      if (fTask)
+      {
+         fTask.destroy();
+         fTask = nullptr;
+      }
+   }
+
+private:
+   std::coroutine_handle<promise_type> fTask;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcTask)
+};
+
+
+/**
+ * A coroutine that nobody waits for; it starts straight away and cleans up
+ * after itself when it finishes. Used to drive a handler's RpcTask.
+ */
+struct RpcDetachedTask
+{
+   struct promise_type
+   {
+      RpcDetachedTask get_return_object() noexcept { return RpcDetachedTask(); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() noexcept {}
+      void unhandled_exception() noexcept { std::terminate(); }
+   };
+};
+
+
+/**
+ * @class RpcCoroutineHandler
+ *
+ * Handles an RpcMethod with a member function of `Object` that's a
+ * coroutine returning RpcTask<Method::ReturnType>. The coroutine starts on
+ * one of the server's workers, and the response is sent whenever it 
+ * finishes, from whichever thread it's on then; while it's suspended, the 
+ * connection carries on with other calls. (One-way and batched calls wait 
+ * for the coroutine to finish, so the handler has the 
+ * RpcHandler::kBlocking trait, and never starts on an I/O thread.) The call's arguments stay alive until it
+ * finishes, so the member function may take them by const reference.
+ */
+template <typename Method, typename Object, typename Fn>
+class RpcCoroutineHandler : public RpcHandler
+{
+public:
+   typedef typename Method::ReturnType ReturnType;
+
+   RpcCoroutineHandler(Object* object, Fn fn, uint32 traits)
+   :  RpcHandler(traits | kNoResponse | kBlocking)
+   ,  fObject(object)
+   ,  fFn(fn)
+   {
+
+   }
+
+   void Handle(RpcServerConnection* connection, RpcMessageReader& call,
+      RpcMessage& response) override
+   {
+      typename Method::ArgTuple args(Method::DecodeArgs(call));
+      if (!call.IsValid())
+      {
+         throw RpcException(Controller::kParameterError);
+      }
+      Run(fObject, fFn, std::move(args),
+         new RpcResponder(connection, call, response.GetOptions()));
+   }
+
+   /**
+    * A batch needs the response before it can be sent, so we wait for the 
+    * coroutine to finish.
+    */
+   void HandleBatched(RpcServerConnection*, RpcMessageReader& call,
+      RpcMessage& response) override
+   {
+      typename Method::ArgTuple args(Method::DecodeArgs(call));
+      if (!call.IsValid())
+      {
+         throw RpcException(Controller::kParameterError);
+      }
+      RpcFuture<void>::State::Ptr done = new RpcFuture<void>::State(nullptr);
+      RunAndWait(fObject, fFn, std::move(args), response, done);
+      RpcFuture<void>(done).Get();
+   }
+
+private:
+   /**
+    * Run the member function and append its result to `response`.
+    */
+   static RpcTask<void> Respond(Object* object, Fn fn,
+      typename Method::ArgTuple& args, RpcMessage& response)
+   {
+      RpcTask<ReturnType> task = std::apply([object, fn](auto&... values)
+      {
+         return (object->*fn)(values...);
+      }, args);
+
+      if constexpr (std::is_void_v<ReturnType>)
+      {
+         co_await task;
+      }
+      else
+      {
+         RpcResult<ReturnType>::Append(response, co_await task);
+      }
+   }
+
+   static RpcDetachedTask Run(Object* object, Fn fn,
+      typename Method::ArgTuple args, RpcResponder::Ptr responder)
+   {
+      try
+      {
+         co_await Respond(object, fn, args, responder->GetResponse());
+         responder->Send();
+      }
+      catch (const RpcException& e)
+      {
+         responder->Fail(e);
+      }
+      catch (...)
+      {
+         responder->Fail(RpcException(Controller::kInternalError));
+      }
+   }
+
+   static RpcDetachedTask RunAndWait(Object* object, Fn fn,
+      typename Method::ArgTuple args, RpcMessage& response,
+      RpcFuture<void>::State::Ptr done)
+   {
+      try
+      {
+         co_await Respond(object, fn, args, response);
+         done->Succeed();
+      }
+      catch (const RpcException& e)
+      {
+         done->Fail(e);
+      }
+      catch (...)
+      {
+         done->Fail(RpcException(Controller::kInternalError));
+      }
+   }
+
+private:
+   // raw pointer; we don't own the object.
+   Object* fObject;
+   Fn      fFn;
+};
+
+
+/**
+ * Register the coroutine member function `fn` of `object` as the
+ * implementation of the RpcMethod `Method`:
+ *
+ *     RpcRegisterCoroutine<Controller::IntFnMethod>(dispatcher, this,
+ *        &Service::IntFnAsync);
+ */
+template <typename Method, typename Object, typename Fn>
+bool RpcRegisterCoroutine(RpcDispatcher& dispatcher, Object* object, Fn fn,
+   uint32 traits=RpcHandler::kDefaultTraits)
+{
+   return dispatcher.Register(Method::kCode,
+      new RpcCoroutineHandler<Method, Object, Fn>(object, fn, traits));
+}
+
+
+#endif  // RPC_COROUTINES
+
+#endif  // RPCCOROUTINE_H_INCLUDED
@@ -0,0 +1,511 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "Controller.h"
+#include "RpcDictionary.h"
+#include "RpcMessageReader.h"
+
+
+namespace
+{
+   enum
+   {
+      /**
+       * Room for the window, plus as much again before we have to slide it
+       * down, plus the largest message.
+       */
+      kCapacity = 2 * RpcDictionaryWindow::kWindowSize + RpcDictionaryWindow::kMaxMessageSize
+   };
+
+   Atomic<int64> sEncodedMessages;
+   Atomic<int64> sBytesIn;
+   Atomic<int64> sBytesOut;
+   Atomic<int64> sDecodedMessages;
+   Atomic<int64> sEncodeTicks;
+   Atomic<int64> sDecodeTicks;
+
+   inline uint32 Read32(const uint8* data)
+   {
+      uint32 val;
+      memcpy(&val, data, sizeof(val));
+      return val;
+   }
+}
+
+
+RpcDictionaryWindow::Stats::Stats()
+:  fEncodedMessages(0)
+,  fBytesIn(0)
+,  fBytesOut(0)
+,  fDecodedMessages(0)
+,  fEncodeSeconds(0)
+,  fDecodeSeconds(0)
+{
+
+}
+
+
+double RpcDictionaryWindow::Stats::GetRatio() const
+{
+   if (0 == fBytesIn)
+   {
+      return 1.0;
+   }
+   return static_cast<double>(fBytesOut) / fBytesIn;
+}
+
+
+RpcDictionaryWindow::RpcDictionaryWindow(const MemoryBlock& dictionary)
+:  fData(kCapacity)
+,  fSize(static_cast<int>(jmin<size_t>(dictionary.getSize(), kWindowSize)))
+{
+   const char* end = static_cast<const char*>(dictionary.getData()) + dictionary.getSize();
+   memcpy(fData.getData(), end - fSize, static_cast<size_t>(fSize));
+}
+
+
+RpcDictionaryWindow::~RpcDictionaryWindow()
+{
+
+}
+
+
+uint32 RpcDictionaryWindow::GetDictionaryId(const MemoryBlock& dictionary)
+{
+   RpcStringView bytes(static_cast<const char*>(dictionary.getData()),
+      dictionary.getSize());
+   return bytes.GetHash();
+}
+
+
+RpcDictionaryWindow::Stats RpcDictionaryWindow::GetStats()
+{
+   Stats stats;
+   stats.fEncodedMessages = sEncodedMessages.get();
+   stats.fBytesIn = sBytesIn.get();
+   stats.fBytesOut = sBytesOut.get();
+   stats.fDecodedMessages = sDecodedMessages.get();
+   stats.fEncodeSeconds = Time::highResolutionTicksToSeconds(sEncodeTicks.get());
+   stats.fDecodeSeconds = Time::highResolutionTicksToSeconds(sDecodeTicks.get());
+   return stats;
+}
+
+
+int RpcDictionaryWindow::MakeRoom(int numBytes)
+{
+   jassert(numBytes <= kMaxMessageSize);
+   if (fSize + numBytes <= kCapacity)
+   {
+      return 0;
+   }
+   const int shift = fSize - kWindowSize;
+   memmove(fData.getData(), fData.getData() + shift, kWindowSize);
+   fSize = kWindowSize;
+   return shift;
+}
+
+
+RpcDictionaryEncoder::RpcDictionaryEncoder(const MemoryBlock& dictionary)
+:  RpcDictionaryWindow(dictionary)
+,  fTable(1 << kHashBits, true)
+{
+   this->Index(0, fSize);
+}
+
+
+RpcDictionaryEncoder::~RpcDictionaryEncoder()
+{
+
+}
+
+
+bool RpcDictionaryEncoder::CanEncode(const RpcMessage& msg)
+{
+   const size_t size = msg.GetBuffer().GetSize();
+   return (0 != (msg.GetOptions() & RpcMessage::kDictionaryFrames)) &&
+      size >= kMinMessageSize && size <= kMaxMessageSize;
+}
+
+
+bool RpcDictionaryEncoder::Encode(const RpcMessage& msg, RpcMessage& encoded)
+{
+   const RpcBuffer& data = msg.GetBuffer();
+   const int size = static_cast<int>(data.GetSize());
+   if (!CanEncode(msg))
+   {
+      return false;
+   }
+
+   const int64 start = Time::getHighResolutionTicks();
+   const int shift = this->MakeRoom(size);
+   if (shift > 0)
+   {
+      this->Rebase(shift);
+   }
+
+   // put the message at the end of the window, so that matches can reach
+   // back into earlier parts of it as well as into the window.
+   const int base = fSize;
+   const int end = base + size;
+   memcpy(fData + base, data.GetData(), static_cast<size_t>(size));
+   fSize = end;
+
+   encoded = RpcMessage(RpcMessage::kEncodedMessageCode, 0, msg.GetOptions());
+   int literals = base;
+   int pos = base;
+   while (pos + kMinMatch <= end)
+   {
+      const uint32 bytes = Read32(fData + pos);
+      const uint32 hash = Hash(bytes);
+      const int candidate = fTable[hash] - 1;
+      fTable[hash] = pos + 1;
+      // the table may hold stale positions; only trust ones that still
+      // match.
+      if (candidate < 0 || candidate >= pos || pos - candidate > kWindowSize ||
+         Read32(fData + candidate) != bytes)
+      {
+         ++pos;
+         continue;
+      }
+
+      int length = kMinMatch;
+      while (pos + length < end && fData[candidate + length] == fData[pos + length])
+      {
+         ++length;
+      }
+      encoded.AppendVarUInt(static_cast<uint64>(pos - literals));
+      encoded.AppendData(fData + literals, static_cast<size_t>(pos - literals));
+      encoded.AppendVarUInt(static_cast<uint64>(length - kMinMatch));
+      encoded.AppendVarUInt(static_cast<uint64>(pos - candidate));
+      this->Index(pos + 1, pos + length);
+      pos += length;
+      literals = pos;
+   }
+   if (literals < end)
+   {
+      encoded.AppendVarUInt(static_cast<uint64>(end - literals));
+      encoded.AppendData(fData + literals, static_cast<size_t>(end - literals));
+   }
+   sEncodeTicks += Time::getHighResolutionTicks() - start;
+
+   ++sEncodedMessages;
+   sBytesIn += static_cast<int64>(data.GetSize());
+   sBytesOut += static_cast<int64>(encoded.GetBuffer().GetSize());
+   return true;
+}
+
+
+void RpcDictionaryEncoder::Index(int start, int end)
+{
+   end = jmin(end, fSize - kMinMatch + 1);
+   for (int i = start; i < end; ++i)
+   {
+      fTable[Hash(Read32(fData + i))] = i + 1;
+   }
+}
+
+
+void RpcDictionaryEncoder::Rebase(int shift)
+{
+   for (int i = 0; i < (1 << kHashBits); ++i)
+   {
+      const int pos = fTable[i] - 1 - shift;
+      fTable[i] = (pos >= 0) ? pos + 1 : 0;
+   }
+}
+
+
+RpcDictionaryDecoder::RpcDictionaryDecoder(const MemoryBlock& dictionary)
+:  RpcDictionaryWindow(dictionary)
+{
+
+}
+
+
+RpcDictionaryDecoder::~RpcDictionaryDecoder()
+{
+
+}
+
+
+bool RpcDictionaryDecoder::IsEncoded(const void* data, size_t size, uint32 options)
+{
+   if (0 == (options & RpcMessage::kDictionaryFrames))
+   {
+      return false;
+   }
+   RpcMessageReader reader(data, size, options);
+   return reader.IsValid() && RpcMessage::kEncodedMessageCode == reader.GetCode();
+}
+
+
+bool RpcDictionaryDecoder::Decode(const void* data, size_t size, uint32 options,
+   MemoryBlock& decoded)
+{
+   const int64 start = Time::getHighResolutionTicks();
+   RpcMessageReader reader(data, size, options);
+   if (!reader.IsValid() || RpcMessage::kEncodedMessageCode != reader.GetCode())
+   {
+      return false;
+   }
+
+   // we don't know how large the message is until we've decoded it.
+   this->MakeRoom(kMaxMessageSize);
+   int pos = fSize;
+   const int end = fSize + kMaxMessageSize;
+   while (reader.GetBytesRemaining() > 0)
+   {
+      const uint64 literals = reader.GetVarUInt();
+      if (!reader.IsValid() || literals > static_cast<uint64>(end - pos))
+      {
+         return false;
+      }
+      const void* src = reader.Skip(static_cast<size_t>(literals));
+      if (nullptr == src)
+      {
+         return false;
+      }
+      memcpy(fData + pos, src, static_cast<size_t>(literals));
+      pos += static_cast<int>(literals);
+      if (0 == reader.GetBytesRemaining())
+      {
+         break;
+      }
+
+      const uint64 extra = reader.GetVarUInt();
+      const uint64 distance = reader.GetVarUInt();
+      if (!reader.IsValid() || end - pos < kMinMatch ||
+         extra > static_cast<uint64>(end - pos - kMinMatch) ||
+         0 == distance || distance > static_cast<uint64>(pos))
+      {
+         return false;
+      }
+      // matches may overlap the bytes they produce, so copy one at a time.
+      const int length = static_cast<int>(extra) + kMinMatch;
+      const uint8* from = fData + pos - static_cast<int>(distance);
+      for (int i = 0; i < length; ++i)
+      {
+         fData[pos + i] = from[i];
+      }
+      pos += length;
+   }
+   const int messageSize = pos - fSize;
+   if (messageSize < kMinMessageSize)
+   {
+      return false;
+   }
+
+   decoded.replaceWith(fData + fSize, static_cast<size_t>(messageSize));
+   fSize = pos;
+
+   sDecodeTicks += Time::getHighResolutionTicks() - start;
+   ++sDecodedMessages;
+   return true;
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+namespace
+{
+   /**
+    * Keeps the deltas that a ValueTreeSynchroniser sends.
+    */
+   class DeltaRecorder : public ValueTreeSynchroniser
+   {
+   public:
+      DeltaRecorder(const ValueTree& tree) : ValueTreeSynchroniser(tree) {}
+
+      void stateChanged(const void* change, size_t size) override
+      {
+         fDeltas.add(MemoryBlock(change, size));
+      }
+
+      Array<MemoryBlock> fDeltas;
+   };
+
+
+   /**
+    * Make `count` realistic ValueTree deltas: property changes on a tree
+    * of tracks and clips.
+    */
+   Array<MemoryBlock> MakeDeltas(int count, int seed)
+   {
+      ValueTree root("session");
+      for (int t = 0; t < 8; ++t)
+      {
+         ValueTree track("track");
+         for (int c = 0; c < 8; ++c)
+         {
+            track.addChild(ValueTree("clip"), -1, nullptr);
+         }
+         root.addChild(track, -1, nullptr);
+      }
+
+      const char* names[] = { "gain", "pan", "start", "length", "muted", "name" };
+      DeltaRecorder recorder(root);
+      Random rng(seed);
+      while (recorder.fDeltas.size() < count)
+      {
+         ValueTree clip = root.getChild(rng.nextInt(8)).getChild(rng.nextInt(8));
+         const int name = rng.nextInt(6);
+         if (5 == name)
+         {
+            clip.setProperty(names[name], "clip " + String(rng.nextInt(100)), nullptr);
+         }
+         else
+         {
+            clip.setProperty(names[name], rng.nextInt(1000) * 0.25, nullptr);
+         }
+      }
+      return recorder.fDeltas;
+   }
+
+
+   RpcMessage MakeUpdate(const MemoryBlock& delta, uint32 options)
+   {
+      RpcMessage msg(Controller::kValueTree1Update, 0, options);
+      msg.AppendData(delta.getData(), delta.getSize());
+      return msg;
+   }
+}
+
+
+class RpcDictionaryTest : public UnitTest
+{
+public:
+   RpcDictionaryTest() : UnitTest("RpcDictionary tests") {}
+
+   void runTest() override
+   {
+      const uint32 options = RpcMessage::kSupportedOptions;
+      const Array<MemoryBlock> deltas = MakeDeltas(2000, 1);
+
+      this->beginTest("Round trips");
+      MemoryBlock none;
+      RpcDictionaryEncoder encoder(none);
+      RpcDictionaryDecoder decoder(none);
+      size_t rawBytes = 0;
+      size_t encodedBytes = 0;
+      bool allMatch = true;
+      for (int i = 0; i < deltas.size(); ++i)
+      {
+         RpcMessage msg = MakeUpdate(deltas[i], options);
+         RpcMessage encoded(0, 0);
+         allMatch = allMatch && encoder.Encode(msg, encoded);
+         const RpcBuffer& wire = encoded.GetBuffer();
+         rawBytes += msg.GetBuffer().GetSize();
+         encodedBytes += wire.GetSize();
+
+         MemoryBlock received;
+         allMatch = allMatch && RpcDictionaryDecoder::IsEncoded(wire.GetData(),
+            wire.GetSize(), options) && decoder.Decode(wire.GetData(), wire.GetSize(),
+            options, received) && (received == msg.GetMemoryBlock());
+      }
+      this->expect(allMatch);
+      // the window learns the codes, property names and paths quickly; the
+      // random values are all that's left.
+      this->expect(encodedBytes * 5 < rawBytes * 3);
+      this->logMessage(String(rawBytes) + " -> " + String(encodedBytes) + " bytes");
+
+      this->beginTest("Pre-trained dictionary");
+      MemoryBlock trained;
+      const Array<MemoryBlock> samples = MakeDeltas(200, 2);
+      for (int i = 0; i < samples.size(); ++i)
+      {
+         trained.append(samples[i].getData(), samples[i].getSize());
+      }
+      this->expect(RpcDictionaryWindow::GetDictionaryId(trained) !=
+         RpcDictionaryWindow::GetDictionaryId(none));
+      RpcDictionaryEncoder trainedEncoder(trained);
+      RpcDictionaryEncoder coldEncoder(none);
+      RpcMessage first = MakeUpdate(deltas[0], options);
+      RpcMessage trainedFirst(0, 0);
+      RpcMessage coldFirst(0, 0);
+      this->expect(trainedEncoder.Encode(first, trainedFirst));
+      this->expect(coldEncoder.Encode(first, coldFirst));
+      this->expect(trainedFirst.GetBuffer().GetSize() < coldFirst.GetBuffer().GetSize());
+      this->expect(trainedFirst.GetBuffer().GetSize() < first.GetBuffer().GetSize());
+      RpcDictionaryDecoder trainedDecoder(trained);
+      MemoryBlock decoded;
+      this->expect(trainedDecoder.Decode(trainedFirst.GetBuffer().GetData(),
+         trainedFirst.GetBuffer().GetSize(), options, decoded));
+      this->expect(decoded == first.GetMemoryBlock());
+
+      this->beginTest("Sliding window");
+      // enough random and repeated data to slide the window many times.
+      RpcDictionaryEncoder slideEncoder(none);
+      RpcDictionaryDecoder slideDecoder(none);
+      Random rng(3);
+      allMatch = true;
+      int numEncoded = 0;
+      for (int i = 0; i < 500; ++i)
+      {
+         RpcMessage msg(Controller::kValueTree1Update, 0, options);
+         const int size = RpcDictionaryWindow::kMinMessageSize + rng.nextInt(4000);
+         for (int j = 0; j < size; ++j)
+         {
+            // half noise, half a small alphabet that repeats a lot.
+            msg.AppendData<uint8>(static_cast<uint8>((i & 1) ? rng.nextInt(256) : 'a' + (j * 7) % 5));
+         }
+         RpcMessage encoded(0, 0);
+         if (slideEncoder.Encode(msg, encoded))
+         {
+            ++numEncoded;
+            MemoryBlock received;
+            const RpcBuffer& wire = encoded.GetBuffer();
+            allMatch = allMatch && slideDecoder.Decode(wire.GetData(), wire.GetSize(),
+               options, received) && (received == msg.GetMemoryBlock());
+         }
+      }
+      this->expect(allMatch);
+      this->expect(500 == numEncoded);
+
+      this->beginTest("Bad encoded data");
+      RpcDictionaryEncoder badEncoder(none);
+      RpcMessage msg = MakeUpdate(deltas[1], options);
+      RpcMessage encoded(0, 0);
+      badEncoder.Encode(msg, encoded);
+      RpcMessage msg2 = MakeUpdate(deltas[1], options);
+      RpcMessage encoded2(0, 0);
+      // the second copy is all one back-reference.
+      this->expect(badEncoder.Encode(msg2, encoded2));
+      RpcDictionaryDecoder fresh(none);
+      // ...so it can't be decoded without the first one.
+      this->expect(!fresh.Decode(encoded2.GetBuffer().GetData(),
+         encoded2.GetBuffer().GetSize(), options, decoded));
+
+      RpcDictionaryDecoder truncated(none);
+      const RpcBuffer& wire = encoded.GetBuffer();
+      this->expect(!truncated.Decode(wire.GetData(), wire.GetSize() - 1, options, decoded));
+
+      RpcMessage tooLong(RpcMessage::kEncodedMessageCode, 0, options);
+      tooLong.AppendVarUInt(RpcDictionaryWindow::kMaxMessageSize + 1);
+      RpcDictionaryDecoder tooLongDecoder(none);
+      this->expect(!tooLongDecoder.Decode(tooLong.GetBuffer().GetData(),
+         tooLong.GetBuffer().GetSize(), options, decoded));
+
+      // a back-reference to before the start of the window.
+      RpcMessage overrun(RpcMessage::kEncodedMessageCode, 0, options);
+      overrun.AppendVarUInt(8);
+      overrun.AppendData("01234567", 8);
+      overrun.AppendVarUInt(0);
+      overrun.AppendVarUInt(9);
+      RpcDictionaryDecoder overrunDecoder(none);
+      this->expect(!overrunDecoder.Decode(overrun.GetBuffer().GetData(),
+         overrun.GetBuffer().GetSize(), options, decoded));
+
+      this->beginTest("Encoding needs the option");
+      this->expect(!RpcDictionaryDecoder::IsEncoded(wire.GetData(), wire.GetSize(),
+         RpcMessage::kCompactEncoding));
+      this->expect(RpcDictionaryDecoder::IsEncoded(wire.GetData(), wire.GetSize(),
+         options));
+   }
+};
+
+static RpcDictionaryTest dictionaryTest;
@@ -0,0 +1,212 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCDICTIONARY_H_INCLUDED
+#define RPCDICTIONARY_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include "RpcMessage.h"
+
+
+/**
+ * @class RpcDictionaryWindow
+ *
+ * Small messages -- ValueTree deltas, mostly -- are too short for zlib to
+ * find anything to compress, but they repeat the same message codes,
+ * property names, type names and paths over and over. With the
+ * RpcMessage::kDictionaryFrames option, each end of a connection keeps a
+ * window holding the most recent kWindowSize bytes of the small messages it
+ * has sent (or received), initially filled from a shared, pre-trained
+ * dictionary, and we encode each new message as literal bytes and
+ * back-references into that window. Both ends add exactly the same messages
+ * in exactly the same order, so their windows always match.
+ *
+ * An encoded message has a header with the code
+ * RpcMessage::kEncodedMessageCode and sequence 0, followed by a series of
+ *    varint literalCount, literal bytes,
+ *    [varint matchLength - kMinMatch, varint distance]
+ * that produce the whole original message, header and all. `distance` counts
+ * back from the current end of the window.
+ */
+class RpcDictionaryWindow
+{
+public:
+   enum
+   {
+      /**
+       * How far back a match can reach.
+       */
+      kWindowSize       = 32 * 1024,
+
+      /**
+       * Messages larger than this are never dictionary-encoded.
+       */
+      kMaxMessageSize   = 16 * 1024,
+
+      /**
+       * Messages smaller than this aren't worth encoding.
+       */
+      kMinMessageSize   = 8,
+
+      kMinMatch         = 4
+   };
+
+   /**
+    * Running totals across every connection.
+    */
+   struct Stats
+   {
+      Stats();
+
+      int64 fEncodedMessages;
+
+      /**
+       * Size of the messages that were encoded, before and after.
+       */
+      int64 fBytesIn;
+      int64 fBytesOut;
+
+      int64 fDecodedMessages;
+
+      double fEncodeSeconds;
+      double fDecodeSeconds;
+
+      /**
+       * @return encoded size / original size, or 1.0 if nothing has been
+       *         encoded.
+       */
+      double GetRatio() const;
+   };
+
+   /**
+    * @param dictionary Pre-trained dictionary to start the window with (only
+    *                   its last kWindowSize bytes are used). Both ends of a
+    *                   connection must use the same one.
+    */
+   RpcDictionaryWindow(const MemoryBlock& dictionary);
+
+   virtual ~RpcDictionaryWindow();
+
+   /**
+    * @return an identifier for a pre-trained dictionary, used to check that
+    *         both ends of a connection are using the same one.
+    */
+   static uint32 GetDictionaryId(const MemoryBlock& dictionary);
+
+   static Stats GetStats();
+
+protected:
+   /**
+    * Make sure that there's room to add `numBytes` to the end of the window,
+    * by discarding data that's more than kWindowSize bytes old.
+    * @return the number of bytes that data had to be moved by.
+    */
+   int MakeRoom(int numBytes);
+
+protected:
+   /**
+    * The window data, followed by space for the next message.
+    */
+   HeapBlock<uint8> fData;
+
+   /**
+    * Number of bytes in fData.
+    */
+   int fSize;
+};
+
+
+/**
+ * @class RpcDictionaryEncoder
+ *
+ * The sending end of a connection. Not thread-safe; RpcConnection only uses
+ * its encoder while holding its send lock, so that messages are encoded in
+ * the same order that they're sent.
+ */
+class RpcDictionaryEncoder : public RpcDictionaryWindow
+{
+public:
+   RpcDictionaryEncoder(const MemoryBlock& dictionary);
+
+   ~RpcDictionaryEncoder();
+
+   /**
+    * @return true if `msg` is the right size to be encoded.
+    */
+   static bool CanEncode(const RpcMessage& msg);
+
+   /**
+    * Encode a message, and add it to the window. Every message that
+    * CanEncode() must be sent encoded, even the occasional one that comes out
+    * a few bytes larger, so that the receiver's window keeps up with ours.
+    * @param  msg     The message to encode.
+    * @param  encoded Set to the encoded message.
+    * @return         false if `msg` can't be encoded.
+    */
+   bool Encode(const RpcMessage& msg, RpcMessage& encoded);
+
+private:
+   static uint32 Hash(uint32 bytes)
+   {
+      return (bytes * 2654435761u) >> (32 - kHashBits);
+   }
+
+   /**
+    * Add the positions from `start` up to `end` to the hash table.
+    */
+   void Index(int start, int end);
+
+   /**
+    * Adjust the hash table after the window data moves down by `shift` bytes.
+    */
+   void Rebase(int shift);
+
+private:
+   enum { kHashBits = 12 };
+
+   /**
+    * For each hash of 4 bytes, 1 + the position in fData where we last saw
+    * them, or 0.
+    */
+   HeapBlock<int> fTable;
+};
+
+
+/**
+ * @class RpcDictionaryDecoder
+ *
+ * The receiving end of a connection. Not thread-safe; messages must be
+ * decoded in the order that they arrive.
+ */
+class RpcDictionaryDecoder : public RpcDictionaryWindow
+{
+public:
+   RpcDictionaryDecoder(const MemoryBlock& dictionary);
+
+   ~RpcDictionaryDecoder();
+
+   /**
+    * @return true if a received message is dictionary-encoded.
+    */
+   static bool IsEncoded(const void* data, size_t size, uint32 options);
+
+   /**
+    * Decode a message back into its original form, and add it to the
+    * window.
+    * @param  data    The received message.
+    * @param  size    its size in bytes.
+    * @param  options WireOptions in use on the connection.
+    * @param  decoded Set to the original message.
+    * @return         false if the data isn't a valid encoded message. The
+    *                 window can't be trusted after that, so the connection
+    *                 should be dropped.
+    */
+   bool Decode(const void* data, size_t size, uint32 options, MemoryBlock& decoded);
+};
+
+
+#endif  // RPCDICTIONARY_H_INCLUDED
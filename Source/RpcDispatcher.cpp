@@ -0,0 +1,189 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcDispatcher.h"
+
+
+RpcDispatcher::RpcDispatcher()
+:  fSlots(kInitialSize, true)
+,  fMask(kInitialSize - 1)
+,  fShift(32 - 6)
+{
+   static_assert(64 == kInitialSize, "fShift must match kInitialSize");
+}
+
+
+RpcDispatcher::~RpcDispatcher()
+{
+
+}
+
+
+bool RpcDispatcher::Register(uint32 code, RpcHandler* handler)
+{
+   jassert(nullptr != handler);
+   if (nullptr != this->Find(code))
+   {
+      // two handlers for the same code is a programming error.
+      jassertfalse;
+      delete handler;
+      return false;
+   }
+
+   fHandlers.add(handler);
+   // keep the table at most half full so that probe runs stay short.
+   if (2 * fHandlers.size() > static_cast<int>(fMask + 1))
+   {
+      this->Grow();
+   }
+   this->Insert(code, handler);
+   return true;
+}
+
+
+void RpcDispatcher::Insert(uint32 code, RpcHandler* handler)
+{
+   uint32 i = this->Hash(code);
+   while (nullptr != fSlots[i].fHandler)
+   {
+      i = (i + 1) & fMask;
+   }
+   fSlots[i].fCode = code;
+   fSlots[i].fHandler = handler;
+}
+
+
+void RpcDispatcher::Grow()
+{
+   const uint32 oldSize = fMask + 1;
+   HeapBlock<Slot> oldSlots(oldSize);
+   memcpy(oldSlots.getData(), fSlots.getData(), oldSize * sizeof(Slot));
+
+   fSlots.calloc(2 * oldSize);
+   fMask = 2 * oldSize - 1;
+   --fShift;
+
+   for (uint32 i = 0; i < oldSize; ++i)
+   {
+      if (nullptr != oldSlots[i].fHandler)
+      {
+         this->Insert(oldSlots[i].fCode, oldSlots[i].fHandler);
+      }
+   }
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+namespace
+{
+   class NullHandler : public RpcHandler
+   {
+   public:
+      NullHandler(uint32 code, uint32 traits=kDefaultTraits)
+      :  RpcHandler(traits)
+      ,  fCode(code)
+      {
+
+      }
+
+      void Handle(RpcServerConnection*, RpcMessageReader&, RpcMessage&) override
+      {
+
+      }
+
+      uint32 fCode;
+   };
+}
+
+
+class RpcDispatcherTest : public UnitTest
+{
+public:
+   RpcDispatcherTest() : UnitTest("RpcDispatcher tests") {}
+
+   void runTest() override
+   {
+      this->beginTest("Lookup");
+      RpcDispatcher d;
+      this->expect(nullptr == d.Find(Controller::kVoidFn));
+      NullHandler* h1 = new NullHandler(Controller::kVoidFn,
+         RpcHandler::kIdempotent | RpcHandler::kConcurrent);
+      this->expect(d.Register(Controller::kVoidFn, h1));
+      this->expect(h1 == d.Find(Controller::kVoidFn));
+      this->expect(nullptr == d.Find(Controller::kIntFn));
+      this->expect(h1->HasTrait(RpcHandler::kConcurrent));
+      this->expect(!h1->HasTrait(RpcHandler::kNoResponse));
+
+      this->beginTest("Many methods");
+      // a realistic spread of codes: runs of consecutive values in a few
+      // widely separated ranges.
+      const uint32 bases[] = { 100, 1000, 10000, 20000, 30000, 0x10000, 0xFFFF0000 };
+      Array<NullHandler*> handlers;
+      for (int b = 0; b < 7; ++b)
+      {
+         for (uint32 i = 0; i < 150; ++i)
+         {
+            NullHandler* h = new NullHandler(bases[b] + i);
+            handlers.add(h);
+            this->expect(d.Register(h->fCode, h));
+         }
+      }
+      this->expect(1 + 7 * 150 == d.GetNumHandlers());
+      bool allFound = true;
+      for (int i = 0; i < handlers.size(); ++i)
+      {
+         allFound = allFound && (handlers[i] == d.Find(handlers[i]->fCode));
+      }
+      this->expect(allFound);
+      this->expect(h1 == d.Find(Controller::kVoidFn));
+      this->expect(nullptr == d.Find(99));
+      this->expect(nullptr == d.Find(250));
+      this->expect(nullptr == d.Find(0));
+
+      this->beginTest("Typed methods");
+      struct Doubler
+      {
+         int Double(int val) { return 2 * val; }
+      };
+      Doubler doubler;
+      RpcDispatcher d2;
+      this->expect(d2.Register<Controller::IntFnMethod>(&doubler, &Doubler::Double,
+         RpcHandler::kIdempotent));
+      RpcHandler* h = d2.Find(Controller::kIntFn);
+      this->expect(nullptr != h);
+      this->expect(h->HasTrait(RpcHandler::kIdempotent));
+
+      RpcMessage call(Controller::kIntFn, 7, RpcMessage::kSupportedOptions);
+      call.AppendInt(21);
+      MemoryBlock callData(call.GetMemoryBlock());
+      RpcMessageReader reader(callData, RpcMessage::kSupportedOptions);
+      RpcMessage response(Controller::kIntFn, 7, RpcMessage::kSupportedOptions);
+      // the method handler doesn't use the connection.
+      h->Handle(nullptr, reader, response);
+      MemoryBlock responseData(response.GetMemoryBlock());
+      RpcMessageReader result(responseData, RpcMessage::kSupportedOptions);
+      this->expect(42 == result.GetInt());
+
+      RpcMessage badCall(Controller::kIntFn, 8, RpcMessage::kSupportedOptions);
+      MemoryBlock badCallData(badCall.GetMemoryBlock());
+      RpcMessageReader badReader(badCallData, RpcMessage::kSupportedOptions);
+      uint32 exceptionCode = 0;
+      try
+      {
+         h->Handle(nullptr, badReader, response);
+      }
+      catch (const RpcException& e)
+      {
+         exceptionCode = e.GetCode();
+      }
+      this->expect(Controller::kParameterError == exceptionCode);
+   }
+};
+
+static RpcDispatcherTest dispatcherTest;
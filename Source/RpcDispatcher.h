@@ -0,0 +1,244 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCDISPATCHER_H_INCLUDED
+#define RPCDISPATCHER_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include "Controller.h"
+#include "RpcException.h"
+#include "RpcMessage.h"
+#include "RpcMessageReader.h"
+
+class RpcServerConnection;
+
+
+/**
+ * @class RpcHandler
+ *
+ * Abstract base class for the object that handles one message code on the
+ * server side.
+ */
+class RpcHandler
+{
+public:
+   /**
+    * Things that the server can rely on when scheduling a handler. These are
+    * bit flags; combine them with `|`.
+    */
+   enum Traits
+   {
+      kDefaultTraits = 0x00,
+
+      /**
+       * The server doesn't send a response when Handle() returns. Either the
+       * call is one-way, or the handler sends its own response(s) through
+       * the connection.
+       */
+      kNoResponse    = 0x01,
+
+      /**
+       * Making the same call twice has the same effect as making it once, so
+       * it's safe to retry.
+       */
+      kIdempotent    = 0x02,
+
+      /**
+       * The handler is thread-safe and doesn't depend on the order of calls,
+       * so it may run at the same time as other calls from the same client.
+       * The server runs these calls on its workers and sends each response 
+       * as soon as it's ready, so they can finish out of order; calls to 
+       * handlers without this trait still run one at a time, in the order 
+       * they arrived. A connection isn't deleted until its concurrent calls
+       * have finished, so these handlers mustn't wait for the message 
+       * thread.
+       */
+      kConcurrent    = 0x04,
+
+      /**
+       * Handling a call may wait for other threads (as a batch waits for 
+       * its concurrent calls), so it mustn't run on the I/O thread that 
+       * read it, where it would hold up every connection on that thread. 
+       * The server runs these calls on its workers instead, still one at 
+       * a time and in order with the connection's other calls.
+       */
+      kBlocking      = 0x08
+   };
+
+   RpcHandler(uint32 traits=kDefaultTraits) : fTraits(traits) {}
+
+   virtual ~RpcHandler() {}
+
+   uint32 GetTraits() const { return fTraits; }
+
+   bool HasTrait(Traits trait) const { return 0 != (fTraits & trait); }
+
+   /**
+    * Handle a call from a client.
+    * @param connection The connection the call arrived on.
+    * @param call       Reader positioned at the call's first parameter.
+    * @param response   Response message, with the code and sequence already
+    *                   set. Unless the handler has the kNoResponse trait, the
+    *                   server sends this when we return.
+    * @throws RpcException to send an exception back to the client instead.
+    */
+   virtual void Handle(RpcServerConnection* connection, RpcMessageReader& call,
+      RpcMessage& response) = 0;
+
+   /**
+    * Handle a call that arrived in a Controller::kBatch message, or a 
+    * one-way call (see RpcMessage::kOneWayCalls). The response always goes 
+    * back in the batch's response, or nowhere, so a kNoResponse handler 
+    * that sends its own response must fill in `response` here instead. By 
+    * default, calls Handle().
+    */
+   virtual void HandleBatched(RpcServerConnection* connection,
+      RpcMessageReader& call, RpcMessage& response)
+   {
+      this->Handle(connection, call, response);
+   }
+
+private:
+   uint32 fTraits;
+};
+
+
+/**
+ * @class RpcMethodHandler
+ *
+ * Handles an RpcMethod by calling a member function of `Object`.
+ */
+template <typename Method, typename Object, typename Fn>
+class RpcMethodHandler : public RpcHandler
+{
+public:
+   RpcMethodHandler(Object* object, Fn fn, uint32 traits)
+   :  RpcHandler(traits)
+   ,  fObject(object)
+   ,  fFn(fn)
+   {
+
+   }
+
+   void Handle(RpcServerConnection*, RpcMessageReader& call,
+      RpcMessage& response) override;
+
+private:
+   // raw pointer; we don't own the object.
+   Object* fObject;
+   Fn      fFn;
+};
+
+
+/**
+ * @class RpcDispatcher
+ *
+ * Maps message codes to the RpcHandler objects that implement them, using an
+ * open-addressed hash table so that finding a handler takes the same time
+ * however many methods are registered.
+ *
+ * Handlers are registered when the server starts up, before it accepts any
+ * connections; after that, the table is only read (from any number of
+ * connection threads at once) and needs no locking.
+ */
+class RpcDispatcher
+{
+public:
+   RpcDispatcher();
+
+   ~RpcDispatcher();
+
+   /**
+    * Add a handler for a message code. The dispatcher takes ownership of the
+    * handler. Not thread-safe; only call this before the server starts.
+    * @return false (and delete the handler) if the code already has one.
+    */
+   bool Register(uint32 code, RpcHandler* handler);
+
+   /**
+    * Register the member function `fn` of `object` as the implementation of
+    * the RpcMethod `Method` (see Controller::IntFnMethod, etc.)
+    */
+   template <typename Method, typename Object, typename Fn>
+   bool Register(Object* object, Fn fn,
+      uint32 traits=RpcHandler::kDefaultTraits)
+   {
+      return this->Register(Method::kCode,
+         new RpcMethodHandler<Method, Object, Fn>(object, fn, traits));
+   }
+
+   /**
+    * @return the handler for `code`, or nullptr if there isn't one.
+    */
+   RpcHandler* Find(uint32 code) const
+   {
+      for (uint32 i = this->Hash(code); ; i = (i + 1) & fMask)
+      {
+         const Slot& slot = fSlots[i];
+         if (code == slot.fCode || nullptr == slot.fHandler)
+         {
+            return slot.fHandler;
+         }
+      }
+   }
+
+   int GetNumHandlers() const { return fHandlers.size(); }
+
+private:
+   struct Slot
+   {
+      uint32      fCode;
+      RpcHandler* fHandler;
+   };
+
+   /**
+    * Fibonacci hashing: the top bits of the code times 2^32 / phi. Message
+    * codes come in runs of consecutive values, which this spreads evenly
+    * over the table.
+    */
+   uint32 Hash(uint32 code) const
+   {
+      return static_cast<uint32>(code * 2654435769u) >> fShift;
+   }
+
+   /**
+    * Put a handler into the first empty slot for its code.
+    */
+   void Insert(uint32 code, RpcHandler* handler);
+
+   /**
+    * Double the size of the table.
+    */
+   void Grow();
+
+private:
+   enum { kInitialSize = 64 };
+
+   HeapBlock<Slot>         fSlots;
+   uint32                  fMask;
+   /**
+    * 32 - log2(table size)
+    */
+   int                     fShift;
+   OwnedArray<RpcHandler>  fHandlers;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcDispatcher)
+};
+
+
+template <typename Method, typename Object, typename Fn>
+void RpcMethodHandler<Method, Object, Fn>::Handle(RpcServerConnection*,
+   RpcMessageReader& call, RpcMessage& response)
+{
+   if (!Method::Invoke(*fObject, fFn, call, response))
+   {
+      throw RpcException(Controller::kParameterError);
+   }
+}
+
+
+#endif  // RPCDISPATCHER_H_INCLUDED
@@ -0,0 +1,1987 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcEventLoop.h"
+
+#include "RpcConnection.h"
+#include "RpcUring.h"
+
+#if JUCE_LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+
+#if JUCE_LINUX
+
+namespace
+{
+   /**
+    * The epoll data (or io_uring user data) of the descriptors that each
+    * thread waits on that aren't channels. Channel pointers are never any
+    * of these, and are aligned, so the io_uring backend tells a channel's
+    * wait to write from its receive with kWritableBit.
+    */
+   enum
+   {
+      kWakeTag = 0,
+      kListenTag = 1,
+      kFlushTag = 2,
+      kWritableBit = 1
+   };
+
+   /**
+    * The options that StreamingSocket gives the sockets it connects, so
+    * that ours behave the same. (TCP_NODELAY doesn't apply to Unix domain
+    * sockets, which just refuse it.)
+    */
+   void SetSocketOptions(int socket)
+   {
+      int size = 65536;
+      ::setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+      ::setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+      int noDelay = 1;
+      ::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+   }
+
+   /**
+    * Wait for a non-blocking connect() that's in progress.
+    * @return true if it succeeded.
+    */
+   bool WaitForConnect(int socket, int msTimeout)
+   {
+      if (EINPROGRESS != errno)
+      {
+         return false;
+      }
+      struct pollfd poll;
+      zerostruct(poll);
+      poll.fd = socket;
+      poll.events = POLLOUT;
+      if (1 != ::poll(&poll, 1, msTimeout))
+      {
+         return false;
+      }
+      int error = 0;
+      socklen_t size = sizeof(error);
+      return 0 == ::getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &size) && 0 == error;
+   }
+
+   /**
+    * Fill in the address of the Unix domain socket at `path`.
+    * @return false if the path is too long for one.
+    */
+   bool MakeLocalAddress(const String& path, struct sockaddr_un& address)
+   {
+      zerostruct(address);
+      address.sun_family = AF_UNIX;
+      const size_t length = path.getNumBytesAsUTF8();
+      if (0 == length || length >= sizeof(address.sun_path))
+      {
+         return false;
+      }
+      memcpy(address.sun_path, path.toRawUTF8(), length);
+      return true;
+   }
+
+   /**
+    * @return true if there's a socket at `address` that nobody's listening
+    *         on, which a server that's gone has left behind.
+    */
+   bool IsStaleSocket(const struct sockaddr_un& address)
+   {
+      struct stat info;
+      if (0 != ::lstat(address.sun_path, &info) || !S_ISSOCK(info.st_mode))
+      {
+         return false;
+      }
+      const int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (probe < 0)
+      {
+         return false;
+      }
+      const bool refused = (0 != ::connect(probe, 
+         reinterpret_cast<const struct sockaddr*>(&address), sizeof(address)) &&
+         ECONNREFUSED == errno);
+      ::close(probe);
+      return refused;
+   }
+}
+
+
+/**
+ * One connection's socket, the frame that's being read from it, and
+ * whether its outbox is waiting to be written.
+ */
+class RpcEventLoop::Channel : public RpcOutbox::Writer
+{
+public:
+   Channel(RpcConnection* connection, int socket, IoThread* thread)
+   :  fConnection(connection)
+   ,  fSocket(socket)
+   ,  fThread(thread)
+   ,  fIndex(-1)
+   ,  fIsReady(false)
+   ,  fWaitingToWrite(false)
+   ,  fReceiving(false)
+   ,  fHeaderBytes(0)
+   ,  fBodyBytes(0)
+   {
+
+   }
+
+   /**
+    * Puts us on our thread's list of channels to write.
+    */
+   void OutboxReady() override;
+
+   /**
+    * Write what the connection has queued.
+    */
+   RpcOutbox::Result Write()
+   {
+      return fOutbox->Flush();
+   }
+
+   /**
+    * Read what's arrived in chunks of up to `chunkSize` bytes, passing each
+    * complete frame to the connection.
+    * @return false if the socket has closed, or sent something that isn't
+    *         a frame.
+    */
+   bool Read(char* chunk, size_t chunkSize)
+   {
+      for (int reads = 0; reads < RpcEventLoop::kMaxReadsPerWakeup; ++reads)
+      {
+         ssize_t bytes;
+         if (this->IsGathering() && fBody.getSize() - fBodyBytes >= chunkSize)
+         {
+            // the rest of a large frame goes straight into its block.
+            bytes = ::recv(fSocket, static_cast<char*>(fBody.getData()) + fBodyBytes,
+               fBody.getSize() - fBodyBytes, MSG_DONTWAIT);
+            if (bytes > 0)
+            {
+               fBodyBytes += static_cast<size_t>(bytes);
+               this->FinishGathering();
+            }
+         }
+         else
+         {
+            bytes = ::recv(fSocket, chunk, chunkSize, MSG_DONTWAIT);
+            if (bytes > 0 && !this->Consume(chunk, static_cast<size_t>(bytes)))
+            {
+               return false;
+            }
+         }
+         if (bytes <= 0)
+         {
+            return this->IsWaiting(bytes);
+         }
+         if (static_cast<size_t>(bytes) < chunkSize)
+         {
+            // that's everything for now; epoll will tell us about any more.
+            return true;
+         }
+      }
+      return true;
+   }
+
+   /**
+    * Parse a chunk of data that's been received for us. Each frame that's 
+    * all there goes to the connection straight from the chunk; we only 
+    * copy the ones that the chunk splits.
+    * @return false if it isn't a frame.
+    */
+   bool Consume(const char* data, size_t size)
+   {
+      while (size > 0)
+      {
+         if (0 == fHeaderBytes && size >= sizeof(fHeader))
+         {
+            uint32 header[2];
+            memcpy(header, data, sizeof(header));
+            const int64 frameSize = FrameSize(header);
+            if (frameSize < 0)
+            {
+               return false;
+            }
+            if (static_cast<size_t>(frameSize) <= size - sizeof(header))
+            {
+               // InterprocessConnection ignores empty frames too.
+               if (frameSize > 0)
+               {
+                  fConnection->FrameReceived(data + sizeof(header), 
+                     static_cast<size_t>(frameSize));
+               }
+               data += sizeof(header) + frameSize;
+               size -= sizeof(header) + static_cast<size_t>(frameSize);
+               continue;
+            }
+         }
+
+         size_t bytes;
+         if (fHeaderBytes < sizeof(fHeader))
+         {
+            bytes = jmin(size, sizeof(fHeader) - fHeaderBytes);
+            memcpy(reinterpret_cast<char*>(fHeader) + fHeaderBytes, data, bytes);
+            fHeaderBytes += bytes;
+            if (fHeaderBytes == sizeof(fHeader) && !this->StartGathering())
+            {
+               return false;
+            }
+         }
+         else
+         {
+            bytes = jmin(size, fBody.getSize() - fBodyBytes);
+            memcpy(static_cast<char*>(fBody.getData()) + fBodyBytes, data, bytes);
+            fBodyBytes += bytes;
+            this->FinishGathering();
+         }
+         data += bytes;
+         size -= bytes;
+      }
+      return true;
+   }
+
+   /**
+    * Forget the socket, and tell the connection that it's gone (which
+    * closes the socket and its outbox).
+    */
+   void Close()
+   {
+      fConnection->connectionLost();
+      fSocket = -1;
+   }
+
+   bool IsClosed() const { return fSocket < 0; }
+
+private:
+   /**
+    * @return the size of the message that follows `header`, or -1 if it 
+    *         isn't one of our frames.
+    */
+   static int64 FrameSize(const uint32* header)
+   {
+      if (RpcConnection::kMagic != ByteOrder::swapIfBigEndian(header[0]))
+      {
+         DBG("ERROR: Received a frame with the wrong magic number.");
+         return -1;
+      }
+      const uint32 size = ByteOrder::swapIfBigEndian(header[1]);
+      if (size > static_cast<uint32>(std::numeric_limits<int>::max()))
+      {
+         return -1;
+      }
+      return size;
+   }
+
+   /**
+    * @return true if we're in the middle of a frame's body.
+    */
+   bool IsGathering() const { return fHeaderBytes == sizeof(fHeader); }
+
+   /**
+    * Check the header that we've just finished gathering, and get ready 
+    * for the body that follows it.
+    * @return false if it isn't one of our frames.
+    */
+   bool StartGathering()
+   {
+      const int64 size = FrameSize(fHeader);
+      if (size < 0)
+      {
+         return false;
+      }
+      if (0 == size)
+      {
+         fHeaderBytes = 0;
+         return true;
+      }
+      fBody.setSize(static_cast<size_t>(size));
+      fBodyBytes = 0;
+      return true;
+   }
+
+   /**
+    * Pass on the frame that we've been gathering, if it's all arrived.
+    */
+   void FinishGathering()
+   {
+      if (fBodyBytes == fBody.getSize())
+      {
+         fHeaderBytes = 0;
+         fConnection->FrameReceived(fBody.getData(), fBody.getSize());
+         if (fBody.getSize() > kMaxKeptBody)
+         {
+            // don't hold on to a large block for the whole connection.
+            fBody.reset();
+         }
+      }
+   }
+
+   /**
+    * @return true if a read that returned `bytes` just ran out of data,
+    *         rather than finding that the socket had closed.
+    */
+   static bool IsWaiting(ssize_t bytes)
+   {
+      return (bytes < 0) && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno);
+   }
+
+public:
+   RpcConnection* fConnection;
+   int fSocket;
+   IoThread* fThread;
+
+   /**
+    * The connection's outbox for our socket. (If the connection is 
+    * attached to another socket later, that one has an outbox of its own.)
+    */
+   RpcOutbox::Ptr fOutbox;
+
+   /**
+    * Where we are in whichever of our I/O thread's arrays holds us.
+    */
+   int fIndex;
+
+   /**
+    * True while we're on our thread's list of channels to write, which is
+    * protected by its lock.
+    */
+   bool fIsReady;
+
+   /**
+    * True while we're waiting for the socket to take more of our outbox.
+    */
+   bool fWaitingToWrite;
+
+   /**
+    * True while the io_uring backend has a receive outstanding for us.
+    */
+   bool fReceiving;
+
+private:
+   enum
+   {
+      kMaxKeptBody = 4096
+   };
+
+   /**
+    * The frame that we're gathering, when one is split between chunks.
+    */
+   uint32 fHeader[2];
+   size_t fHeaderBytes;
+
+   MemoryBlock fBody;
+   size_t fBodyBytes;
+
+   JUCE_DECLARE_NON_COPYABLE(Channel)
+};
+
+
+/**
+ * One of our I/O threads: the channels that it reads from, and the queue
+ * that other threads hand it new ones through. How it waits for them is
+ * up to the backend.
+ */
+class RpcEventLoop::IoThread : public Thread
+{
+public:
+   IoThread(RpcEventLoop& owner, int index)
+   :  Thread("RpcIo" + String(index))
+   ,  fOwner(owner)
+   ,  fWake(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+   ,  fFlushTimer(::timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK))
+   ,  fListener(-1)
+   ,  fTimerArmed(false)
+   ,  fFlushDue(false)
+   {
+
+   }
+
+   virtual ~IoThread()
+   {
+      if (fWake >= 0)
+      {
+         ::close(fWake);
+      }
+      if (fFlushTimer >= 0)
+      {
+         ::close(fFlushTimer);
+      }
+   }
+
+   virtual bool IsValid() const { return fWake >= 0 && fFlushTimer >= 0; }
+
+   /**
+    * Start the thread.
+    * @return false if it couldn't set itself up, in which case it's already
+    *         finishing.
+    */
+   virtual bool Start()
+   {
+      this->startThread();
+      return true;
+   }
+
+   /**
+    * Start accepting connections on a listening socket.
+    */
+   virtual bool AddListener(int socket) = 0;
+
+   /**
+    * Take ownership of a channel; it's added to our set on our thread.
+    * @return false if we've stopped.
+    */
+   bool Add(Channel* channel)
+   {
+      {
+         const ScopedLock lock(fLock);
+         if (this->threadShouldExit())
+         {
+            return false;
+         }
+         fIncoming.add(channel);
+      }
+      this->Wake();
+      return true;
+   }
+
+   void Wake()
+   {
+      const uint64 one = 1;
+      ignoreUnused(::write(fWake, &one, sizeof(one)));
+   }
+
+   /**
+    * Write a channel's outbox at the end of our current pass (or the one
+    * that this wakes us for), or once the write latency is up. Any thread.
+    */
+   void Ready(Channel* channel)
+   {
+      bool wake;
+      {
+         const ScopedLock lock(fLock);
+         if (channel->fIsReady)
+         {
+            return;
+         }
+         channel->fIsReady = true;
+         wake = (0 == fReady.size());
+         fReady.add(channel);
+      }
+      // if there were others, we've already been woken.
+      if (wake && Thread::getCurrentThreadId() != this->getThreadId())
+      {
+         this->Wake();
+      }
+   }
+
+   void Stop()
+   {
+      {
+         const ScopedLock lock(fLock);
+         this->signalThreadShouldExit();
+      }
+      this->Wake();
+      this->waitForThreadToExit(-1);
+   }
+
+protected:
+   /**
+    * Start reading from the channels that Add() has given us.
+    */
+   virtual void AddIncoming() = 0;
+
+   /**
+    * Write a channel's outbox, and wait for its socket to become writable
+    * if it's full.
+    * @return false if that failed, and we've dropped the channel.
+    */
+   virtual bool Write(Channel* channel) = 0;
+
+   /**
+    * Called at the end of each pass over what's happened. Writes the
+    * channels that have something to write, unless we're still waiting 
+    * for more to join them (see SetWriteLatency()).
+    */
+   void FlushReady()
+   {
+      Array<Channel*> ready;
+      while (!this->threadShouldExit())
+      {
+         {
+            const ScopedLock lock(fLock);
+            if (0 == fReady.size())
+            {
+               fFlushDue = false;
+               return;
+            }
+            const int latency = fOwner.GetWriteLatency();
+            if (latency > 0 && !fFlushDue && (fTimerArmed || this->ArmTimer(latency)))
+            {
+               return;
+            }
+            if (0 == fIncoming.size())
+            {
+               ready.swapWith(fReady);
+               for (int i = 0; i < ready.size(); ++i)
+               {
+                  ready.getUnchecked(i)->fIsReady = false;
+               }
+               break;
+            }
+         }
+         // a channel that's written to as soon as it's added may not be 
+         // in our set yet.
+         this->AddIncoming();
+      }
+
+      fFlushDue = false;
+      for (int i = 0; i < ready.size(); ++i)
+      {
+         this->Write(ready.getUnchecked(i));
+      }
+   }
+
+   /**
+    * Called when fFlushTimer goes off.
+    */
+   void TimerFired()
+   {
+      uint64 count;
+      ignoreUnused(::read(fFlushTimer, &count, sizeof(count)));
+      fTimerArmed = false;
+      fFlushDue = true;
+   }
+
+   /**
+    * Reset fWake, and take the channels that Add() has given us.
+    */
+   void TakeIncoming(Array<Channel*>& incoming)
+   {
+      uint64 count;
+      ignoreUnused(::read(fWake, &count, sizeof(count)));
+
+      const ScopedLock lock(fLock);
+      incoming.swapWith(fIncoming);
+   }
+
+   /**
+    * Set up a connection for a socket that we've accepted, and hand it out.
+    */
+   void Accepted(int socket)
+   {
+      SetSocketOptions(socket);
+      RpcConnection* connection = fOwner.fFactory();
+      if (nullptr == connection)
+      {
+         ::close(socket);
+         return;
+      }
+      fOwner.Add(connection, socket);
+   }
+
+   static void Insert(Array<Channel*>& channels, Channel* channel)
+   {
+      channel->fIndex = channels.size();
+      channels.add(channel);
+   }
+
+   static void Erase(Array<Channel*>& channels, Channel* channel)
+   {
+      Channel* last = channels.getLast();
+      last->fIndex = channel->fIndex;
+      channels.set(channel->fIndex, last);
+      channels.removeLast();
+   }
+
+   /**
+    * Close a channel that isn't (or is no longer) in fChannels, but don't
+    * delete it yet.
+    */
+   void Lose(Channel* channel)
+   {
+      --fOwner.fNumConnections;
+      // once its outbox is closed, nothing puts it back on fReady.
+      channel->Close();
+      const ScopedLock lock(fLock);
+      if (channel->fIsReady)
+      {
+         fReady.removeFirstMatchingValue(channel);
+         channel->fIsReady = false;
+      }
+   }
+
+   /**
+    * Close and delete a channel that isn't (or is no longer) in fChannels.
+    */
+   void Drop(Channel* channel)
+   {
+      this->Lose(channel);
+      delete channel;
+   }
+
+   /**
+    * Once we've stopped, drop every channel that we have.
+    */
+   void DropAll()
+   {
+      while (fChannels.size() > 0)
+      {
+         Channel* channel = fChannels.getLast();
+         fChannels.removeLast();
+         // send what we can of what's been queued, without waiting.
+         channel->Write();
+         this->Drop(channel);
+      }
+      // Add() turns channels away from now on, so these are the last. They
+      // lose their connections after we've let go of the lock, which the 
+      // threads that send to other connections may be waiting for (see 
+      // Ready()).
+      Array<Channel*> incoming;
+      {
+         const ScopedLock lock(fLock);
+         incoming.swapWith(fIncoming);
+      }
+      for (int i = 0; i < incoming.size(); ++i)
+      {
+         this->Drop(incoming.getUnchecked(i));
+      }
+   }
+
+protected:
+   RpcEventLoop& fOwner;
+
+   /**
+    * An eventfd, signalled when there's something in fIncoming or fReady 
+    * (or a new listener) or it's time to stop.
+    */
+   int fWake;
+
+   /**
+    * A timerfd that goes off when the write latency is up.
+    */
+   int fFlushTimer;
+
+   int fListener;
+
+   Array<Channel*> fChannels;
+
+   CriticalSection fLock;
+   Array<Channel*> fIncoming;
+
+   /**
+    * The channels that have something to write.
+    */
+   Array<Channel*> fReady;
+
+private:
+   /**
+    * @return false if we couldn't, in which case we write right away.
+    */
+   bool ArmTimer(int microseconds)
+   {
+      struct itimerspec spec;
+      zerostruct(spec);
+      spec.it_value.tv_sec = microseconds / 1000000;
+      spec.it_value.tv_nsec = (microseconds % 1000000) * 1000;
+      fTimerArmed = (0 == ::timerfd_settime(fFlushTimer, 0, &spec, nullptr));
+      return fTimerArmed;
+   }
+
+   bool fTimerArmed;
+   bool fFlushDue;
+
+   JUCE_DECLARE_NON_COPYABLE(IoThread)
+};
+
+
+void RpcEventLoop::Channel::OutboxReady()
+{
+   if (nullptr != fThread)
+   {
+      fThread->Ready(this);
+   }
+}
+
+
+/**
+ * Waits on an epoll set, reading from the channels whose sockets are ready,
+ * and writing to the ones that were full once they've drained.
+ */
+class RpcEventLoop::EpollThread : public RpcEventLoop::IoThread
+{
+public:
+   enum
+   {
+      kMaxEvents = 256,
+      kChunkSize = 64 * 1024
+   };
+
+   EpollThread(RpcEventLoop& owner, int index)
+   :  IoThread(owner, index)
+   ,  fEpoll(::epoll_create1(EPOLL_CLOEXEC))
+   ,  fChunk(kChunkSize)
+   {
+      if (this->IsValid())
+      {
+         this->Watch(fWake, kWakeTag);
+         this->Watch(fFlushTimer, kFlushTag);
+      }
+   }
+
+   ~EpollThread()
+   {
+      if (fEpoll >= 0)
+      {
+         ::close(fEpoll);
+      }
+   }
+
+   bool IsValid() const override { return IoThread::IsValid() && fEpoll >= 0; }
+
+   bool AddListener(int socket) override
+   {
+      fListener = socket;
+      return this->Watch(socket, kListenTag);
+   }
+
+   void run() override
+   {
+      struct epoll_event events[kMaxEvents];
+      while (!this->threadShouldExit())
+      {
+         const int count = ::epoll_wait(fEpoll, events, kMaxEvents, -1);
+         for (int i = 0; i < count && !this->threadShouldExit(); ++i)
+         {
+            const uint64 tag = events[i].data.u64;
+            if (kWakeTag == tag)
+            {
+               this->AddIncoming();
+            }
+            else if (kListenTag == tag)
+            {
+               this->Accept();
+            }
+            else if (kFlushTag == tag)
+            {
+               this->TimerFired();
+            }
+            else
+            {
+               Channel* channel = static_cast<Channel*>(events[i].data.ptr);
+               if (0 != (events[i].events & EPOLLOUT) && !this->Write(channel))
+               {
+                  continue;
+               }
+               if (0 != (events[i].events & ~EPOLLOUT) && 
+                  !channel->Read(fChunk, kChunkSize))
+               {
+                  this->Remove(channel);
+               }
+            }
+         }
+         this->FlushReady();
+      }
+      this->DropAll();
+   }
+
+protected:
+   void AddIncoming() override
+   {
+      Array<Channel*> incoming;
+      this->TakeIncoming(incoming);
+      for (int i = 0; i < incoming.size(); ++i)
+      {
+         Channel* channel = incoming.getUnchecked(i);
+         if (!this->Watch(channel, false, EPOLL_CTL_ADD))
+         {
+            this->Drop(channel);
+            continue;
+         }
+         Insert(fChannels, channel);
+      }
+   }
+
+   bool Write(Channel* channel) override
+   {
+      const RpcOutbox::Result result = channel->Write();
+      if (RpcOutbox::kFailed == result)
+      {
+         this->Remove(channel);
+         return false;
+      }
+      // only ask to hear that the socket's writable while it's full.
+      const bool full = (RpcOutbox::kBlocked == result);
+      if (full != channel->fWaitingToWrite)
+      {
+         channel->fWaitingToWrite = full;
+         this->Watch(channel, full, EPOLL_CTL_MOD);
+      }
+      return true;
+   }
+
+private:
+   bool Watch(int socket, uint64 tag)
+   {
+      struct epoll_event event;
+      zerostruct(event);
+      event.events = EPOLLIN | EPOLLRDHUP;
+      event.data.u64 = tag;
+      return 0 == ::epoll_ctl(fEpoll, EPOLL_CTL_ADD, socket, &event);
+   }
+
+   bool Watch(Channel* channel, bool writable, int operation)
+   {
+      struct epoll_event event;
+      zerostruct(event);
+      event.events = EPOLLIN | EPOLLRDHUP | (writable ? static_cast<uint32>(EPOLLOUT) : 0);
+      event.data.ptr = channel;
+      return 0 == ::epoll_ctl(fEpoll, operation, channel->fSocket, &event);
+   }
+
+   void Remove(Channel* channel)
+   {
+      ::epoll_ctl(fEpoll, EPOLL_CTL_DEL, channel->fSocket, nullptr);
+      Erase(fChannels, channel);
+      this->Drop(channel);
+   }
+
+   void Accept()
+   {
+      while (!this->threadShouldExit())
+      {
+         const int socket = ::accept4(fListener, nullptr, nullptr, SOCK_CLOEXEC);
+         if (socket < 0)
+         {
+            if (EINTR == errno)
+            {
+               continue;
+            }
+            // EAGAIN once we've taken everything that's waiting.
+            return;
+         }
+         this->Accepted(socket);
+      }
+   }
+
+private:
+   int fEpoll;
+
+   /**
+    * What every channel reads into; the frames in it are handled before 
+    * the next read.
+    */
+   HeapBlock<char> fChunk;
+
+   JUCE_DECLARE_NON_COPYABLE(EpollThread)
+};
+
+
+/**
+ * Keeps a multishot receive outstanding on each channel's socket (and a
+ * multishot accept on the listener), and parses what the kernel has
+ * received into our ring's buffers, handing each buffer back once its 
+ * frames have been handled. A channel whose socket is too full to write
+ * waits with a one-shot poll. Everything that we ask for in one
+ * pass over the completions goes to the kernel in a single system call,
+ * which also waits for the next completions.
+ */
+class RpcEventLoop::UringThread : public RpcEventLoop::IoThread
+{
+public:
+   enum
+   {
+      kRingEntries = 256,
+      kNumBuffers = 128,
+      kBufferSize = 16 * 1024
+   };
+
+   UringThread(RpcEventLoop& owner, int index)
+   :  IoThread(owner, index)
+   ,  fHasBuffers(false)
+   ,  fNewListener(-1)
+   {
+
+   }
+
+   ~UringThread()
+   {
+      // the ring is closed after this, cancelling what's still outstanding;
+      // the kernel never looks at the channels behind their user data, so
+      // they're already gone.
+      for (int i = 0; i < fClosing.size(); ++i)
+      {
+         delete fClosing.getUnchecked(i);
+      }
+   }
+
+   bool Start() override
+   {
+      this->startThread();
+      fSetUp.wait();
+      return fHasBuffers;
+   }
+
+   bool AddListener(int socket) override
+   {
+      // only our thread may use the ring.
+      {
+         const ScopedLock lock(fLock);
+         fNewListener = socket;
+      }
+      this->Wake();
+      return true;
+   }
+
+   void run() override
+   {
+      // we set our ring up here rather than on the thread that constructs
+      // us, which closing the ring would interrupt (see RpcUring).
+      fRing = new RpcUring(kRingEntries);
+      fHasBuffers = fRing->IsValid() && fRing->SetUpBuffers(kNumBuffers, kBufferSize);
+      fSetUp.signal();
+      if (!fHasBuffers)
+      {
+         return;
+      }
+
+      fRing->PreparePoll(fWake, kWakeTag);
+      fRing->PreparePoll(fFlushTimer, kFlushTag);
+      while (!this->threadShouldExit() && fRing->Submit(1))
+      {
+         fRing->ForEachCompletion([this](const struct io_uring_cqe& completion)
+         {
+            this->Complete(completion);
+         });
+         this->FlushReady();
+      }
+      this->DropAll();
+   }
+
+protected:
+   void AddIncoming() override
+   {
+      if (this->threadShouldExit())
+      {
+         return;
+      }
+      int listener;
+      {
+         const ScopedLock lock(fLock);
+         listener = fNewListener;
+         fNewListener = -1;
+      }
+      if (listener >= 0)
+      {
+         fListener = listener;
+         fRing->PrepareAccept(fListener, kListenTag);
+      }
+
+      Array<Channel*> incoming;
+      this->TakeIncoming(incoming);
+      for (int i = 0; i < incoming.size(); ++i)
+      {
+         Channel* channel = incoming.getUnchecked(i);
+         Insert(fChannels, channel);
+         this->Arm(channel);
+      }
+   }
+
+   bool Write(Channel* channel) override
+   {
+      const RpcOutbox::Result result = channel->Write();
+      if (RpcOutbox::kFailed == result)
+      {
+         this->Remove(channel);
+         return false;
+      }
+      if (RpcOutbox::kBlocked == result && !channel->fWaitingToWrite)
+      {
+         channel->fWaitingToWrite = true;
+         fRing->PrepareWritable(channel->fSocket, 
+            reinterpret_cast<uint64>(channel) | kWritableBit);
+      }
+      return true;
+   }
+
+private:
+   void Complete(const struct io_uring_cqe& completion)
+   {
+      const bool more = (0 != (completion.flags & IORING_CQE_F_MORE));
+      if (kWakeTag == completion.user_data)
+      {
+         this->AddIncoming();
+         if (!more)
+         {
+            fRing->PreparePoll(fWake, kWakeTag);
+         }
+      }
+      else if (kListenTag == completion.user_data)
+      {
+         if (completion.res >= 0)
+         {
+            this->Accepted(completion.res);
+         }
+         if (!more && !this->threadShouldExit())
+         {
+            fRing->PrepareAccept(fListener, kListenTag);
+         }
+      }
+      else if (kFlushTag == completion.user_data)
+      {
+         this->TimerFired();
+         if (!more)
+         {
+            fRing->PreparePoll(fFlushTimer, kFlushTag);
+         }
+      }
+      else if (kCancelTag == completion.user_data)
+      {
+         // we only needed to know that the request itself had finished.
+      }
+      else if (0 != (completion.user_data & kWritableBit))
+      {
+         this->Writable(reinterpret_cast<Channel*>(
+            completion.user_data & ~static_cast<uint64>(kWritableBit)));
+      }
+      else
+      {
+         this->Receive(reinterpret_cast<Channel*>(completion.user_data),
+            completion, more);
+      }
+   }
+
+   void Writable(Channel* channel)
+   {
+      channel->fWaitingToWrite = false;
+      if (channel->IsClosed())
+      {
+         this->Release(channel);
+      }
+      else
+      {
+         this->Write(channel);
+      }
+   }
+
+   void Receive(Channel* channel, const struct io_uring_cqe& completion, bool more)
+   {
+      if (!more)
+      {
+         channel->fReceiving = false;
+      }
+      // running out of buffers ends the receive, but the data is still
+      // waiting in the socket for the next one.
+      bool open = (completion.res > 0) || (-ENOBUFS == completion.res);
+      if (completion.flags & IORING_CQE_F_BUFFER)
+      {
+         const uint16 id = static_cast<uint16>(completion.flags >> IORING_CQE_BUFFER_SHIFT);
+         if (open && !channel->IsClosed())
+         {
+            open = channel->Consume(fRing->GetBuffer(id),
+               static_cast<size_t>(completion.res));
+         }
+         fRing->RecycleBuffer(id);
+      }
+
+      if (channel->IsClosed())
+      {
+         this->Release(channel);
+      }
+      else if (!open)
+      {
+         this->Remove(channel);
+      }
+      else if (!more)
+      {
+         this->Arm(channel);
+      }
+   }
+
+   void Arm(Channel* channel)
+   {
+      channel->fReceiving = true;
+      fRing->PrepareReceive(channel->fSocket, reinterpret_cast<uint64>(channel));
+   }
+
+   /**
+    * Lose a channel, and cancel what we've asked the kernel to do with it.
+    */
+   void Remove(Channel* channel)
+   {
+      Erase(fChannels, channel);
+      this->Lose(channel);
+      if (channel->fReceiving)
+      {
+         fRing->PrepareCancel(reinterpret_cast<uint64>(channel), kCancelTag);
+      }
+      if (channel->fWaitingToWrite)
+      {
+         fRing->PrepareCancel(reinterpret_cast<uint64>(channel) | kWritableBit, 
+            kCancelTag);
+      }
+      if (channel->fReceiving || channel->fWaitingToWrite)
+      {
+         Insert(fClosing, channel);
+      }
+      else
+      {
+         delete channel;
+      }
+   }
+
+   /**
+    * Delete a lost channel once the last of its requests has finished.
+    */
+   void Release(Channel* channel)
+   {
+      if (!channel->fReceiving && !channel->fWaitingToWrite)
+      {
+         Erase(fClosing, channel);
+         delete channel;
+      }
+   }
+
+private:
+   enum
+   {
+      /**
+       * The user data of our cancellations, which we don't need to hear
+       * about.
+       */
+      kCancelTag = 3
+   };
+
+   /**
+    * Created on our thread, in run().
+    */
+   ScopedPointer<RpcUring> fRing;
+   WaitableEvent fSetUp;
+   bool fHasBuffers;
+
+   /**
+    * A listener that AddListener() has given us, until our thread starts
+    * accepting on it.
+    */
+   int fNewListener;
+
+   /**
+    * Channels that have been lost, whose receives haven't finished yet.
+    */
+   Array<Channel*> fClosing;
+
+   JUCE_DECLARE_NON_COPYABLE(UringThread)
+};
+
+
+RpcEventLoop::RpcEventLoop(int numThreads, Backend backend)
+:  fBackend(backend)
+,  fLocalListener(-1)
+{
+   if (!IsAvailable(backend))
+   {
+      return;
+   }
+   for (int i = 0; i < jmax(1, numThreads); ++i)
+   {
+      IoThread* thread = (kIoUring == backend) ? 
+         static_cast<IoThread*>(new UringThread(*this, i)) : 
+         static_cast<IoThread*>(new EpollThread(*this, i));
+      if (!thread->IsValid() || !thread->Start())
+      {
+         thread->waitForThreadToExit(-1);
+         delete thread;
+         break;
+      }
+      fThreads.add(thread);
+   }
+}
+
+
+RpcEventLoop::~RpcEventLoop()
+{
+   this->Stop();
+}
+
+
+bool RpcEventLoop::IsAvailable(Backend backend)
+{
+   return (kIoUring != backend) || RpcUring::IsAvailable();
+}
+
+
+bool RpcEventLoop::Listen(int portNumber, const Factory& factory)
+{
+   if (0 == fThreads.size() || nullptr != fListener || fLocalListener >= 0)
+   {
+      return false;
+   }
+   ScopedPointer<StreamingSocket> listener(new StreamingSocket());
+   if (!listener->createListener(portNumber))
+   {
+      return false;
+   }
+   const int socket = listener->getRawSocketHandle();
+   ::fcntl(socket, F_SETFL, ::fcntl(socket, F_GETFL) | O_NONBLOCK);
+
+   fFactory = factory;
+   if (!fThreads.getFirst()->AddListener(socket))
+   {
+      return false;
+   }
+   fListener = listener.release();
+   return true;
+}
+
+
+bool RpcEventLoop::ListenLocal(const String& name, const Factory& factory)
+{
+   if (0 == fThreads.size() || nullptr != fListener || fLocalListener >= 0)
+   {
+      return false;
+   }
+   const String path(GetLocalPath(name));
+   struct sockaddr_un address;
+   if (!MakeLocalAddress(path, address))
+   {
+      return false;
+   }
+   const int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+   if (socket < 0)
+   {
+      return false;
+   }
+   const struct sockaddr* addr = reinterpret_cast<const struct sockaddr*>(&address);
+   bool bound = (0 == ::bind(socket, addr, sizeof(address)));
+   if (!bound && EADDRINUSE == errno && IsStaleSocket(address))
+   {
+      ::unlink(address.sun_path);
+      bound = (0 == ::bind(socket, addr, sizeof(address)));
+   }
+   if (!bound)
+   {
+      ::close(socket);
+      return false;
+   }
+
+   fFactory = factory;
+   if (0 != ::listen(socket, SOMAXCONN) || !fThreads.getFirst()->AddListener(socket))
+   {
+      ::close(socket);
+      ::unlink(address.sun_path);
+      return false;
+   }
+   fLocalListener = socket;
+   fLocalPath = path;
+   return true;
+}
+
+
+bool RpcEventLoop::Connect(RpcConnection* connection, const String& hostName, 
+   int portNumber, int msTimeout)
+{
+   // (StreamingSocket would shut the socket down when it went, so we 
+   // connect it ourselves.)
+   struct addrinfo hints;
+   zerostruct(hints);
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   struct addrinfo* addresses = nullptr;
+   if (0 != ::getaddrinfo(hostName.toRawUTF8(), String(portNumber).toRawUTF8(), 
+      &hints, &addresses))
+   {
+      return false;
+   }
+
+   int socket = -1;
+   for (struct addrinfo* address = addresses; nullptr != address && socket < 0;
+      address = address->ai_next)
+   {
+      socket = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC | 
+         SOCK_NONBLOCK, address->ai_protocol);
+      if (socket < 0)
+      {
+         continue;
+      }
+      if (0 != ::connect(socket, address->ai_addr, address->ai_addrlen) && 
+         !WaitForConnect(socket, msTimeout))
+      {
+         ::close(socket);
+         socket = -1;
+      }
+   }
+   ::freeaddrinfo(addresses);
+   if (socket < 0)
+   {
+      return false;
+   }
+   ::fcntl(socket, F_SETFL, ::fcntl(socket, F_GETFL) & ~O_NONBLOCK);
+   SetSocketOptions(socket);
+   return this->Add(connection, socket);
+}
+
+
+bool RpcEventLoop::ConnectLocal(RpcConnection* connection, const String& name,
+   int msTimeout)
+{
+   struct sockaddr_un address;
+   if (!MakeLocalAddress(GetLocalPath(name), address))
+   {
+      return false;
+   }
+   const int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (socket < 0)
+   {
+      return false;
+   }
+   // connecting a Unix domain socket only waits while the server's backlog 
+   // is full, for up to the socket's send timeout.
+   struct timeval timeout;
+   zerostruct(timeout);
+   timeout.tv_sec = jmax(0, msTimeout) / 1000;
+   timeout.tv_usec = (jmax(0, msTimeout) % 1000) * 1000;
+   ::setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+   if (0 != ::connect(socket, reinterpret_cast<const struct sockaddr*>(&address), 
+      sizeof(address)))
+   {
+      ::close(socket);
+      return false;
+   }
+   zerostruct(timeout);
+   ::setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+   SetSocketOptions(socket);
+   return this->Add(connection, socket);
+}
+
+
+bool RpcEventLoop::Add(RpcConnection* connection, int socket)
+{
+   IoThread* thread = (fThreads.size() > 0) ? fThreads.getUnchecked(
+      (++fNextThread & 0x7fffffff) % fThreads.size()) : nullptr;
+   Channel* channel = new Channel(connection, socket, thread);
+   channel->fOutbox = new RpcOutbox(socket, channel);
+   connection->AttachSocket(socket, channel->fOutbox);
+   ++fNumConnections;
+   if (nullptr == thread || !thread->Add(channel))
+   {
+      --fNumConnections;
+      channel->Close();
+      delete channel;
+      return false;
+   }
+   return true;
+}
+
+
+void RpcEventLoop::Stop()
+{
+   for (int i = 0; i < fThreads.size(); ++i)
+   {
+      fThreads.getUnchecked(i)->Stop();
+   }
+   fThreads.clear();
+   fListener = nullptr;
+   if (fLocalListener >= 0)
+   {
+      ::close(fLocalListener);
+      ::unlink(fLocalPath.toRawUTF8());
+      fLocalListener = -1;
+   }
+}
+
+
+int RpcEventLoop::GetNumThreads() const
+{
+   return fThreads.size();
+}
+
+#else
+
+class RpcEventLoop::Channel {};
+class RpcEventLoop::IoThread {};
+
+
+RpcEventLoop::RpcEventLoop(int, Backend backend)
+:  fBackend(backend)
+,  fLocalListener(-1)
+{
+
+}
+
+
+RpcEventLoop::~RpcEventLoop()
+{
+
+}
+
+
+bool RpcEventLoop::IsAvailable(Backend)
+{
+   return false;
+}
+
+
+bool RpcEventLoop::Listen(int, const Factory&)
+{
+   return false;
+}
+
+
+bool RpcEventLoop::ListenLocal(const String&, const Factory&)
+{
+   return false;
+}
+
+
+bool RpcEventLoop::Connect(RpcConnection*, const String&, int, int)
+{
+   return false;
+}
+
+
+bool RpcEventLoop::ConnectLocal(RpcConnection*, const String&, int)
+{
+   return false;
+}
+
+
+bool RpcEventLoop::Add(RpcConnection*, int)
+{
+   return false;
+}
+
+
+void RpcEventLoop::Stop()
+{
+
+}
+
+
+int RpcEventLoop::GetNumThreads() const
+{
+   return 0;
+}
+
+#endif
+
+
+String RpcEventLoop::GetLocalPath(const String& name)
+{
+   if (File::isAbsolutePath(name))
+   {
+      return name;
+   }
+   return File::getSpecialLocation(File::tempDirectory).getChildFile(
+      name + ".sock").getFullPathName();
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+#if JUCE_LINUX
+
+namespace
+{
+   /**
+    * A connection that the event loop reads, which sends every message 
+    * straight back.
+    */
+   class EchoConnection : public RpcConnection
+   {
+   public:
+      void connectionMade() override
+      {
+         RpcConnection::connectionMade();
+         ++fMade;
+      }
+
+      void connectionLost() override
+      {
+         RpcConnection::connectionLost();
+         ++fLost;
+      }
+
+      void HandleMessage(const void* data, size_t size) override
+      {
+         this->SendFrame(data, size);
+      }
+
+      Atomic<int> fMade;
+      Atomic<int> fLost;
+   };
+
+
+   /**
+    * Keeps the messages that a test client receives.
+    */
+   class MessageLog
+   {
+   public:
+      void Add(const MemoryBlock& message)
+      {
+         const ScopedLock lock(fLock);
+         fMessages.add(message);
+         fReceived.signal();
+      }
+
+      bool WaitForMessages(int count)
+      {
+         while (true)
+         {
+            {
+               const ScopedLock lock(fLock);
+               if (fMessages.size() >= count)
+               {
+                  return true;
+               }
+            }
+            if (!fReceived.wait(5000))
+            {
+               return false;
+            }
+         }
+      }
+
+      CriticalSection fLock;
+      Array<MemoryBlock> fMessages;
+      WaitableEvent fReceived;
+   };
+
+
+   /**
+    * A plain JUCE client, to check that our frames are compatible with 
+    * InterprocessConnection's in both directions.
+    */
+   class JuceClient : public InterprocessConnection
+                    , public MessageLog
+   {
+   public:
+      JuceClient() : InterprocessConnection(false, RpcConnection::kMagic) {}
+
+      ~JuceClient() { this->disconnect(); }
+
+      void connectionMade() override {}
+
+      void connectionLost() override {}
+
+      void messageReceived(const MemoryBlock& message) override
+      {
+         this->Add(message);
+      }
+   };
+
+
+   /**
+    * A client that another event loop reads, for local sockets.
+    */
+   class LocalClient : public RpcConnection
+                     , public MessageLog
+   {
+   public:
+      void HandleMessage(const void* data, size_t size) override
+      {
+         this->Add(MemoryBlock(data, size));
+      }
+   };
+
+
+   /**
+    * Owns the connections that the event loop accepts.
+    */
+   class EchoFactory
+   {
+   public:
+      RpcEventLoop::Factory GetFactory()
+      {
+         return [this]() -> RpcConnection*
+         {
+            const ScopedLock lock(fLock);
+            return fConnections.add(new EchoConnection());
+         };
+      }
+
+      EchoConnection* Get(int index)
+      {
+         const ScopedLock lock(fLock);
+         return fConnections[index];
+      }
+
+      int GetSize()
+      {
+         const ScopedLock lock(fLock);
+         return fConnections.size();
+      }
+
+      /**
+       * Wait for a condition that the event loop's threads will make true.
+       */
+      template <typename Condition>
+      static bool WaitFor(Condition condition)
+      {
+         for (int i = 0; i < 500; ++i)
+         {
+            if (condition())
+            {
+               return true;
+            }
+            Thread::sleep(10);
+         }
+         return false;
+      }
+
+      CriticalSection fLock;
+      OwnedArray<EchoConnection> fConnections;
+   };
+}
+
+
+class RpcEventLoopTest : public UnitTest
+{
+public:
+   RpcEventLoopTest()
+   :  UnitTest("RpcEventLoop tests")
+   ,  fPort(-1)
+   {
+
+   }
+
+   void runTest() override
+   {
+      this->RunTests(RpcEventLoop::kEpoll, String::empty);
+      if (RpcEventLoop::IsAvailable(RpcEventLoop::kIoUring))
+      {
+         this->RunTests(RpcEventLoop::kIoUring, " (io_uring)");
+      }
+      else
+      {
+         this->logMessage("io_uring isn't available here.");
+      }
+   }
+
+   void RunTests(RpcEventLoop::Backend backend, const String& suffix)
+   {
+      this->beginTest("Frames from InterprocessConnection" + suffix);
+      EchoFactory factory;
+      RpcEventLoop loop(2, backend);
+      this->expect(2 == loop.GetNumThreads());
+      this->expect(backend == loop.GetBackend());
+      this->expect(loop.Listen(0, factory.GetFactory()));
+      fPort = loop.GetPort();
+      this->expect(fPort > 0);
+      {
+         ScopedPointer<JuceClient> client(new JuceClient());
+         this->expect(client->connectToSocket("127.0.0.1", fPort, 1000));
+
+         MemoryBlock small("a small message", 15);
+         MemoryBlock large(1024 * 1024 + 3);
+         for (size_t i = 0; i < large.getSize(); ++i)
+         {
+            large[i] = static_cast<char>(i * 7);
+         }
+         this->expect(client->sendMessage(small));
+         // empty frames are skipped, as InterprocessConnection skips them.
+         this->expect(client->sendMessage(MemoryBlock()));
+         this->expect(client->sendMessage(large));
+         this->expect(client->sendMessage(small));
+         this->expect(client->WaitForMessages(3));
+         {
+            const ScopedLock lock(client->fLock);
+            this->expect(3 == client->fMessages.size());
+            this->expect(client->fMessages[0] == small);
+            this->expect(client->fMessages[1] == large);
+            this->expect(client->fMessages[2] == small);
+         }
+         this->expect(1 == factory.GetSize());
+         this->expect(1 == factory.Get(0)->fMade.get());
+
+         this->beginTest("Clients that disconnect" + suffix);
+         client = nullptr;
+         this->expect(EchoFactory::WaitFor([&factory]()
+         {
+            return 1 == factory.Get(0)->fLost.get();
+         }));
+         this->expect(0 == loop.GetNumConnections());
+      }
+
+      this->beginTest("Many connections" + suffix);
+      {
+         OwnedArray<JuceClient> clients;
+         for (int i = 0; i < kNumClients; ++i)
+         {
+            this->expect(clients.add(new JuceClient())->connectToSocket("127.0.0.1", 
+               fPort, 1000));
+         }
+         for (int round = 0; round < kNumRounds; ++round)
+         {
+            for (int i = 0; i < kNumClients; ++i)
+            {
+               const String text("client " + String(i) + ", round " + String(round));
+               clients[i]->sendMessage(MemoryBlock(text.toRawUTF8(), text.length()));
+            }
+         }
+         bool allEchoed = true;
+         for (int i = 0; i < kNumClients; ++i)
+         {
+            allEchoed = allEchoed && clients[i]->WaitForMessages(kNumRounds);
+            const ScopedLock lock(clients[i]->fLock);
+            const MemoryBlock& last = clients[i]->fMessages.getReference(kNumRounds - 1);
+            allEchoed = allEchoed && (last.toString() == 
+               "client " + String(i) + ", round " + String(kNumRounds - 1));
+         }
+         this->expect(allEchoed);
+         this->expect(kNumClients == loop.GetNumConnections());
+
+         this->beginTest("Frames with the wrong magic number" + suffix);
+         {
+            StreamingSocket socket;
+            this->expect(socket.connect("127.0.0.1", fPort, 1000));
+            this->expect(EchoFactory::WaitFor([&factory]()
+            {
+               return kNumClients + 2 == factory.GetSize();
+            }));
+            const uint32 header[2] = { 0x12345678, 4 };
+            socket.write(header, sizeof(header));
+            EchoConnection* connection = factory.Get(kNumClients + 1);
+            this->expect(EchoFactory::WaitFor([connection]()
+            {
+               return 1 == connection->fLost.get();
+            }));
+            this->expect(kNumClients == loop.GetNumConnections());
+         }
+
+         this->beginTest("Frames that share a read, or are split" + suffix);
+         {
+            StreamingSocket socket;
+            this->expect(socket.connect("127.0.0.1", fPort, 1000));
+            MemoryBlock frames;
+            for (int i = 0; i < kNumFrames; ++i)
+            {
+               const String text("frame " + String(i));
+               const uint32 header[2] = { ByteOrder::swapIfBigEndian(
+                  static_cast<uint32>(RpcConnection::kMagic)),
+                  ByteOrder::swapIfBigEndian(static_cast<uint32>(text.length())) };
+               frames.append(header, sizeof(header));
+               frames.append(text.toRawUTF8(), text.length());
+            }
+            // most of them at once, and then the rest a byte at a time.
+            const int split = static_cast<int>(frames.getSize()) - 20;
+            this->expect(split == socket.write(frames.getData(), split));
+            for (int i = split; i < static_cast<int>(frames.getSize()); ++i)
+            {
+               this->expect(1 == socket.write(static_cast<char*>(frames.getData()) + i, 1));
+               Thread::sleep(1);
+            }
+            MemoryBlock echoed(frames.getSize());
+            this->expect(static_cast<int>(frames.getSize()) == socket.read(
+               echoed.getData(), static_cast<int>(echoed.getSize()), true));
+            this->expect(echoed == frames);
+         }
+
+         this->beginTest("A client that doesn't read" + suffix);
+         {
+            StreamingSocket slow;
+            EchoConnection* connection = this->Connect(factory, slow);
+            this->expect(nullptr != connection);
+            MemoryBlock frame(kLargeFrameSize);
+            for (size_t i = 0; i < frame.getSize(); ++i)
+            {
+               frame[i] = static_cast<char>(i * 7);
+            }
+            // far more than the socket's buffers hold, and none of it 
+            // waits for the client.
+            const double start = Time::getMillisecondCounterHiRes();
+            for (int i = 0; i < kNumLargeFrames && nullptr != connection; ++i)
+            {
+               this->expect(connection->SendFrame(frame.getData(), frame.getSize()));
+            }
+            this->expect(Time::getMillisecondCounterHiRes() - start < 1000.0);
+
+            // and other clients are still served meanwhile.
+            StreamingSocket other;
+            this->expect(nullptr != this->Connect(factory, other));
+            const uint32 ping[3] = { ByteOrder::swapIfBigEndian(
+               static_cast<uint32>(RpcConnection::kMagic)), 
+               ByteOrder::swapIfBigEndian(static_cast<uint32>(4)), 42 };
+            uint32 pong[3];
+            this->expect(sizeof(ping) == other.write(ping, sizeof(ping)));
+            this->expect(sizeof(pong) == other.read(pong, sizeof(pong), true));
+            this->expect(0 == memcmp(ping, pong, sizeof(ping)));
+
+            bool intact = true;
+            MemoryBlock received(frame.getSize() + 8);
+            for (int i = 0; i < kNumLargeFrames; ++i)
+            {
+               intact = intact && static_cast<int>(received.getSize()) == slow.read(
+                  received.getData(), static_cast<int>(received.getSize()), true) &&
+                  0 == memcmp(frame.getData(), static_cast<char*>(received.getData()) + 8, 
+                  frame.getSize());
+            }
+            this->expect(intact);
+            this->expect(nullptr == connection || 0 == connection->GetOutbox()->GetQueuedBytes());
+         }
+
+         this->beginTest("Writes wait for the write latency" + suffix);
+         {
+            StreamingSocket socket;
+            EchoConnection* connection = this->Connect(factory, socket);
+            this->expect(nullptr != connection);
+            loop.SetWriteLatency(kWriteLatencyMs * 1000);
+            const int64 writes = RpcOutbox::GetWriteCount();
+            const double start = Time::getMillisecondCounterHiRes();
+            for (int i = 0; i < 10 && nullptr != connection; ++i)
+            {
+               this->expect(connection->SendFrame("latency", 7));
+            }
+            char received[10 * 15];
+            this->expect(sizeof(received) == socket.read(received, sizeof(received), true));
+            this->expect(Time::getMillisecondCounterHiRes() - start >= kWriteLatencyMs - 1);
+            // they all went out together.
+            this->expect(writes + 1 == RpcOutbox::GetWriteCount());
+            loop.SetWriteLatency(0);
+         }
+
+         this->beginTest("Stopping drops every connection" + suffix);
+         loop.Stop();
+         this->expect(0 == loop.GetNumConnections());
+         bool allLost = true;
+         for (int i = 0; i < factory.GetSize(); ++i)
+         {
+            allLost = allLost && (1 == factory.Get(i)->fMade.get()) && 
+               (1 == factory.Get(i)->fLost.get());
+         }
+         this->expect(allLost);
+         this->expect(!loop.Listen(fPort, factory.GetFactory()));
+      }
+
+      this->RunLocalTests(backend, suffix);
+   }
+
+   void RunLocalTests(RpcEventLoop::Backend backend, const String& suffix)
+   {
+      this->beginTest("Local sockets" + suffix);
+      // one name per process, so copies of the tests don't share a socket.
+      const String name("RpcEventLoopTest" + String(::getpid()));
+      const File path(RpcEventLoop::GetLocalPath(name));
+      EchoFactory factory;
+      ScopedPointer<LocalClient> local(new LocalClient());
+      {
+         RpcEventLoop server(1, backend);
+         this->expect(server.ListenLocal(name, factory.GetFactory()));
+         this->expect(path.exists());
+         // nobody else can take it over while we're listening (although 
+         // checking connects to us).
+         RpcEventLoop other(1, backend);
+         this->expect(!other.ListenLocal(name, factory.GetFactory()));
+
+         RpcEventLoop client(1, backend);
+         this->expect(client.ConnectLocal(local, name, 1000));
+         MemoryBlock small("a small message", 15);
+         MemoryBlock large(1024 * 1024 + 3);
+         for (size_t i = 0; i < large.getSize(); ++i)
+         {
+            large[i] = static_cast<char>(i * 7);
+         }
+         this->expect(local->SendFrame(small.getData(), small.getSize()));
+         this->expect(local->SendFrame(large.getData(), large.getSize()));
+         this->expect(local->WaitForMessages(2));
+         {
+            const ScopedLock lock(local->fLock);
+            this->expect(local->fMessages[0] == small);
+            this->expect(local->fMessages[1] == large);
+         }
+         this->expect(EchoFactory::WaitFor([&server]()
+         {
+            return 1 == server.GetNumConnections();
+         }));
+
+         client.Stop();
+         this->expect(EchoFactory::WaitFor([&server]()
+         {
+            return 0 == server.GetNumConnections();
+         }));
+         server.Stop();
+         this->expect(!path.exists());
+         this->expect(!other.ConnectLocal(local, name, 1000));
+      }
+
+      this->beginTest("Local sockets that are left behind" + suffix);
+      {
+         struct sockaddr_un address;
+         zerostruct(address);
+         address.sun_family = AF_UNIX;
+         path.getFullPathName().copyToUTF8(address.sun_path, sizeof(address.sun_path));
+         const int stale = ::socket(AF_UNIX, SOCK_STREAM, 0);
+         this->expect(0 == ::bind(stale, reinterpret_cast<struct sockaddr*>(&address), 
+            sizeof(address)));
+         ::close(stale);
+         this->expect(path.exists());
+
+         RpcEventLoop server(1, backend);
+         this->expect(server.ListenLocal(name, factory.GetFactory()));
+         RpcEventLoop client(1, backend);
+         local = new LocalClient();
+         this->expect(client.ConnectLocal(local, name, 1000));
+         this->expect(local->SendFrame("again", 5));
+         this->expect(local->WaitForMessages(1));
+         client.Stop();
+         server.Stop();
+      }
+   }
+
+private:
+   /**
+    * Connect `socket` to the loop that's listening on fPort.
+    * @return the connection that the loop made for it, or nullptr.
+    */
+   EchoConnection* Connect(EchoFactory& factory, StreamingSocket& socket)
+   {
+      const int index = factory.GetSize();
+      if (!socket.connect("127.0.0.1", fPort, 1000) ||
+         !EchoFactory::WaitFor([&factory, index]()
+         {
+            return index < factory.GetSize() && 1 == factory.Get(index)->fMade.get();
+         }))
+      {
+         return nullptr;
+      }
+      return factory.Get(index);
+   }
+
+private:
+   enum 
+   { 
+      kNumClients = 20,
+      kNumRounds = 10,
+      kNumFrames = 100,
+      kLargeFrameSize = 64 * 1024,
+      kNumLargeFrames = 64,
+      kWriteLatencyMs = 50
+   };
+
+   /**
+    * The port that the loop under test is listening on.
+    */
+   int fPort;
+};
+
+static RpcEventLoopTest eventLoopTest;
+
+#endif
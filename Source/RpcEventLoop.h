@@ -0,0 +1,226 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCEVENTLOOP_H_INCLUDED
+#define RPCEVENTLOOP_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include <functional>
+
+class RpcConnection;
+
+
+/**
+ * @class RpcEventLoop
+ *
+ * Reads from any number of connections with a small, fixed set of I/O
+ * threads, in place of the thread per connection that
+ * InterprocessConnection uses. Each I/O thread waits on its own epoll set
+ * or io_uring instance (see Backend) and owns the sockets that it's given;
+ * the first one also accepts new connections, and hands them out to the
+ * threads in turn.
+ *
+ * Frames are the same as InterprocessConnection's (an 8-byte header of
+ * RpcConnection::kMagic and the size, then the message). Rather than 
+ * reading each header and body separately into a new block, as 
+ * InterprocessConnection does, we read whatever has arrived in large 
+ * chunks, into buffers that each I/O thread reuses, and pass every 
+ * complete frame in a chunk to the connection's FrameReceived() without
+ * copying it. Only a frame that's split between chunks is gathered in a 
+ * block of the connection's own.
+ *
+ * Frames are handled on their connection's I/O thread, so anything that a
+ * connection does there holds up the other connections on that thread. A
+ * frame with the wrong magic number drops the connection.
+ *
+ * Writes go the other way round: whatever thread sends a frame just queues
+ * it in the connection's RpcOutbox, and the I/O thread writes everything
+ * that's queued for a connection with one vectored write at the end of its
+ * pass (or once the write latency is up; see SetWriteLatency()). If the
+ * socket is full, the rest waits until the client has read enough, without
+ * holding up the sender or any other connection.
+ *
+ * Clients on the same host can connect over a Unix domain socket instead
+ * (see ListenLocal() and ConnectLocal()), with the same frames; that skips
+ * the TCP stack, so each round trip takes less time.
+ *
+ * A connection is attached to its socket (see RpcConnection::AttachSocket())
+ * before it's given to an I/O thread, which calls its connectionLost()
+ * when the socket closes, or when we're stopped. After that, we don't touch
+ * it again.
+ *
+ * Only available on Linux; see IsAvailable().
+ */
+class RpcEventLoop
+{
+public:
+   /**
+    * Creates the connection for a socket that we've accepted, or returns
+    * nullptr to refuse it. Called on one of our I/O threads.
+    */
+   typedef std::function<RpcConnection*()> Factory;
+
+   enum
+   {
+      /**
+       * Each wakeup makes at most this many reads from a connection
+       * before moving on to the next one, so that a busy client can't
+       * starve the others on its thread.
+       */
+      kMaxReadsPerWakeup = 16
+   };
+
+   enum Backend
+   {
+      /**
+       * Wait for sockets to become readable with epoll, then read them.
+       */
+      kEpoll = 0,
+
+      /**
+       * Keep a multishot receive outstanding on every socket with
+       * io_uring, into a ring of buffers that's registered with the
+       * kernel, and batch each pass's requests into one system call. Needs
+       * Linux 5.19 or later.
+       */
+      kIoUring
+   };
+
+   /**
+    * If `backend` isn't available (see IsAvailable()), we don't start any
+    * I/O threads, and can't be used.
+    */
+   RpcEventLoop(int numThreads, Backend backend = kEpoll);
+
+   /**
+    * Stops, if that hasn't been done already.
+    */
+   ~RpcEventLoop();
+
+   /**
+    * @return false if this platform doesn't have what `backend` needs.
+    */
+   static bool IsAvailable(Backend backend = kEpoll);
+
+   /**
+    * Start accepting connections on `portNumber`, or on a free port that
+    * the system picks if it's 0 (see GetPort()).
+    * @return false if we couldn't listen on that port.
+    */
+   bool Listen(int portNumber, const Factory& factory);
+
+   /**
+    * @return the port that Listen() is accepting connections on, or -1 if 
+    *         we aren't listening on one.
+    */
+   int GetPort() const
+   {
+      return (nullptr != fListener) ? fListener->getBoundPort() : -1;
+   }
+
+   /**
+    * Start accepting connections on the Unix domain socket for `name` (see
+    * GetLocalPath()), in place of Listen(). A socket that's been left there
+    * by a server that's gone is replaced; the socket is removed again when
+    * we stop.
+    * @return false if we couldn't listen there, another server is 
+    *         listening there, or we're already listening.
+    */
+   bool ListenLocal(const String& name, const Factory& factory);
+
+   /**
+    * Connect to a server, and Add() `connection` with the socket.
+    * @return false if we couldn't connect within `msTimeout` milliseconds,
+    *         or we're stopped.
+    */
+   bool Connect(RpcConnection* connection, const String& hostName, 
+      int portNumber, int msTimeout);
+
+   /**
+    * Connect to a server on this host that's listening on the Unix domain 
+    * socket for `name` (see ListenLocal()), and Add() `connection` with the
+    * socket.
+    * @return false if we couldn't connect within `msTimeout` milliseconds,
+    *         or we're stopped.
+    */
+   bool ConnectLocal(RpcConnection* connection, const String& name, 
+      int msTimeout);
+
+   /**
+    * @return the path of the Unix domain socket for `name`: `name` itself 
+    *         if it's an absolute path, otherwise `name`.sock in the 
+    *         temporary directory.
+    */
+   static String GetLocalPath(const String& name);
+
+   /**
+    * Attach a connection to a socket that's already connected, and give it
+    * to the next I/O thread in turn.
+    * @return false if we're stopped, in which case the connection has
+    *         already been lost.
+    */
+   bool Add(RpcConnection* connection, int socket);
+
+   /**
+    * Stop accepting connections, and drop the ones that we have. Waits for
+    * the I/O threads to finish.
+    */
+   void Stop();
+
+   int GetNumThreads() const;
+
+   /**
+    * Let frames wait up to `microseconds` after they're sent for others to
+    * join them in the same write, which saves system calls (and packets)
+    * for connections that are sent many small messages, at the cost of
+    * that much latency. With 0 (the default), what's been sent is written
+    * at the end of the I/O thread's current pass, or of the one that the
+    * send wakes it for.
+    */
+   void SetWriteLatency(int microseconds) { fWriteLatency = jmax(0, microseconds); }
+
+   int GetWriteLatency() const { return fWriteLatency.get(); }
+
+   Backend GetBackend() const { return fBackend; }
+
+   /**
+    * @return the number of connections that we're reading from.
+    */
+   int GetNumConnections() const { return fNumConnections.get(); }
+
+private:
+   class Channel;
+   class IoThread;
+   class EpollThread;
+   class UringThread;
+
+   Backend fBackend;
+
+   OwnedArray<IoThread> fThreads;
+
+   Atomic<int> fNextThread;
+
+   Atomic<int> fNumConnections;
+
+   Atomic<int> fWriteLatency;
+
+   ScopedPointer<StreamingSocket> fListener;
+
+   /**
+    * The Unix domain socket that ListenLocal() listens on, or -1, and its 
+    * path.
+    */
+   int fLocalListener;
+   String fLocalPath;
+
+   Factory fFactory;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcEventLoop)
+};
+
+
+#endif  // RPCEVENTLOOP_H_INCLUDED
@@ -0,0 +1,478 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcExecutor.h"
+#include "RpcFuture.h"
+
+
+void RpcMessageThreadExecutor::Post(const Job& job)
+{
+   MessageManager::callAsync(job);
+}
+
+
+class RpcThreadExecutor::Worker : public Thread
+{
+public:
+   Worker(RpcThreadExecutor& owner, const String& name)
+   :  Thread(name)
+   ,  fOwner(owner)
+   {
+
+   }
+
+   void run() override
+   {
+      while (!this->threadShouldExit())
+      {
+         Job job;
+         if (fOwner.Next(job))
+         {
+            job();
+         }
+         else
+         {
+            fOwner.fPosted.wait(-1);
+         }
+      }
+   }
+
+private:
+   RpcThreadExecutor& fOwner;
+};
+
+
+RpcThreadExecutor::RpcThreadExecutor(const String& name, int numThreads)
+:  fNumPosted(0)
+,  fTookTimed(false)
+{
+   for (int i = 0; i < jmax(1, numThreads); ++i)
+   {
+      fWorkers.add(new Worker(*this, name))->startThread();
+   }
+}
+
+
+RpcThreadExecutor::~RpcThreadExecutor()
+{
+   for (int i = 0; i < fWorkers.size(); ++i)
+   {
+      fWorkers.getUnchecked(i)->signalThreadShouldExit();
+   }
+   for (int i = 0; i < fWorkers.size(); ++i)
+   {
+      // each signal wakes one worker, but not necessarily this one.
+      while (!fWorkers.getUnchecked(i)->waitForThreadToExit(10))
+      {
+         fPosted.signal();
+      }
+   }
+
+   // run anything that the workers didn't get to.
+   Job job;
+   while (this->Next(job))
+   {
+      job();
+   }
+}
+
+
+void RpcThreadExecutor::Post(const Job& job)
+{
+   {
+      const ScopedLock lock(fLock);
+      fUntimedJobs.push_back(job);
+   }
+   fPosted.signal();
+}
+
+
+void RpcThreadExecutor::PostBefore(const Job& job, int64 deadline)
+{
+   {
+      const ScopedLock lock(fLock);
+      fJobs[std::make_pair(deadline, fNumPosted++)] = job;
+   }
+   fPosted.signal();
+}
+
+
+int RpcThreadExecutor::GetQueueSize() const
+{
+   const ScopedLock lock(fLock);
+   return static_cast<int>(fJobs.size() + fUntimedJobs.size());
+}
+
+
+bool RpcThreadExecutor::Next(Job& job)
+{
+   const ScopedLock lock(fLock);
+   if (fJobs.empty() && fUntimedJobs.empty())
+   {
+      return false;
+   }
+   // take turns between the queues while they both have jobs.
+   fTookTimed = fUntimedJobs.empty() || (!fJobs.empty() && !fTookTimed);
+   if (fTookTimed)
+   {
+      std::swap(job, fJobs.begin()->second);
+      fJobs.erase(fJobs.begin());
+   }
+   else
+   {
+      std::swap(job, fUntimedJobs.front());
+      fUntimedJobs.pop_front();
+   }
+   if (!fJobs.empty() || !fUntimedJobs.empty())
+   {
+      // there's more to do; wake another worker to help.
+      fPosted.signal();
+   }
+   return true;
+}
+
+
+RpcStrand::RpcStrand(RpcExecutor& executor)
+:  fExecutor(executor)
+,  fScheduled(false)
+,  fIdle(true)
+,  fThread(nullptr)
+{
+   fIdle.signal();
+}
+
+
+RpcStrand::~RpcStrand()
+{
+   fIdle.wait(-1);
+}
+
+
+void RpcStrand::Post(const Job& job)
+{
+   {
+      const ScopedLock lock(fLock);
+      fJobs.push_back(job);
+      if (fScheduled)
+      {
+         // the Drain() that's already on its way will run it.
+         return;
+      }
+      fScheduled = true;
+      fIdle.reset();
+   }
+   fExecutor.Post([this]() { this->Drain(); });
+}
+
+
+void RpcStrand::RunAndWait(const Job& job)
+{
+   if (this->IsCurrent())
+   {
+      job();
+      return;
+   }
+   WaitableEvent done;
+   this->Post([&job, &done]()
+   {
+      job();
+      done.signal();
+   });
+   done.wait(-1);
+}
+
+
+bool RpcStrand::IsCurrent() const
+{
+   return Thread::getCurrentThreadId() == fThread.get();
+}
+
+
+void RpcStrand::Drain()
+{
+   std::deque<Job> jobs;
+   {
+      const ScopedLock lock(fLock);
+      jobs.swap(fJobs);
+   }
+
+   fThread = Thread::getCurrentThreadId();
+   for (size_t i = 0; i < jobs.size(); ++i)
+   {
+      jobs[i]();
+   }
+   fThread = nullptr;
+
+   {
+      const ScopedLock lock(fLock);
+      if (fJobs.empty())
+      {
+         fScheduled = false;
+         fIdle.signal();
+         return;
+      }
+   }
+   // jobs posted while we were running go to the back of the executor's 
+   // queue, so that other strands get a turn.
+   fExecutor.Post([this]() { this->Drain(); });
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+class RpcExecutorTest : public UnitTest
+{
+public:
+   RpcExecutorTest() : UnitTest("RpcExecutor tests") {}
+
+   /**
+    * A method to make futures for, without needing a connection.
+    */
+   struct TestMethod
+   {
+      static int DecodeResult(RpcMessageReader& reader) { return reader.GetInt(); }
+   };
+
+   void runTest() override
+   {
+      this->beginTest("Thread executor");
+      {
+         Atomic<int> count;
+         Array<int> order;
+         CriticalSection orderLock;
+         WaitableEvent done;
+         {
+            RpcThreadExecutor executor("test");
+            for (int i = 0; i < 1000; ++i)
+            {
+               executor.Post([&, i]()
+               {
+                  const ScopedLock lock(orderLock);
+                  order.add(i);
+                  if (1000 == ++count)
+                  {
+                     done.signal();
+                  }
+               });
+            }
+            this->expect(done.wait(5000));
+         }
+         // one thread runs them in order.
+         for (int i = 0; i < order.size(); ++i)
+         {
+            this->expect(i == order[i]);
+         }
+      }
+
+      this->beginTest("Deadlines");
+      {
+         Array<int> order;
+         WaitableEvent started;
+         WaitableEvent gate;
+         WaitableEvent done;
+         {
+            RpcThreadExecutor executor("test");
+            // hold up the thread until everything's been posted.
+            executor.Post([&]() { started.signal(); gate.wait(5000); });
+            this->expect(started.wait(5000));
+            const int64 now = Time::getHighResolutionTicks();
+            const int64 ms = Time::secondsToHighResolutionTicks(0.001);
+            executor.PostBefore([&order]() { order.add(3); }, now + 3000 * ms);
+            executor.Post([&order]() { order.add(1); });
+            executor.PostBefore([&order]() { order.add(2); }, now + 10 * ms);
+            executor.PostBefore([&order]() { order.add(0); }, now - 10 * ms);
+            executor.PostBefore([&order, &done]() { order.add(4); done.signal(); },
+               now + 3000 * ms);
+            this->expect(5 == executor.GetQueueSize());
+            gate.signal();
+            this->expect(done.wait(5000));
+         }
+         // earliest deadline first, and in the order they were posted when
+         // the deadlines are the same, taking turns with the job that has 
+         // no deadline.
+         this->expect(5 == order.size());
+         for (int i = 0; i < order.size(); ++i)
+         {
+            this->expect(i == order[i]);
+         }
+      }
+
+      this->beginTest("Jobs without deadlines aren't starved");
+      {
+         Array<int> order;
+         WaitableEvent started;
+         WaitableEvent gate;
+         WaitableEvent done;
+         {
+            RpcThreadExecutor executor("test");
+            executor.Post([&]() { started.signal(); gate.wait(5000); });
+            this->expect(started.wait(5000));
+            const int64 now = Time::getHighResolutionTicks();
+            for (int i = 0; i < 100; ++i)
+            {
+               executor.PostBefore([&order]() { order.add(1); }, now);
+            }
+            executor.Post([&order]() { order.add(0); });
+            executor.Post([&order, &done]() { order.add(0); done.signal(); });
+            gate.signal();
+            this->expect(done.wait(5000));
+         }
+         // however urgent the others are, the jobs without deadlines each
+         // wait behind at most one of them.
+         this->expect(102 == order.size());
+         this->expect(0 == order[1] && 0 == order[3]);
+      }
+
+      this->beginTest("Destroying an executor runs its jobs");
+      {
+         Atomic<int> count;
+         {
+            RpcThreadExecutor executor("test", 4);
+            for (int i = 0; i < 1000; ++i)
+            {
+               executor.Post([&count]() { ++count; });
+            }
+         }
+         this->expect(1000 == count.get());
+      }
+
+      this->beginTest("Strands");
+      {
+         RpcThreadExecutor pool("strands", 4);
+         Array<int> orders[2];
+         Atomic<int> running[2];
+         Atomic<int> overlaps;
+         Atomic<int> concurrency;
+         Atomic<int> maxConcurrency;
+         {
+            RpcStrand strand0(pool);
+            RpcStrand strand1(pool);
+            RpcStrand* strands[2] = { &strand0, &strand1 };
+            for (int i = 0; i < 2000; ++i)
+            {
+               const int s = i % 2;
+               strands[s]->Post([&, s, i]()
+               {
+                  if (1 != ++running[s])
+                  {
+                     ++overlaps;
+                  }
+                  const int now = ++concurrency;
+                  if (now > maxConcurrency.get())
+                  {
+                     maxConcurrency = now;
+                  }
+                  if (0 == i % 200)
+                  {
+                     Thread::sleep(5);
+                  }
+                  orders[s].add(i);
+                  --concurrency;
+                  --running[s];
+               });
+            }
+
+            int value = 0;
+            strand0.RunAndWait([&]()
+            {
+               this->expect(strand0.IsCurrent());
+               this->expect(!strand1.IsCurrent());
+               // already on the strand, so this runs straight away.
+               strand0.RunAndWait([&]() { value = orders[0].size(); });
+            });
+            this->expect(1000 == value);
+            this->expect(!strand0.IsCurrent());
+         }
+         // the strands waited for their jobs...
+         this->expect(1000 == orders[0].size() && 1000 == orders[1].size());
+         // ...which ran one at a time on each strand, in order...
+         this->expect(0 == overlaps.get());
+         for (int i = 0; i < 1000; ++i)
+         {
+            this->expect(2 * i == orders[0][i] && 2 * i + 1 == orders[1][i]);
+         }
+         // ...but the two strands ran alongside each other.
+         this->expect(2 == maxConcurrency.get());
+      }
+
+      RpcThreadExecutor executor("futures");
+      RpcMessage result(1, 1, RpcMessage::kCompactEncoding);
+      result.AppendInt(42);
+      MemoryBlock resultData(result.GetMemoryBlock());
+
+      this->beginTest("Futures");
+      {
+         RpcFuture<int>::State::Ptr state = new RpcFuture<int>::State(&executor);
+         RpcFuture<int> future(state);
+         RpcFuture<int> copy(future);
+         this->expect(future.IsValid());
+         this->expect(!future.IsReady());
+         this->expect(!future.Wait(0));
+
+         RpcMessageReader reader(resultData, RpcMessage::kCompactEncoding);
+         state->GetValue().Decode<TestMethod>(reader);
+         state->Succeed();
+         this->expect(copy.IsReady());
+         this->expect(42 == copy.Get());
+         this->expect(!RpcFuture<int>().IsValid());
+      }
+
+      this->beginTest("Callbacks");
+      {
+         RpcFuture<int>::State::Ptr state = new RpcFuture<int>::State(&executor);
+         RpcFuture<int> future(state);
+         WaitableEvent called;
+         Thread::ThreadID callbackThread = nullptr;
+         int value = 0;
+         future.Then([&](RpcFuture<int> f)
+         {
+            value = f.Get();
+            callbackThread = Thread::getCurrentThreadId();
+            called.signal();
+         });
+         this->expect(!called.wait(20));
+
+         RpcMessageReader reader(resultData, RpcMessage::kCompactEncoding);
+         state->GetValue().Decode<TestMethod>(reader);
+         state->Succeed();
+         this->expect(called.wait(5000));
+         this->expect(42 == value);
+         // it ran on the executor's thread, not ours.
+         this->expect(Thread::getCurrentThreadId() != callbackThread);
+
+         // a callback added afterwards runs straight away.
+         future.Then([&](RpcFuture<int>) { called.signal(); });
+         this->expect(called.wait(5000));
+      }
+
+      this->beginTest("Failures");
+      {
+         RpcFuture<void>::State::Ptr state = new RpcFuture<void>::State(&executor);
+         RpcFuture<void> future(state);
+         RpcException e(77);
+         e.AppendExtraData(var("extra"));
+         state->Fail(e);
+
+         uint32 code = 0;
+         String extra;
+         try
+         {
+            future.Get();
+         }
+         catch (const RpcException& thrown)
+         {
+            code = thrown.GetCode();
+            extra = thrown.GetExtraData(0).toString();
+         }
+         this->expect(77 == code);
+         this->expect(extra == "extra");
+      }
+   }
+};
+
+static RpcExecutorTest executorTest;
@@ -0,0 +1,199 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCEXECUTOR_H_INCLUDED
+#define RPCEXECUTOR_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <utility>
+
+
+/**
+ * @class RpcExecutor
+ *
+ * Somewhere to run work that mustn't run on the thread that produced it --
+ * most importantly, the completions of asynchronous calls, which would
+ * otherwise run on (and hold up) the connection's IPC thread.
+ */
+class RpcExecutor
+{
+public:
+   typedef std::function<void()> Job;
+
+   virtual ~RpcExecutor() {}
+
+   /**
+    * Run `job` as soon as possible. Must be thread-safe.
+    */
+   virtual void Post(const Job& job) = 0;
+
+   /**
+    * Run `job`, which is only worth running before `deadline` (in
+    * Time::getHighResolutionTicks()), as soon as possible. Executors that
+    * don't queue their jobs by deadline just Post() it.
+    */
+   virtual void PostBefore(const Job& job, int64 deadline)
+   {
+      ignoreUnused(deadline);
+      this->Post(job);
+   }
+};
+
+
+/**
+ * @class RpcMessageThreadExecutor
+ *
+ * Runs jobs on the JUCE message thread, so that they can safely touch UI
+ * components (and the controller's trees).
+ */
+class RpcMessageThreadExecutor : public RpcExecutor
+{
+public:
+   void Post(const Job& job) override;
+};
+
+
+/**
+ * @class RpcThreadExecutor
+ *
+ * Runs jobs on its own threads (with more than one thread, jobs may finish
+ * in any order). Jobs posted with a deadline wait in one queue, earliest 
+ * deadline first; jobs posted without one wait in another, in the order 
+ * they were posted. While both queues have jobs, the workers take from 
+ * each in turn, so neither kind can starve the other. Jobs that are still
+ * waiting when the executor is destroyed are run by the destructor, so no
+ * job is ever dropped.
+ */
+class RpcThreadExecutor : public RpcExecutor
+{
+public:
+   RpcThreadExecutor(const String& name, int numThreads=1);
+
+   ~RpcThreadExecutor();
+
+   void Post(const Job& job) override;
+
+   void PostBefore(const Job& job, int64 deadline) override;
+
+   /**
+    * @return the number of jobs that haven't started yet.
+    */
+   int GetQueueSize() const;
+
+   /**
+    * @return the number of jobs that can run at once.
+    */
+   int GetNumThreads() const { return fWorkers.size(); }
+
+private:
+   class Worker;
+
+   /**
+    * Take the next job off the queue.
+    * @return false if there isn't one.
+    */
+   bool Next(Job& job);
+
+private:
+   OwnedArray<Worker> fWorkers;
+
+   CriticalSection fLock;
+
+   /**
+    * Jobs with deadlines waiting to run, keyed by their deadline and then 
+    * the order they were posted in. (Not a JUCE container, which would move
+    * the std::function objects around with realloc().)
+    */
+   std::map<std::pair<int64, uint64>, Job> fJobs;
+
+   uint64 fNumPosted;
+
+   /**
+    * Jobs without deadlines waiting to run, oldest first.
+    */
+   std::deque<Job> fUntimedJobs;
+
+   /**
+    * True if the last job that we took was one with a deadline.
+    */
+   bool fTookTimed;
+
+   /**
+    * Signalled when a job is posted.
+    */
+   WaitableEvent fPosted;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcThreadExecutor)
+};
+
+
+/**
+ * @class RpcStrand
+ *
+ * Runs jobs one at a time, in the order that they're posted, on another 
+ * executor's threads. Jobs on different strands of the same executor can 
+ * run at the same time, so giving each piece of shared state its own 
+ * strand (and only touching it from jobs on that strand) serializes 
+ * everything that uses it without a lock or a thread of its own.
+ *
+ * The executor must outlive the strand; destroying the strand waits for 
+ * its jobs to finish.
+ */
+class RpcStrand : public RpcExecutor
+{
+public:
+   RpcStrand(RpcExecutor& executor);
+
+   ~RpcStrand();
+
+   void Post(const Job& job) override;
+
+   /**
+    * Run `job` on the strand and wait for it to finish. If we're already 
+    * on the strand, it runs straight away.
+    */
+   void RunAndWait(const Job& job);
+
+   /**
+    * @return true if we're in one of the strand's jobs.
+    */
+   bool IsCurrent() const;
+
+private:
+   /**
+    * Run the jobs that have been posted, then hand the thread back to the 
+    * executor.
+    */
+   void Drain();
+
+private:
+   RpcExecutor& fExecutor;
+
+   CriticalSection fLock;
+   std::deque<Job> fJobs;
+
+   /**
+    * True from when a Drain() is posted to the executor until it runs out 
+    * of jobs.
+    */
+   bool fScheduled;
+
+   /**
+    * Signalled whenever fScheduled is false.
+    */
+   WaitableEvent fIdle;
+
+   Atomic<Thread::ThreadID> fThread;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcStrand)
+};
+
+
+#endif  // RPCEXECUTOR_H_INCLUDED
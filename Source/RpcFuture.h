@@ -0,0 +1,222 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCFUTURE_H_INCLUDED
+#define RPCFUTURE_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include "RpcException.h"
+#include "RpcExecutor.h"
+#include "RpcMessageReader.h"
+
+
+/**
+ * Where an RpcFuture keeps its result; there's nothing to keep for a void
+ * method.
+ */
+template <typename R>
+struct RpcFutureValue
+{
+   RpcFutureValue() : fValue() {}
+
+   template <typename Method>
+   void Decode(RpcMessageReader& reader) { fValue = Method::DecodeResult(reader); }
+
+   R Get() const { return fValue; }
+
+   R fValue;
+};
+
+template <>
+struct RpcFutureValue<void>
+{
+   template <typename Method>
+   void Decode(RpcMessageReader& reader) { Method::DecodeResult(reader); }
+
+   void Get() const {}
+};
+
+
+/**
+ * @class RpcFuture
+ *
+ * The result of an asynchronous call (see ClientController::CallAsync()),
+ * which will be ready some time later. Either wait for it:
+ *
+ *     RpcFuture<int> result = client.CallAsync<IntFnMethod>(21);
+ *     ...
+ *     int doubled = result.Get();
+ *
+ * or have a callback run on the client's RpcExecutor when it's ready:
+ *
+ *     client.CallAsync<IntFnMethod>(21).Then([](RpcFuture<int> result)
+ *     {
+ *        ...result.Get() won't block here.
+ *     });
+ *
+ * Futures are cheap to copy; all of the copies share the same result.
+ */
+template <typename R>
+class RpcFuture
+{
+public:
+   typedef std::function<void(RpcFuture<R>)> Callback;
+
+   /**
+    * The result shared by all of the copies of a future.
+    */
+   class State : public ReferenceCountedObject
+   {
+   public:
+      typedef ReferenceCountedObjectPtr<State> Ptr;
+
+      State(RpcExecutor* executor)
+      :  fExecutor(executor)
+      ,  fReady(false)
+      ,  fError(0)
+      ,  fFailed(false)
+      ,  fDone(true)
+      {
+
+      }
+
+      /**
+       * Only the call that will produce the result may use this, and only
+       * before calling Succeed().
+       */
+      RpcFutureValue<R>& GetValue() { return fValue; }
+
+      void Succeed()
+      {
+         this->Finish();
+      }
+
+      void Fail(const RpcException& e)
+      {
+         fError = e;
+         fFailed = true;
+         this->Finish();
+      }
+
+      bool IsReady() const
+      {
+         const ScopedLock lock(fLock);
+         return fReady;
+      }
+
+      bool Wait(int milliseconds)
+      {
+         return fDone.wait(milliseconds);
+      }
+
+      R Get()
+      {
+         fDone.wait();
+         if (fFailed)
+         {
+            throw fError;
+         }
+         return fValue.Get();
+      }
+
+      void Then(const Callback& callback)
+      {
+         {
+            const ScopedLock lock(fLock);
+            if (!fReady)
+            {
+               fCallback = callback;
+               return;
+            }
+         }
+         this->Post(callback);
+      }
+
+   private:
+      void Finish()
+      {
+         Callback callback;
+         {
+            const ScopedLock lock(fLock);
+            fReady = true;
+            std::swap(callback, fCallback);
+         }
+         fDone.signal();
+         if (callback)
+         {
+            this->Post(callback);
+         }
+      }
+
+      void Post(const Callback& callback)
+      {
+         Ptr self(this);
+         fExecutor->Post([self, callback]() { callback(RpcFuture<R>(self)); });
+      }
+
+   private:
+      RpcExecutor* fExecutor;
+
+      CriticalSection fLock;
+      bool fReady;
+
+      RpcFutureValue<R> fValue;
+      RpcException fError;
+      bool fFailed;
+
+      /**
+       * Manual-reset; stays signalled once the result is ready.
+       */
+      WaitableEvent fDone;
+
+      Callback fCallback;
+   };
+
+   /**
+    * Create a future that has no result and never will.
+    */
+   RpcFuture() {}
+
+   RpcFuture(State* state) : fState(state) {}
+
+   bool IsValid() const { return nullptr != fState; }
+
+   bool IsReady() const { return this->IsValid() && fState->IsReady(); }
+
+   /**
+    * Wait for the result to be ready.
+    * @return false if we timed out.
+    */
+   bool Wait(int milliseconds=-1) { return this->IsValid() && fState->Wait(milliseconds); }
+
+   /**
+    * Wait for the result to be ready, and return it.
+    * @throws RpcException if the call failed.
+    */
+   R Get()
+   {
+      jassert(this->IsValid());
+      return fState->Get();
+   }
+
+   /**
+    * Run `callback` on the client's executor once the result is ready (or
+    * straight away, if it already is). A future has one callback; setting
+    * another replaces it if it hasn't run yet.
+    */
+   void Then(const Callback& callback)
+   {
+      jassert(this->IsValid());
+      fState->Then(callback);
+   }
+
+private:
+   typename State::Ptr fState;
+};
+
+
+#endif  // RPCFUTURE_H_INCLUDED
@@ -5,6 +5,7 @@
 
 
 #include "RpcMessage.h"
+#include "RpcMessageReader.h"
 
 
 namespace
@@ -13,15 +14,6 @@ namespace
 }
 
 
-template <>
-void RpcMessage::SetTreeProperty<String>(const String& path, DataType type, String val)
-{
-   this->AppendString(path);
-   this->AppendData<int>(type);
-   this->AppendString(val);
-
-}
-
 class RpcValueTreeSync : public ValueTreeSynchroniser
 {
 public:
@@ -34,7 +26,7 @@ public:
 
    void stateChanged(const void* encodedChange, size_t encodedChangeSize) override
    {
-      fMessage->AppendData(encodedChange, encodedChangeSize);
+      fMessage->AppendTreeChange(encodedChange, encodedChangeSize);
    }
 
    void GetTreeData()
@@ -51,15 +43,168 @@ private:
 
 
 
-RpcMessage::RpcMessage(uint32 code, uint32 sequence)
+String RpcStringView::ToString() const
+{
+   if (this->IsEmpty())
+   {
+      return String();
+   }
+   return String(CharPointer_UTF8(fData), CharPointer_UTF8(fData + fLength));
+}
+
+
+uint32 RpcStringView::GetHash() const
+{
+   uint32 hash = 2166136261u;
+   for (size_t i = 0; i < fLength; ++i)
+   {
+      hash ^= static_cast<uint8>(fData[i]);
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+
+bool RpcStringView::operator==(const RpcStringView& rhs) const
+{
+   return (fLength == rhs.fLength) && 
+      ((0 == fLength) || (0 == memcmp(fData, rhs.fData, fLength)));
+}
+
+
+bool RpcStringView::operator==(const char* rhs) const
+{
+   size_t len = (nullptr == rhs) ? 0 : strlen(rhs);
+   return *this == RpcStringView(rhs, len);
+}
+
+
+bool RpcStringView::operator==(const String& rhs) const
+{
+   return *this == RpcStringView(rhs.toRawUTF8(), rhs.getNumBytesAsUTF8());
+}
+
+
+bool RpcStringView::IsValidUtf8(const char* data, size_t numBytes)
+{
+   const uint8* p = reinterpret_cast<const uint8*>(data);
+   const uint8* end = p + numBytes;
+
+   const uint64 kLowBits = 0x0101010101010101ULL;
+   const uint64 kHighBits = 0x8080808080808080ULL;
+
+   while (p < end)
+   {
+      if (end - p >= 8)
+      {
+         // Check a whole word at once -- if none of the 8 bytes has its high 
+         // bit set and none of them is zero, they're all valid ASCII.
+         uint64 word;
+         memcpy(&word, p, sizeof(word));
+         bool hasHighBit = (0 != (word & kHighBits));
+         bool hasZeroByte = (0 != ((word - kLowBits) & ~word & kHighBits));
+         if (!hasHighBit && !hasZeroByte)
+         {
+            p += 8;
+            continue;
+         }
+      }
+
+      uint8 c = *p;
+      if (c < 0x80)
+      {
+         if (0 == c)
+         {
+            // JUCE strings can't contain NUL characters.
+            return false;
+         }
+         ++p;
+         continue;
+      }
+
+      int extraBytes;
+      uint32 codePoint;
+      uint32 minCodePoint;
+      if (0xC0 == (c & 0xE0))
+      {
+         extraBytes = 1;
+         codePoint = c & 0x1F;
+         minCodePoint = 0x80;
+      }
+      else if (0xE0 == (c & 0xF0))
+      {
+         extraBytes = 2;
+         codePoint = c & 0x0F;
+         minCodePoint = 0x800;
+      }
+      else if (0xF0 == (c & 0xF8))
+      {
+         extraBytes = 3;
+         codePoint = c & 0x07;
+         minCodePoint = 0x10000;
+      }
+      else
+      {
+         // a stray continuation byte or an invalid lead byte.
+         return false;
+      }
+
+      if ((end - p) <= extraBytes)
+      {
+         // truncated sequence.
+         return false;
+      }
+
+      for (int i = 1; i <= extraBytes; ++i)
+      {
+         uint8 b = p[i];
+         if (0x80 != (b & 0xC0))
+         {
+            return false;
+         }
+         codePoint = (codePoint << 6) | (b & 0x3F);
+      }
+
+      if ((codePoint < minCodePoint) || (codePoint > 0x10FFFF) ||
+         ((codePoint >= 0xD800) && (codePoint <= 0xDFFF)))
+      {
+         // overlong encoding, out of range, or a UTF-16 surrogate.
+         return false;
+      }
+      p += 1 + extraBytes;
+   }
+
+   return true;
+}
+
+
+
+RpcMessage::RpcMessage(uint32 code, uint32 sequence, uint32 options)
 :  fNextOffset(0)
+,  fOptions(options)
 {
-   this->AppendData<uint32>(code); 
-   this->AppendData<uint32>(RpcMessage::GetSequence(sequence));
+   this->AppendHeader(code, RpcMessage::GetSequence(sequence));
 }
 
 
-RpcMessage::RpcMessage(const MemoryBlock& message)
+RpcMessage::RpcMessage(uint32 code, uint32 sequence, uint32 options, 
+   uint32 timeoutMs)
+:  fNextOffset(0)
+,  fOptions(options)
+{
+   if (0 == timeoutMs || 0 == (options & RpcMessage::kCallDeadlines))
+   {
+      this->AppendHeader(code, RpcMessage::GetSequence(sequence));
+      return;
+   }
+   this->AppendHeader(code | RpcMessage::kDeadlineFlag, 
+      RpcMessage::GetSequence(sequence));
+   this->AppendUInt(timeoutMs);
+}
+
+
+RpcMessage::RpcMessage(const MemoryBlock& message, uint32 options)
+:  fOptions(options)
 {
    this->FromMemoryBlock(message);
 
@@ -73,7 +218,7 @@ RpcMessage::~RpcMessage()
 
 void RpcMessage::FromMemoryBlock(const MemoryBlock& message)
 {
-   fData = message;
+   fData.ReplaceWith(message.getData(), message.getSize());
    fNextOffset = 0;
 }
 
@@ -82,19 +227,107 @@ bool RpcMessage::GetMetadata(uint32& code, uint32& sequence)
 {
    bool retval = false;
    fNextOffset = 0;
-   if (fData.getSize() >= (2 * sizeof(uint32)))
+   RpcMessageReader reader(fData.GetData(), fData.GetSize(), fOptions);
+   if (reader.IsValid())
    {
-      code = this->GetData<uint32>();
-      sequence = this->GetData<uint32>();
+      // a call's timeout is part of its header.
+      reader.GetTimeout();
+      code = reader.GetCode();
+      sequence = reader.GetSequence();
+      fNextOffset = reader.GetOffset();
       retval = true;
    }
    return retval;
 }
 
 
+void RpcMessage::AppendHeader(uint32 code, uint32 sequence)
+{
+   this->AppendUInt(code);
+   this->AppendUInt(sequence);
+}
+
+
 void RpcMessage::AppendData(const void* data, size_t numBytes)
 {
-   fData.append(data, numBytes);
+   fData.Append(data, numBytes);
+}
+
+
+void RpcMessage::AppendVarUInt(uint64 val)
+{
+   // 7 bits at a time, low bits first; the high bit of each byte is set if 
+   // there are more bytes to follow.
+   uint8 bytes[10];
+   size_t numBytes = 0;
+   do
+   {
+      uint8 b = static_cast<uint8>(val & 0x7F);
+      val >>= 7;
+      if (val)
+      {
+         b |= 0x80;
+      }
+      bytes[numBytes++] = b;
+   }
+   while (val);
+
+   this->AppendData(bytes, numBytes);
+}
+
+
+void RpcMessage::AppendUInt(uint32 val)
+{
+   if (fOptions & kCompactEncoding)
+   {
+      this->AppendVarUInt(val);
+   }
+   else
+   {
+      this->AppendData<uint32>(val);
+   }
+}
+
+
+void RpcMessage::AppendInt(int val)
+{
+   if (fOptions & kCompactEncoding)
+   {
+      // zigzag encoding keeps small negative numbers small.
+      uint32 zigzag = (static_cast<uint32>(val) << 1) ^ static_cast<uint32>(val >> 31);
+      this->AppendVarUInt(zigzag);
+   }
+   else
+   {
+      this->AppendData<int>(val);
+   }
+}
+
+
+void RpcMessage::AppendInt64(int64 val)
+{
+   if (fOptions & kCompactEncoding)
+   {
+      uint64 zigzag = (static_cast<uint64>(val) << 1) ^ static_cast<uint64>(val >> 63);
+      this->AppendVarUInt(zigzag);
+   }
+   else
+   {
+      this->AppendData<int64>(val);
+   }
+}
+
+
+void RpcMessage::AppendTypeTag(DataType type)
+{
+   if (fOptions & kCompactEncoding)
+   {
+      this->AppendData<uint8>(static_cast<uint8>(type));
+   }
+   else
+   {
+      this->AppendData<int>(type);
+   }
 }
 
 
@@ -103,34 +336,34 @@ void RpcMessage::AppendVar(const var& value)
 {
    if (value.isInt())
    {
-      this->AppendData<int>(kInt);
-      this->AppendData<int>(int(value));
+      this->AppendTypeTag(kInt);
+      this->AppendInt(int(value));
    }
    else if (value.isInt64())
    {
-      this->AppendData<int>(kInt64);
-      this->AppendData<int64>(int64(value));
+      this->AppendTypeTag(kInt64);
+      this->AppendInt64(int64(value));
    }
    else if (value.isBool())
    {
-      this->AppendData<int>(kBool);
+      this->AppendTypeTag(kBool);
       this->AppendData<bool>(bool(value));
    }
 
    else if (value.isDouble())
    {
-      this->AppendData<int>(kDouble);
+      this->AppendTypeTag(kDouble);
       this->AppendData<double>(double(value));
    }
    else if (value.isString())
    {
-      this->AppendData<int>(kString);
+      this->AppendTypeTag(kString);
       String s = value;
       this->AppendString(s);
    }
    else if (value.isVoid())
    {
-      this->AppendData<int>(kVoid);
+      this->AppendTypeTag(kVoid);
    }
    else 
    {
@@ -143,8 +376,16 @@ void RpcMessage::AppendString(const String& s)
 {
    const char* p = s.toRawUTF8();
    // getBytesRequiredFor() does *not* include the trailing NULL.
-   size_t len = 1 + CharPointer_UTF8::getBytesRequiredFor(s.getCharPointer());
-   this->AppendData(static_cast<void*>(const_cast<char*>(p)), len);
+   size_t len = CharPointer_UTF8::getBytesRequiredFor(s.getCharPointer());
+   if (fOptions & kLengthPrefixedStrings)
+   {
+      this->AppendUInt(static_cast<uint32>(len));
+      this->AppendData(p, len);
+   }
+   else
+   {
+      this->AppendData(p, len + 1);
+   }
 
 }
 
@@ -155,6 +396,24 @@ void RpcMessage::AppendValueTree(const ValueTree& tree)
    sync.GetTreeData();
 }
 
+
+void RpcMessage::AppendTreeChange(const void* change, size_t size)
+{
+   if (fOptions & kDelimitedTrees)
+   {
+      this->AppendUInt(static_cast<uint32>(size));
+   }
+   this->AppendData(change, size);
+}
+
+
+void RpcMessage::AppendMessage(const RpcMessage& msg)
+{
+   const RpcBuffer& data = msg.GetBuffer();
+   this->AppendUInt(static_cast<uint32>(data.GetSize()));
+   this->AppendData(data.GetData(), data.GetSize());
+}
+
 /*
 void RpcMessage::SetTreePropertyString(const String& path, const String& val)
 {
@@ -165,91 +424,83 @@ void RpcMessage::SetTreePropertyString(const String& path, const String& val)
 */
 
 
-var RpcMessage::GetVar(size_t offset)
+int RpcMessage::GetInt(size_t offset)
 {
-   DataType type = static_cast<DataType>(this->GetData<int>(offset));
-   var retval;
-   bool isValid = true;
-   switch (type)
-   {
-      case kInt:
-      {
-         retval = this->GetData<int>();
-      }
-      break;
-
-      case kInt64:
-      {
-         retval = this->GetData<int64>();
-      }
-      break;
-
-      case kBool:
-      {
-         retval = this->GetData<bool>();    
-
-      }
-      break;
-      case kDouble:
-      {
-         retval = this->GetData<double>();
-      }
-      break;
+   RpcMessageReader reader = this->GetReader(offset);
+   int retval = reader.GetInt();
+   fNextOffset = reader.GetOffset();
+   return retval;
+}
 
-      case kString:
-      {
-         retval = this->GetString();
-      }
-      break;
 
-      case kVoid:
-      {
-         // empty on purpose; retval is already a void var.
-      }
+int64 RpcMessage::GetInt64(size_t offset)
+{
+   RpcMessageReader reader = this->GetReader(offset);
+   int64 retval = reader.GetInt64();
+   fNextOffset = reader.GetOffset();
+   return retval;
+}
 
-      default:
-      {
-         // a place to add a breakpoint.
-         isValid = false;
-      }
-   }
 
+var RpcMessage::GetVar(size_t offset)
+{
+   RpcMessageReader reader = this->GetReader(offset);
+   var retval = reader.GetVar();
+   fNextOffset = reader.GetOffset();
    return retval;
 }
 
 String RpcMessage::GetString(size_t offset)
 {
-   void* p = this->GetDataPointer(offset);
-   const char* s = static_cast<const char*>(p);
-   size_t rawLen = 1 + strlen(s);
-   fNextOffset += rawLen;
-   return String(CharPointer_UTF8(s));
+   return this->GetStringView(offset).ToString();
+}
 
+
+RpcStringView RpcMessage::GetStringView(size_t offset)
+{
+   RpcMessageReader reader = this->GetReader(offset);
+   RpcStringView retval = reader.GetStringView();
+   fNextOffset = reader.GetOffset();
+   return retval;
 }
 
 
 // void RpcMessage::GetValueTree(ValueTree& target, size_t offset)
 String RpcMessage::GetValueTree(ValueTree& target, size_t offset)
 { 
-   void* p = this->GetDataPointer(offset);
-   size_t len = fData.getSize() - fNextOffset;
+   RpcMessageReader reader = this->GetReader(offset);
+   const size_t start = reader.GetOffset();
+   reader.GetValueTree(target);
+   fNextOffset = reader.GetOffset();
 
-   String delta = String::toHexString(p, len);
+   String delta = String::toHexString(this->GetDataPointer(start), 
+      static_cast<int>(fNextOffset - start));
    DBG(delta);
-
-   ValueTreeSynchroniser::applyChange(target, p, len, nullptr);
    return delta;
 
 }
 
 
+RpcMessageReader RpcMessage::GetReader(size_t offset) const
+{
+   if (kUseNextOffset == offset)
+   {
+      offset = fNextOffset;
+   }
+   RpcMessageReader reader(fData.GetData(), fData.GetSize(), fOptions);
+   reader.Seek(offset);
+   return reader;
+}
+
+
 void RpcMessage::ResetData()
 {
    uint32 code;
    uint32 sequence;
 
    this->GetMetadata(code, sequence);
-   fData.reset();
+   // keep our memory around for the next use.
+   fData.Clear();
 
    fNextOffset = 0;
 
@@ -257,51 +508,18 @@ void RpcMessage::ResetData()
    {
        sequence = RpcMessage::GetSequence(kUseNextSequence);
    }
-   this->AppendData<uint32>(code);
-   this->AppendData<uint32>(sequence);
+   this->AppendHeader(code, sequence);
 
 
 }
 
 void RpcMessage::ApplyTreeProperty(ValueTree root)
 {
-   String path = this->GetString();
-
-   DBG("PATH = " + path);
-
+   RpcMessageReader reader = this->GetReader(kUseNextOffset);
+   bool isValid = reader.ApplyTreeProperty(root);
+   fNextOffset = reader.GetOffset();
 
-   // !!! unpack path & get the target tree
-   ValueTree target = root;
-   String propertyName = "";
-
-   while (true)
-   {
-      int slashPosition = path.indexOfChar('/');
-      if (-1 == slashPosition)
-      {  
-         // if there are no more slashes, the remaining part of 
-         // `path` is the property name.
-         propertyName = path;
-         break;
-      }
-      else
-      {
-         String treeName = path.substring(0, slashPosition);
-         path = path.substring(slashPosition + 1);
-
-         target = target.getOrCreateChildWithName(treeName, nullptr);
-      }
-   }
-   var newValue = this->GetVar();
-
-   bool isValid = (!newValue.isVoid());
-
-   if (isValid)
-   {
-      // actually set the property!
-      target.setProperty(propertyName, newValue, nullptr);
-   }
-   else
+   if (!isValid)
    {
       // figure out what's wrong...
       jassert(false);
@@ -481,7 +699,58 @@ public:
       DBG("\n\nTarget:");
       DBG(target.toXmlString());
       this->expect(tree.isEquivalentTo(target));      
-      
+
+      this->beginTest("Delimited ValueTrees");
+      const uint32 delimited = RpcMessage::kDelimitedTrees | RpcMessage::kCompactEncoding;
+      ValueTree mixer("mixer");
+      mixer.setProperty("volume", 0.5, nullptr);
+      RpcMessage m7(1000, 0, delimited);
+      m7.AppendValueTree(tree);
+      m7.AppendValueTree(mixer);
+      {
+         // two changes to the same tree, one after the other.
+         RpcValueTreeSync sync2(&m7, mixer);
+         mixer.setProperty("volume", 0.75, nullptr);
+         mixer.setProperty("muted", true, nullptr);
+      }
+      m7.AppendString("trailing");
+      m7.AppendInt(-42);
+
+      MemoryBlock m7Data(m7.GetMemoryBlock());
+      RpcMessageReader r7(m7Data, delimited);
+      ValueTree target1;
+      ValueTree target2;
+      this->expect(r7.GetValueTree(target1));
+      this->expect(r7.GetValueTree(target2));
+      this->expect(r7.GetValueTree(target2));
+      this->expect(r7.GetValueTree(target2));
+      this->expect(r7.GetString() == "trailing");
+      this->expect(-42 == r7.GetInt());
+      this->expect(r7.IsValid());
+      this->expect(0 == r7.GetBytesRemaining());
+      this->expect(tree.isEquivalentTo(target1));
+      this->expect(mixer.isEquivalentTo(target2));
+
+      // RpcMessage's own cursor advances past each tree the same way.
+      ValueTree target3;
+      m7.GetMetadata(code, sequence);
+      m7.GetValueTree(target3);
+      m7.GetValueTree(target3);
+      this->expect(mixer.isEquivalentTo(target3) == false);
+      this->expect(String("mixer") == target3.getType().toString());
+      m7.GetValueTree(target3);
+      m7.GetValueTree(target3);
+      this->expect(mixer.isEquivalentTo(target3));
+      this->expect(m7.GetString() == "trailing");
+
+      // a change whose size runs past the end of the message.
+      RpcMessage m8(1000, 0, delimited);
+      m8.AppendUInt(100);
+      m8.AppendString("too short");
+      MemoryBlock m8Data(m8.GetMemoryBlock());
+      RpcMessageReader r8(m8Data, delimited);
+      this->expect(!r8.GetValueTree(target1));
+      this->expect(!r8.IsValid());
        
       /*
       ValueTree tree2("test 2");
@@ -804,9 +1073,101 @@ public:
    }
 };
 
+class RpcStringTest : public UnitTest
+{
+public:
+   RpcStringTest() : UnitTest("RpcMessage string encoding") {}
+
+   void runTest() override
+   {
+      uint32 code;
+      uint32 sequence;
+
+      this->beginTest("Length-prefixed strings");
+      RpcMessage m1(1, 0, RpcMessage::kLengthPrefixedStrings);
+      String s1("malarkey");
+      String s2(CharPointer_UTF8("caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x8e\xb9"));
+      m1.AppendString(s1);
+      m1.AppendString(String());
+      m1.AppendString(s2);
+      m1.AppendData(-1);
+
+      // 8 bytes of header, 3 length prefixes, no terminators.
+      size_t expected = 8 + 3 * sizeof(uint32) + s1.getNumBytesAsUTF8() + 
+         s2.getNumBytesAsUTF8() + sizeof(int);
+      this->expect(expected == m1.GetMemoryBlock().getSize());
+
+      RpcMessage m2(m1.GetMemoryBlock(), RpcMessage::kLengthPrefixedStrings);
+      m2.GetMetadata(code, sequence);
+      this->expect(s1 == m2.GetString());
+      this->expect(m2.GetString().isEmpty());
+      this->expect(s2 == m2.GetString());
+      this->expect(-1 == m2.GetData<int>());
+
+      this->beginTest("String views");
+      m2.GetMetadata(code, sequence);
+      RpcStringView v1 = m2.GetStringView();
+      RpcStringView v2 = m2.GetStringView();
+      RpcStringView v3 = m2.GetStringView();
+      this->expect(v1 == s1);
+      this->expect(v1 == "malarkey");
+      this->expect(v1 != "malarke");
+      this->expect(v2.IsEmpty());
+      this->expect(v3 == s2);
+      this->expect(v3.ToString() == s2);
+      this->expect(v1.GetHash() == RpcStringView("malarkey", 8).GetHash());
+      this->expect(v1.GetHash() != v3.GetHash());
+
+      // views work the same way over NUL-terminated strings.
+      RpcMessage m3(1, 0);
+      m3.AppendString(s2);
+      m3.GetMetadata(code, sequence);
+      this->expect(m3.GetStringView() == s2);
+
+      this->beginTest("Truncated strings");
+      RpcMessage m4(1, 0, RpcMessage::kLengthPrefixedStrings);
+      m4.AppendData<uint32>(100);
+      m4.AppendData("abc", 3);
+      m4.GetMetadata(code, sequence);
+      this->expect(m4.GetStringView().IsEmpty());
+
+      RpcMessage m5(1, 0);
+      m5.AppendData("abc", 3);
+      m5.GetMetadata(code, sequence);
+      this->expect(m5.GetString().isEmpty());
+
+      this->beginTest("UTF-8 validation");
+      const char* ascii = "The quick brown fox jumps over the lazy dog";
+      this->expect(RpcStringView::IsValidUtf8(ascii, strlen(ascii)));
+      this->expect(RpcStringView::IsValidUtf8(s2.toRawUTF8(), s2.getNumBytesAsUTF8()));
+      this->expect(RpcStringView::IsValidUtf8("", 0));
+      // embedded NUL in the fast and slow paths
+      this->expect(!RpcStringView::IsValidUtf8("abcdefg\0ijklmnop", 17));
+      this->expect(!RpcStringView::IsValidUtf8("ab\0", 3));
+      // overlong '/'
+      this->expect(!RpcStringView::IsValidUtf8("\xc0\xaf", 2));
+      // UTF-16 surrogate
+      this->expect(!RpcStringView::IsValidUtf8("\xed\xa0\x80", 3));
+      // > U+10FFFF
+      this->expect(!RpcStringView::IsValidUtf8("\xf4\x90\x80\x80", 4));
+      // truncated sequence after a run of ASCII
+      this->expect(!RpcStringView::IsValidUtf8("abcdefgh\xe2\x82", 10));
+      // stray continuation byte
+      this->expect(!RpcStringView::IsValidUtf8("abc\x80", 4));
+
+      RpcMessage m6(1, 0, RpcMessage::kLengthPrefixedStrings);
+      m6.AppendData<uint32>(2);
+      m6.AppendData("\xc0\xaf", 2);
+      m6.GetMetadata(code, sequence);
+      this->expect(m6.GetStringView().IsEmpty());
+   }
+};
+
+
 static RpcMessageTest tests;
 static RpcMessageTest2 test2;
 static RpcMessageTest3 test3;
 static RpcMessageTest4 test4;
+static RpcStringTest stringTest;
 
 
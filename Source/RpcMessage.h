@@ -9,6 +9,75 @@
 
 #include "../JuceLibraryCode/JuceHeader.h"
 
+#include "RpcBuffer.h"
+
+class RpcMessageReader;
+
+/**
+ * @class RpcStringView
+ *
+ * A bounded, non-owning view of a UTF-8 string that lives inside a received
+ * message. Handlers that only need to compare or hash a string argument can 
+ * use this directly and never allocate a `String` object. 
+ *
+ * The view is only valid as long as the message data it points into.
+ */
+class RpcStringView
+{
+public:
+   RpcStringView() : fData(nullptr), fLength(0) {}
+
+   RpcStringView(const char* data, size_t length)
+   :  fData(data)
+   ,  fLength(length)
+   {
+
+   }
+
+   const char* GetData() const { return fData; }
+
+   /**
+    * @return Number of bytes (not characters) in the string.
+    */
+   size_t GetLength() const { return fLength; }
+
+   bool IsEmpty() const { return 0 == fLength; }
+
+   /**
+    * Create a JUCE String holding a copy of the viewed text.
+    */
+   String ToString() const;
+
+   /**
+    * @return an FNV-1a hash of the string's bytes.
+    */
+   uint32 GetHash() const;
+
+   bool operator==(const RpcStringView& rhs) const;
+   bool operator!=(const RpcStringView& rhs) const { return !(*this == rhs); }
+
+   bool operator==(const char* rhs) const;
+   bool operator!=(const char* rhs) const { return !(*this == rhs); }
+
+   bool operator==(const String& rhs) const;
+   bool operator!=(const String& rhs) const { return !(*this == rhs); }
+
+   /**
+    * Check that a block of bytes is well-formed UTF-8 that a JUCE String can 
+    * hold (no overlong encodings, surrogates, or embedded NULs). Runs of ASCII 
+    * are checked 8 bytes at a time, so the common case is a single pass over
+    * the buffer with no per-character decoding.
+    * @param  data     start of the bytes to check
+    * @param  numBytes number of bytes to check.
+    * @return          true if the data is valid.
+    */
+   static bool IsValidUtf8(const char* data, size_t numBytes);
+
+private:
+   const char* fData;
+   size_t      fLength;
+};
+
 
 /**
  * @class RpcMessage
@@ -25,6 +94,9 @@
  * Eventually the server sends us back a message with the function results, and we look up the 
  * pending transaction, signaling the waiting thread that it has data, which it can unpack
  * and return as if this had been a synchronous in-process function call.
+ *
+ * Message data is held in an RpcBuffer, so small messages are built without any 
+ * heap allocation at all. 
  */
 
 class RpcMessage
@@ -37,6 +109,119 @@ public:
    };
 
 
+   /**
+    * Optional wire format features. The client and server agree on a set of 
+    * these when the connection is made (see Controller::kNegotiate); until 
+    * then (and with peers that don't know how to negotiate) every message
+    * uses the original kLegacyFormat.
+    */
+   enum WireOptions
+   {
+      kLegacyFormat           = 0x00,
+      /**
+       * Strings are sent as a uint32 byte count followed by UTF-8 data 
+       * instead of being NUL-terminated.
+       */
+      kLengthPrefixedStrings  = 0x01,
+
+      /**
+       * The message code, sequence number, string lengths and integer values
+       * are sent as LEB128 varints (zigzag-encoded if signed), and `var` 
+       * type tags are a single byte.
+       */
+      kCompactEncoding        = 0x02,
+
+      /**
+       * Large messages may be sent zlib-compressed; see RpcCompression.
+       */
+      kCompressedFrames       = 0x04,
+
+      /**
+       * Small messages may be encoded against a window of earlier ones; 
+       * see RpcDictionaryWindow. Only agreed on if both ends were given the 
+       * same pre-trained dictionary.
+       */
+      kDictionaryFrames       = 0x08,
+
+      /**
+       * Each ValueTree change is preceded by its size (as written by 
+       * AppendUInt()) instead of running to the end of the message, so a 
+       * message can hold several of them followed by other parameters.
+       */
+      kDelimitedTrees         = 0x10,
+
+      /**
+       * The server accepts several calls in one Controller::kBatch message, 
+       * and answers them all in one response (see RpcBatch).
+       */
+      kBatchedCalls           = 0x20,
+
+      /**
+       * A call with sequence number 0 is one-way: the server handles it but
+       * never sends a response, not even an exception. See 
+       * ClientController::CallOneWay().
+       */
+      kOneWayCalls            = 0x40,
+
+      /**
+       * A call may carry a deadline: its code has kDeadlineFlag set, and 
+       * its header is followed by the number of milliseconds (as written 
+       * by AppendUInt()) that the caller will wait for it. The server 
+       * doesn't start calls whose deadlines have passed, and runs the 
+       * ones that it queues earliest deadline first.
+       */
+      kCallDeadlines          = 0x80,
+
+      /**
+       * The client may send a Controller::kCancel message when it gives up
+       * on a call, and the server won't start the call (or send its 
+       * response) if it hasn't already.
+       */
+      kCancelCalls            = 0x100,
+
+      /**
+       * All of the options that this build knows how to speak.
+       */
+      kSupportedOptions       = kLengthPrefixedStrings | kCompactEncoding | 
+                                kCompressedFrames | kDictionaryFrames | 
+                                kDelimitedTrees | kBatchedCalls | 
+                                kOneWayCalls | kCallDeadlines | 
+                                kCancelCalls
+   };
+
+
+   /**
+    * Bits that may be set in a message code on the wire. No message code 
+    * uses these itself.
+    */
+   enum CodeFlags
+   {
+      /**
+       * The rest of the message is compressed (kCompressedFrames only).
+       */
+      kCompressedFlag         = 0x80000000,
+
+      /**
+       * The header is followed by the call's timeout (kCallDeadlines only;
+       * see RpcMessageReader::GetTimeout()).
+       */
+      kDeadlineFlag           = 0x40000000
+   };
+
+
+   /**
+    * Message codes used by the wire format itself.
+    */
+   enum ReservedCodes
+   {
+      /**
+       * With kDictionaryFrames, a message with this code holds another 
+       * message, dictionary-encoded. No method uses code 0.
+       */
+      kEncodedMessageCode     = 0
+   };
+
+
    /**
     * We support setting value tree properties for most of the data types that the
     * JUCE `var` type can hold.
@@ -53,29 +238,64 @@ public:
 
    /**
     * Create an empty RpcMessage object.
+    * @param options Bitmask of WireOptions values used to encode the message.
     */
-   RpcMessage(uint32 code=0, uint32 sequence=kUseNextSequence);
+   RpcMessage(uint32 code=0, uint32 sequence=kUseNextSequence, 
+      uint32 options=kLegacyFormat);
+
+   /**
+    * Create a call message that the server shouldn't start once 
+    * `timeoutMs` milliseconds have passed. Without the kCallDeadlines 
+    * option, or if `timeoutMs` is 0, it's an ordinary call.
+    */
+   RpcMessage(uint32 code, uint32 sequence, uint32 options, uint32 timeoutMs);
 
    /**
     * Initialize with an existing MemoryBlock object, which we must be in our
     * messagecode + data format. Used when parsing received messages.
+    * @param options WireOptions that the message was encoded with.
     */
-   RpcMessage(const MemoryBlock& message);
+   RpcMessage(const MemoryBlock& message, uint32 options=kLegacyFormat);
 
    ~RpcMessage();
 
 
-   const MemoryBlock& GetMemoryBlock() const
+   /**
+    * @return a view of the message data, without copying it. The view is only
+    *         good until the message is next modified; convert it to a
+    *         MemoryBlock to keep a copy.
+    */
+   RpcBufferView GetMemoryBlock() const
+   {
+      return RpcBufferView(fData.GetData(), fData.GetSize());
+   }
+
+   const RpcBuffer& GetBuffer() const
    {
       return fData;
    }
 
+   /**
+    * If you know how large a message is going to be, reserve space for it 
+    * so that it's allocated at most once.
+    * @param numBytes Total size of the message, including the header.
+    */
+   void Reserve(size_t numBytes)
+   {
+      fData.Reserve(numBytes);
+   }
+
    /**
     * Replace our existing contents with the provided memory block.
     * @param message [description]
     */
    void FromMemoryBlock(const MemoryBlock& message);
 
+   /**
+    * @return the WireOptions bitmask this message is encoded with.
+    */
+   uint32 GetOptions() const { return fOptions; }
+
 
    /**
     * Retrieve the message's function code and sequence number, leaving the offset
@@ -100,6 +320,36 @@ public:
       this->AppendData(&val, sizeof(T));
    }
 
+   /**
+    * Append an unsigned LEB128 varint, whatever our options are.
+    */
+   void AppendVarUInt(uint64 val);
+
+   /**
+    * Append integer values. With the kCompactEncoding option these are 
+    * written as varints (zigzag-encoded for the signed types), otherwise 
+    * they're fixed-size.
+    */
+   void AppendUInt(uint32 val);
+   void AppendInt(int val);
+   void AppendInt64(int64 val);
+
+   /**
+    * Append one of the DataType values, as a single byte with the 
+    * kCompactEncoding option or an int without it.
+    */
+   void AppendTypeTag(DataType type);
+
+   /**
+    * Append a value whose type is already known to the receiver, using the 
+    * most compact representation our options allow.
+    */
+   void AppendValue(int val)           { this->AppendInt(val); }
+   void AppendValue(int64 val)         { this->AppendInt64(val); }
+   void AppendValue(bool val)          { this->AppendData<bool>(val); }
+   void AppendValue(double val)        { this->AppendData<double>(val); }
+   void AppendValue(const String& val) { this->AppendString(val); }
+
 
    /**
     * Append a JUCE var object to our data. Note that we only support a subset of 
@@ -109,16 +359,35 @@ public:
     */
    void AppendVar(const var& val);
     
+   /**
+    * Append a string, either NUL-terminated or length-prefixed depending on 
+    * whether this message uses the kLengthPrefixedStrings option.
+    */
    void AppendString(const String& s);
 
 
    /**
-    * Add a ValueTree object to this message. NOTE that for things to work, we
-    * require that the ValueTree data be the last thing in the message.
+    * Add a ValueTree object to this message. Unless this message uses the 
+    * kDelimitedTrees option, the ValueTree data must be the last thing in 
+    * the message.
     * @param tree ValueTree object to send.
     */
    void AppendValueTree(const ValueTree& tree);
 
+   /**
+    * Add one change to a tree, as passed to 
+    * ValueTreeSynchroniser::stateChanged(). The same rule about being last
+    * in the message applies.
+    */
+   void AppendTreeChange(const void* change, size_t size);
+
+   /**
+    * Add a whole message (header and all), preceded by its size as written 
+    * by AppendUInt(). Used to carry several calls or responses in one 
+    * message; see RpcMessageReader::GetMessage().
+    */
+   void AppendMessage(const RpcMessage& msg);
+
    /**
     * Set a property value in a ValueTree on the server. Since ValueTrees can 
     * be recursive, the `path` variable may contain forward slashes to indicate 
@@ -142,11 +411,9 @@ public:
    template <typename T>
    void SetTreeProperty(const String& path, DataType type, T val)
    {
-
-      jassert(RpcMessage::kString != type);
       this->AppendString(path);
-      this->AppendData<int>(type);
-      this->AppendData<T>(val);
+      this->AppendTypeTag(type);
+      this->AppendValue(val);
    }
 
 
@@ -161,27 +428,51 @@ public:
          offset = fNextOffset;
       }
 
-      char* dataStart = offset + static_cast<char*>(fData.getData());
-      return static_cast<void*>(dataStart);   
+      const char* dataStart = offset + static_cast<const char*>(fData.GetData());
+      return const_cast<char*>(dataStart);   
    }
 
    /**
     * Return a primitive POD object from the message object, by default at the next
-    * offset.
+    * offset. Returns a default-constructed T if the message is too short.
     */
    template <typename T>
    T GetData(size_t offset=kUseNextOffset)
    {
-      void* p = this->GetDataPointer(offset);
-      fNextOffset += sizeof(T);
-      return * (static_cast<T*>(p));
+      if (kUseNextOffset == offset)
+      {
+         offset = fNextOffset;
+      }
+
+      T retval = T();
+      if (offset + sizeof(T) <= fData.GetSize())
+      {
+         // the data may not be aligned for a T.
+         memcpy(&retval, this->GetDataPointer(offset), sizeof(T));
+      }
+      fNextOffset = offset + sizeof(T);
+      return retval;
    }
 
 
+    /**
+     * Counterparts to AppendInt() and friends.
+     */
+    int GetInt(size_t offset=kUseNextOffset);
+    int64 GetInt64(size_t offset=kUseNextOffset);
+
     var GetVar(size_t offset = kUseNextOffset);
 
     String GetString(size_t offset=kUseNextOffset);
 
+    /**
+     * Return a view of the next string in the message without copying it. 
+     * The view points into this message's data, so it becomes invalid when 
+     * this message is changed or destroyed. If the string data isn't 
+     * valid UTF-8, returns an empty view.
+     */
+    RpcStringView GetStringView(size_t offset=kUseNextOffset);
+
     // void GetValueTree(ValueTree& target, size_t offset=kUseNextOffset);
     String GetValueTree(ValueTree& target, size_t offset=kUseNextOffset);
 
@@ -204,21 +495,26 @@ public:
 private:
     static uint32 GetSequence(uint32 sequence);
 
+    /**
+     * Write the message code and sequence number, in the format that our 
+     * options call for.
+     */
+    void AppendHeader(uint32 code, uint32 sequence);
+
+    /**
+     * Create a reader over our data, positioned at `offset` (or our next 
+     * offset).
+     */
+    RpcMessageReader GetReader(size_t offset) const;
+
 private:
 
-   MemoryBlock fData;
+   RpcBuffer   fData;
    size_t      fNextOffset;
+   uint32      fOptions;
 
 };
 
 
 
-/*
-template <>
-void RpcMessage::SetTreeProperty<String>(const String& path, DataType type, String val)
-{
-
-}
-*/
-
 #endif  // IPCMESSAGE_H_INCLUDED
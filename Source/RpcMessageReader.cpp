@@ -0,0 +1,587 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcMessageReader.h"
+
+
+RpcMessageReader::RpcMessageReader(const void* data, size_t size, uint32 options)
+:  fData(static_cast<const char*>(data))
+,  fSize(size)
+,  fOffset(0)
+,  fOptions(options)
+,  fCode(0)
+,  fSequence(0)
+,  fError(false)
+{
+   this->ReadHeader();
+}
+
+
+RpcMessageReader::RpcMessageReader(const MemoryBlock& message, uint32 options)
+:  fData(static_cast<const char*>(message.getData()))
+,  fSize(message.getSize())
+,  fOffset(0)
+,  fOptions(options)
+,  fCode(0)
+,  fSequence(0)
+,  fError(false)
+{
+   this->ReadHeader();
+}
+
+
+void RpcMessageReader::ReadHeader()
+{
+   fCode = this->GetUInt();
+   fSequence = this->GetUInt();
+}
+
+
+void RpcMessageReader::SetError()
+{
+   fError = true;
+   // make sure that nothing else gets read.
+   fOffset = fSize;
+}
+
+
+void RpcMessageReader::Seek(size_t offset)
+{
+   if (fError || offset > fSize)
+   {
+      this->SetError();
+   }
+   else
+   {
+      fOffset = offset;
+   }
+}
+
+
+bool RpcMessageReader::Read(void* dest, size_t numBytes)
+{
+   const void* p = this->Skip(numBytes);
+   if (nullptr != p)
+   {
+      memcpy(dest, p, numBytes);
+   }
+   return (nullptr != p);
+}
+
+
+const void* RpcMessageReader::Skip(size_t numBytes)
+{
+   if (fError || (numBytes > fSize - fOffset))
+   {
+      this->SetError();
+      return nullptr;
+   }
+
+   const void* retval = fData + fOffset;
+   fOffset += numBytes;
+   return retval;
+}
+
+
+uint64 RpcMessageReader::GetVarUInt()
+{
+   uint64 retval = 0;
+   for (int shift = 0; shift < 64; shift += 7)
+   {
+      uint8 b = this->GetData<uint8>();
+      if (fError)
+      {
+         return 0;
+      }
+      // the 10th byte may only hold the single remaining bit.
+      if ((63 == shift) && (b > 1))
+      {
+         break;
+      }
+      retval |= static_cast<uint64>(b & 0x7F) << shift;
+      if (0 == (b & 0x80))
+      {
+         return retval;
+      }
+   }
+
+   this->SetError();
+   return 0;
+}
+
+
+uint32 RpcMessageReader::GetUInt()
+{
+   if (0 == (fOptions & RpcMessage::kCompactEncoding))
+   {
+      return this->GetData<uint32>();
+   }
+
+   uint64 val = this->GetVarUInt();
+   if (val > 0xFFFFFFFF)
+   {
+      this->SetError();
+      return 0;
+   }
+   return static_cast<uint32>(val);
+}
+
+
+int RpcMessageReader::GetInt()
+{
+   if (0 == (fOptions & RpcMessage::kCompactEncoding))
+   {
+      return this->GetData<int>();
+   }
+
+   uint64 val = this->GetVarUInt();
+   if (val > 0xFFFFFFFF)
+   {
+      this->SetError();
+      return 0;
+   }
+   uint32 zigzag = static_cast<uint32>(val);
+   return static_cast<int>((zigzag >> 1) ^ (0 - (zigzag & 1)));
+}
+
+
+int64 RpcMessageReader::GetInt64()
+{
+   if (0 == (fOptions & RpcMessage::kCompactEncoding))
+   {
+      return this->GetData<int64>();
+   }
+
+   uint64 zigzag = this->GetVarUInt();
+   return static_cast<int64>((zigzag >> 1) ^ (0 - (zigzag & 1)));
+}
+
+
+RpcMessage::DataType RpcMessageReader::GetTypeTag()
+{
+   if (fOptions & RpcMessage::kCompactEncoding)
+   {
+      return static_cast<RpcMessage::DataType>(this->GetData<uint8>());
+   }
+   return static_cast<RpcMessage::DataType>(this->GetData<int>());
+}
+
+
+var RpcMessageReader::GetVar()
+{
+   RpcMessage::DataType type = this->GetTypeTag();
+   var retval;
+   switch (type)
+   {
+      case RpcMessage::kInt:
+      {
+         retval = this->GetInt();
+      }
+      break;
+
+      case RpcMessage::kInt64:
+      {
+         retval = this->GetInt64();
+      }
+      break;
+
+      case RpcMessage::kBool:
+      {
+         retval = this->GetData<bool>();
+      }
+      break;
+
+      case RpcMessage::kDouble:
+      {
+         retval = this->GetData<double>();
+      }
+      break;
+
+      case RpcMessage::kString:
+      {
+         retval = this->GetString();
+      }
+      break;
+
+      case RpcMessage::kVoid:
+      {
+         // empty on purpose; retval is already a void var.
+      }
+      break;
+
+      default:
+      {
+         this->SetError();
+      }
+      break;
+   }
+
+   if (fError)
+   {
+      retval = var();
+   }
+   return retval;
+}
+
+
+String RpcMessageReader::GetString()
+{
+   return this->GetStringView().ToString();
+}
+
+
+RpcStringView RpcMessageReader::GetStringView()
+{
+   const char* p = nullptr;
+   size_t length = 0;
+
+   if (fOptions & RpcMessage::kLengthPrefixedStrings)
+   {
+      uint32 prefix = this->GetUInt();
+      p = static_cast<const char*>(this->Skip(prefix));
+      length = prefix;
+   }
+   else if (!fError)
+   {
+      // never scan past the end of the message looking for the terminator.
+      p = fData + fOffset;
+      const void* terminator = memchr(p, 0, fSize - fOffset);
+      if (nullptr == terminator)
+      {
+         this->SetError();
+      }
+      else
+      {
+         length = static_cast<const char*>(terminator) - p;
+         this->Skip(length + 1);
+      }
+   }
+
+   if (fError)
+   {
+      return RpcStringView();
+   }
+
+   if (!RpcStringView::IsValidUtf8(p, length))
+   {
+      this->SetError();
+      return RpcStringView();
+   }
+   return RpcStringView(p, length);
+}
+
+
+bool RpcMessageReader::GetValueTree(ValueTree& target)
+{
+   size_t len = this->GetBytesRemaining();
+   if (fOptions & RpcMessage::kDelimitedTrees)
+   {
+      len = this->GetUInt();
+   }
+   const void* p = this->Skip(len);
+   if (nullptr == p)
+   {
+      return false;
+   }
+   return ValueTreeSynchroniser::applyChange(target, p, len, nullptr);
+}
+
+
+uint32 RpcMessageReader::GetTimeout()
+{
+   if (0 == (fCode & RpcMessage::kDeadlineFlag))
+   {
+      return 0;
+   }
+   fCode &= ~static_cast<uint32>(RpcMessage::kDeadlineFlag);
+   return this->GetUInt();
+}
+
+
+RpcMessageReader RpcMessageReader::GetMessage()
+{
+   const size_t len = this->GetUInt();
+   const void* p = this->Skip(len);
+   if (nullptr == p)
+   {
+      // too short to hold a header, so the new reader is invalid too.
+      return RpcMessageReader(nullptr, 0, fOptions);
+   }
+   return RpcMessageReader(p, len, fOptions);
+}
+
+
+bool RpcMessageReader::ApplyTreeProperty(ValueTree root)
+{
+   RpcStringView path;
+   var newValue;
+   if (!this->GetTreeProperty(path, newValue) || 
+      !RpcMessageReader::SetTreeProperty(root, path, newValue))
+   {
+      this->SetError();
+      return false;
+   }
+   return true;
+}
+
+
+bool RpcMessageReader::GetTreeProperty(RpcStringView& path, var& value)
+{
+   path = this->GetStringView();
+   value = this->GetVar();
+
+   if (fError || path.IsEmpty() || value.isVoid())
+   {
+      this->SetError();
+      return false;
+   }
+   return true;
+}
+
+
+bool RpcMessageReader::SetTreeProperty(ValueTree root, const RpcStringView& path, 
+   const var& value)
+{
+   if (path.IsEmpty())
+   {
+      return false;
+   }
+
+   // walk down the path, creating child trees as needed. Everything after
+   // the last slash is the property name.
+   ValueTree target = root;
+   const char* start = path.GetData();
+   const char* end = start + path.GetLength();
+
+   while (true)
+   {
+      const char* slash = static_cast<const char*>(memchr(start, '/', end - start));
+      if (nullptr == slash)
+      {
+         break;
+      }
+      if (slash == start)
+      {
+         // an empty tree name.
+         return false;
+      }
+      String::CharPointerType nameStart(start);
+      String::CharPointerType nameEnd(slash);
+      Identifier treeName(nameStart, nameEnd);
+      target = target.getOrCreateChildWithName(treeName, nullptr);
+      start = slash + 1;
+   }
+
+   if (start == end)
+   {
+      // an empty property name.
+      return false;
+   }
+
+   String::CharPointerType nameStart(start);
+   String::CharPointerType nameEnd(end);
+   Identifier propertyName(nameStart, nameEnd);
+   target.setProperty(propertyName, value, nullptr);
+   return true;
+}
+
+
+/**
+ *  UNIT TEST CODE FOLLOWS
+ */
+
+
+
+class RpcMessageReaderTest : public UnitTest
+{
+public:
+   RpcMessageReaderTest() : UnitTest("RpcMessageReader Tests") {}
+
+   void runTest() override
+   {
+      this->beginTest("Header");
+      RpcMessage m1(77, 5);
+      m1.AppendData<char>('x');
+      m1.AppendData<double>(3.5);
+      m1.AppendString("malarkey");
+
+      MemoryBlock m1Data(m1.GetMemoryBlock());
+      RpcMessageReader r1(m1Data);
+      this->expect(r1.IsValid());
+      this->expect(77 == r1.GetCode());
+      this->expect(5 == r1.GetSequence());
+
+      this->beginTest("Unaligned reads");
+      this->expect('x' == r1.GetData<char>());
+      // this double starts at offset 9.
+      this->expect(3.5 == r1.GetData<double>());
+      this->expect(r1.GetStringView() == "malarkey");
+      this->expect(0 == r1.GetBytesRemaining());
+      this->expect(r1.IsValid());
+
+      this->beginTest("Reading past the end");
+      this->expect(0 == r1.GetData<int>());
+      this->expect(!r1.IsValid());
+      // once we're in the error state, nothing else can be read.
+      this->expect(r1.GetString().isEmpty());
+      this->expect(r1.GetVar().isVoid());
+
+      const MemoryBlock& block = m1Data;
+      RpcMessageReader r2(block.getData(), block.getSize() - 4);
+      this->expect('x' == r2.GetData<char>());
+      this->expect(3.5 == r2.GetData<double>());
+      // the string's terminator was cut off.
+      this->expect(r2.GetStringView().IsEmpty());
+      this->expect(!r2.IsValid());
+
+      RpcMessageReader r3(block.getData(), 6);
+      this->expect(!r3.IsValid());
+
+      this->beginTest("Bools");
+      RpcMessage bools(1, 0);
+      bools.AppendData<uint8>(0);
+      bools.AppendData<uint8>(1);
+      bools.AppendData<uint8>(0xa5);
+      MemoryBlock boolData(bools.GetMemoryBlock());
+      RpcMessageReader boolReader(boolData);
+      this->expect(!boolReader.GetData<bool>());
+      this->expect(boolReader.GetData<bool>());
+      // anything but 0 is true.
+      this->expect(boolReader.GetData<bool>());
+      this->expect(boolReader.IsValid());
+
+      this->beginTest("Vars");
+      RpcMessage m2(1, 0, RpcMessage::kLengthPrefixedStrings);
+      m2.AppendVar(var(201));
+      m2.AppendVar(var(int64(-202020)));
+      m2.AppendVar(var(true));
+      m2.AppendVar(var(231.010));
+      m2.AppendVar(var("This is a string value!"));
+      m2.AppendVar(var());
+
+      MemoryBlock m2Data(m2.GetMemoryBlock());
+      RpcMessageReader r4(m2Data, RpcMessage::kLengthPrefixedStrings);
+      this->expect(var(201) == r4.GetVar());
+      this->expect(var(int64(-202020)) == r4.GetVar());
+      this->expect(var(true) == r4.GetVar());
+      this->expect(var(231.010) == r4.GetVar());
+      this->expect(var("This is a string value!") == r4.GetVar());
+      this->expect(r4.GetVar().isVoid());
+      this->expect(r4.IsValid());
+
+      RpcMessage m3(1, 0);
+      m3.AppendData<int>(99);
+      MemoryBlock m3Data(m3.GetMemoryBlock());
+      RpcMessageReader r5(m3Data);
+      this->expect(r5.GetVar().isVoid());
+      this->expect(!r5.IsValid());
+
+      this->beginTest("Tree properties");
+      ValueTree root("root");
+      RpcMessage m4(1000);
+      m4.SetTreeProperty("sub1/sub2/intVal", RpcMessage::kInt, 1000);
+      MemoryBlock m4Data(m4.GetMemoryBlock());
+      RpcMessageReader r6(m4Data);
+      this->expect(r6.ApplyTreeProperty(root));
+      ValueTree sub2 = root.getChildWithName("sub1").getChildWithName("sub2");
+      this->expect(1000 == (int) sub2.getProperty("intVal"));
+
+      RpcMessage m5(1000);
+      m5.SetTreeProperty("sub1//intVal", RpcMessage::kInt, 1000);
+      MemoryBlock m5Data(m5.GetMemoryBlock());
+      RpcMessageReader r7(m5Data);
+      this->expect(!r7.ApplyTreeProperty(root));
+      this->expect(!r7.IsValid());
+
+      this->beginTest("ValueTrees");
+      ValueTree tree("test1");
+      tree.setProperty("foo", 1, nullptr);
+      RpcMessage m6;
+      m6.AppendValueTree(tree);
+      ValueTree target;
+      MemoryBlock m6Data(m6.GetMemoryBlock());
+      RpcMessageReader r8(m6Data);
+      this->expect(r8.GetValueTree(target));
+      this->expect(tree.isEquivalentTo(target));
+
+      this->beginTest("Varints");
+      const uint32 compact = RpcMessage::kCompactEncoding;
+      RpcMessage m7(300, 2, compact);
+      m7.AppendVarUInt(0);
+      m7.AppendVarUInt(127);
+      m7.AppendVarUInt(128);
+      m7.AppendVarUInt(0xFFFFFFFFFFFFFFFFULL);
+      m7.AppendInt(-1);
+      m7.AppendInt(std::numeric_limits<int>::min());
+      m7.AppendInt(std::numeric_limits<int>::max());
+      m7.AppendInt64(std::numeric_limits<int64>::min());
+      m7.AppendInt64(-202020);
+      // code 300 takes 2 bytes, sequence 2 takes one.
+      this->expect(3 + 1 + 1 + 2 + 10 + 1 + 5 + 5 + 10 + 3 == m7.GetBuffer().GetSize());
+
+      MemoryBlock m7Data(m7.GetMemoryBlock());
+      RpcMessageReader r9(m7Data, compact);
+      this->expect(300 == r9.GetCode());
+      this->expect(2 == r9.GetSequence());
+      this->expect(0 == r9.GetVarUInt());
+      this->expect(127 == r9.GetVarUInt());
+      this->expect(128 == r9.GetVarUInt());
+      this->expect(0xFFFFFFFFFFFFFFFFULL == r9.GetVarUInt());
+      this->expect(-1 == r9.GetInt());
+      this->expect(std::numeric_limits<int>::min() == r9.GetInt());
+      this->expect(std::numeric_limits<int>::max() == r9.GetInt());
+      this->expect(std::numeric_limits<int64>::min() == r9.GetInt64());
+      this->expect(-202020 == r9.GetInt64());
+      this->expect(r9.IsValid());
+      this->expect(0 == r9.GetBytesRemaining());
+
+      this->beginTest("Malformed varints");
+      // runs off the end of the message
+      const uint8 truncated[] = { 0x01, 0x02, 0x80, 0x80 };
+      RpcMessageReader r10(truncated, sizeof(truncated), compact);
+      this->expect(r10.IsValid());
+      this->expect(0 == r10.GetVarUInt());
+      this->expect(!r10.IsValid());
+
+      // more than 64 bits
+      const uint8 tooLong[] = { 0x01, 0x02, 
+         0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x02 };
+      RpcMessageReader r11(tooLong, sizeof(tooLong), compact);
+      this->expect(0 == r11.GetVarUInt());
+      this->expect(!r11.IsValid());
+
+      // a uint32 that's too big
+      const uint8 bigUInt[] = { 0x01, 0x02, 0x80, 0x80, 0x80, 0x80, 0x10 };
+      RpcMessageReader r12(bigUInt, sizeof(bigUInt), compact);
+      this->expect(0 == r12.GetUInt());
+      this->expect(!r12.IsValid());
+
+      this->beginTest("Compact vars and tree properties");
+      const uint32 allOptions = RpcMessage::kSupportedOptions;
+      RpcMessage m8(1, 0, allOptions);
+      m8.AppendVar(var(201));
+      m8.AppendVar(var(int64(-202020)));
+      m8.AppendVar(var(true));
+      m8.AppendVar(var(231.010));
+      m8.AppendVar(var("This is a string value!"));
+      m8.AppendVar(var());
+      m8.SetTreeProperty("sub1/sub2/strVal", RpcMessage::kString, String("yes"));
+
+      MemoryBlock m8Data(m8.GetMemoryBlock());
+      RpcMessageReader r13(m8Data, allOptions);
+      this->expect(var(201) == r13.GetVar());
+      this->expect(var(int64(-202020)) == r13.GetVar());
+      this->expect(var(true) == r13.GetVar());
+      this->expect(var(231.010) == r13.GetVar());
+      this->expect(var("This is a string value!") == r13.GetVar());
+      this->expect(r13.GetVar().isVoid());
+      this->expect(r13.ApplyTreeProperty(root));
+      this->expect(r13.IsValid());
+      this->expect(sub2.getProperty("strVal").toString() == "yes");
+   }
+};
+
+static RpcMessageReaderTest readerTest;
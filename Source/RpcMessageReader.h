@@ -0,0 +1,206 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCMESSAGEREADER_H_INCLUDED
+#define RPCMESSAGEREADER_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include "RpcMessage.h"
+
+
+/**
+ * @class RpcMessageReader
+ *
+ * A read-only cursor over a received message. Unlike an RpcMessage, the reader
+ * does not own (or copy) the message data -- it's meant to be created on the
+ * stack over the MemoryBlock that `InterprocessConnection::messageReceived()`
+ * hands us, and must not outlive that block.
+ *
+ * The message code and sequence number are parsed when the reader is created,
+ * leaving the cursor at the first byte of parameter data.
+ *
+ * Every read is bounds-checked. Reading past the end of the message (or
+ * finding data that doesn't make sense) puts the reader into an error state:
+ * the failed read returns a default value, all subsequent reads fail, and
+ * IsValid() returns false. Callers can decode all of their parameters and
+ * then check IsValid() once.
+ */
+class RpcMessageReader
+{
+public:
+   /**
+    * Create a reader over a block of raw message data.
+    * @param data    Start of the message (code + sequence + parameters)
+    * @param size    Number of bytes in the message
+    * @param options RpcMessage::WireOptions the message was encoded with.
+    */
+   RpcMessageReader(const void* data, size_t size,
+      uint32 options=RpcMessage::kLegacyFormat);
+
+   RpcMessageReader(const MemoryBlock& message,
+      uint32 options=RpcMessage::kLegacyFormat);
+
+   /**
+    * @return true if the header was parsed and no read has failed.
+    */
+   bool IsValid() const { return !fError; }
+
+   uint32 GetCode() const { return fCode; }
+
+   uint32 GetSequence() const { return fSequence; }
+
+   uint32 GetOptions() const { return fOptions; }
+
+   /**
+    * @return offset of the next byte that will be read.
+    */
+   size_t GetOffset() const { return fOffset; }
+
+   size_t GetBytesRemaining() const { return fSize - fOffset; }
+
+   /**
+    * Move the cursor to an absolute offset in the message. Seeking past the
+    * end of the message is an error.
+    */
+   void Seek(size_t offset);
+
+   /**
+    * Copy the next `numBytes` bytes of the message into `dest`.
+    * @return false (and enter the error state) if there aren't enough bytes.
+    */
+   bool Read(void* dest, size_t numBytes);
+
+   /**
+    * Return a pointer to the next `numBytes` bytes of the message and advance
+    * past them.
+    * @return nullptr (and enter the error state) if there aren't enough bytes.
+    */
+   const void* Skip(size_t numBytes);
+
+   /**
+    * Return a primitive POD object from the message. The data may not be
+    * aligned, so we memcpy it out instead of dereferencing a cast pointer.
+    */
+   template <typename T>
+   T GetData()
+   {
+      T retval = T();
+      this->Read(&retval, sizeof(T));
+      return retval;
+   }
+
+   /**
+    * Read an unsigned LEB128 varint. A varint that runs past the end of the
+    * message or won't fit in 64 bits is an error.
+    */
+   uint64 GetVarUInt();
+
+   /**
+    * Counterparts to RpcMessage::AppendUInt() and friends; these read either 
+    * varints or fixed-size values, depending on our options.
+    */
+   uint32 GetUInt();
+   int GetInt();
+   int64 GetInt64();
+
+   RpcMessage::DataType GetTypeTag();
+
+   var GetVar();
+
+   String GetString();
+
+   /**
+    * Return a view of the next string in the message without copying it.
+    * The view points into the message data, so it's only usable while that
+    * data is.
+    */
+   RpcStringView GetStringView();
+
+   /**
+    * Apply the next ValueTreeSynchroniser change in the message to `target`.
+    * With the kDelimitedTrees option that's the next size-prefixed change;
+    * otherwise it's the rest of the message.
+    * @return false if the data couldn't be applied.
+    */
+   bool GetValueTree(ValueTree& target);
+
+   /**
+    * If the message is a call with a deadline (see 
+    * RpcMessage::kCallDeadlines), read its timeout and take 
+    * RpcMessage::kDeadlineFlag out of our code. Call this before reading 
+    * any parameters.
+    * @return the number of milliseconds that the caller will wait, or 0 if
+    *         there's no deadline.
+    */
+   uint32 GetTimeout();
+
+   /**
+    * Read a message that was added with RpcMessage::AppendMessage(). 
+    * @return a reader over it with our options, which points into our data.
+    *         If it's truncated, both readers are invalid.
+    */
+   RpcMessageReader GetMessage();
+
+   /**
+    * Unpack a message that is setting a property in the tree (see
+    * RpcMessage::SetTreeProperty) and apply that change to the tree. If the
+    * subtrees specified in the path don't exist, they'll be created.
+    * @param root Root of the ValueTree to update.
+    * @return false if the message couldn't be decoded.
+    */
+   bool ApplyTreeProperty(ValueTree root);
+
+   /**
+    * Unpack a message that is setting a property in the tree, without 
+    * applying it (see SetTreeProperty()).
+    * @param path  Set to the property's path, which points into our data.
+    * @param value Set to the property's new value.
+    * @return false if the message couldn't be decoded.
+    */
+   bool GetTreeProperty(RpcStringView& path, var& value);
+
+   /**
+    * Set the property at `path` (e.g. "sub1/sub2/name") under `root`, 
+    * creating any of the subtrees that don't exist.
+    * @return false if the path is malformed.
+    */
+   static bool SetTreeProperty(ValueTree root, const RpcStringView& path, 
+      const var& value);
+
+private:
+   void ReadHeader();
+
+   /**
+    * Enter the error state.
+    */
+   void SetError();
+
+private:
+   const char* fData;
+   size_t      fSize;
+   size_t      fOffset;
+   uint32      fOptions;
+
+   uint32      fCode;
+   uint32      fSequence;
+
+   bool        fError;
+};
+
+
+/**
+ * A bool is sent as one byte, and any byte but 0 is true; copying some 
+ * other byte straight into a bool would be undefined.
+ */
+template <>
+inline bool RpcMessageReader::GetData<bool>()
+{
+   return 0 != this->GetData<uint8>();
+}
+
+
+#endif  // RPCMESSAGEREADER_H_INCLUDED
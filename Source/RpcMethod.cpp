@@ -0,0 +1,156 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcMethod.h"
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+namespace
+{
+   class Calculator
+   {
+   public:
+      Calculator() : fCalls(0) {}
+
+      void Reset() { fCalls = 0; }
+
+      int Add(int a, int b) { ++fCalls; return a + b; }
+
+      double Scale(int64 val, double factor, bool negate)
+      {
+         ++fCalls;
+         return (negate ? -1 : 1) * val * factor;
+      }
+
+      String Greet(const String& name, uint32 times)
+      {
+         ++fCalls;
+         return String::repeatedString("hi " + name + " ", times).trim();
+      }
+
+      int fCalls;
+   };
+
+   typedef RpcMethod<100, void()>                       ResetMethod;
+   typedef RpcMethod<101, int(int, int)>                AddMethod;
+   typedef RpcMethod<102, double(int64, double, bool)>  ScaleMethod;
+   typedef RpcMethod<103, String(String, uint32)>       GreetMethod;
+
+   static_assert(15 == ResetMethod::kMaxCallSize, "header only");
+   static_assert(25 == AddMethod::kMaxCallSize, "two varint ints");
+   static_assert(34 == ScaleMethod::kMaxCallSize, "int64 + double + bool");
+   static_assert(0 == GreetMethod::kMaxCallSize, "strings have no fixed size");
+
+
+   /**
+    * Send `call` to `calc` the way that the server would, and return the
+    * response data.
+    */
+   template <typename Method, typename Fn>
+   MemoryBlock Serve(Calculator& calc, Fn fn, const RpcMessage& call, bool& ok)
+   {
+      const RpcBuffer& callData = call.GetBuffer();
+      RpcMessageReader reader(callData.GetData(), callData.GetSize(),
+         call.GetOptions());
+      reader.GetTimeout();
+      RpcMessage response(reader.GetCode(), reader.GetSequence(),
+         call.GetOptions());
+      ok = Method::Invoke(calc, fn, reader, response);
+      return response.GetMemoryBlock();
+   }
+}
+
+
+class RpcMethodTest : public UnitTest
+{
+public:
+   RpcMethodTest() : UnitTest("RpcMethod tests") {}
+
+   void runTest() override
+   {
+      const uint32 optionList[] = { RpcMessage::kLegacyFormat,
+         RpcMessage::kSupportedOptions };
+      for (int i = 0; i < 2; ++i)
+      {
+         const uint32 options = optionList[i];
+         Calculator calc;
+         bool ok = false;
+
+         this->beginTest("Round trips, options = " + String(options));
+         calc.fCalls = 5;
+         RpcMessage reset = ResetMethod::EncodeCall(options, 1);
+         MemoryBlock response = Serve<ResetMethod>(calc, &Calculator::Reset,
+            reset, ok);
+         this->expect(ok);
+         this->expect(0 == calc.fCalls);
+
+         RpcMessage add = AddMethod::EncodeCall(options, 2, 40, -2);
+         response = Serve<AddMethod>(calc, &Calculator::Add, add, ok);
+         this->expect(ok);
+         RpcMessageReader addResult(response, options);
+         this->expect(101 == addResult.GetCode());
+         this->expect(38 == AddMethod::DecodeResult(addResult));
+         this->expect(addResult.IsValid());
+
+         RpcMessage scale = ScaleMethod::EncodeCall(options, 3, int64(1) << 40, 0.5, true);
+         response = Serve<ScaleMethod>(calc, &Calculator::Scale, scale, ok);
+         this->expect(ok);
+         RpcMessageReader scaleResult(response, options);
+         this->expect(-double(int64(1) << 39) == ScaleMethod::DecodeResult(scaleResult));
+
+         RpcMessage greet = GreetMethod::EncodeCall(options, 4, String("bob"), 2u);
+         response = Serve<GreetMethod>(calc, &Calculator::Greet, greet, ok);
+         this->expect(ok);
+         RpcMessageReader greetResult(response, options);
+         this->expect(GreetMethod::DecodeResult(greetResult) == "hi bob hi bob");
+         this->expect(3 == calc.fCalls);
+
+         this->beginTest("Deadlines, options = " + String(options));
+         RpcMessage timed = AddMethod::EncodeTimedCall(options, 5, 1500, 1, 2);
+         const RpcBuffer& timedData = timed.GetBuffer();
+         RpcMessageReader timedReader(timedData.GetData(), timedData.GetSize(), options);
+         // only sent if both ends have the option.
+         const bool hasDeadline = (0 != (options & RpcMessage::kCallDeadlines));
+         this->expect(hasDeadline == (0 != (timedReader.GetCode() & RpcMessage::kDeadlineFlag)));
+         this->expect((hasDeadline ? 1500u : 0u) == timedReader.GetTimeout());
+         this->expect(101 == timedReader.GetCode());
+         this->expect(5 == timedReader.GetSequence());
+         this->expect(1 == timedReader.GetInt() && 2 == timedReader.GetInt());
+         this->expect(timedReader.IsValid());
+         response = Serve<AddMethod>(calc, &Calculator::Add, timed, ok);
+         this->expect(ok);
+         RpcMessageReader timedResult(response, options);
+         this->expect(101 == timedResult.GetCode());
+         this->expect(3 == AddMethod::DecodeResult(timedResult));
+         calc.fCalls = 3;
+
+         this->beginTest("Missing arguments, options = " + String(options));
+         RpcMessage shortAdd(101, RpcMessage::kUseNextSequence, options);
+         shortAdd.AppendInt(1);
+         response = Serve<AddMethod>(calc, &Calculator::Add, shortAdd, ok);
+         this->expect(!ok);
+         this->expect(3 == calc.fCalls);
+
+         this->beginTest("Failed calls, options = " + String(options));
+         MemoryBlock empty;
+         RpcMessageReader noResult(empty, options);
+         this->expect(0 == AddMethod::DecodeResult(noResult));
+         this->expect(GreetMethod::DecodeResult(noResult).isEmpty());
+      }
+
+      this->beginTest("Pre-sized messages");
+      int allocations = RpcBuffer::GetHeapAllocationCount();
+      RpcMessage scale = ScaleMethod::EncodeCall(RpcMessage::kLegacyFormat, 5,
+         int64(1), 1.0, false);
+      this->expect(allocations == RpcBuffer::GetHeapAllocationCount());
+      this->expect(scale.GetBuffer().IsInline());
+   }
+};
+
+static RpcMethodTest methodTest;
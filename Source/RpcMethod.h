@@ -0,0 +1,308 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCMETHOD_H_INCLUDED
+#define RPCMETHOD_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include "RpcMessage.h"
+#include "RpcMessageReader.h"
+
+#include <tuple>
+
+
+/**
+ * @struct RpcArg
+ *
+ * How a single parameter or return value of type T is marshalled. There's
+ * deliberately no generic implementation, so using an unsupported type in an
+ * RpcMethod signature is a compile error.
+ *
+ * kMaxSize is the most bytes that a value can take on the wire in any of our
+ * WireOptions, or 0 if the size depends on the value (strings).
+ */
+template <typename T>
+struct RpcArg;
+
+
+template <>
+struct RpcArg<int>
+{
+   static const size_t kMaxSize = 5;
+   static void Append(RpcMessage& msg, int val) { msg.AppendInt(val); }
+   static int Get(RpcMessageReader& reader) { return reader.GetInt(); }
+};
+
+
+template <>
+struct RpcArg<uint32>
+{
+   static const size_t kMaxSize = 5;
+   static void Append(RpcMessage& msg, uint32 val) { msg.AppendUInt(val); }
+   static uint32 Get(RpcMessageReader& reader) { return reader.GetUInt(); }
+};
+
+
+template <>
+struct RpcArg<int64>
+{
+   static const size_t kMaxSize = 10;
+   static void Append(RpcMessage& msg, int64 val) { msg.AppendInt64(val); }
+   static int64 Get(RpcMessageReader& reader) { return reader.GetInt64(); }
+};
+
+
+template <>
+struct RpcArg<bool>
+{
+   static const size_t kMaxSize = 1;
+   static void Append(RpcMessage& msg, bool val) { msg.AppendData<bool>(val); }
+   static bool Get(RpcMessageReader& reader) { return reader.GetData<bool>(); }
+};
+
+
+template <>
+struct RpcArg<double>
+{
+   static const size_t kMaxSize = 8;
+   static void Append(RpcMessage& msg, double val) { msg.AppendData<double>(val); }
+   static double Get(RpcMessageReader& reader) { return reader.GetData<double>(); }
+};
+
+
+template <>
+struct RpcArg<String>
+{
+   static const size_t kMaxSize = 0;
+   static void Append(RpcMessage& msg, const String& val) { msg.AppendString(val); }
+   static String Get(RpcMessageReader& reader) { return reader.GetString(); }
+};
+
+
+/**
+ * Compile-time facts about a list of argument types.
+ */
+template <typename... Args>
+struct RpcArgList;
+
+template <>
+struct RpcArgList<>
+{
+   static const bool kFixedSize = true;
+   static const size_t kMaxSize = 0;
+
+   static void Append(RpcMessage&) {}
+};
+
+template <typename T, typename... Rest>
+struct RpcArgList<T, Rest...>
+{
+   // (constants rather than enumerators, since each RpcArg's kMaxSize is a
+   // different type, and arithmetic between enumerations is deprecated.)
+
+   /**
+    * True if every argument has a known maximum size.
+    */
+   static const bool kFixedSize = (RpcArg<T>::kMaxSize > 0) && 
+      RpcArgList<Rest...>::kFixedSize;
+
+   /**
+    * The most parameter bytes a call can take, if kFixedSize.
+    */
+   static const size_t kMaxSize = RpcArg<T>::kMaxSize + RpcArgList<Rest...>::kMaxSize;
+
+   template <typename U, typename... RestValues>
+   static void Append(RpcMessage& msg, const U& val, const RestValues&... rest)
+   {
+      RpcArg<T>::Append(msg, val);
+      RpcArgList<Rest...>::Append(msg, rest...);
+   }
+};
+
+
+/**
+ * The return value of a method; void methods have an empty response.
+ */
+template <typename R>
+struct RpcResult
+{
+   static void Append(RpcMessage& msg, const R& val) { RpcArg<R>::Append(msg, val); }
+   static R Get(RpcMessageReader& reader) { return RpcArg<R>::Get(reader); }
+};
+
+template <>
+struct RpcResult<void>
+{
+   static void Get(RpcMessageReader&) {}
+};
+
+
+/**
+ * A list of the integers 0..N-1 as a type, used to expand a tuple of
+ * decoded arguments back into a parameter list. (The project still builds
+ * as C++11, which has no std::index_sequence, for the VS2013 exporter; 
+ * only the optional coroutine handlers in RpcCoroutine.h need C++20.)
+ */
+template <size_t... Indexes>
+struct RpcIndexes {};
+
+template <size_t N, size_t... Indexes>
+struct RpcMakeIndexes : RpcMakeIndexes<N - 1, N - 1, Indexes...> {};
+
+template <size_t... Indexes>
+struct RpcMakeIndexes<0, Indexes...>
+{
+   typedef RpcIndexes<Indexes...> Type;
+};
+
+
+/**
+ * @class RpcMethod
+ *
+ * Describes a remote method by its message code and C++ signature, and
+ * derives everything needed to call it from that:
+ *
+ *     typedef RpcMethod<Controller::kIntFn, int(int)> IntFnMethod;
+ *
+ * The client side calls `IntFnMethod::EncodeCall()` and
+ * `IntFnMethod::DecodeResult()` (ClientController::Call() wraps both), and
+ * the server side calls `IntFnMethod::Invoke()` with the member function that
+ * implements it. Arguments are marshalled directly by type -- never through
+ * `var` -- and messages whose arguments all have a fixed size are reserved
+ * at their maximum size up front.
+ *
+ * Parameter types in the signature are the types on the wire, so use
+ * `String` rather than `const String&`; the implementing member function can
+ * take its parameters by const reference.
+ */
+template <uint32 Code, typename Signature>
+class RpcMethod;
+
+template <uint32 Code, typename R, typename... Args>
+class RpcMethod<Code, R(Args...)>
+{
+public:
+   typedef R ReturnType;
+   typedef RpcArgList<Args...> ArgList;
+   typedef std::tuple<Args...> ArgTuple;
+
+   enum
+   {
+      kCode = Code,
+      kNumArgs = sizeof...(Args),
+
+      /**
+       * Largest possible code + sequence header, with a timeout (see
+       * RpcMessage::kCallDeadlines).
+       */
+      kMaxHeaderSize = 15,
+
+      /**
+       * Largest possible call message, or 0 if it depends on the argument
+       * values.
+       */
+      kMaxCallSize = ArgList::kFixedSize ? 
+         (static_cast<size_t>(kMaxHeaderSize) + ArgList::kMaxSize) : 0
+   };
+
+   /**
+    * Create the call message for these arguments.
+    * @param sequence The call's sequence number (see PendingCallTable).
+    */
+   template <typename... Values>
+   static RpcMessage EncodeCall(uint32 options, uint32 sequence, const Values&... args)
+   {
+      return EncodeTimedCall(options, sequence, 0, args...);
+   }
+
+   /**
+    * Create a call message that the server shouldn't start once `timeoutMs`
+    * milliseconds have passed (see RpcMessage::kCallDeadlines); 0 means 
+    * no deadline.
+    */
+   template <typename... Values>
+   static RpcMessage EncodeTimedCall(uint32 options, uint32 sequence, 
+      uint32 timeoutMs, const Values&... args)
+   {
+      static_assert(sizeof...(Values) == sizeof...(Args),
+         "wrong number of arguments to RpcMethod");
+      RpcMessage msg(Code, sequence, options, timeoutMs);
+      if (kMaxCallSize > 0)
+      {
+         msg.Reserve(kMaxCallSize);
+      }
+      ArgList::Append(msg, args...);
+      return msg;
+   }
+
+   /**
+    * Unpack the return value from a response. An invalid reader gives a
+    * default-constructed value.
+    */
+   static R DecodeResult(RpcMessageReader& reader)
+   {
+      return RpcResult<R>::Get(reader);
+   }
+
+   /**
+    * Unpack a call's arguments. If they can't all be read, `call` is no
+    * longer valid afterwards.
+    */
+   static ArgTuple DecodeArgs(RpcMessageReader& call)
+   {
+      // a braced initializer list is evaluated left to right, which gets the
+      // arguments out of the message in order.
+      return ArgTuple{ RpcArg<Args>::Get(call)... };
+   }
+
+   /**
+    * Unpack a call's arguments, call `fn` on `object` with them and append
+    * any return value to `response`.
+    * @return false (without calling `fn`) if the arguments can't be read.
+    */
+   template <typename Object, typename Class, typename FnReturn, typename... FnArgs>
+   static bool Invoke(Object& object, FnReturn (Class::*fn)(FnArgs...),
+      RpcMessageReader& call, RpcMessage& response)
+   {
+      static_assert(sizeof...(FnArgs) == sizeof...(Args),
+         "member function doesn't match the RpcMethod signature");
+      ArgTuple args(DecodeArgs(call));
+      if (!call.IsValid())
+      {
+         return false;
+      }
+      Caller<R>::Call(object, fn, args, response,
+         typename RpcMakeIndexes<sizeof...(Args)>::Type());
+      return true;
+   }
+
+private:
+   template <typename Result, typename Dummy=void>
+   struct Caller
+   {
+      template <typename Object, typename Fn, size_t... Indexes>
+      static void Call(Object& object, Fn fn, ArgTuple& args,
+         RpcMessage& response, RpcIndexes<Indexes...>)
+      {
+         RpcResult<Result>::Append(response, (object.*fn)(std::get<Indexes>(args)...));
+      }
+   };
+
+   template <typename Dummy>
+   struct Caller<void, Dummy>
+   {
+      template <typename Object, typename Fn, size_t... Indexes>
+      static void Call(Object& object, Fn fn, ArgTuple& args,
+         RpcMessage&, RpcIndexes<Indexes...>)
+      {
+         (object.*fn)(std::get<Indexes>(args)...);
+      }
+   };
+};
+
+
+#endif  // RPCMETHOD_H_INCLUDED
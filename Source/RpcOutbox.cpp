@@ -0,0 +1,501 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcOutbox.h"
+
+#include "RpcConnection.h"
+
+#if ! JUCE_WINDOWS
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+
+namespace
+{
+   Atomic<int64> sFrames;
+   Atomic<int64> sWrites;
+
+   enum
+   {
+      kHeaderSize = 2 * sizeof(uint32)
+   };
+}
+
+
+RpcOutbox::RpcOutbox(int socket, Writer* writer)
+:  fSocket(socket)
+,  fPushed(nullptr)
+,  fWriter(writer)
+,  fFirst(nullptr)
+,  fLast(nullptr)
+,  fWritten(0)
+{
+
+}
+
+
+RpcOutbox::~RpcOutbox()
+{
+   FreeAll(fPushed.get());
+   FreeAll(fFirst);
+}
+
+
+bool RpcOutbox::Push(const void* data, size_t size)
+{
+   if (fClosed.get() || fFailed.get())
+   {
+      return false;
+   }
+   const size_t frameSize = kHeaderSize + size;
+   if (fQueuedBytes.get() + static_cast<int64>(frameSize) > kMaxQueuedBytes)
+   {
+      // the writer drops the connection when it next flushes.
+      DBG("ERROR: A connection has fallen too far behind; dropping it.");
+      fFailed = 1;
+      const ScopedLock lock(fWriterLock);
+      if (nullptr != fWriter)
+      {
+         fWriter->OutboxReady();
+      }
+      return false;
+   }
+
+   Frame* frame = static_cast<Frame*>(std::malloc(sizeof(Frame) + frameSize));
+   if (nullptr == frame)
+   {
+      return false;
+   }
+   frame->fSize = frameSize;
+   const uint32 header[2] = { ByteOrder::swapIfBigEndian(static_cast<uint32>(RpcConnection::kMagic)),
+                              ByteOrder::swapIfBigEndian(static_cast<uint32>(size)) };
+   memcpy(frame->GetData(), header, kHeaderSize);
+   if (size > 0)
+   {
+      memcpy(frame->GetData() + kHeaderSize, data, size);
+   }
+   fQueuedBytes += static_cast<int64>(frameSize);
+
+   Frame* head;
+   do
+   {
+      head = fPushed.get();
+      frame->fNext = head;
+   }
+   while (!fPushed.compareAndSetBool(frame, head));
+
+   if (fScheduled.compareAndSetBool(1, 0))
+   {
+      const ScopedLock lock(fWriterLock);
+      if (nullptr != fWriter)
+      {
+         fWriter->OutboxReady();
+      }
+   }
+   return true;
+}
+
+
+RpcOutbox::Result RpcOutbox::Flush()
+{
+   if (fFailed.get())
+   {
+      return kFailed;
+   }
+   // anything pushed after this tells the writer again.
+   fScheduled = 0;
+   this->TakePushed();
+
+#if ! JUCE_WINDOWS
+   while (nullptr != fFirst)
+   {
+      struct iovec iov[kMaxFramesPerWrite];
+      int count = 0;
+      size_t total = 0;
+      for (Frame* frame = fFirst; nullptr != frame && count < kMaxFramesPerWrite;
+         frame = frame->fNext, ++count)
+      {
+         const size_t skip = (frame == fFirst) ? fWritten : 0;
+         iov[count].iov_base = frame->GetData() + skip;
+         iov[count].iov_len = frame->fSize - skip;
+         total += iov[count].iov_len;
+      }
+
+      struct msghdr msg;
+      zerostruct(msg);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      const ssize_t written = ::sendmsg(fSocket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (written < 0)
+      {
+         if (EINTR == errno)
+         {
+            continue;
+         }
+         if (EAGAIN == errno || EWOULDBLOCK == errno)
+         {
+            // we'll be flushed again once the socket's writable.
+            fScheduled = 1;
+            return kBlocked;
+         }
+         fFailed = 1;
+         return kFailed;
+      }
+      ++sWrites;
+      fQueuedBytes -= static_cast<int64>(written);
+
+      // free whatever was written in full.
+      size_t remaining = fWritten + static_cast<size_t>(written);
+      while (nullptr != fFirst && remaining >= fFirst->fSize)
+      {
+         remaining -= fFirst->fSize;
+         Frame* next = fFirst->fNext;
+         std::free(fFirst);
+         fFirst = next;
+         ++sFrames;
+      }
+      fWritten = remaining;
+      if (nullptr == fFirst)
+      {
+         fLast = nullptr;
+      }
+      if (static_cast<size_t>(written) < total)
+      {
+         fScheduled = 1;
+         return kBlocked;
+      }
+   }
+   return kWritten;
+#else
+   return kFailed;
+#endif
+}
+
+
+void RpcOutbox::Close()
+{
+   const ScopedLock lock(fWriterLock);
+   fClosed = 1;
+   fWriter = nullptr;
+}
+
+
+int64 RpcOutbox::GetFrameCount()
+{
+   return sFrames.get();
+}
+
+
+int64 RpcOutbox::GetWriteCount()
+{
+   return sWrites.get();
+}
+
+
+void RpcOutbox::TakePushed()
+{
+   // the stack is newest first, so reverse it.
+   Frame* pushed = fPushed.exchange(nullptr);
+   Frame* first = nullptr;
+   Frame* last = pushed;
+   while (nullptr != pushed)
+   {
+      Frame* next = pushed->fNext;
+      pushed->fNext = first;
+      first = pushed;
+      pushed = next;
+   }
+   if (nullptr == first)
+   {
+      return;
+   }
+   if (nullptr == fLast)
+   {
+      fFirst = first;
+   }
+   else
+   {
+      fLast->fNext = first;
+   }
+   fLast = last;
+}
+
+
+void RpcOutbox::FreeAll(Frame* frame)
+{
+   while (nullptr != frame)
+   {
+      Frame* next = frame->fNext;
+      std::free(frame);
+      frame = next;
+   }
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+#if ! JUCE_WINDOWS
+
+class RpcOutboxTest : public UnitTest
+{
+public:
+   RpcOutboxTest() : UnitTest("RpcOutbox tests") {}
+
+   class CountingWriter : public RpcOutbox::Writer
+   {
+   public:
+      void OutboxReady() override { ++fCount; }
+
+      Atomic<int> fCount;
+   };
+
+   /**
+    * Read one frame from `socket`.
+    * @return false if it isn't one.
+    */
+   static bool ReadFrame(int socket, MemoryBlock& body)
+   {
+      uint32 header[2];
+      if (!ReadAll(socket, header, sizeof(header)) ||
+         RpcConnection::kMagic != ByteOrder::swapIfBigEndian(header[0]))
+      {
+         return false;
+      }
+      body.setSize(ByteOrder::swapIfBigEndian(header[1]));
+      return ReadAll(socket, body.getData(), body.getSize());
+   }
+
+   static bool ReadAll(int socket, void* data, size_t size)
+   {
+      size_t received = 0;
+      while (received < size)
+      {
+         const ssize_t bytes = ::read(socket, static_cast<char*>(data) + received,
+            size - received);
+         if (bytes <= 0)
+         {
+            return false;
+         }
+         received += static_cast<size_t>(bytes);
+      }
+      return true;
+   }
+
+   void runTest() override
+   {
+      this->beginTest("Frames go out in order, in one write");
+      {
+         int sockets[2];
+         this->expect(0 == ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+         CountingWriter writer;
+         RpcOutbox outbox(sockets[0], &writer);
+         for (int i = 0; i < 10; ++i)
+         {
+            const String text(String::repeatedString("x", i));
+            this->expect(outbox.Push(text.toRawUTF8(), text.length()));
+         }
+         // only the first push tells the writer.
+         this->expect(1 == writer.fCount.get());
+         this->expect(10 * 8 + 45 == outbox.GetQueuedBytes());
+
+         const int64 writes = RpcOutbox::GetWriteCount();
+         this->expect(RpcOutbox::kWritten == outbox.Flush());
+         this->expect(writes + 1 == RpcOutbox::GetWriteCount());
+         this->expect(0 == outbox.GetQueuedBytes());
+         for (int i = 0; i < 10; ++i)
+         {
+            MemoryBlock body;
+            this->expect(ReadFrame(sockets[1], body));
+            this->expect(static_cast<size_t>(i) == body.getSize());
+         }
+
+         // and the next push after a flush tells it again.
+         this->expect(outbox.Push("y", 1));
+         this->expect(2 == writer.fCount.get());
+         outbox.Close();
+         this->expect(!outbox.Push("z", 1));
+         ::close(sockets[0]);
+         ::close(sockets[1]);
+      }
+
+      this->beginTest("Pushing from several threads");
+      {
+         int sockets[2];
+         this->expect(0 == ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+         CountingWriter writer;
+         RpcOutbox outbox(sockets[0], &writer);
+
+         OwnedArray<Thread> threads;
+         for (uint32 i = 0; i < kNumThreads; ++i)
+         {
+            threads.add(new Pusher(outbox, i))->startThread();
+         }
+         // flush while they're still pushing, and read on another thread
+         // so that the socket never fills up.
+         Reader reader(sockets[1]);
+         reader.startThread();
+         bool pushing = true;
+         while (pushing)
+         {
+            pushing = false;
+            for (int i = 0; i < threads.size(); ++i)
+            {
+               pushing = pushing || threads[i]->isThreadRunning();
+            }
+            this->expect(RpcOutbox::kFailed != outbox.Flush());
+         }
+         while (RpcOutbox::kWritten != outbox.Flush())
+         {
+            Thread::sleep(1);
+         }
+         this->expect(reader.waitForThreadToExit(10000));
+         this->expect(kNumThreads * kNumFrames == reader.fNumFrames);
+         this->expect(!reader.fOutOfOrder);
+         ::close(sockets[0]);
+         ::close(sockets[1]);
+      }
+
+      this->beginTest("A socket that's full");
+      {
+         int sockets[2];
+         this->expect(0 == ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+         CountingWriter writer;
+         RpcOutbox outbox(sockets[0], &writer);
+         MemoryBlock large(1024 * 1024);
+         for (size_t i = 0; i < large.getSize(); ++i)
+         {
+            large[i] = static_cast<char>(i * 7);
+         }
+         this->expect(outbox.Push(large.getData(), large.getSize()));
+         this->expect(RpcOutbox::kBlocked == outbox.Flush());
+
+         // whatever's pushed meanwhile waits behind the rest of the first.
+         this->expect(outbox.Push("after", 5));
+         this->expect(1 == writer.fCount.get());
+
+         Reader reader(sockets[1]);
+         reader.fNumExpected = 2;
+         reader.startThread();
+         RpcOutbox::Result result;
+         while (RpcOutbox::kBlocked == (result = outbox.Flush()))
+         {
+            Thread::sleep(1);
+         }
+         this->expect(RpcOutbox::kWritten == result);
+         this->expect(reader.waitForThreadToExit(10000));
+         this->expect(2 == reader.fNumFrames);
+         this->expect(reader.fLast == MemoryBlock("after", 5));
+         ::close(sockets[0]);
+         ::close(sockets[1]);
+      }
+
+      this->beginTest("Falling too far behind");
+      {
+         int sockets[2];
+         this->expect(0 == ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+         CountingWriter writer;
+         RpcOutbox outbox(sockets[0], &writer);
+         MemoryBlock large(RpcOutbox::kMaxQueuedBytes / 8);
+         int pushed = 0;
+         while (outbox.Push(large.getData(), large.getSize()))
+         {
+            ++pushed;
+         }
+         this->expect(7 == pushed);
+         // the writer is told, even though it already had been.
+         this->expect(2 == writer.fCount.get());
+         this->expect(RpcOutbox::kFailed == outbox.Flush());
+         ::close(sockets[0]);
+         ::close(sockets[1]);
+      }
+   }
+
+private:
+   enum
+   {
+      kNumThreads = 4,
+      kNumFrames = 5000
+   };
+
+   /**
+    * Pushes kNumFrames frames, each holding its thread's index and its
+    * number.
+    */
+   class Pusher : public Thread
+   {
+   public:
+      Pusher(RpcOutbox& outbox, uint32 index)
+      :  Thread("Pusher")
+      ,  fOutbox(outbox)
+      ,  fIndex(index)
+      {
+
+      }
+
+      void run() override
+      {
+         for (uint32 i = 0; i < kNumFrames; ++i)
+         {
+            const uint32 frame[2] = { fIndex, i };
+            fOutbox.Push(frame, sizeof(frame));
+         }
+      }
+
+      RpcOutbox& fOutbox;
+      const uint32 fIndex;
+   };
+
+   /**
+    * Reads frames until it has fNumExpected, checking that each Pusher's
+    * arrive in order.
+    */
+   class Reader : public Thread
+   {
+   public:
+      Reader(int socket)
+      :  Thread("Reader")
+      ,  fSocket(socket)
+      ,  fNumExpected(kNumThreads * kNumFrames)
+      ,  fNumFrames(0)
+      ,  fOutOfOrder(false)
+      {
+         zeromem(fNext, sizeof(fNext));
+      }
+
+      void run() override
+      {
+         while (fNumFrames < fNumExpected && ReadFrame(fSocket, fLast))
+         {
+            ++fNumFrames;
+            if (sizeof(uint32) * 2 == fLast.getSize())
+            {
+               const uint32* frame = static_cast<const uint32*>(fLast.getData());
+               if (frame[0] < kNumThreads)
+               {
+                  fOutOfOrder = fOutOfOrder || (frame[1] != fNext[frame[0]]);
+                  fNext[frame[0]] = frame[1] + 1;
+               }
+            }
+         }
+      }
+
+      int fSocket;
+      int fNumExpected;
+      int fNumFrames;
+      bool fOutOfOrder;
+      uint32 fNext[kNumThreads];
+      MemoryBlock fLast;
+   };
+};
+
+static RpcOutboxTest outboxTest;
+
+#endif
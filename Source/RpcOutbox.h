@@ -0,0 +1,192 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCOUTBOX_H_INCLUDED
+#define RPCOUTBOX_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+
+/**
+ * @class RpcOutbox
+ *
+ * The frames that are waiting to be written to one connection's socket.
+ * Any number of threads queue frames with Push(), which copies the frame
+ * and links it onto a lock-free stack, and never touches the socket; one
+ * thread (the writer, normally the RpcEventLoop I/O thread that reads the
+ * connection) takes everything that's queued with Flush(), and writes it
+ * with a single vectored, non-blocking write. So a sender never waits for
+ * a slow client, and a burst of small messages goes out as one write.
+ *
+ * The writer is told (see Writer) when a Push() finds that it hasn't been
+ * told already, and then isn't told again until it has flushed, so a busy
+ * connection costs it one notification per flush rather than one per
+ * frame. Whatever a Flush() can't write (because the socket's buffer is
+ * full) stays at the front of the queue for the next one, which the writer
+ * makes once the socket is writable.
+ *
+ * A client that stops reading can't make us queue without limit: once
+ * more than kMaxQueuedBytes are waiting, the outbox fails, and the writer
+ * drops the connection.
+ *
+ * Outboxes are reference counted, so a sender that has found one can keep
+ * pushing to it after its connection has moved on to a new one (the old 
+ * one is closed by then, and turns the frames away).
+ */
+class RpcOutbox : public ReferenceCountedObject
+{
+public:
+   typedef ReferenceCountedObjectPtr<RpcOutbox> Ptr;
+
+   enum
+   {
+      kMaxQueuedBytes = 64 * 1024 * 1024,
+
+      /**
+       * The most frames that one write takes.
+       */
+      kMaxFramesPerWrite = 256
+   };
+
+   /**
+    * Whatever flushes the outbox.
+    */
+   class Writer
+   {
+   public:
+      virtual ~Writer() {}
+
+      /**
+       * Called on the thread that pushed a frame when there's something to
+       * flush, and we haven't said so since the last Flush().
+       */
+      virtual void OutboxReady() = 0;
+   };
+
+   enum Result
+   {
+      /**
+       * Everything that was queued has been written.
+       */
+      kWritten = 0,
+
+      /**
+       * The socket can't take any more for now; flush again once it's
+       * writable.
+       */
+      kBlocked,
+
+      /**
+       * The socket has failed, or the other end has fallen more than
+       * kMaxQueuedBytes behind.
+       */
+      kFailed
+   };
+
+   /**
+    * @param socket The socket that we write to, which we don't own.
+    * @param writer Told when there's something to flush, until Close().
+    */
+   RpcOutbox(int socket, Writer* writer);
+
+   /**
+    * Frees whatever hasn't been written.
+    */
+   ~RpcOutbox();
+
+   /**
+    * Queue a frame (the 8-byte header of RpcConnection::kMagic and `size`,
+    * then a copy of `data`). Any thread.
+    * @return false if we've been closed, or have failed.
+    */
+   bool Push(const void* data, size_t size);
+
+   /**
+    * Write as much of what's queued as the socket will take without
+    * blocking. Only call this from the writer's thread.
+    */
+   Result Flush();
+
+   /**
+    * Stop taking frames, and forget the writer. Whatever's still queued is
+    * freed with the outbox.
+    */
+   void Close();
+
+   /**
+    * @return the number of bytes that have been pushed and not yet written.
+    */
+   int64 GetQueuedBytes() const { return fQueuedBytes.get(); }
+
+   /**
+    * @return the number of frames and writes that every outbox has
+    *         written. Used by the benchmarks.
+    */
+   static int64 GetFrameCount();
+   static int64 GetWriteCount();
+
+private:
+   /**
+    * A queued frame, with its header and data following it in the same
+    * block.
+    */
+   struct Frame
+   {
+      Frame* fNext;
+      size_t fSize;
+
+      char* GetData() { return reinterpret_cast<char*>(this + 1); }
+   };
+
+   /**
+    * Move what's been pushed onto the end of fFirst...fLast, in the order
+    * it was pushed.
+    */
+   void TakePushed();
+
+   /**
+    * Free the frames in a list that starts with `frame`.
+    */
+   static void FreeAll(Frame* frame);
+
+private:
+   int fSocket;
+
+   /**
+    * Frames are pushed here, newest first.
+    */
+   Atomic<Frame*> fPushed;
+
+   /**
+    * 1 once the writer has been told that there's something to flush.
+    */
+   Atomic<int> fScheduled;
+
+   Atomic<int> fClosed;
+   Atomic<int> fFailed;
+
+   Atomic<int64> fQueuedBytes;
+
+   /**
+    * Held while the writer is told, so that Close() can't return while it's
+    * being told.
+    */
+   CriticalSection fWriterLock;
+   Writer* fWriter;
+
+   /**
+    * What the writer has taken and not yet written, oldest first, and how
+    * much of the first frame has been written. Only the writer uses these.
+    */
+   Frame* fFirst;
+   Frame* fLast;
+   size_t fWritten;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcOutbox)
+};
+
+
+#endif  // RPCOUTBOX_H_INCLUDED
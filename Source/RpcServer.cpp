@@ -6,9 +6,13 @@
 
 #include "RpcTest.h"
 
+#include "RpcBatch.h"
 #include "RpcException.h"
 #include "RpcServer.h"
 #include "RpcMessage.h"
+#include "RpcMessageReader.h"
+
+#include <vector>
 
 #if 0
 namespace
@@ -23,14 +27,29 @@ namespace
 #endif
 
 
+/**
+ * Sends the changes to one of the controller's trees to every client that's 
+ * watching it. Each change is encoded once for each set of wire options in 
+ * use, and the same payload is sent to all of the clients that use them; 
+ * full syncs are cached the same way until the tree changes again.
+ *
+ * Clients that use the RpcMessage::kDelimitedTrees option don't get a 
+ * message per change; we hold on to the changes until the jobs that are 
+ * already waiting on the tree's strand have run, and then send them all in
+ * a single kValueTreeUpdates message.
+ *
+ * Apart from its constructor and destructor, this object may only be used 
+ * in jobs on its tree's strand (see ServerController::PostToTree()).
+ */
 class ValueTreeSyncServer : public ValueTreeSynchroniser
 {
 public:
-  ValueTreeSyncServer(ValueTree& tree, RpcServerConnection* ipcServer, uint32 code)
-  :   ValueTreeSynchroniser(tree)
-  ,   fServer(ipcServer)
+  ValueTreeSyncServer(RpcServer* server, int treeIndex, uint32 code)
+  :   ValueTreeSynchroniser(server->GetController()->GetTree(treeIndex))
+  ,   fServer(server)
+  ,   fTreeIndex(treeIndex)
   ,   fMessageCode(code)
-  ,   fSequence(0)
+  ,   fFlushPosted(false)
   {
 
   }
@@ -40,16 +59,56 @@ public:
 
   }
 
-  void stateChanged(const void* change, size_t size)
+  void stateChanged(const void* change, size_t size) override
   {
+     if (nullptr != fCapture)
+     {
+        // we're building a full sync; see SendFullSync().
+        fCapture->GetMessage().AppendTreeChange(change, size);
+        return;
+     }
+
      DBG("ValueTree code " + String(fMessageCode) + " has changed; " + String(size) + " bytes of data.");
-     String delta = String("> ") + String::toHexString(change, size);
-     DBG(delta);
+     fFullSyncs.clear();
+
+     Array<RpcPayload::Ptr> payloads;
+     bool batched = false;
+     for (int i = 0; i < fWatchers.size(); ++i)
+     {
+        RpcServerConnection* watcher = fWatchers.getUnchecked(i);
+        const ScopedLock session(watcher->GetSessionLock());
+        if (watcher->GetOptions() & RpcMessage::kDelimitedTrees)
+        {
+           batched = true;
+           continue;
+        }
+        RpcPayload::Ptr payload = FindPayload(payloads, watcher->GetOptions());
+        if (nullptr == payload)
+        {
+           payload = new RpcPayload(fMessageCode, 0, watcher->GetOptions());
+           payload->GetMessage().AppendData(change, size);
+           payloads.add(payload);
+        }
+        watcher->SendPayload(*payload);
+     }
 
-     RpcMessage msg(fMessageCode, fSequence);
-     fSequence = 0;
-     msg.AppendData(change, size);
-     fServer->SendRpcMessage(msg);
+     if (batched)
+     {
+        fChanges.add(new MemoryBlock(change, size));
+        if (!fFlushPosted)
+        {
+           fFlushPosted = true;
+           fServer->GetController()->PostToTree(fTreeIndex, [this]()
+           {
+              this->FlushChanges();
+           });
+        }
+     }
+  }
+
+  int GetTreeIndex() const
+  {
+      return fTreeIndex;
   }
 
   uint32 GetMessageCode() const
@@ -57,11 +116,118 @@ public:
       return fMessageCode;
   }
 
+  /**
+   * Send the whole tree to a connection, and then keep sending it changes.
+   */
+  void AddWatcher(RpcServerConnection* connection)
+  {
+     if (!fWatchers.contains(connection))
+     {
+        // the full sync will include any changes that we're holding, so 
+        // they mustn't be sent to the new watcher afterwards.
+        this->FlushChanges();
+        fWatchers.add(connection);
+        this->SendFullSync(connection);
+     }
+  }
+
+  void RemoveWatcher(RpcServerConnection* connection)
+  {
+     fWatchers.removeAllInstancesOf(connection);
+  }
+
+  bool IsWatcher(RpcServerConnection* connection) const
+  {
+     return fWatchers.contains(connection);
+  }
+
+  /**
+   * Send the whole tree to one connection.
+   */
+  void SendFullSync(RpcServerConnection* connection)
+  {
+     this->FlushChanges();
+     const ScopedLock session(connection->GetSessionLock());
+     RpcPayload::Ptr payload = FindPayload(fFullSyncs, connection->GetOptions());
+     if (nullptr == payload)
+     {
+        payload = new RpcPayload(fMessageCode, 0, connection->GetOptions());
+        fCapture = payload;
+        this->sendFullSyncCallback();
+        fCapture = nullptr;
+        fFullSyncs.add(payload);
+     }
+     connection->SendPayload(*payload);
+  }
+
+  /**
+   * Send the changes that we've been holding to the kDelimitedTrees 
+   * watchers, encoding them once for each set of wire options.
+   */
+  void FlushChanges()
+  {
+     fFlushPosted = false;
+     if (0 == fChanges.size())
+     {
+        return;
+     }
+
+     Array<RpcPayload::Ptr> payloads;
+     for (int i = 0; i < fWatchers.size(); ++i)
+     {
+        RpcServerConnection* watcher = fWatchers.getUnchecked(i);
+        const ScopedLock session(watcher->GetSessionLock());
+        if (0 == (watcher->GetOptions() & RpcMessage::kDelimitedTrees))
+        {
+           continue;
+        }
+        RpcPayload::Ptr payload = FindPayload(payloads, watcher->GetOptions());
+        if (nullptr == payload)
+        {
+           payload = new RpcPayload(Controller::kValueTreeUpdates, 0, 
+              watcher->GetOptions());
+           this->AppendChanges(payload->GetMessage());
+           payloads.add(payload);
+        }
+        watcher->SendPayload(*payload);
+     }
+     fChanges.clear();
+  }
+
+private:
+  static RpcPayload* FindPayload(const Array<RpcPayload::Ptr>& payloads, uint32 options)
+  {
+     for (int i = 0; i < payloads.size(); ++i)
+     {
+        if (options == payloads.getUnchecked(i)->GetOptions())
+        {
+           return payloads.getUnchecked(i);
+        }
+     }
+     return nullptr;
+  }
+
+  /**
+   * Add the changes that are waiting to be flushed to a kValueTreeUpdates 
+   * message.
+   */
+  void AppendChanges(RpcMessage& msg) const
+  {
+     for (int i = 0; i < fChanges.size(); ++i)
+     {
+        const MemoryBlock* change = fChanges.getUnchecked(i);
+        msg.AppendUInt(fMessageCode);
+        msg.AppendTreeChange(change->getData(), change->getSize());
+     }
+  }
+
 private:
+  RpcServer*  fServer;
+
   /**
-   * We need the RpcServer to send messages back to our client.
+   * Our tree's index in the controller, which picks its strand.
    */
-  RpcServerConnection* fServer;
+  int         fTreeIndex;
 
   /**
    * Each ValueTree that's watched has its own message code 
@@ -69,94 +235,466 @@ private:
   uint32      fMessageCode;
 
   /**
-   *  If the client requests the full tree, we need to use the right sequence number.
+   * Connections that want to hear about changes. We don't own them; they 
+   * remove themselves when they disconnect.
    */
-  uint32      fSequence;
+  Array<RpcServerConnection*> fWatchers;
+
+  /**
+   * Full syncs of the current tree that we've already encoded, one for each 
+   * set of wire options.
+   */
+  Array<RpcPayload::Ptr> fFullSyncs;
+
+  /**
+   * The full sync that we're building, if any.
+   */
+  RpcPayload::Ptr fCapture;
+
+  /**
+   * Changes that haven't been sent to the kDelimitedTrees watchers yet.
+   */
+  OwnedArray<MemoryBlock> fChanges;
+
+  /**
+   * True if a FlushChanges() job is waiting on the strand.
+   */
+  bool fFlushPosted;
 
 };
 
 
-RpcServer::RpcServer(ServerController* controller)
+namespace
+{
+   /**
+    * A client asking for the full contents of one of the trees that we're 
+    * watching for it. 
+    */
+   class TreeSyncHandler : public RpcHandler
+   {
+   public:
+      TreeSyncHandler() : RpcHandler(kNoResponse | kIdempotent) {}
+
+      void Handle(RpcServerConnection* connection, RpcMessageReader& call, 
+         RpcMessage& response) override
+      {
+         // the tree's sync server sends the response, or this one if the 
+         // connection isn't watching that tree... 
+         if (!connection->SendFullTreeSync(call.GetCode(), &response))
+         {
+            // ...unless there's no such tree.
+            connection->SendRpcMessage(response);
+         }
+      }
+
+      void HandleBatched(RpcServerConnection* connection, 
+         RpcMessageReader& call, RpcMessage&) override
+      {
+         // the batch's response stands in for ours.
+         connection->SendFullTreeSync(call.GetCode());
+      }
+   };
+
+
+   /**
+    * A client setting a property in one of the controller's trees.
+    */
+   class TreePropertyHandler : public RpcHandler
+   {
+   public:
+      TreePropertyHandler(ServerController* controller, int treeIndex)
+      :  RpcHandler(kNoResponse | kIdempotent)
+      ,  fController(controller)
+      ,  fTreeIndex(treeIndex)
+      {
+
+      }
+
+      void Handle(RpcServerConnection* connection, RpcMessageReader& call, 
+         RpcMessage& response) override
+      {
+         // value tree changes should take place after we've sent the (void) 
+         // response back to the client.
+         connection->SendRpcMessage(response);
+         this->Apply(call);
+      }
+
+      void HandleBatched(RpcServerConnection*, RpcMessageReader& call, 
+         RpcMessage&) override
+      {
+         // the (void) response goes back with the rest of the batch.
+         this->Apply(call);
+      }
+
+   private:
+      void Apply(RpcMessageReader& call)
+      {
+         RpcStringView path;
+         var value;
+         if (!call.GetTreeProperty(path, value))
+         {
+            DBG("Couldn't decode tree property for tree " + String(fTreeIndex));
+            return;
+         }
+
+         // the change is made on the tree's strand, in the order that the 
+         // changes arrived; the path only lasts as long as the call, so 
+         // the job gets its own copy.
+         ServerController* controller = fController;
+         const int treeIndex = fTreeIndex;
+         const String pathCopy(path.ToString());
+         controller->PostToTree(treeIndex, [controller, treeIndex, pathCopy, value]()
+         {
+            const RpcStringView path(pathCopy.toRawUTF8(), pathCopy.getNumBytesAsUTF8());
+            if (!RpcMessageReader::SetTreeProperty(controller->GetTree(treeIndex), 
+               path, value))
+            {
+               DBG("Couldn't apply tree property to tree " + String(treeIndex));
+            }
+         });
+      }
+
+      ServerController* fController;
+      int fTreeIndex;
+   };
+}
+
+
+RpcServer::RpcServer(ServerController* controller, Engine engine)
 :  fController(controller)
+,  fWorkers("RpcWorkers", jmax(static_cast<int>(RpcServer::kMinWorkers), 
+      SystemStats::getNumCpus()))
 {
+  const int numIoThreads = jlimit(1, static_cast<int>(kMaxIoThreads), 
+     SystemStats::getNumCpus());
+  if (kIoUring == engine && RpcEventLoop::IsAvailable(RpcEventLoop::kIoUring))
+  {
+     fEventLoop = new RpcEventLoop(numIoThreads, RpcEventLoop::kIoUring);
+     if (0 == fEventLoop->GetNumThreads())
+     {
+        fEventLoop = nullptr;
+     }
+  }
+  if (kThreadPerConnection != engine && nullptr == fEventLoop && 
+     RpcEventLoop::IsAvailable())
+  {
+     fEventLoop = new RpcEventLoop(numIoThreads);
+     if (0 == fEventLoop->GetNumThreads())
+     {
+        fEventLoop = nullptr;
+     }
+  }
+
+  fController->RegisterMethods(fDispatcher);
+
+  fDispatcher.Register(Controller::kValueTree1SetProp, 
+     new TreePropertyHandler(controller, 0));
+  fDispatcher.Register(Controller::kValueTree2SetProp, 
+     new TreePropertyHandler(controller, 1));
+  fDispatcher.Register(Controller::kValueTree1Update, new TreeSyncHandler());
+  fDispatcher.Register(Controller::kValueTree2Update, new TreeSyncHandler());
+  fDispatcher.Register(Controller::kBatch, 
+     new RpcBatchHandler(fDispatcher, &fWorkers));
+
+  fTreeSyncs.add(new ValueTreeSyncServer(this, 0, Controller::kValueTree1Update));
+  fTreeSyncs.add(new ValueTreeSyncServer(this, 1, Controller::kValueTree2Update));
+  // from now on, the trees (and their sync servers) are only touched on 
+  // their own strands.
+  fController->SetTreeExecutor(&fWorkers);
+
   this->startTimer(10 * 1000);
 
 }
 
+RpcServer::Engine RpcServer::GetEngine() const
+{
+   if (nullptr == fEventLoop)
+   {
+      return kThreadPerConnection;
+   }
+   return (RpcEventLoop::kIoUring == fEventLoop->GetBackend()) ? kIoUring : kEventLoop;
+}
+
+
 RpcServer::~RpcServer()
 {
+   // disconnect everyone while the tree sync servers still exist...
+   this->Stop();
+   fConnections.clear();
+   // ...and let them finish their jobs before they go.
+   fController->SetTreeExecutor(nullptr);
+}
 
+
+bool RpcServer::Start(int portNumber)
+{
+   if (nullptr != fEventLoop)
+   {
+      return fEventLoop->Listen(portNumber, [this]() -> RpcConnection*
+      {
+         return static_cast<RpcServerConnection*>(this->createConnectionObject());
+      });
+   }
+   return this->beginWaitingForSocket(portNumber);
+}
+
+
+int RpcServer::GetPort() const
+{
+   return (nullptr != fEventLoop) ? fEventLoop->GetPort() : -1;
 }
 
+
+bool RpcServer::StartLocal(const String& name)
+{
+   if (nullptr == fEventLoop)
+   {
+      // InterprocessConnectionServer only listens on TCP sockets, but a 
+      // connection can wait for its client on a pipe of its own.
+      RpcServerConnection* connection = 
+         static_cast<RpcServerConnection*>(this->createConnectionObject());
+      // a pipe that's been left behind by a server that's gone is reused.
+      if (connection->createPipe(name, -1, false))
+      {
+         return true;
+      }
+      const ScopedLock lock(fConnectionsLock);
+      fConnections.removeObject(connection);
+      return false;
+   }
+   return fEventLoop->ListenLocal(name, [this]() -> RpcConnection*
+   {
+      return static_cast<RpcServerConnection*>(this->createConnectionObject());
+   });
+}
+
+
+void RpcServer::SetWriteLatency(int microseconds)
+{
+   if (nullptr != fEventLoop)
+   {
+      fEventLoop->SetWriteLatency(microseconds);
+   }
+}
+
+
+void RpcServer::Stop()
+{
+   if (nullptr != fEventLoop)
+   {
+      fEventLoop->Stop();
+   }
+   this->stop();
+}
+
+
+ValueTreeSyncServer* RpcServer::FindTreeSync(uint32 messageCode) const
+{
+   for (int i = 0; i < fTreeSyncs.size(); ++i)
+   {
+      ValueTreeSyncServer* vts = fTreeSyncs.getUnchecked(i);
+      if (messageCode == vts->GetMessageCode())
+      {
+         return vts;
+      }
+   }
+   return nullptr;
+}
+
+
+bool RpcServer::WatchValueTree(RpcServerConnection* connection, uint32 messageCode)
+{
+   ValueTreeSyncServer* vts = this->FindTreeSync(messageCode);
+   if (nullptr != vts)
+   {
+      // the connection can't be deleted before this runs; its destructor 
+      // waits for UnwatchValueTrees(), which goes on the same strand.
+      fController->PostToTree(vts->GetTreeIndex(), [vts, connection]()
+      {
+         vts->AddWatcher(connection);
+      });
+   }
+   return (nullptr != vts);
+}
+
+
+bool RpcServer::SendFullTreeSync(RpcServerConnection* connection, 
+   uint32 messageCode, const RpcMessage* otherwise)
+{
+   ValueTreeSyncServer* vts = this->FindTreeSync(messageCode);
+   if (nullptr == vts)
+   {
+      return false;
+   }
+   const bool reply = (nullptr != otherwise);
+   const RpcMessage replyMessage(reply ? *otherwise : RpcMessage());
+   fController->PostToTree(vts->GetTreeIndex(), [vts, connection, reply, replyMessage]()
+   {
+      if (vts->IsWatcher(connection))
+      {
+         vts->SendFullSync(connection);
+      }
+      else if (reply)
+      {
+         connection->SendRpcMessage(replyMessage);
+      }
+   });
+   return true;
+}
+
+
+void RpcServer::UnwatchValueTrees(RpcServerConnection* connection, bool wait)
+{
+   for (int i = 0; i < fTreeSyncs.size(); ++i)
+   {
+      ValueTreeSyncServer* vts = fTreeSyncs.getUnchecked(i);
+      const RpcExecutor::Job job([vts, connection]()
+      {
+         vts->RemoveWatcher(connection);
+      });
+      if (wait)
+      {
+         fController->RunOnTree(vts->GetTreeIndex(), job);
+      }
+      else
+      {
+         fController->PostToTree(vts->GetTreeIndex(), job);
+      }
+   }
+}
+
+
+void RpcServer::FlushTreeChanges()
+{
+   for (int i = 0; i < fTreeSyncs.size(); ++i)
+   {
+      ValueTreeSyncServer* vts = fTreeSyncs.getUnchecked(i);
+      fController->PostToTree(vts->GetTreeIndex(), [vts]()
+      {
+         vts->FlushChanges();
+      });
+   }
+}
+
+
 void RpcServer::timerCallback()
 {
     // iterate through the connections -- if any of them are disconnected, delete them. 
     // NOTE that we iterate from the end to the front so we can delete items without
     // needing to worry about goofing up indexes.
-    int connectionListSize = fConnections.size();
-    if (connectionListSize)
+    OwnedArray<RpcServerConnection> disconnected;
     {
-      for (int i = (connectionListSize - 1); i >= 0; --i)
+      const ScopedLock lock(fConnectionsLock);
+      for (int i = (fConnections.size() - 1); i >= 0; --i)
       {
-         // RpcServerConnection* ipc = dynamic_cast<RpcServerConnection*>(fConnections.getUnchecked(i));
          RpcServerConnection* ipc = fConnections.getUnchecked(i);
-         if (ipc)
+         if (RpcServerConnection::kDisconnected == ipc->GetConnectionState())
          {
-            if (RpcServerConnection::kDisconnected == ipc->GetConnectionState())
-            {
-               // this connection is no longer operative; delete it.
-               fConnections.remove(i);
-            }
+            // this connection is no longer operative; delete it (once 
+            // we've let go of the lock).
+            disconnected.add(fConnections.removeAndReturn(i));
          }
       }
     }
 }
 
 
+void RpcServer::SetSharedDictionary(const MemoryBlock& dictionary)
+{
+   fSharedDictionary = dictionary;
+}
+
+
 InterprocessConnection* RpcServer::createConnectionObject()
 {
    // TODO: store into list, periodically delete disconnected connections.
-   RpcServerConnection* ipc = new RpcServerConnection(fController);
+   RpcServerConnection* ipc = new RpcServerConnection(this);
+   ipc->SetSharedDictionary(fSharedDictionary);
+   const ScopedLock lock(fConnectionsLock);
    fConnections.add(ipc);
    return ipc;
 }
 
 
-RpcServerConnection::RpcServerConnection(ServerController* controller)
-:  InterprocessConnection(false, 0xf2b49e2c)
-,  fController(controller)
+RpcServerConnection::RpcServerConnection(RpcServer* server)
+:  fServer(server)
+,  fController(server->GetController())
+,  fDispatcher(server->GetDispatcher())
+,  fWorkers(server->GetWorkers())
 ,  fConnected(RpcServerConnection::kConnecting)
+,  fNegotiable(true)
+,  fLink(new Link(this))
+,  fQueue(server->GetWorkers())
 {
   DBG("RpcServerConnection created." );
-  MessageManagerLock mmLock;
-  fController->addChangeListener(this);
+  // we're created on an I/O thread (or the server's), which mustn't wait 
+  // for the message thread, so we start listening once it gets to us.
+  Link::Ptr link(fLink);
+  ServerController* controller = fController;
+  MessageManager::callAsync([link, controller]()
+  {
+     const Link::ScopedUse use(link);
+     RpcServerConnection* connection = use.GetConnection();
+     if (nullptr != connection && 
+        RpcServerConnection::kDisconnected != connection->GetConnectionState())
+     {
+        controller->addChangeListener(connection);
+     }
+  });
 }
 
 RpcServerConnection::~RpcServerConnection()
 {
   DBG("RpcServerConnection destroyed." );
-
+  // responses that are still being worked on go nowhere.
+  fLink->Detach();
+  fServer->UnwatchValueTrees(this);
+  MessageManagerLock mmLock;
+  fController->removeChangeListener(this);
 }
 
 
 void RpcServerConnection::connectionMade()
 {
    DBG("RpcServerConnection::connectionMade()");
-   fConnected = RpcServerConnection::kConnected;
-   this->WatchValueTree(0, Controller::kValueTree1Update);
-   // this->WatchValueTree(1, Controller::kValueTree2Update);
+   RpcConnection::connectionMade();
+   // a client that only listens never sends us anything, so we can't wait 
+   // for it to negotiate; we talk to it in the legacy format until it does.
+   // A pipe is made before its client arrives, though, so there we wait 
+   // for the client's first message.
+   if (nullptr == this->getPipe())
+   {
+      this->StartSession();
+   }
+}
+
 
+void RpcServerConnection::StartSession()
+{
+   fConnected = RpcServerConnection::kConnected;
+   fServer->WatchValueTree(this, Controller::kValueTree1Update);
+   // fServer->WatchValueTree(this, Controller::kValueTree2Update);
 }
 
 void RpcServerConnection::connectionLost()
 {
    DBG("RpcServerConnection::connectionLost()");
-   MessageManagerLock mmLock;
+   RpcConnection::connectionLost();
+   // stop listening to any ValueTrees, and to the controller. We're on our 
+   // I/O thread, so we don't wait for either; our destructor does.
+   fServer->UnwatchValueTrees(this, false);
+   Link::Ptr link(fLink);
+   ServerController* controller = fController;
+   MessageManager::callAsync([link, controller]()
+   {
+      const Link::ScopedUse use(link);
+      if (nullptr != use.GetConnection())
+      {
+         controller->removeChangeListener(use.GetConnection());
+      }
+   });
+   // last of all, because the server deletes us once it sees this.
    fConnected = RpcServerConnection::kDisconnected;
-   fController->removeChangeListener(this);
-   // stop listening to any ValueTrees...
-   fTreeListeners.clear();
-   //delete this;
 }
 
 void RpcServerConnection::changeListenerCallback(ChangeBroadcaster* source)
@@ -164,149 +702,727 @@ void RpcServerConnection::changeListenerCallback(ChangeBroadcaster* source)
    if (RpcServerConnection::kConnected == fConnected)
    {
       DBG("TICK");
-      RpcMessage notify(Controller::kTimerAlert, 0);
+      const ScopedLock session(fSessionLock);
+      RpcMessage notify(Controller::kTimerAlert, 0, this->GetOptions());
       this->SendRpcMessage(notify);
    }
 
 }
 
-void RpcServerConnection::SendRpcMessage(const RpcMessage& msg)
+bool RpcServerConnection::SendFullTreeSync(uint32 messageCode, 
+   const RpcMessage* otherwise)
 {
-   const ScopedLock mutex(fLock);
-   this->sendMessage(msg.GetMemoryBlock());
+   return fServer->SendFullTreeSync(this, messageCode, otherwise);
 }
 
 
-void RpcServerConnection::messageReceived(const MemoryBlock& message)
+class RpcServerConnection::ConcurrentCall : public ReferenceCountedObject
+{
+public:
+   typedef ReferenceCountedObjectPtr<ConcurrentCall> Ptr;
+
+   ConcurrentCall(Link* link, RpcHandler* handler, const void* data, 
+      size_t size, uint32 sequence, bool oneWay, int64 deadline)
+   :  fLink(link)
+   ,  fHandler(handler)
+   ,  fMessage(data, size)
+   ,  fSequence(sequence)
+   ,  fOneWay(oneWay)
+   ,  fDeadline(deadline)
+   {
+
+   }
+
+   uint32 GetSequence() const { return fSequence; }
+
+   void Cancel() { fCancelled = 1; }
+
+   bool IsCancelled() const { return 0 != fCancelled.get(); }
+
+   /**
+    * The call that each worker thread is running, if any.
+    */
+   static ThreadLocalValue<ConcurrentCall*> sCurrent;
+
+   void Run()
+   {
+      const Link::ScopedUse use(fLink);
+      RpcServerConnection* connection = use.GetConnection();
+      if (nullptr == connection)
+      {
+         // the client went away before we got to this call.
+         return;
+      }
+      if (this->IsCancelled())
+      {
+         // ...or gave up on it.
+         connection->Finished(this);
+         return;
+      }
+      RpcMessageReader call(fMessage, connection->GetOptions());
+      // skip over the timeout (even one of 0, which gives us no deadline);
+      // we already know when the deadline is.
+      call.GetTimeout();
+      const uint32 messageCode = call.GetCode();
+      const uint32 sequence = call.GetSequence();
+      RpcMessage response(messageCode, sequence, connection->GetOptions());
+      sCurrent = this;
+      connection->Dispatch(fHandler, call, response, fOneWay, fDeadline);
+      sCurrent = nullptr;
+      connection->Finished(this);
+   }
+
+private:
+   Link::Ptr fLink;
+   RpcHandler* fHandler;
+   // our own copy; the one we were given only lasts as long as 
+   // HandleMessage().
+   MemoryBlock fMessage;
+   uint32 fSequence;
+   bool fOneWay;
+   int64 fDeadline;
+   Atomic<int> fCancelled;
+};
+
+
+ThreadLocalValue<RpcServerConnection::ConcurrentCall*> 
+   RpcServerConnection::ConcurrentCall::sCurrent;
+
+
+bool RpcServerConnection::IsCallCancelled()
+{
+   const ConcurrentCall* call = ConcurrentCall::sCurrent.get();
+   return (nullptr != call) && call->IsCancelled();
+}
+
+
+void RpcServerConnection::CancelCall(uint32 sequence)
+{
+   const ScopedLock lock(fRunningLock);
+   std::map<uint32, ConcurrentCall*>::iterator found = fRunning.find(sequence);
+   if (found != fRunning.end())
+   {
+      found->second->Cancel();
+      fServer->CountCancelledCall();
+   }
+}
+
+
+void RpcServerConnection::Finished(ConcurrentCall* call)
+{
+   const ScopedLock lock(fRunningLock);
+   std::map<uint32, ConcurrentCall*>::iterator found = fRunning.find(call->GetSequence());
+   // (a misbehaving client could reuse a sequence number while its first 
+   // call is still running.)
+   if (found != fRunning.end() && call == found->second)
+   {
+      fRunning.erase(found);
+   }
+}
+
+
+void RpcServerConnection::HandleMessage(const void* data, size_t size)
 {
    // a received message from a client needs to be decoded and converted into a 
    // function call that results in us sending a message back over this connection.
    
-   RpcMessage ipcMessage(message);
+   // Decode directly from the received block; we never copy it.
+   RpcMessageReader ipcMessage(data, size, this->GetOptions());
 
-   uint32 messageCode;
-   uint32 sequence;
-   ipcMessage.GetMetadata(messageCode, sequence);
-   DBG("Received message code " + String(messageCode) + " sequence = " + String(sequence));
+   // the deadline is measured from now; our clock and the client's needn't
+   // agree.
+   int64 deadline = 0;
+   if (0 != (this->GetOptions() & RpcMessage::kCallDeadlines))
+   {
+      deadline = RpcServerConnection::GetDeadline(ipcMessage.GetTimeout());
+   }
 
-   RpcMessage response(messageCode, sequence);
+   uint32 messageCode = ipcMessage.GetCode();
+   uint32 sequence = ipcMessage.GetSequence();
+   if (!ipcMessage.IsValid())
+   {
+      // we don't even have a sequence number to reply to.
+      DBG("Received a message too short to hold a header.");
+      return;
+   }
+   DBG("Received message code " + String(messageCode) + " sequence = " + String(sequence));
 
+   RpcMessage response(messageCode, sequence, this->GetOptions());
 
-   try
+   if (fNegotiable)
    {
+      // only the client's first message may negotiate.
+      fNegotiable = false;
+      if (Controller::kNegotiate == messageCode)
+      {
+         uint32 offered = ipcMessage.GetData<uint32>();
+         uint32 accepted = offered & RpcMessage::kSupportedOptions;
+         if (0 != (accepted & RpcMessage::kDictionaryFrames))
+         {
+            // the client follows its options with its dictionary's ID.
+            const uint32 dictionaryId = ipcMessage.GetData<uint32>();
+            if (!ipcMessage.IsValid() || dictionaryId != this->GetDictionaryId())
+            {
+               accepted &= ~static_cast<uint32>(RpcMessage::kDictionaryFrames);
+            }
+         }
+         // the reply goes out in the legacy format, and only then do we 
+         // switch over to the new options. The client switches when it 
+         // reads the reply, so nothing that we send unprompted can go out
+         // in between.
+         response.AppendData<uint32>(accepted);
+         const ScopedLock session(fSessionLock);
+         this->SendRpcMessage(response);
+         this->SetOptions(accepted);
+         DBG("Negotiated wire options " + String::toHexString((int) accepted));
+         if (RpcServerConnection::kConnecting == fConnected)
+         {
+            this->StartSession();
+         }
+         return;
+      }
+      if (RpcServerConnection::kConnecting == fConnected)
+      {
+         this->StartSession();
+      }
+   }
 
-     switch (messageCode)
-     {
-        case Controller::kVoidFn:
-        {
-           fController->VoidFn();
-        }
-        break;
 
-        case Controller::kIntFn:
-        {
-           int arg = ipcMessage.GetData<int>();
-           DBG("IntFn arg = " + String(arg));
-           int retval = fController->IntFn(arg);
-           DBG("IntFn retval = " + String(retval));
+   if (Controller::kCancel == messageCode && 
+      0 != (this->GetOptions() & RpcMessage::kCancelCalls))
+   {
+      this->CancelCall(ipcMessage.GetUInt());
+      return;
+   }
 
-           response.AppendData(retval);
-        }
-        break;
+   // the client isn't waiting for anything back from a one-way call.
+   const bool oneWay = (0 == sequence) && 
+      (0 != (this->GetOptions() & RpcMessage::kOneWayCalls));
 
-        case Controller::kStringFn:
-        {
-          String arg = ipcMessage.GetString();
-          DBG("StringFn arg = " + arg);
-          String retval = fController->StringFn(arg);
-          DBG("StringFn retval = " + retval);
+   RpcHandler* handler = fDispatcher.Find(messageCode);
+   if (nullptr != handler && handler->HasTrait(RpcHandler::kConcurrent))
+   {
+      // don't hold up the calls behind this one; its response goes back 
+      // whenever it's ready, and the client matches it up by its sequence 
+      // number.
+      ConcurrentCall::Ptr call = new ConcurrentCall(fLink, handler, data, size,
+         sequence, oneWay, deadline);
+      if (!oneWay)
+      {
+         const ScopedLock lock(fRunningLock);
+         fRunning[sequence] = call;
+      }
+      if (0 != deadline)
+      {
+         // the calls with the least time left run first.
+         fWorkers.PostBefore([call]() { call->Run(); }, deadline);
+      }
+      else
+      {
+         fWorkers.Post([call]() { call->Run(); });
+      }
+      return;
+   }
+   if (0 != fNumQueued.get() || 
+      (nullptr != handler && handler->HasTrait(RpcHandler::kBlocking)))
+   {
+      this->Queue(handler, data, size, sequence, oneWay, deadline);
+      return;
+   }
+   this->Dispatch(handler, ipcMessage, response, oneWay, deadline);
+}
 
-          response.AppendString(retval);
 
-        }
-        break;
+void RpcServerConnection::Queue(RpcHandler* handler, const void* data, 
+   size_t size, uint32 sequence, bool oneWay, int64 deadline)
+{
+   ConcurrentCall::Ptr call = new ConcurrentCall(fLink, handler, data, size,
+      sequence, oneWay, deadline);
+   if (!oneWay)
+   {
+      // the client may give up on it while it waits.
+      const ScopedLock lock(fRunningLock);
+      fRunning[sequence] = call;
+   }
+   Link::Ptr link(fLink);
+   ++fNumQueued;
+   fQueue.Post([call, link]()
+   {
+      call->Run();
+      const Link::ScopedUse use(link);
+      if (nullptr != use.GetConnection())
+      {
+         --use.GetConnection()->fNumQueued;
+      }
+   });
+}
 
-        case Controller::kValueTree1Update:
-        case Controller::kValueTree2Update:
-        {
-            // client is explicitly requesting the full tree update.
-            for (int i = 0; i < fTreeListeners.size(); ++i)
-            {
-               ValueTreeSyncServer* vts = fTreeListeners.getUnchecked(i);
-               if (messageCode == vts->GetMessageCode())
-               {
-                  // we found the sync handler for that tree. Get a full sync:
-                  vts->sendFullSyncCallback();
-                  // return immediately -- the listener code will send back the response.
-                  return;
-               }
-            }
 
-        }
-        break;
+int64 RpcServerConnection::GetDeadline(uint32 timeoutMs)
+{
+   if (0 == timeoutMs)
+   {
+      return 0;
+   }
+   return Time::getHighResolutionTicks() + 
+      Time::secondsToHighResolutionTicks(timeoutMs / 1000.0);
+}
 
-        default:
-        {
-           DBG("Received unknown message code" + String(messageCode));
-           RpcException e(Controller::kUnknownMethodError);
-           e.AppendExtraData(var(static_cast<int>(messageCode)));
 
-           throw e;
-        }
-        break;
+void RpcServerConnection::Dispatch(RpcHandler* handler, RpcMessageReader& call,
+   RpcMessage& response, bool oneWay, int64 deadline)
+{
+   uint32 messageCode;
+   uint32 sequence;
+   response.GetMetadata(messageCode, sequence);
+   try
+   {
+     if (0 != deadline && Time::getHighResolutionTicks() > deadline)
+     {
+        // the caller has given up on this call, so running it would only
+        // delay the ones that can still make their deadlines.
+        fServer->CountShedCall();
+        throw RpcException(Controller::kTimeout);
      }
 
-     this->SendRpcMessage(response);
+     if (nullptr == handler)
+     {
+        DBG("Received unknown message code" + String(messageCode));
+        RpcException e(Controller::kUnknownMethodError);
+        e.AppendExtraData(var(static_cast<int>(messageCode)));
+
+        throw e;
+     }
 
-      if ((messageCode >= Controller::kValueTree1SetProp) && (messageCode < Controller::kTimerAlert))
+     if (oneWay)
+     {
+        handler->HandleBatched(this, call, response);
+     }
+     else
      {
-        // value tree changes should take place after we've sent the (void) response back to the 
-        // client.
-        switch (messageCode)
+        handler->Handle(this, call, response);
+        if (!handler->HasTrait(RpcHandler::kNoResponse) && 
+           !RpcServerConnection::IsCallCancelled())
         {
-            case Controller::kValueTree2SetProp:
-            {
-                ValueTree tree = fController->GetTree(1);
-                ipcMessage.ApplyTreeProperty(tree);
-            }  
-        } 
+           this->SendRpcMessage(response);
+        }
      }
    }
    catch (const RpcException& e)
    {
-      RpcMessage exception(e.GetCode(), sequence);
-      int extraData = e.GetExtraDataSize();
-      if (extraData)
+      if (oneWay || RpcServerConnection::IsCallCancelled())
+      {
+         DBG("One-way or cancelled call code " + String(messageCode) + 
+            " failed, exception code = " + String(e.GetCode()));
+         return;
+      }
+      this->SendRpcMessage(RpcResponder::MakeException(e, sequence, 
+         this->GetOptions()));
+   }
+
+}
+
+
+bool RpcServerConnection::Link::Send(const RpcMessage& msg)
+{
+   const ScopedReadLock lock(fLock);
+   return (nullptr != fConnection) && fConnection->SendRpcMessage(msg);
+}
+
+
+void RpcServerConnection::Link::Detach()
+{
+   const ScopedWriteLock lock(fLock);
+   fConnection = nullptr;
+}
+
+
+RpcResponder::RpcResponder(RpcServerConnection* connection, 
+   const RpcMessageReader& call, uint32 options)
+:  fLink((nullptr != connection) ? connection->GetLink() : nullptr)
+,  fResponse(call.GetCode(), call.GetSequence(), options)
+,  fSequence(call.GetSequence())
+,  fDone(0)
+{
+
+}
+
+
+RpcResponder::~RpcResponder()
+{
+   if (!this->IsDone())
+   {
+      DBG("Call sequence " + String(fSequence) + " was never answered.");
+      this->Fail(RpcException(Controller::kInternalError));
+   }
+}
+
+
+bool RpcResponder::Send()
+{
+   return this->Finish(fResponse);
+}
+
+
+bool RpcResponder::Fail(const RpcException& e)
+{
+   return this->Finish(MakeException(e, fSequence, fResponse.GetOptions()));
+}
+
+
+bool RpcResponder::Finish(const RpcMessage& msg)
+{
+   if (!fDone.compareAndSetBool(1, 0))
+   {
+      jassertfalse;     // only respond once!
+      return false;
+   }
+   return (nullptr != fLink) && fLink->Send(msg);
+}
+
+
+RpcMessage RpcResponder::MakeException(const RpcException& e, uint32 sequence, 
+   uint32 options)
+{
+   RpcMessage exception(e.GetCode(), sequence, options);
+   int extraData = e.GetExtraDataSize();
+   if (extraData)
+   {
+      for (int i = 0; i < extraData; ++i)
       {
-         for (int i = 0; i < extraData; ++i)
+         exception.AppendVar(e.GetExtraData(i)); 
+      }
+   }
+   // append a void var as a terminator of the extra data.
+   var voidVar;
+   exception.AppendVar(voidVar);
+   return exception;
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+namespace
+{
+   typedef RpcMethod<900, int(int)>    GatedMethod;
+   typedef RpcMethod<901, void()>      BlockingMethod;
+   typedef RpcMethod<902, void(int)>   RecordMethod;
+   typedef RpcMethod<903, void()>      ThrowMethod;
+   typedef RpcMethod<904, int(int)>    CountMethod;
+
+   /**
+    * The methods that the tests call, alongside the controller's own. The 
+    * gated ones don't return until the test opens the gate.
+    */
+   class TestService
+   {
+   public:
+      TestService()
+      :  fGate(true)
+      {
+
+      }
+
+      int Gated(int val)
+      {
+         fGate.wait(5000);
+         return val;
+      }
+
+      void Block()
+      {
+         fGate.wait(5000);
+      }
+
+      int Count(int val)
+      {
+         ++fNumCounted;
+         return val;
+      }
+
+      void Throw()
+      {
+         ++fNumThrown;
+         throw RpcException(Controller::kParameterError);
+      }
+
+      void Record(int val)
+      {
+         const ScopedLock lock(fLock);
+         fRecorded.add(val);
+      }
+
+      /**
+       * @return true if Record() has been called with 0, 1, 2... `count` - 1,
+       *         in that order.
+       */
+      bool RecordedInOrder(int count)
+      {
+         const ScopedLock lock(fLock);
+         bool inOrder = (count == fRecorded.size());
+         for (int i = 0; inOrder && i < count; ++i)
          {
-            exception.AppendVar(e.GetExtraData(i)); 
+            inOrder = (i == fRecorded.getUnchecked(i));
          }
+         return inOrder;
       }
-      // append a void var as a terminator of the extra data.
-      var voidVar;
-      exception.AppendVar(voidVar);
 
-      this->SendRpcMessage(exception);
-   }
+      WaitableEvent fGate;
+      CriticalSection fLock;
+      Array<int> fRecorded;
+      Atomic<int> fNumThrown;
+      Atomic<int> fNumCounted;
+   };
+
 
+   /**
+    * Keeps the code of every message that the client receives, in the 
+    * order that they arrive.
+    */
+   class RecordingClient : public RpcClient
+   {
+   public:
+      void HandleMessage(const void* data, size_t size) override
+      {
+         {
+            RpcMessageReader reader(data, size, this->GetOptions());
+            const ScopedLock lock(fLock);
+            fCodes.add(reader.GetCode());
+         }
+         RpcClient::HandleMessage(data, size);
+      }
+
+      /**
+       * @return the index of the first message with code `code`, or -1.
+       */
+      int IndexOf(uint32 code) const
+      {
+         const ScopedLock lock(fLock);
+         return fCodes.indexOf(code);
+      }
+
+      /**
+       * @return the number of messages with code `code`.
+       */
+      int Count(uint32 code) const
+      {
+         const ScopedLock lock(fLock);
+         int count = 0;
+         for (int i = 0; i < fCodes.size(); ++i)
+         {
+            count += (code == fCodes.getUnchecked(i)) ? 1 : 0;
+         }
+         return count;
+      }
+
+      CriticalSection fLock;
+      Array<uint32> fCodes;
+   };
 }
 
 
- bool RpcServerConnection::WatchValueTree(int index, uint32 messageCode)
- {
-    ValueTree tree = fController->GetTree(index);
-    // bool retval = fController->GetTree(index, tree);
-    bool retval = (ValueTree::invalid != tree);
-    if (retval)
-    {
-        // connect this sync server to the value tree
-        ValueTreeSyncServer* vts = new ValueTreeSyncServer(tree, this, messageCode);
-        fTreeListeners.add(vts);
-        // and force a full update 
-        vts->sendFullSyncCallback();
+class RpcServerTest : public UnitTest
+{
+public:
+   RpcServerTest() : UnitTest("RpcServer tests") {}
 
-    }
-    return retval;
+   void runTest() override
+   {
+      this->beginTest("Slow concurrent calls");
+      TestService service;
+      RpcServer server(new ServerController());
+      if (RpcServer::kThreadPerConnection == server.GetEngine())
+      {
+         // we need the event loop to tell us which port it picked.
+         this->logMessage("RpcEventLoop isn't available here.");
+         return;
+      }
+      RpcDispatcher& dispatcher = server.GetDispatcher();
+      dispatcher.Register<GatedMethod>(&service, &TestService::Gated, 
+         RpcHandler::kConcurrent);
+      dispatcher.Register<BlockingMethod>(&service, &TestService::Block,
+         RpcHandler::kBlocking);
+      dispatcher.Register<RecordMethod>(&service, &TestService::Record);
+      dispatcher.Register<ThrowMethod>(&service, &TestService::Throw);
+      dispatcher.Register<CountMethod>(&service, &TestService::Count, 
+         RpcHandler::kConcurrent);
+      this->expect(server.Start(0));
+      RecordingClient* rpc = new RecordingClient();
+      ClientController client(rpc);
+      this->expect(client.ConnectToServer("127.0.0.1", server.GetPort(), 1000));
+
+      RpcFuture<int> gated = client.CallAsync<GatedMethod>(7);
+      // the cheap call isn't held up by the slow one in front of it.
+      this->expect(4 == client.IntFn(2));
+      this->expect(!gated.IsReady());
+      service.fGate.signal();
+      this->expect(gated.Wait(5000));
+      this->expect(7 == gated.Get());
+
+      this->beginTest("Out of order responses");
+      // the cheap call's response overtook the slow one's...
+      this->expect(rpc->IndexOf(Controller::kIntFn) < rpc->IndexOf(GatedMethod::kCode));
+      // ...and each still went to its own caller.
+      service.fGate.reset();
+      std::vector<RpcFuture<int> > slow;
+      std::vector<RpcFuture<int> > quick;
+      for (int i = 0; i < 2; ++i)
+      {
+         slow.push_back(client.CallAsync<GatedMethod>(i));
+      }
+      for (int i = 0; i < 20; ++i)
+      {
+         quick.push_back(client.CallAsync<Controller::IntFnMethod>(i));
+      }
+      bool matched = true;
+      for (int i = 0; i < 20; ++i)
+      {
+         matched = matched && (2 * i == quick[i].Get());
+      }
+      this->expect(matched);
+      service.fGate.signal();
+      for (int i = 0; i < 2; ++i)
+      {
+         this->expect(i == slow[i].Get());
+      }
+
+      this->beginTest("Ordered calls");
+      std::vector<RpcFuture<void> > ordered;
+      for (int i = 0; i < 50; ++i)
+      {
+         ordered.push_back(client.CallAsync<RecordMethod>(i));
+         client.CallAsync<Controller::IntFnMethod>(i);
+      }
+      // these wait behind a call that has to leave the I/O thread.
+      service.fGate.reset();
+      RpcFuture<void> blocked = client.CallAsync<BlockingMethod>();
+      for (int i = 50; i < 100; ++i)
+      {
+         ordered.push_back(client.CallAsync<RecordMethod>(i));
+      }
+      service.fGate.signal();
+      this->expect(blocked.Wait(5000));
+      bool finished = true;
+      for (size_t i = 0; i < ordered.size(); ++i)
+      {
+         finished = finished && ordered[i].Wait(5000);
+      }
+      this->expect(finished);
+      this->expect(service.RecordedInOrder(100));
+
+      this->beginTest("One-way calls");
+      this->expect(client.CallOneWay<ThrowMethod>());
+      // the one-way call runs before this one, which is sent after it.
+      this->expect(4 == client.IntFn(2));
+      this->expect(1 == service.fNumThrown.get());
+      // neither its result nor its exception comes back.
+      this->expect(0 == rpc->Count(ThrowMethod::kCode));
+      this->expect(0 == rpc->Count(Controller::kParameterError));
+
+      this->beginTest("Shed calls");
+      {
+         // an ordered call that nobody cancels waits behind the blocked one
+         // until its deadline has passed...
+         const int shed = server.GetNumShedCalls();
+         service.fGate.reset();
+         RpcFuture<void> blocking = client.CallAsync<BlockingMethod>();
+         RpcMessage late(RecordMethod::kCode, 0x7fff0000, client.GetOptions(), 50);
+         late.AppendInt(-1);
+         this->expect(rpc->SendRpcMessage(late));
+         Thread::sleep(100);
+         service.fGate.signal();
+         this->expect(blocking.Wait(5000));
+         // ...so it's answered with kTimeout by the time this one runs.
+         client.Call<RecordMethod>(100);
+         this->expect(shed + 1 == server.GetNumShedCalls());
+         this->expect(service.RecordedInOrder(101));
+      }
+
+      this->beginTest("Cancelled calls");
+      {
+         // with every worker busy, the call waits in the queue...
+         RpcThreadExecutor& workers = server.GetWorkers();
+         const int numThreads = workers.GetNumThreads();
+         Atomic<int> started;
+         service.fGate.reset();
+         for (int i = 0; i < numThreads; ++i)
+         {
+            workers.Post([&service, &started]()
+            {
+               ++started;
+               service.fGate.wait(5000);
+            });
+         }
+         for (int i = 0; i < 500 && started.get() < numThreads; ++i)
+         {
+            Thread::sleep(10);
+         }
+         this->expect(numThreads == started.get());
+         const int cancelled = server.GetNumCancelledCalls();
+         const int timeouts = rpc->Count(Controller::kTimeout);
+         client.SetCallTimeout(50);
+         RpcFuture<int> queued = client.CallAsync<CountMethod>(-1);
+         this->expect(queued.Wait(5000));
+         this->expect(Controller::kTimeout == this->GetErrorCode(queued));
+         client.SetCallTimeout(ClientController::kDefaultCallTimeoutMs);
+         // ...until the client cancels it.
+         for (int i = 0; i < 500 && cancelled == server.GetNumCancelledCalls(); ++i)
+         {
+            Thread::sleep(10);
+         }
+         this->expect(cancelled + 1 == server.GetNumCancelledCalls());
+         service.fGate.signal();
+         // this one is queued behind it, so it's been skipped by now.
+         this->expect(7 == client.Call<CountMethod>(7));
+         this->expect(1 == service.fNumCounted.get());
+         this->expect(1 == rpc->Count(CountMethod::kCode));
+         this->expect(timeouts == rpc->Count(Controller::kTimeout));
+      }
+
+      this->beginTest("Cancelled queued calls");
+      {
+         // a call waits its turn behind a blocking one...
+         service.fGate.reset();
+         RpcFuture<void> blocking = client.CallAsync<BlockingMethod>();
+         const int cancelled = server.GetNumCancelledCalls();
+         client.SetCallTimeout(50);
+         RpcFuture<void> queued = client.CallAsync<RecordMethod>(-1);
+         this->expect(queued.Wait(5000));
+         this->expect(Controller::kTimeout == this->GetErrorCode(queued));
+         client.SetCallTimeout(ClientController::kDefaultCallTimeoutMs);
+         // ...until the client cancels it.
+         for (int i = 0; i < 500 && cancelled == server.GetNumCancelledCalls(); ++i)
+         {
+            Thread::sleep(10);
+         }
+         this->expect(cancelled + 1 == server.GetNumCancelledCalls());
+         service.fGate.signal();
+         this->expect(blocking.Wait(5000));
+         this->expect(0 == this->GetErrorCode(blocking));
+         // this one runs after it, in order, so it's been skipped by now.
+         client.Call<RecordMethod>(-2);
+         const ScopedLock lock(service.fLock);
+         this->expect(!service.fRecorded.contains(-1));
+         this->expect(service.fRecorded.contains(-2));
+      }
+   }
+
+private:
+   template <typename R>
+   uint32 GetErrorCode(RpcFuture<R>& future)
+   {
+      try
+      {
+         future.Get();
+      }
+      catch (const RpcException& e)
+      {
+         return e.GetCode();
+      }
+      return 0;
+   }
+};
 
- }
\ No newline at end of file
+static RpcServerTest rpcServerTest;
@@ -8,18 +8,107 @@
 #define IPCSERVER_H_INCLUDED
 
 #include "Controller.h"
+#include "RpcConnection.h"
+#include "RpcDispatcher.h"
+#include "RpcEventLoop.h"
+
+#include <map>
 
 class RpcMessage;
 class RpcServerConnection;
+class ValueTreeSyncServer;
 
 class RpcServer : public InterprocessConnectionServer
                 , public Timer
 {
 public: 
-   RpcServer(ServerController* controller);
+   enum
+   {
+      /**
+       * Handlers often spend their time waiting rather than computing, so 
+       * we have at least this many workers however few CPUs there are.
+       */
+      kMinWorkers = 4,
+
+      /**
+       * The most RpcEventLoop I/O threads we use, however many CPUs there 
+       * are; each one can serve thousands of connections.
+       */
+      kMaxIoThreads = 4
+   };
+
+   /**
+    * How we read from our clients.
+    */
+   enum Engine
+   {
+      /**
+       * Each connection has its own InterprocessConnection thread. Its 
+       * sockets wait with select(), which can't handle descriptors of 
+       * FD_SETSIZE (1024) or more, and each connection uses two of them, so
+       * this tops out at a few hundred clients.
+       */
+      kThreadPerConnection = 0,
+
+      /**
+       * A few RpcEventLoop I/O threads read from every connection. Where 
+       * that isn't available, we fall back to kThreadPerConnection.
+       */
+      kEventLoop,
+
+      /**
+       * As kEventLoop, but with RpcEventLoop's io_uring backend, falling
+       * back to kEventLoop on kernels older than 5.19.
+       */
+      kIoUring
+   };
+
+   RpcServer(ServerController* controller, Engine engine=kEventLoop);
 
    ~RpcServer();
 
+   /**
+    * Start accepting connections on `portNumber`, with our engine.
+    * @return false if we couldn't listen on that port.
+    */
+   bool Start(int portNumber);
+
+   /**
+    * @return the port that we're listening on, which Start() picks for 
+    *         itself if it's given port 0; or -1 if we aren't listening on 
+    *         one, or our engine is kThreadPerConnection, which doesn't say.
+    */
+   int GetPort() const;
+
+   /**
+    * Start accepting connections from clients on this host on the local 
+    * socket for `name` (see RpcEventLoop::ListenLocal()), in place of 
+    * Start(). Each call's round trip is quicker than over loopback TCP. 
+    * Only the event loop engines can do this; where they aren't available,
+    * or our engine is kThreadPerConnection, we open the NamedPipe `name` 
+    * instead, which only has room for a single client.
+    * @return false if we couldn't listen there.
+    */
+   bool StartLocal(const String& name);
+
+   /**
+    * Stop accepting connections, and disconnect every client.
+    */
+   void Stop();
+
+   /**
+    * @return the engine that we ended up with, which may not be the one 
+    *         that was asked for.
+    */
+   Engine GetEngine() const;
+
+   /**
+    * Let what we send each client wait up to `microseconds` for more to 
+    * join it in the same write (see RpcEventLoop::SetWriteLatency()). The 
+    * kThreadPerConnection engine writes each message as it's sent.
+    */
+   void SetWriteLatency(int microseconds);
+
    /**
     * Will actually return an instance of RpcServerConnection (below)
     * @return [pointer to server connection]
@@ -32,30 +121,127 @@ public:
     */
    void timerCallback();
 
+   /**
+    * Services register their handlers here before the server starts 
+    * accepting connections.
+    */
+   RpcDispatcher& GetDispatcher() { return fDispatcher; }
+
+   ServerController* GetController() const { return fController; }
+
+   /**
+    * Threads for handlers that can run alongside others (see 
+    * RpcHandler::kConcurrent), and for the strands of the controller's 
+    * trees (see ServerController::SetTreeExecutor()).
+    */
+   RpcThreadExecutor& GetWorkers() { return fWorkers; }
+
+   /**
+    * @return the number of calls that we've answered with 
+    * Controller::kTimeout instead of running, because their deadlines (see 
+    * RpcMessage::kCallDeadlines) passed before a worker got to them.
+    */
+   int GetNumShedCalls() const { return fNumShedCalls.get(); }
+
+   /**
+    * Called by a connection when it sheds a call.
+    */
+   void CountShedCall() { ++fNumShedCalls; }
+
+   /**
+    * @return the number of calls that their clients cancelled (see 
+    * RpcMessage::kCancelCalls) before they had finished.
+    */
+   int GetNumCancelledCalls() const { return fNumCancelledCalls.get(); }
+
+   void CountCancelledCall() { ++fNumCancelledCalls; }
+
+   /**
+    * Send a connection the full contents of the controller tree that's 
+    * sent with `messageCode` updates, and then send it each change to that 
+    * tree. This happens on the tree's strand, after we return.
+    * @return false if there's no tree with that code.
+    */
+   bool WatchValueTree(RpcServerConnection* connection, uint32 messageCode);
+
+   /**
+    * Send a connection that's watching a tree its full contents again. This
+    * happens on the tree's strand, after we return.
+    * @param otherwise A message to send instead if the connection isn't 
+    *                  watching that tree, or nullptr.
+    * @return false if there's no tree with that code.
+    */
+   bool SendFullTreeSync(RpcServerConnection* connection, uint32 messageCode,
+      const RpcMessage* otherwise=nullptr);
+
+   /**
+    * Stop sending tree changes to a connection. 
+    * @param wait If true, wait for the jobs on the trees' strands that may
+    *             still be using it; otherwise, return straight away.
+    */
+   void UnwatchValueTrees(RpcServerConnection* connection, bool wait=true);
+
+   /**
+    * Send the tree changes that we've been holding for kDelimitedTrees 
+    * connections. Each tree's changes go out in a single message once the 
+    * jobs that are waiting on its strand have run, so this only needs 
+    * calling to send them sooner.
+    */
+   void FlushTreeChanges();
+
+   /**
+    * Give every connection made from now on this pre-trained dictionary
+    * for the RpcMessage::kDictionaryFrames option. Clients must use the
+    * same one (see ClientController::SetSharedDictionary()).
+    */
+   void SetSharedDictionary(const MemoryBlock& dictionary);
 
 
+private:
+   ValueTreeSyncServer* FindTreeSync(uint32 messageCode) const;
+
 private:
    ScopedPointer<ServerController> fController;
+   RpcDispatcher fDispatcher;
+   RpcThreadExecutor fWorkers;
+
+   /**
+    * One for each of the controller's trees. 
+    */
+   OwnedArray<ValueTreeSyncServer> fTreeSyncs;
+
+   /**
+    * Only for the kEventLoop engine.
+    */
+   ScopedPointer<RpcEventLoop> fEventLoop;
+
+   /**
+    * Connections are added on the thread that accepts them, and removed on 
+    * the message thread.
+    */
+   CriticalSection fConnectionsLock;
    OwnedArray<RpcServerConnection> fConnections;
 
-};
+   MemoryBlock fSharedDictionary;
 
+   Atomic<int> fNumShedCalls;
+   Atomic<int> fNumCancelledCalls;
+
+};
 
 
-// forward ref
-class ValueTreeSyncServer;
 
-class RpcServerConnection : public InterprocessConnection
+class RpcServerConnection : public RpcConnection
                           , public ChangeListener
 {
 public:
-   RpcServerConnection(ServerController* controller);
+   RpcServerConnection(RpcServer* server);
 
    ~RpcServerConnection();
 
    enum ConnectionState
    {
-      kConnecting = 0,
+      kConnecting = 0,  /** socket is being opened, or pipe has no client yet */
       kConnected, 
       kDisconnected
    };
@@ -64,32 +250,247 @@ public:
 
    void connectionLost() override;
 
-   void messageReceived(const MemoryBlock& message) override;
+   void HandleMessage(const void* data, size_t size) override;
 
    void changeListenerCallback(ChangeBroadcaster* source) override;
 
-   void SendRpcMessage(const RpcMessage& msg);
-
    /**
-    * ValueTree-related functions:
+    * Send the client the full contents of the tree that's being sent with 
+    * `messageCode` updates (see RpcServer::SendFullTreeSync()).
     */
-   
-   bool WatchValueTree(int index, uint32 messageCode);
+   bool SendFullTreeSync(uint32 messageCode, const RpcMessage* otherwise=nullptr);
 
    ConnectionState GetConnectionState() const { return fConnected; };
 
+   /**
+    * Hold this while reading GetOptions() to build a message that the 
+    * client didn't ask for (a tree change, say), and sending it. The client
+    * switches wire options as soon as it reads our kNegotiate reply, so 
+    * the reply and our switch go out under the same lock.
+    */
+   const CriticalSection& GetSessionLock() const { return fSessionLock; }
+
+   /**
+    * Something that an RpcResponder can hold on to in place of the 
+    * connection itself, which may be deleted before the response is ready.
+    */
+   class Link : public ReferenceCountedObject
+   {
+   public:
+      typedef ReferenceCountedObjectPtr<Link> Ptr;
+
+      Link(RpcServerConnection* connection) : fConnection(connection) {}
+
+      /**
+       * Send a message if the connection still exists.
+       */
+      bool Send(const RpcMessage& msg);
+
+      /**
+       * Called by the connection's destructor. Waits for any ScopedUse 
+       * that's still in scope on another thread.
+       */
+      void Detach();
+
+      /**
+       * Keeps the connection from being deleted while one of its calls is 
+       * handled on another thread.
+       */
+      class ScopedUse
+      {
+      public:
+         ScopedUse(Link* link) : fLock(link->fLock), fConnection(link->fConnection) {}
+
+         /**
+          * @return the connection, or nullptr if it's already gone.
+          */
+         RpcServerConnection* GetConnection() const { return fConnection; }
+
+      private:
+         const ScopedReadLock fLock;
+         RpcServerConnection* fConnection;
+      };
+
+   private:
+      ReadWriteLock fLock;
+      RpcServerConnection* fConnection;
+   };
+
+   Link* GetLink() const { return fLink; }
+
+   /**
+    * @return true if the client has cancelled the call that this thread is 
+    * running (see RpcMessage::kCancelCalls). Only calls on the workers 
+    * (RpcHandler::kConcurrent calls, and those waiting their turn on the 
+    * connection's queue) can be cancelled once they've started; a handler 
+    * that takes a while can check this now and then and give up early. Its 
+    * response isn't sent.
+    */
+   static bool IsCallCancelled();
+
+
+private:
+   /**
+    * Start sending the client its tree syncs and timer alerts, once it's 
+    * connected. Until the client negotiates (if it ever does), they go in 
+    * the legacy format.
+    */
+   void StartSession();
+
+   /**
+    * Run a call with its handler, and send its response (unless it's 
+    * one-way) or the exception that it throws.
+    * @param handler  The call's handler, or nullptr if there isn't one.
+    * @param deadline When the caller stops waiting for the response, in 
+    *                 Time::getHighResolutionTicks(), or 0 if it doesn't.
+    *                 Past that, we send Controller::kTimeout instead of 
+    *                 running the call.
+    */
+   void Dispatch(RpcHandler* handler, RpcMessageReader& call, 
+      RpcMessage& response, bool oneWay, int64 deadline);
+
+   /**
+    * @return when a call that the caller will wait `timeoutMs` for must 
+    * have finished, or 0 if `timeoutMs` is 0.
+    */
+   static int64 GetDeadline(uint32 timeoutMs);
+
+   /**
+    * A call that runs on the server's workers: either one to a 
+    * RpcHandler::kConcurrent handler, or one that's waiting its turn on 
+    * fQueue.
+    */
+   class ConcurrentCall;
+
+   /**
+    * Run a call on fQueue, after the calls that are already waiting there
+    * (see RpcHandler::kBlocking).
+    */
+   void Queue(RpcHandler* handler, const void* data, size_t size, 
+      uint32 sequence, bool oneWay, int64 deadline);
+
+   /**
+    * The client has given up on the call with sequence number `sequence`.
+    * If it's a call on the workers that hasn't finished, it won't start 
+    * or send its response.
+    */
+   void CancelCall(uint32 sequence);
+
+   /**
+    * Forget a call on the workers once it's done.
+    */
+   void Finished(ConcurrentCall* call);
 
 private:
+   // the server that created us.
+   RpcServer* fServer;
+
    // raw pointer; we do NOT own this controller.
    ServerController* fController;
 
-   // When ValueTrees change, these listeners will make sure that clients 
-   // receive sync info.
-   OwnedArray<ValueTreeSyncServer>  fTreeListeners;
-
-   CriticalSection fLock;
+   // owned by our RpcServer.
+   const RpcDispatcher& fDispatcher;
+   RpcExecutor& fWorkers;
 
    ConnectionState fConnected;
+
+   /**
+    * True until the client's first message arrives, which is the only one
+    * that can be a kNegotiate request. Only used on the connection's 
+    * reading thread.
+    */
+   bool fNegotiable;
+
+   /**
+    * See GetSessionLock().
+    */
+   CriticalSection fSessionLock;
+
+   Link::Ptr fLink;
+
+   /**
+    * The calls on the workers that haven't finished yet, by sequence number,
+    * so they can be cancelled. Each one removes itself when it's done, while 
+    * it still holds us with a Link::ScopedUse, so these are never left 
+    * dangling.
+    */
+   CriticalSection fRunningLock;
+   std::map<uint32, ConcurrentCall*> fRunning;
+
+   /**
+    * Runs the calls that mustn't run on our I/O thread (see 
+    * RpcHandler::kBlocking), in order. Once one is waiting here, the calls 
+    * that follow it wait here too, until it's empty again, so that they 
+    * still run in the order that they arrived.
+    */
+   RpcStrand fQueue;
+   Atomic<int> fNumQueued;
+};
+
+
+/**
+ * @class RpcResponder
+ *
+ * The response to a call whose handler returns before it has the result 
+ * (see RpcCoroutineHandler), so that it doesn't hold up the other calls on 
+ * its connection. The handler needs the RpcHandler::kNoResponse trait; it 
+ * keeps a reference to the responder and calls Send() or Fail() exactly 
+ * once, from any thread, when it's done. If the connection has gone by 
+ * then, the response is dropped. A responder that's released without 
+ * either sends the client a kInternalError exception, so the client isn't 
+ * left waiting.
+ */
+class RpcResponder : public ReferenceCountedObject
+{
+public:
+   typedef ReferenceCountedObjectPtr<RpcResponder> Ptr;
+
+   /**
+    * @param connection The connection the call arrived on, or nullptr to 
+    *                   build the response without sending it (in tests).
+    * @param call       The call we're responding to.
+    * @param options    The options to encode the response with (those of 
+    *                   the response message that the handler was given).
+    */
+   RpcResponder(RpcServerConnection* connection, const RpcMessageReader& call,
+      uint32 options);
+
+   ~RpcResponder();
+
+   /**
+    * Append the call's results here before calling Send().
+    */
+   RpcMessage& GetResponse() { return fResponse; }
+
+   /**
+    * Send the response.
+    * @return false if the connection has gone, or couldn't send.
+    */
+   bool Send();
+
+   /**
+    * Send an exception in place of the response.
+    */
+   bool Fail(const RpcException& e);
+
+   bool IsDone() const { return fDone.get() != 0; }
+
+   /**
+    * @return the message that the server sends when a call throws `e`.
+    */
+   static RpcMessage MakeException(const RpcException& e, uint32 sequence, 
+      uint32 options);
+
+private:
+   bool Finish(const RpcMessage& msg);
+
+private:
+   RpcServerConnection::Link::Ptr fLink;
+   RpcMessage fResponse;
+   uint32 fSequence;
+   Atomic<int> fDone;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcResponder)
 };
 
 
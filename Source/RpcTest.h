@@ -7,6 +7,8 @@
 #define IPCTEST_H_INCLUDED
 
 
+// connect over a local socket named kPipeName instead of TCP (see 
+// RpcServer::StartLocal()); the client must share the server's host.
 //#define qUseNamedPipe
 
 #define kPortNumber 0xec50
@@ -0,0 +1,234 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcTimerWheel.h"
+
+
+RpcTimerWheel::RpcTimerWheel()
+:  fFree(kNone)
+,  fNow(0)
+,  fSize(0)
+{
+   for (int i = 0; i < kNumSlots; ++i)
+   {
+      fSlots[i] = kNone;
+   }
+}
+
+
+RpcTimerWheel::Handle RpcTimerWheel::Schedule(uint32 id, int64 ticks)
+{
+   ticks = jmax(static_cast<int64>(1), ticks);
+
+   const ScopedLock lock(fLock);
+   int32 index = fFree;
+   if (kNone != index)
+   {
+      fFree = fTimers[index].fNext;
+   }
+   else
+   {
+      index = static_cast<int32>(fTimers.size());
+      Timer fresh;
+      fresh.fGeneration = 1;
+      fTimers.push_back(fresh);
+   }
+
+   // the hand passes the timer's slot (ticks - 1) / kNumSlots times before
+   // it's due.
+   const int32 slot = static_cast<int32>((fNow + ticks) & (kNumSlots - 1));
+   Timer& timer = fTimers[index];
+   timer.fId = id;
+   timer.fTurns = (ticks - 1) / kNumSlots;
+   timer.fSlot = slot;
+   timer.fPrev = kNone;
+   timer.fNext = fSlots[slot];
+   if (kNone != timer.fNext)
+   {
+      fTimers[timer.fNext].fPrev = index;
+   }
+   fSlots[slot] = index;
+   ++fSize;
+
+   return (static_cast<Handle>(timer.fGeneration) << 32) | static_cast<uint32>(index);
+}
+
+
+bool RpcTimerWheel::Cancel(Handle handle)
+{
+   const int32 index = static_cast<int32>(handle & 0xffffffff);
+   const uint32 generation = static_cast<uint32>(handle >> 32);
+
+   const ScopedLock lock(fLock);
+   if (index < 0 || index >= static_cast<int32>(fTimers.size()))
+   {
+      return false;
+   }
+   const Timer& timer = fTimers[index];
+   if (kNone == timer.fSlot || generation != timer.fGeneration)
+   {
+      return false;
+   }
+   this->Unlink(index);
+   this->Free(index);
+   return true;
+}
+
+
+void RpcTimerWheel::Advance(int64 ticks, Array<uint32>& expired)
+{
+   for (int64 i = 0; i < ticks; ++i)
+   {
+      // let Schedule() and Cancel() in between slots.
+      const ScopedLock lock(fLock);
+      const int32 slot = static_cast<int32>(++fNow & (kNumSlots - 1));
+      int32 index = fSlots[slot];
+      while (kNone != index)
+      {
+         Timer& timer = fTimers[index];
+         const int32 next = timer.fNext;
+         if (0 == timer.fTurns)
+         {
+            expired.add(timer.fId);
+            this->Unlink(index);
+            this->Free(index);
+         }
+         else
+         {
+            --timer.fTurns;
+         }
+         index = next;
+      }
+   }
+}
+
+
+int RpcTimerWheel::GetSize() const
+{
+   const ScopedLock lock(fLock);
+   return fSize;
+}
+
+
+void RpcTimerWheel::Unlink(int32 index)
+{
+   Timer& timer = fTimers[index];
+   if (kNone != timer.fPrev)
+   {
+      fTimers[timer.fPrev].fNext = timer.fNext;
+   }
+   else
+   {
+      fSlots[timer.fSlot] = timer.fNext;
+   }
+   if (kNone != timer.fNext)
+   {
+      fTimers[timer.fNext].fPrev = timer.fPrev;
+   }
+}
+
+
+void RpcTimerWheel::Free(int32 index)
+{
+   Timer& timer = fTimers[index];
+   if (0 == ++timer.fGeneration)
+   {
+      timer.fGeneration = 1;
+   }
+   timer.fSlot = kNone;
+   timer.fNext = fFree;
+   fFree = index;
+   --fSize;
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+class RpcTimerWheelTest : public UnitTest
+{
+public:
+   RpcTimerWheelTest() : UnitTest("RpcTimerWheel tests") {}
+
+   void runTest() override
+   {
+      this->beginTest("Expiry");
+      {
+         RpcTimerWheel wheel;
+         wheel.Schedule(1, 1);
+         wheel.Schedule(5, 5);
+         wheel.Schedule(2, 2);
+         // more than one turn of the wheel, landing in the same slots.
+         wheel.Schedule(1 + RpcTimerWheel::kNumSlots, 1 + RpcTimerWheel::kNumSlots);
+         wheel.Schedule(5 + 3 * RpcTimerWheel::kNumSlots, 5 + 3 * RpcTimerWheel::kNumSlots);
+         this->expect(5 == wheel.GetSize());
+
+         Array<uint32> expired;
+         for (uint32 tick = 1; tick <= 4 * RpcTimerWheel::kNumSlots; ++tick)
+         {
+            wheel.Advance(1, expired);
+            if (expired.size() > 0)
+            {
+               this->expect(1 == expired.size() && tick == expired[0]);
+               expired.clearQuick();
+            }
+         }
+         this->expect(0 == wheel.GetSize());
+
+         // nothing expires early, however far we go in one step.
+         wheel.Schedule(7, 700);
+         wheel.Advance(699, expired);
+         this->expect(0 == expired.size());
+         wheel.Advance(10, expired);
+         this->expect(1 == expired.size() && 7 == expired[0]);
+      }
+
+      this->beginTest("Cancelling");
+      {
+         RpcTimerWheel wheel;
+         RpcTimerWheel::Handle a = wheel.Schedule(1, 10);
+         RpcTimerWheel::Handle b = wheel.Schedule(2, 10);
+         RpcTimerWheel::Handle c = wheel.Schedule(3, 10);
+         this->expect(wheel.Cancel(b));
+         this->expect(!wheel.Cancel(b));
+         this->expect(wheel.Cancel(a));
+         // a's timer is reused, but its old handle doesn't cancel the new one.
+         RpcTimerWheel::Handle d = wheel.Schedule(4, 10);
+         this->expect(!wheel.Cancel(a));
+         this->expect(2 == wheel.GetSize());
+
+         Array<uint32> expired;
+         wheel.Advance(10, expired);
+         this->expect(2 == expired.size());
+         this->expect(expired.contains(3) && expired.contains(4));
+         this->expect(!wheel.Cancel(c) && !wheel.Cancel(d));
+         this->expect(0 == wheel.GetSize());
+      }
+
+      this->beginTest("Many timers");
+      {
+         RpcTimerWheel wheel;
+         Random random(42);
+         Array<RpcTimerWheel::Handle> handles;
+         for (uint32 i = 0; i < 20000; ++i)
+         {
+            handles.add(wheel.Schedule(i, 1 + random.nextInt(3000)));
+         }
+         int cancelled = 0;
+         for (int i = 0; i < handles.size(); i += 3)
+         {
+            cancelled += wheel.Cancel(handles[i]) ? 1 : 0;
+         }
+         Array<uint32> expired;
+         wheel.Advance(3000, expired);
+         this->expect(20000 == cancelled + expired.size());
+         this->expect(0 == wheel.GetSize());
+      }
+   }
+};
+
+static RpcTimerWheelTest timerWheelTest;
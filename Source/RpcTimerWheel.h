@@ -0,0 +1,127 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCTIMERWHEEL_H_INCLUDED
+#define RPCTIMERWHEEL_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#include <vector>
+
+
+/**
+ * @class RpcTimerWheel
+ *
+ * A hashed timing wheel: a ring of kNumSlots lists of timers, one list per
+ * tick, with a hand that moves on one slot each tick. A timer that's due
+ * `ticks` from now goes in the list `ticks` slots ahead of the hand, along
+ * with the number of whole turns that the hand has to make before it's
+ * due. Scheduling and cancelling a timer are O(1), whatever the number of
+ * timers, and each tick only looks at the timers in one slot.
+ *
+ * A timer is just a 32-bit ID -- for the client, a call's sequence number
+ * -- and it's handed back from Advance() when it expires. Timers live in a
+ * pool that only ever grows, so once it's as big as it needs to be,
+ * scheduling doesn't allocate.
+ *
+ * Thread-safe; each call holds our lock, but never for longer than one
+ * slot's worth of work.
+ */
+class RpcTimerWheel
+{
+public:
+   enum
+   {
+      /**
+       * A power of 2, so finding a slot is a mask. With the client's 10ms
+       * ticks, one turn of the wheel covers about 40 seconds, so most 
+       * timers expire the first time the hand reaches them.
+       */
+      kNumSlots = 4096
+   };
+
+   /**
+    * Identifies a scheduled timer for Cancel(). Handles of timers that have
+    * expired or been cancelled are never reused, so cancelling one of those
+    * is harmless; 0 is never a handle.
+    */
+   typedef uint64 Handle;
+
+   RpcTimerWheel();
+
+   /**
+    * Start a timer that expires `ticks` ticks from now (at least 1).
+    */
+   Handle Schedule(uint32 id, int64 ticks);
+
+   /**
+    * Stop a timer before it expires.
+    * @return false if it had already expired or been cancelled.
+    */
+   bool Cancel(Handle handle);
+
+   /**
+    * Move the hand on `ticks` ticks.
+    * @param expired Receives the IDs of the timers that expired.
+    */
+   void Advance(int64 ticks, Array<uint32>& expired);
+
+   /**
+    * @return the number of timers that haven't expired or been cancelled.
+    */
+   int GetSize() const;
+
+private:
+   struct Timer
+   {
+      uint32 fId;
+      /**
+       * Bumped every time the timer is freed, to make stale handles
+       * harmless. Never 0.
+       */
+      uint32 fGeneration;
+      int64 fTurns;
+      int32 fSlot;
+      int32 fPrev;
+      int32 fNext;
+   };
+
+   enum
+   {
+      kNone = -1
+   };
+
+   void Unlink(int32 index);
+
+   void Free(int32 index);
+
+private:
+   CriticalSection fLock;
+
+   /**
+    * The index in fTimers of the first timer in each slot.
+    */
+   int32 fSlots[kNumSlots];
+
+   /**
+    * Every timer we've ever needed; the free ones are linked through
+    * fNext from fFree.
+    */
+   std::vector<Timer> fTimers;
+   int32 fFree;
+
+   /**
+    * The number of ticks that the hand has made.
+    */
+   int64 fNow;
+
+   int fSize;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcTimerWheel)
+};
+
+
+#endif  // RPCTIMERWHEEL_H_INCLUDED
@@ -0,0 +1,477 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#include "RpcUring.h"
+
+#if JUCE_LINUX
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+namespace
+{
+   int Setup(uint32 entries, struct io_uring_params* params)
+   {
+      return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+   }
+
+   int Enter(int ring, uint32 toSubmit, uint32 minComplete, uint32 flags)
+   {
+      return static_cast<int>(::syscall(__NR_io_uring_enter, ring, toSubmit,
+         minComplete, flags, nullptr, 0));
+   }
+
+   int Register(int ring, uint32 opcode, void* arg, uint32 numArgs)
+   {
+      return static_cast<int>(::syscall(__NR_io_uring_register, ring, opcode,
+         arg, numArgs));
+   }
+
+   /**
+    * The buffer group that our receives pick from.
+    */
+   enum { kBufferGroup = 0 };
+}
+
+
+RpcUring::RpcUring(uint32 numEntries)
+:  fRing(-1)
+,  fRingMemory(MAP_FAILED)
+,  fRingSize(0)
+,  fSqes(static_cast<struct io_uring_sqe*>(MAP_FAILED))
+,  fSqesSize(0)
+,  fLocalTail(0)
+,  fPending(0)
+,  fBufferRing(nullptr)
+,  fNumBuffers(0)
+,  fBufferSize(0)
+,  fBufferTail(0)
+{
+   struct io_uring_params params;
+   zerostruct(params);
+   params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+   params.cq_entries = numEntries * 4;
+   fRing = Setup(numEntries, &params);
+   if (fRing < 0 && EINVAL == errno)
+   {
+      // kernels before 5.19 don't know COOP_TASKRUN.
+      zerostruct(params);
+      params.flags = IORING_SETUP_CQSIZE;
+      params.cq_entries = numEntries * 4;
+      fRing = Setup(numEntries, &params);
+   }
+   if (fRing < 0)
+   {
+      return;
+   }
+   if (0 == (params.features & IORING_FEAT_SINGLE_MMAP) ||
+      0 == (params.features & IORING_FEAT_NODROP))
+   {
+      // too old to be worth supporting.
+      this->Close();
+      return;
+   }
+
+   // the submission and completion rings share one mapping.
+   fRingSize = jmax(params.sq_off.array + params.sq_entries * sizeof(uint32),
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+   fRingMemory = ::mmap(nullptr, fRingSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fRing, IORING_OFF_SQ_RING);
+   fSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+   fSqes = static_cast<struct io_uring_sqe*>(::mmap(nullptr, fSqesSize,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fRing, IORING_OFF_SQES));
+   if (MAP_FAILED == fRingMemory || MAP_FAILED == fSqes)
+   {
+      this->Close();
+      return;
+   }
+
+   char* ring = static_cast<char*>(fRingMemory);
+   fSqHead = reinterpret_cast<uint32*>(ring + params.sq_off.head);
+   fSqTail = reinterpret_cast<uint32*>(ring + params.sq_off.tail);
+   fSqMask = *reinterpret_cast<uint32*>(ring + params.sq_off.ring_mask);
+   fSqArray = reinterpret_cast<uint32*>(ring + params.sq_off.array);
+   fSqEntries = params.sq_entries;
+   fLocalTail = *fSqTail;
+
+   fCqHead = reinterpret_cast<uint32*>(ring + params.cq_off.head);
+   fCqTail = reinterpret_cast<uint32*>(ring + params.cq_off.tail);
+   fCqMask = *reinterpret_cast<uint32*>(ring + params.cq_off.ring_mask);
+   fCqes = reinterpret_cast<struct io_uring_cqe*>(ring + params.cq_off.cqes);
+}
+
+
+RpcUring::~RpcUring()
+{
+   this->Close();
+}
+
+
+void RpcUring::Close()
+{
+   if (fRing >= 0)
+   {
+      // closing the ring cancels anything that's still outstanding.
+      ::close(fRing);
+      fRing = -1;
+   }
+   if (MAP_FAILED != fSqes)
+   {
+      ::munmap(fSqes, fSqesSize);
+      fSqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+   }
+   if (MAP_FAILED != fRingMemory)
+   {
+      ::munmap(fRingMemory, fRingSize);
+      fRingMemory = MAP_FAILED;
+   }
+   if (nullptr != fBufferRing)
+   {
+      ::munmap(fBufferRing, fNumBuffers * sizeof(struct io_uring_buf));
+      fBufferRing = nullptr;
+   }
+}
+
+
+bool RpcUring::IsAvailable()
+{
+   /**
+    * Sets up a ring with everything that we need, and closes it again, on
+    * a thread of its own (see the class comment).
+    */
+   class Probe : public Thread
+   {
+   public:
+      Probe() : Thread("RpcUringProbe"), fAvailable(false) {}
+
+      void run() override
+      {
+         RpcUring ring(8);
+         // provided buffer rings need 5.19 or later.
+         fAvailable = ring.IsValid() && ring.SetUpBuffers(1, 64);
+      }
+
+      bool fAvailable;
+   };
+
+   static const bool sAvailable = []()
+   {
+      Probe probe;
+      probe.startThread();
+      probe.waitForThreadToExit(-1);
+      return probe.fAvailable;
+   }();
+   return sAvailable;
+}
+
+
+bool RpcUring::SetUpBuffers(int numBuffers, int bufferSize)
+{
+   jassert(nullptr == fBufferRing && isPowerOfTwo(numBuffers));
+   // the ring of buffer descriptors must be page-aligned, which mmap() is.
+   void* memory = ::mmap(nullptr, numBuffers * sizeof(struct io_uring_buf),
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (MAP_FAILED == memory)
+   {
+      return false;
+   }
+
+   struct io_uring_buf_reg reg;
+   zerostruct(reg);
+   reg.ring_addr = reinterpret_cast<uint64>(memory);
+   reg.ring_entries = static_cast<uint32>(numBuffers);
+   reg.bgid = kBufferGroup;
+   if (0 != Register(fRing, IORING_REGISTER_PBUF_RING, &reg, 1))
+   {
+      ::munmap(memory, numBuffers * sizeof(struct io_uring_buf));
+      return false;
+   }
+
+   fBufferRing = static_cast<struct io_uring_buf_ring*>(memory);
+   fNumBuffers = numBuffers;
+   fBufferSize = bufferSize;
+   fBuffers.malloc(static_cast<size_t>(numBuffers) * bufferSize);
+   for (int i = 0; i < numBuffers; ++i)
+   {
+      this->RecycleBuffer(static_cast<uint16>(i));
+   }
+   return true;
+}
+
+
+void RpcUring::RecycleBuffer(uint16 id)
+{
+   // the kernel reads the tail, so the descriptor must be written first.
+   // (The tail shares its space with the first descriptor's resv, which we
+   // never write.) We don't use io_uring_buf_ring::bufs, which C++ puts 8
+   // bytes too far in.
+   struct io_uring_buf* buffers = reinterpret_cast<struct io_uring_buf*>(fBufferRing);
+   struct io_uring_buf& buffer = buffers[fBufferTail & (fNumBuffers - 1)];
+   buffer.addr = reinterpret_cast<uint64>(fBuffers + static_cast<size_t>(id) * fBufferSize);
+   buffer.len = static_cast<uint32>(fBufferSize);
+   buffer.bid = id;
+   __atomic_store_n(&fBufferRing->tail, ++fBufferTail, __ATOMIC_RELEASE);
+}
+
+
+struct io_uring_sqe* RpcUring::GetSqe()
+{
+   if (fLocalTail - __atomic_load_n(fSqHead, __ATOMIC_ACQUIRE) >= fSqEntries)
+   {
+      // full; let the kernel take what we have.
+      if (!this->Submit(0) ||
+         fLocalTail - __atomic_load_n(fSqHead, __ATOMIC_ACQUIRE) >= fSqEntries)
+      {
+         return nullptr;
+      }
+   }
+   const uint32 index = fLocalTail & fSqMask;
+   struct io_uring_sqe* sqe = &fSqes[index];
+   zerostruct(*sqe);
+   fSqArray[index] = index;
+   ++fLocalTail;
+   ++fPending;
+   return sqe;
+}
+
+
+bool RpcUring::PrepareReceive(int socket, uint64 userData)
+{
+   struct io_uring_sqe* sqe = this->GetSqe();
+   if (nullptr == sqe)
+   {
+      return false;
+   }
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = socket;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = kBufferGroup;
+   sqe->user_data = userData;
+   return true;
+}
+
+
+bool RpcUring::PrepareAccept(int socket, uint64 userData)
+{
+   struct io_uring_sqe* sqe = this->GetSqe();
+   if (nullptr == sqe)
+   {
+      return false;
+   }
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = socket;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   sqe->accept_flags = SOCK_CLOEXEC;
+   sqe->user_data = userData;
+   return true;
+}
+
+
+bool RpcUring::PreparePoll(int fd, uint64 userData)
+{
+   struct io_uring_sqe* sqe = this->GetSqe();
+   if (nullptr == sqe)
+   {
+      return false;
+   }
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = fd;
+   sqe->len = IORING_POLL_ADD_MULTI;
+   sqe->poll32_events = POLLIN;
+   sqe->user_data = userData;
+   return true;
+}
+
+
+bool RpcUring::PrepareWritable(int fd, uint64 userData)
+{
+   struct io_uring_sqe* sqe = this->GetSqe();
+   if (nullptr == sqe)
+   {
+      return false;
+   }
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = fd;
+   sqe->poll32_events = POLLOUT;
+   sqe->user_data = userData;
+   return true;
+}
+
+
+bool RpcUring::PrepareCancel(uint64 target, uint64 userData)
+{
+   struct io_uring_sqe* sqe = this->GetSqe();
+   if (nullptr == sqe)
+   {
+      return false;
+   }
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->addr = target;
+   sqe->user_data = userData;
+   return true;
+}
+
+
+bool RpcUring::Submit(int waitFor)
+{
+   __atomic_store_n(fSqTail, fLocalTail, __ATOMIC_RELEASE);
+   while (true)
+   {
+      const int submitted = Enter(fRing, fPending, static_cast<uint32>(waitFor),
+         (waitFor > 0) ? IORING_ENTER_GETEVENTS : 0);
+      if (submitted >= 0)
+      {
+         fPending -= jmin(fPending, static_cast<uint32>(submitted));
+         return true;
+      }
+      if (EINTR != errno && EAGAIN != errno && EBUSY != errno)
+      {
+         return false;
+      }
+      if (EINTR != errno)
+      {
+         // the completion ring is backed up; the caller has to empty it.
+         return true;
+      }
+   }
+}
+
+
+/**
+ * UNIT TESTS FOLLOW
+ */
+
+class RpcUringTest : public UnitTest
+{
+public:
+   RpcUringTest() : UnitTest("RpcUring tests") {}
+
+   /**
+    * What arrived for one request.
+    */
+   struct Received
+   {
+      Received() : fCompletions(0), fFinished(false), fResult(0) {}
+
+      String fData;
+      int fCompletions;
+      bool fFinished;
+      int fResult;
+   };
+
+   void Collect(RpcUring& ring, Received& received)
+   {
+      ring.ForEachCompletion([&ring, &received](const struct io_uring_cqe& cqe)
+      {
+         if (kCancel == cqe.user_data)
+         {
+            return;
+         }
+         ++received.fCompletions;
+         received.fResult = cqe.res;
+         if (cqe.flags & IORING_CQE_F_BUFFER)
+         {
+            const uint16 id = static_cast<uint16>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            received.fData += String(ring.GetBuffer(id), static_cast<size_t>(cqe.res));
+            ring.RecycleBuffer(id);
+         }
+         received.fFinished = (0 == (cqe.flags & IORING_CQE_F_MORE));
+      });
+   }
+
+   void runTest() override
+   {
+      if (!RpcUring::IsAvailable())
+      {
+         this->logMessage("io_uring isn't available here.");
+         return;
+      }
+
+      this->beginTest("Multishot receives");
+      {
+         int sockets[2];
+         this->expect(0 == ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+         RpcUring ring(16);
+         this->expect(ring.IsValid());
+         this->expect(ring.SetUpBuffers(4, 8));
+         this->expect(ring.PrepareReceive(sockets[0], kReceive));
+         this->expect(ring.Submit(0));
+
+         Received received;
+         const char* chunks[] = { "one", "two and more", "three" };
+         for (int i = 0; i < 3; ++i)
+         {
+            this->expect(static_cast<ssize_t>(strlen(chunks[i])) ==
+               ::write(sockets[1], chunks[i], strlen(chunks[i])));
+            this->expect(ring.Submit(1));
+            this->Collect(ring, received);
+         }
+         // the middle chunk doesn't fit in one buffer.
+         this->expect(received.fData == "onetwo and morethree");
+         this->expect(received.fCompletions >= 4);
+         this->expect(!received.fFinished);
+
+         this->beginTest("Cancelling a receive");
+         this->expect(ring.PrepareCancel(kReceive, kCancel));
+         while (!received.fFinished)
+         {
+            this->expect(ring.Submit(1));
+            this->Collect(ring, received);
+         }
+         this->expect(-ECANCELED == received.fResult);
+         ::close(sockets[0]);
+         ::close(sockets[1]);
+      }
+
+      this->beginTest("Running out of buffers");
+      {
+         int sockets[2];
+         this->expect(0 == ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+         RpcUring ring(16);
+         this->expect(ring.SetUpBuffers(2, 4));
+         this->expect(ring.PrepareReceive(sockets[0], kReceive));
+         this->expect(ring.Submit(0));
+         this->expect(12 == ::write(sockets[1], "abcdefghijkl", 12));
+
+         // without recycling anything, we get two buffers' worth and then
+         // the receive ends.
+         int completions = 0;
+         bool finished = false;
+         int result = 0;
+         while (!finished)
+         {
+            this->expect(ring.Submit(1));
+            ring.ForEachCompletion([&](const struct io_uring_cqe& cqe)
+            {
+               ++completions;
+               result = cqe.res;
+               finished = (0 == (cqe.flags & IORING_CQE_F_MORE));
+            });
+         }
+         this->expect(-ENOBUFS == result);
+         this->expect(3 == completions);
+         ::close(sockets[0]);
+         ::close(sockets[1]);
+      }
+   }
+
+private:
+   enum
+   {
+      kReceive = 100,
+      kCancel = 101
+   };
+};
+
+static RpcUringTest uringTest;
+
+#endif  // JUCE_LINUX
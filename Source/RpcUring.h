@@ -0,0 +1,167 @@
+/*
+  Copyright 2016 Art & Logic Software Development.
+ */
+
+
+
+#ifndef RPCURING_H_INCLUDED
+#define RPCURING_H_INCLUDED
+
+#include "../JuceLibraryCode/JuceHeader.h"
+
+#if JUCE_LINUX
+
+#include <linux/io_uring.h>
+
+
+/**
+ * @class RpcUring
+ *
+ * One io_uring instance, set up with the system calls themselves (we don't
+ * depend on liburing): its submission and completion rings, and a ring of
+ * buffers that's registered with the kernel for receives to pick from, so
+ * that a socket that's waiting for data doesn't tie up a buffer of its
+ * own.
+ *
+ * Submissions are queued with the Prepare...() functions and go to the
+ * kernel together in the next Submit(). Only one thread may use a ring at a
+ * time. When a ring is closed, the kernel interrupts whatever blocking call
+ * each thread that has used it is making (a blocking send() returns part
+ * way, for instance), so a ring should be created and used on a thread
+ * that's dedicated to it.
+ */
+class RpcUring
+{
+public:
+   /**
+    * @param numEntries The size of the submission ring (a power of 2); the
+    *                   completion ring is four times as big.
+    */
+   RpcUring(uint32 numEntries);
+
+   ~RpcUring();
+
+   /**
+    * @return false if the kernel doesn't support io_uring, or everything
+    *         that we use it for.
+    */
+   static bool IsAvailable();
+
+   bool IsValid() const { return fRing >= 0; }
+
+   /**
+    * Give the kernel `numBuffers` (a power of 2) buffers of `bufferSize`
+    * bytes, for multishot receives to fill.
+    */
+   bool SetUpBuffers(int numBuffers, int bufferSize);
+
+   /**
+    * @return the data in a buffer that a receive filled in.
+    */
+   const char* GetBuffer(uint16 id) const { return fBuffers + static_cast<size_t>(id) * fBufferSize; }
+
+   /**
+    * Hand a buffer back to the kernel once we're done with its data.
+    */
+   void RecycleBuffer(uint16 id);
+
+   /**
+    * Receive from `socket` into our buffers until it's cancelled, the socket
+    * closes, or we run out of buffers; each completion carries
+    * IORING_CQE_F_MORE until the last.
+    */
+   bool PrepareReceive(int socket, uint64 userData);
+
+   /**
+    * Accept connections on `socket` until cancelled.
+    */
+   bool PrepareAccept(int socket, uint64 userData);
+
+   /**
+    * Complete each time that `fd` becomes readable, until cancelled.
+    */
+   bool PreparePoll(int fd, uint64 userData);
+
+   /**
+    * Complete once, when `fd` becomes writable (or fails).
+    */
+   bool PrepareWritable(int fd, uint64 userData);
+
+   /**
+    * Cancel the request submitted with `target` as its user data.
+    */
+   bool PrepareCancel(uint64 target, uint64 userData);
+
+   /**
+    * Send everything that's been prepared since the last call, and wait
+    * for at least `waitFor` completions.
+    * @return false if the ring has failed.
+    */
+   bool Submit(int waitFor);
+
+   /**
+    * Call `fn` with each completion that's arrived, then let the kernel
+    * reuse their slots.
+    * @return the number of completions.
+    */
+   template <typename Fn>
+   int ForEachCompletion(Fn fn)
+   {
+      uint32 head = *fCqHead;
+      const uint32 tail = __atomic_load_n(fCqTail, __ATOMIC_ACQUIRE);
+      int count = 0;
+      for (; head != tail; ++head, ++count)
+      {
+         fn(fCqes[head & fCqMask]);
+      }
+      __atomic_store_n(fCqHead, head, __ATOMIC_RELEASE);
+      return count;
+   }
+
+private:
+   /**
+    * @return a cleared submission to fill in, or nullptr if the ring is
+    *         full even after submitting what's queued.
+    */
+   struct io_uring_sqe* GetSqe();
+
+   void Close();
+
+private:
+   int fRing;
+
+   void* fRingMemory;
+   size_t fRingSize;
+   struct io_uring_sqe* fSqes;
+   size_t fSqesSize;
+
+   uint32* fSqHead;
+   uint32* fSqTail;
+   uint32 fSqMask;
+   uint32* fSqArray;
+   uint32 fSqEntries;
+
+   /**
+    * Where our next submission goes. The kernel doesn't see the ones
+    * between *fSqTail and here until Submit().
+    */
+   uint32 fLocalTail;
+   uint32 fPending;
+
+   uint32* fCqHead;
+   uint32* fCqTail;
+   uint32 fCqMask;
+   struct io_uring_cqe* fCqes;
+
+   struct io_uring_buf_ring* fBufferRing;
+   HeapBlock<char> fBuffers;
+   int fNumBuffers;
+   int fBufferSize;
+   uint16 fBufferTail;
+
+   JUCE_DECLARE_NON_COPYABLE(RpcUring)
+};
+
+#endif  // JUCE_LINUX
+
+#endif  // RPCURING_H_INCLUDED